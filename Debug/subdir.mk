@@ -4,9 +4,27 @@
 
 # Add inputs and outputs from these tool invocations to the build variables 
 C_SRCS += \
+../SerialAggregate.c \
+../SerialCache.c \
+../SerialCapture.c \
+../SerialCompress.c \
+../SerialConfig.c \
 ../SerialDaemon.c \
+../SerialDelta.c \
+../SerialFragment.c \
+../SerialJournal.c \
 ../SerialLib8051.c \
+../SerialLink.c \
+../SerialLoad.c \
 ../SerialMsgUtils.c \
+../SerialPool.c \
+../SerialRealtime.c \
+../SerialReplay.c \
+../SerialRoute.c \
+../SerialRxBuffer.c \
+../SerialSocket.c \
+../SerialTransact.c \
+../SerialUring.c \
 ../alt_functions.c \
 ../become_daemon.c \
 ../error_functions.c \
@@ -15,9 +33,27 @@ C_SRCS += \
 ../tty_functions.c 
 
 OBJS += \
+./SerialAggregate.o \
+./SerialCache.o \
+./SerialCapture.o \
+./SerialCompress.o \
+./SerialConfig.o \
 ./SerialDaemon.o \
+./SerialDelta.o \
+./SerialFragment.o \
+./SerialJournal.o \
 ./SerialLib8051.o \
+./SerialLink.o \
+./SerialLoad.o \
 ./SerialMsgUtils.o \
+./SerialPool.o \
+./SerialRealtime.o \
+./SerialReplay.o \
+./SerialRoute.o \
+./SerialRxBuffer.o \
+./SerialSocket.o \
+./SerialTransact.o \
+./SerialUring.o \
 ./alt_functions.o \
 ./become_daemon.o \
 ./error_functions.o \
@@ -26,9 +62,27 @@ OBJS += \
 ./tty_functions.o 
 
 C_DEPS += \
+./SerialAggregate.d \
+./SerialCache.d \
+./SerialCapture.d \
+./SerialCompress.d \
+./SerialConfig.d \
 ./SerialDaemon.d \
+./SerialDelta.d \
+./SerialFragment.d \
+./SerialJournal.d \
 ./SerialLib8051.d \
+./SerialLink.d \
+./SerialLoad.d \
 ./SerialMsgUtils.d \
+./SerialPool.d \
+./SerialRealtime.d \
+./SerialReplay.d \
+./SerialRoute.d \
+./SerialRxBuffer.d \
+./SerialSocket.d \
+./SerialTransact.d \
+./SerialUring.d \
 ./alt_functions.d \
 ./become_daemon.d \
 ./error_functions.d \
@@ -0,0 +1,122 @@
+/*
+ * PacketHdrSchema.h
+ *
+ *  Single description of the packet header layout. The header
+ *  encoder and decoder are generated from PACKET_HDR_FIELDS below,
+ *  so BuildPacketHdr and ProcessPacket can never disagree about an
+ *  offset, a width, an encoding or the byte order again.
+ *
+ *  Wire layout (MSG_HEADER_LENGTH bytes):
+ *   0..6   HEADERBYTE1..7 magic ("BADCAFE")
+ *   7      MsgID        + UINT8_ENCODE
+ *   8..9   FrameLength  + UINT16_ENCODE (header + ASCII data + new line)
+ *   10     MsgFlags     + UINT8_ENCODE
+ *   11..12 SeqCount     + UINT16_ENCODE
+ *
+ *  Included from SerialMsgUtils.h, which defines the magic bytes
+ *  and the encode offsets.
+ */
+
+#ifndef PACKETHDRSCHEMA_H_
+#define PACKETHDRSCHEMA_H_
+
+#include <string.h>
+
+/* Byte order of the multi byte header fields on the wire. Every 16 bit
+ * field uses the same order, set the 8051 firmware to match */
+#define HDR_LITTLE_ENDIAN	0
+#define HDR_BIG_ENDIAN		1
+
+#ifndef PACKET_HDR_BYTE_ORDER
+	#define PACKET_HDR_BYTE_ORDER	HDR_LITTLE_ENDIAN
+#endif
+
+#define PACKET_HDR_MAGIC_LENGTH	7
+
+/* The schema, X(Name, Offset, Width in bytes, Encode offset) */
+#define PACKET_HDR_FIELDS(X) \
+	X(MsgID,		7,	1,	UINT8_ENCODE) \
+	X(FrameLength,	8,	2,	UINT16_ENCODE) \
+	X(MsgFlags,		10,	1,	UINT8_ENCODE) \
+	X(SeqCount,		11,	2,	UINT16_ENCODE)
+
+/* C type used to hold a field of a given width */
+#define HDR_FIELD_TYPE_1	uint8_t
+#define HDR_FIELD_TYPE_2	uint16_t
+
+/* Straight line loads and stores for each width, in wire byte order */
+#define HDR_LOAD_1(p, o)		((uint8_t)(p)[o])
+#define HDR_STORE_1(p, o, v)	((p)[o] = (uint8_t)(v))
+
+#if PACKET_HDR_BYTE_ORDER == HDR_LITTLE_ENDIAN
+	#define HDR_LOAD_2(p, o)		((uint16_t)((uint16_t)(p)[o] | ((uint16_t)(p)[(o)+1] << 8)))
+	#define HDR_STORE_2(p, o, v)	((p)[o] = (uint8_t)(v), (p)[(o)+1] = (uint8_t)((uint16_t)(v) >> 8))
+#else
+	#define HDR_LOAD_2(p, o)		((uint16_t)(((uint16_t)(p)[o] << 8) | (uint16_t)(p)[(o)+1]))
+	#define HDR_STORE_2(p, o, v)	((p)[o] = (uint8_t)((uint16_t)(v) >> 8), (p)[(o)+1] = (uint8_t)(v))
+#endif
+
+/* Decoded (encode offsets removed) header fields */
+typedef struct PacketHdrFields{
+#define X(Name, Offset, Width, Encode) HDR_FIELD_TYPE_##Width Name;
+	PACKET_HDR_FIELDS(X)
+#undef X
+	}PacketHdrFields;
+
+/* The magic and MsgID make up the first 8 bytes of the header, so the
+ * magic is checked with one 64 bit load and a masked compare. The load
+ * is in host order, so the constant is built in host order too */
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	#define PACKET_HDR_MAGIC_WORD	( (uint64_t)HEADERBYTE1        | (uint64_t)HEADERBYTE2 << 8  | \
+									  (uint64_t)HEADERBYTE3 << 16  | (uint64_t)HEADERBYTE4 << 24 | \
+									  (uint64_t)HEADERBYTE5 << 32  | (uint64_t)HEADERBYTE6 << 40 | \
+									  (uint64_t)HEADERBYTE7 << 48 )
+	#define PACKET_HDR_MAGIC_MASK	0x00FFFFFFFFFFFFFFULL
+#else
+	#define PACKET_HDR_MAGIC_WORD	( (uint64_t)HEADERBYTE1 << 56  | (uint64_t)HEADERBYTE2 << 48 | \
+									  (uint64_t)HEADERBYTE3 << 40  | (uint64_t)HEADERBYTE4 << 32 | \
+									  (uint64_t)HEADERBYTE5 << 24  | (uint64_t)HEADERBYTE6 << 16 | \
+									  (uint64_t)HEADERBYTE7 << 8 )
+	#define PACKET_HDR_MAGIC_MASK	0xFFFFFFFFFFFFFF00ULL
+#endif
+
+/* Returns non zero if Hdr starts with the magic bytes. Hdr must have
+ * at least 8 readable bytes, which any complete header does */
+static inline int
+PacketHdrMagicMatch(const uint8_t *Hdr){
+	uint64_t Word;
+
+	memcpy(&Word, Hdr, sizeof(Word));
+
+	return (Word & PACKET_HDR_MAGIC_MASK) == PACKET_HDR_MAGIC_WORD;
+}
+
+/* Write the magic and every schema field into Hdr (MSG_HEADER_LENGTH bytes) */
+static inline void
+EncodePacketHdrFields(uint8_t *Hdr, const PacketHdrFields *Fields){
+
+	Hdr[0] = HEADERBYTE1;
+	Hdr[1] = HEADERBYTE2;
+	Hdr[2] = HEADERBYTE3;
+	Hdr[3] = HEADERBYTE4;
+	Hdr[4] = HEADERBYTE5;
+	Hdr[5] = HEADERBYTE6;
+	Hdr[6] = HEADERBYTE7;
+
+#define X(Name, Offset, Width, Encode) \
+	HDR_STORE_##Width(Hdr, Offset, Fields->Name + (Encode));
+	PACKET_HDR_FIELDS(X)
+#undef X
+}
+
+/* Read every schema field out of Hdr, magic is not checked here */
+static inline void
+DecodePacketHdrFields(const uint8_t *Hdr, PacketHdrFields *Fields){
+
+#define X(Name, Offset, Width, Encode) \
+	Fields->Name = (HDR_FIELD_TYPE_##Width)(HDR_LOAD_##Width(Hdr, Offset) - (Encode));
+	PACKET_HDR_FIELDS(X)
+#undef X
+}
+
+#endif /* PACKETHDRSCHEMA_H_ */
@@ -0,0 +1,299 @@
+/*
+ * SerialAggregate.c
+ *
+ *  Packing small messages into one frame, see SerialAggregate.h
+ */
+
+#include <string.h>
+#include <syslog.h>
+
+#include "tlpi_hdr.h"
+#include "SerialAggregate.h"
+
+/* Flags a message can carry inside a super-frame */
+#define AGG_SUB_MSG_FLAGS		((MSG_FLAG_COMPRESSED | MSG_FLAGS_USER_MASK) & ~MSG_FLAG_AGGREGATE)
+
+typedef struct{
+	uint32_t TxFrames;			/* Super-frames built */
+	uint32_t TxMessages;		/* Messages in them */
+	uint32_t TxAlone;			/* Held, but went out as a plain frame */
+	uint32_t TxBytesSaved;		/* Line bytes, against sending each one plain */
+	uint32_t RxFrames;
+	uint32_t RxMessages;
+	uint32_t RxBadFrames;
+}AggregateCounters;
+
+static AggregateCounters Counters;
+
+
+/* Sub-header of a message, following one numbered LastSeq if Chained
+ *
+ *  RETURNS:
+ *  Bytes in Sub
+*/
+static int32_t
+SubHeader(const RxMsgInfo *Info, Boolean Chained, uint16_t LastSeq, uint8_t *Sub ){
+
+	int32_t SubLength = 2;
+
+	Sub[0] = Info->MsgID;
+	Sub[1] = (uint8_t)Info->MsgLength;
+
+	if(Info->MsgFlags != 0)
+	{
+		Sub[1] |= AGG_SUB_FLAGS;
+		Sub[SubLength++] = Info->MsgFlags;
+	}
+
+	/* A sender's burst numbers on from one message to the next */
+	if(Chained && Info->SeqCount != (uint16_t)(LastSeq + 1))
+	{
+		Sub[1] |= AGG_SUB_SEQ;
+		Sub[SubLength++] = (uint8_t)Info->SeqCount;
+		Sub[SubLength++] = (uint8_t)(Info->SeqCount >> 8);
+	}
+
+	return SubLength;
+}
+
+/* Length and PlainBytes again, for the messages still held */
+static void
+Remeasure(SerialAggregator *Agg ){
+
+	uint8_t Sub[AGG_SUB_HEADER_MAX];
+	int32_t i;
+
+	Agg->Length = 0;
+	Agg->PlainBytes = 0;
+
+	for(i = 0; i < Agg->Count; i++)
+	{
+		Agg->Length += SubHeader(&Agg->Held[i].Info, i > 0, Agg->Held[(i > 0) ? i - 1 : 0].Info.SeqCount, Sub);
+		Agg->Length += Agg->Held[i].Info.MsgLength;
+		Agg->PlainBytes += PACKET_FRAME_LENGTH(Agg->Held[i].Info.MsgLength);
+	}
+}
+
+void
+AggregateInit(SerialAggregator *Agg, int32_t LimitBytes ){
+
+	Agg->HexLength = 0;
+	Agg->Length = 0;
+	Agg->Count = 0;
+	Agg->PlainBytes = 0;
+	Agg->Limit = (LimitBytes > AGG_MAX_BYTES) ? AGG_MAX_BYTES : LimitBytes;
+}
+
+int32_t
+AggregateAdd(SerialAggregator *Agg, const ARM_char_t *Frame, const RxMsgInfo *Info, int64_t ExpiresUs ){
+
+	uint8_t Sub[AGG_SUB_HEADER_MAX];
+	SerialAggregated *Held;
+	int32_t SubLength;
+
+	if(Info->MsgLength > AGG_MSG_MAX || (Info->MsgFlags & ~AGG_SUB_MSG_FLAGS))
+		return AGG_NOT_SMALL;
+
+	SubLength = SubHeader(Info, Agg->Count > 0, (Agg->Count > 0) ? Agg->Held[Agg->Count - 1].Info.SeqCount : 0, Sub);
+
+	if(Agg->Length + SubLength + Info->MsgLength > Agg->Limit)
+		return (Agg->Count == 0) ? AGG_NOT_SMALL : AGG_FULL;
+
+	Held = &Agg->Held[Agg->Count];
+	Held->Info = *Info;
+	Held->ExpiresUs = ExpiresUs;
+	Held->Offset = Agg->HexLength;
+
+	memcpy(&Agg->Hex[Agg->HexLength], &Frame[MSG_HEADER_LENGTH], (size_t)(2*Info->MsgLength));
+
+	Agg->HexLength += 2*Info->MsgLength;
+	Agg->Length += SubLength + Info->MsgLength;
+	Agg->PlainBytes += PACKET_FRAME_LENGTH(Info->MsgLength);
+
+	return ++Agg->Count;
+}
+
+int32_t
+AggregateExpire(SerialAggregator *Agg, int64_t NowUs ){
+
+	SerialAggregated *Held;
+	int32_t i, Kept = 0, Dropped;
+
+	for(i = 0; i < Agg->Count; i++)
+	{
+		if(Agg->Held[i].ExpiresUs != 0 && NowUs >= Agg->Held[i].ExpiresUs)
+			continue;
+
+		Agg->Held[Kept++] = Agg->Held[i];
+	}
+
+	Dropped = Agg->Count - Kept;
+	if(Dropped == 0)
+		return 0;
+
+	/* Close up the payloads, so Hex has room for as many as Limit */
+	Agg->HexLength = 0;
+	for(i = 0; i < Kept; i++)
+	{
+		Held = &Agg->Held[i];
+		memmove(&Agg->Hex[Agg->HexLength], &Agg->Hex[Held->Offset], (size_t)(2*Held->Info.MsgLength));
+		Held->Offset = Agg->HexLength;
+		Agg->HexLength += 2*Held->Info.MsgLength;
+	}
+
+	Agg->Count = Kept;
+	Remeasure(Agg);
+
+	return Dropped;
+}
+
+int64_t
+AggregateExpiry(const SerialAggregator *Agg ){
+
+	int64_t Latest = 0;
+	int32_t i;
+
+	for(i = 0; i < Agg->Count; i++)
+	{
+		if(Agg->Held[i].ExpiresUs == 0)
+			return 0;
+
+		if(Agg->Held[i].ExpiresUs > Latest)
+			Latest = Agg->Held[i].ExpiresUs;
+	}
+
+	return Latest;
+}
+
+int32_t
+AggregateBuild(SerialAggregator *Agg, ARM_char_t *Frame, RxMsgInfo *Info ){
+
+	uint8_t Sub[AGG_SUB_HEADER_MAX];
+	SerialAggregated *Held;
+	PacketHdr Hdr;
+	int32_t Length, Offset = MSG_HEADER_LENGTH, SubLength, i;
+
+	if(Agg->Count == 0)
+		return 0;
+
+	/* On its own, a super-frame would only add its sub-header */
+	if(Agg->Count == 1)
+	{
+		*Info = Agg->Held[0].Info;
+		memcpy(&Frame[Offset], &Agg->Hex[Agg->Held[0].Offset], (size_t)(2*Info->MsgLength));
+		Counters.TxAlone++;
+	}
+	else
+	{
+		for(i = 0; i < Agg->Count; i++)
+		{
+			Held = &Agg->Held[i];
+			SubLength = SubHeader(&Held->Info, i > 0, Agg->Held[(i > 0) ? i - 1 : 0].Info.SeqCount, Sub);
+
+			BytesToASCIIHex(Sub, (uint8_t *)&Frame[Offset], SubLength);
+			Offset += 2*SubLength;
+
+			memcpy(&Frame[Offset], &Agg->Hex[Held->Offset], (size_t)(2*Held->Info.MsgLength));
+			Offset += 2*Held->Info.MsgLength;
+		}
+
+		Info->MsgID = Agg->Held[0].Info.MsgID;
+		Info->MsgLength = (uint16_t)Agg->Length;
+		Info->MsgFlags = MSG_FLAG_AGGREGATE;
+		Info->SeqCount = Agg->Held[0].Info.SeqCount;
+
+		Counters.TxFrames++;
+		Counters.TxMessages += Agg->Count;
+		Counters.TxBytesSaved += Agg->PlainBytes - PACKET_FRAME_LENGTH(Agg->Length);
+	}
+
+	BuildPacketHdr(Info->MsgLength, Info->MsgID, Info->MsgFlags, Info->SeqCount, &Hdr);
+	memcpy(Frame, &Hdr, MSG_HEADER_LENGTH);
+
+	Length = PACKET_FRAME_LENGTH(Info->MsgLength);
+	Frame[Length - 1] = '\n';
+
+	Agg->HexLength = 0;
+	Agg->Length = 0;
+	Agg->Count = 0;
+	Agg->PlainBytes = 0;
+
+	return Length;
+}
+
+int32_t
+AggregateSplit(const ARM_char_t *Frame, const RxMsgInfo *Info, AggregateFrameFn FrameFn, void *Context ){
+
+	ARM_char_t Plain[PACKET_FRAME_LENGTH(AGG_MSG_MAX)];
+	const ARM_char_t *Hex = &Frame[MSG_HEADER_LENGTH];
+	uint8_t Sub[AGG_SUB_HEADER_MAX];
+	RxMsgInfo SubInfo;
+	PacketHdr Hdr;
+	int32_t Offset = 0, SubLength, Count = 0;
+	uint16_t SeqCount = (uint16_t)(Info->SeqCount - 1);
+
+	Counters.RxFrames++;
+
+	while(Offset < Info->MsgLength)
+	{
+		if(Offset + 2 > Info->MsgLength)
+			break;
+
+		ASCIIHexToBytes((ARM_char_t *)&Hex[2*Offset], Sub, 4);
+
+		SubLength = 2;
+		if(Sub[1] & AGG_SUB_FLAGS)
+			SubLength++;
+		if(Sub[1] & AGG_SUB_SEQ)
+			SubLength += 2;
+
+		if(Offset + SubLength > Info->MsgLength)
+			break;
+
+		ASCIIHexToBytes((ARM_char_t *)&Hex[2*Offset], Sub, 2*SubLength);
+
+		SubInfo.MsgID = Sub[0];
+		SubInfo.MsgLength = Sub[1] & AGG_SUB_LENGTH_MASK;
+		SubInfo.MsgFlags = (Sub[1] & AGG_SUB_FLAGS) ? Sub[2] : 0;
+
+		if(Sub[1] & AGG_SUB_SEQ)
+			SeqCount = (uint16_t)(Sub[SubLength - 2] | Sub[SubLength - 1] << 8);
+		else
+			SeqCount++;
+
+		SubInfo.SeqCount = SeqCount;
+		Offset += SubLength;
+
+		if(Offset + SubInfo.MsgLength > Info->MsgLength || (SubInfo.MsgFlags & ~AGG_SUB_MSG_FLAGS))
+			break;
+
+		BuildPacketHdr(SubInfo.MsgLength, SubInfo.MsgID, SubInfo.MsgFlags, SubInfo.SeqCount, &Hdr);
+		memcpy(Plain, &Hdr, MSG_HEADER_LENGTH);
+		memcpy(&Plain[MSG_HEADER_LENGTH], &Hex[2*Offset], (size_t)(2*SubInfo.MsgLength));
+		Plain[PACKET_FRAME_LENGTH(SubInfo.MsgLength) - 1] = '\n';
+
+		FrameFn(Plain, PACKET_FRAME_LENGTH(SubInfo.MsgLength), &SubInfo, Context);
+
+		Offset += SubInfo.MsgLength;
+		Count++;
+	}
+
+	Counters.RxMessages += Count;
+
+	if(Offset < Info->MsgLength)
+	{
+		Counters.RxBadFrames++;
+		return AGG_BAD_FRAME;
+	}
+
+	return Count;
+}
+
+void
+AggregateLogStats(void){
+
+	syslog(LOG_INFO, "Aggregation: TxFrames %u, TxMessages %u, TxAlone %u, TxBytesSaved %u, "
+			"RxFrames %u, RxMessages %u, RxBadFrames %u", Counters.TxFrames, Counters.TxMessages,
+			Counters.TxAlone, Counters.TxBytesSaved, Counters.RxFrames, Counters.RxMessages,
+			Counters.RxBadFrames);
+}
@@ -0,0 +1,145 @@
+/*
+ * SerialAggregate.h
+ *
+ *  Packing small messages into one frame on the link (-g). A frame
+ *  carries a 13 byte header and a new line, several times the payload
+ *  of a 2 - 8 byte command. With aggregation on the Daemon holds small
+ *  TX frames for a while and sends them as one super-frame, flagged
+ *  MSG_FLAG_AGGREGATE, and splits super-frames from the MCU back into
+ *  frames for the clients. The flag is the link's only while -g is on,
+ *  the Daemon then clears it from what clients send.
+ *
+ *  A super-frame's header has the MsgID and SeqCount of its first
+ *  message. Its payload is the messages one after another, each behind
+ *  a sub-header:
+ *   MsgID
+ *   Length (bits 0 - 5), AGG_SUB_FLAGS, AGG_SUB_SEQ
+ *   MsgFlags        with AGG_SUB_FLAGS, otherwise 0
+ *   SeqCount        with AGG_SUB_SEQ (little endian), otherwise the
+ *                   SeqCount of the message before plus one, the first
+ *                   message's is the header's
+ *   Length bytes of payload
+ *  So a message in a burst from one sender costs 2 bytes over its
+ *  payload, 4 characters on the line against 14 on its own.
+ *
+ *  Only messages up to AGG_MSG_MAX bytes, that aren't fragments, go in.
+ *  A held message goes out when the super-frame is full, ahead of a
+ *  message that can't be aggregated (the link keeps the order they were
+ *  sent in) and at the latest after the hold time. One message held on
+ *  its own goes out as the plain frame it was. A held message keeps the
+ *  expiry its TX frame had (see TxExpiryTrailer), one that has passed
+ *  by the time the frame is built is dropped, AggregateExpire.
+ */
+
+#ifndef SERIALAGGREGATE_H_
+#define SERIALAGGREGATE_H_
+
+#include "typedef.h"
+#include "SerialMsgUtils.h"
+
+/* Sub-header Length byte */
+#define AGG_SUB_LENGTH_MASK		0x3F
+#define AGG_SUB_FLAGS			0x40
+#define AGG_SUB_SEQ				0x80
+
+#define AGG_SUB_HEADER_MAX		5
+
+/* Largest message that is aggregated */
+#define AGG_MSG_MAX				AGG_SUB_LENGTH_MASK
+
+/* Super-frame payload, the default and the range for -G */
+#define AGG_DEFAULT_BYTES		64
+#define AGG_MIN_BYTES			(2 + AGG_SUB_HEADER_MAX)
+#define AGG_MAX_BYTES			MAX_MSG_SIZE
+
+/* Error Return Codes */
+#define AGG_FULL				-1		/* Flush, then add it again */
+#define AGG_NOT_SMALL			-2		/* Goes out on its own */
+#define AGG_BAD_FRAME			-3
+
+/* A message held, its payload is in the aggregator's Hex */
+typedef struct SerialAggregated{
+		RxMsgInfo	Info;
+		int64_t		ExpiresUs;				/* From its TxExpiryTrailer, 0 for none */
+		int32_t		Offset;					/* Of its payload in Hex */
+	}SerialAggregated;
+
+/* The sub-headers are put in front of the payloads when the frame is
+ * built, so a message dropped on the way leaves no gap */
+typedef struct SerialAggregator{
+		ARM_char_t	Hex[2*AGG_MAX_BYTES];	/* Payloads of the held messages, ASCII encoded */
+		SerialAggregated Held[AGG_MAX_BYTES/2];
+		int32_t		HexLength;
+		int32_t		Length;					/* Raw payload bytes of the frame, sub-headers included */
+		int32_t		Limit;
+		int32_t		Count;					/* Messages held */
+		int32_t		PlainBytes;				/* The held frames on their own */
+	}SerialAggregator;
+
+/* Called with each message split out of a super-frame, as a plain frame */
+typedef void (*AggregateFrameFn)(const ARM_char_t *Frame, int32_t Length, const RxMsgInfo *Info, void *Context);
+
+
+/* Empty Agg, super-frames of up to LimitBytes of payload */
+void
+AggregateInit(SerialAggregator *Agg, int32_t LimitBytes );
+
+/* Add a TX frame to those held
+ *
+ *  INPUTS:
+ *  Frame - The whole frame, as it would go on the line
+ *  Info - Its header, from ProcessPacket
+ *  ExpiresUs - When it's too late to send (CLOCK_MONOTONIC, see
+ *  	TxExpiryTrailer), 0 for never
+ *
+ *  RETURNS:
+ *  Messages held if sucessful, AGG_FULL if it doesn't fit with those
+ *  already held, AGG_NOT_SMALL if it can't be aggregated at all
+*/
+int32_t
+AggregateAdd(SerialAggregator *Agg, const ARM_char_t *Frame, const RxMsgInfo *Info, int64_t ExpiresUs );
+
+/* Drop the held messages that expired by NowUs, call it before
+ * AggregateBuild
+ *
+ *  RETURNS:
+ *  Messages dropped
+*/
+int32_t
+AggregateExpire(SerialAggregator *Agg, int64_t NowUs );
+
+/* When the last of the held messages expires, for a built frame that
+ * has to be kept
+ *
+ *  RETURNS:
+ *  The latest ExpiresUs, 0 if one of them never expires
+*/
+int64_t
+AggregateExpiry(const SerialAggregator *Agg );
+
+/* Build the frame for the held messages and empty Agg
+ *
+ *  INPUTS:
+ *  Frame - PACKET_FRAME_LENGTH(AGG_MAX_BYTES) bytes
+ *  Info - Filled in with the built frame's header
+ *
+ *  RETURNS:
+ *  Bytes in Frame, 0 with nothing held
+*/
+int32_t
+AggregateBuild(SerialAggregator *Agg, ARM_char_t *Frame, RxMsgInfo *Info );
+
+/* Split a received super-frame, in order
+ *
+ *  RETURNS:
+ *  Messages handed to FrameFn, AGG_BAD_FRAME if the payload doesn't
+ *  parse (the messages before the bad one have been handed on)
+*/
+int32_t
+AggregateSplit(const ARM_char_t *Frame, const RxMsgInfo *Info, AggregateFrameFn FrameFn, void *Context );
+
+/* Write the counters to the system log */
+void
+AggregateLogStats(void);
+
+#endif /* SERIALAGGREGATE_H_ */
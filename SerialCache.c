@@ -0,0 +1,265 @@
+/*
+ * SerialCache.c
+ *
+ *  Last value cache of each MsgID in shared memory, see SerialCache.h
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+
+#include "tlpi_hdr.h"
+#include "SerialCache.h"
+#include "SerialMsgUtils.h"
+#include "SerialCompress.h"
+
+typedef struct{
+	uint32_t Updates;
+	uint32_t Skipped;		/* Fragments, or payloads that didn't decode */
+}CacheCounters;
+
+/* The Daemon's mapping, read / write */
+static SerialCacheTable *Table = NULL;
+static CacheCounters Counters;
+
+/* A client's mapping, read only */
+static const SerialCacheTable *ReadTable = NULL;
+
+
+int32_t
+CacheOpen(const char *Name ){
+
+	struct stat Stat;
+	int Fd;
+	Boolean Fresh;
+
+	/* Readable by anyone, only the Daemon writes */
+	Fd = shm_open(Name, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if(Fd == -1)
+	{
+		syslog(LOG_INFO, "Cache: shm_open %s failed, error %s", Name, strerror(errno));
+		return CACHE_OPEN_FAIL;
+	}
+
+	if(fstat(Fd, &Stat) == -1 || (Stat.st_size != sizeof(SerialCacheTable) &&
+			ftruncate(Fd, sizeof(SerialCacheTable)) == -1))
+	{
+		syslog(LOG_INFO, "Cache: sizing %s failed, error %s", Name, strerror(errno));
+		close(Fd);
+		return CACHE_OPEN_FAIL;
+	}
+
+	Table = mmap(NULL, sizeof(SerialCacheTable), PROT_READ | PROT_WRITE, MAP_SHARED, Fd, 0);
+	close(Fd);
+
+	if(Table == MAP_FAILED)
+	{
+		Table = NULL;
+		syslog(LOG_INFO, "Cache: mmap %s failed, error %s", Name, strerror(errno));
+		return CACHE_OPEN_FAIL;
+	}
+
+	/* Values an earlier Daemon left are kept, unless the layout changed */
+	Fresh = Table->Magic != CACHE_MAGIC || Table->Version != CACHE_VERSION ||
+			Table->SlotSize != sizeof(SerialCacheSlot);
+
+	if(Fresh)
+	{
+		/* Readers check the magic, so it goes in last */
+		Table->Magic = 0;
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+		memset(Table->Slots, 0, sizeof(Table->Slots));
+		Table->Version = CACHE_VERSION;
+		Table->SlotSize = sizeof(SerialCacheSlot);
+		__atomic_store_n(&Table->Magic, CACHE_MAGIC, __ATOMIC_RELEASE);
+	}
+
+	memset(&Counters, 0, sizeof(Counters));
+
+	syslog(LOG_INFO, "Cache: last values in %s, %u bytes%s", Name, (unsigned)sizeof(SerialCacheTable),
+			Fresh ? "" : ", kept from the last run");
+	return 1;
+}
+
+void
+CacheClose(void){
+
+	if(Table == NULL)
+		return;
+
+	munmap(Table, sizeof(SerialCacheTable));
+	Table = NULL;
+}
+
+void
+CacheUpdate(const ARM_char_t *Frame, const RxMsgInfo *Info ){
+
+	static uint8_t Compressed[MAX_MSG_SIZE], Expanded[MAX_MSG_SIZE];
+	SerialCacheSlot *Slot;
+	uint32_t Sequence;
+	int32_t Length = 0;
+
+	if(Table == NULL)
+		return;
+
+	if((Info->MsgFlags & (MSG_FLAG_FRAGMENT | MSG_FLAG_MORE_FRAGMENTS)) || Info->MsgLength > MAX_MSG_SIZE)
+	{
+		Counters.Skipped++;
+		return;
+	}
+
+	/* Expanded before the slot is touched, a payload that won't expand
+	 * leaves the last good value */
+	if(Info->MsgFlags & MSG_FLAG_COMPRESSED)
+	{
+		ASCIIHexToBytes((ARM_char_t *)&Frame[MSG_HEADER_LENGTH], Compressed, Info->MsgLength*2);
+		Length = DecompressPayload(Compressed, Info->MsgLength, Expanded, MAX_MSG_SIZE);
+
+		if(Length < 0)
+		{
+			Counters.Skipped++;
+			return;
+		}
+	}
+
+	Slot = &Table->Slots[Info->MsgID];
+	Sequence = Slot->Sequence;
+
+	/* Odd, readers that started before now retry */
+	__atomic_store_n(&Slot->Sequence, Sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	if(Info->MsgFlags & MSG_FLAG_COMPRESSED)
+		memcpy(Slot->Data, Expanded, (size_t)Length);
+	else
+		Length = ASCIIHexToBytes((ARM_char_t *)&Frame[MSG_HEADER_LENGTH], Slot->Data, Info->MsgLength*2);
+
+	/* As Serial8051Receive hands it back, expanded */
+	Slot->Info = *Info;
+	Slot->Info.MsgLength = (uint16_t)Length;
+	Slot->Info.MsgFlags &= ~MSG_FLAG_COMPRESSED;
+	Slot->Length = Length;
+	clock_gettime(CLOCK_REALTIME, &Slot->Received);
+	Slot->Updates++;
+	Counters.Updates++;
+
+	__atomic_store_n(&Slot->Sequence, Sequence + 2, __ATOMIC_RELEASE);
+}
+
+void
+CacheLogStats(void){
+
+	if(Table == NULL)
+		return;
+
+	syslog(LOG_INFO, "Cache: Updates %u, Skipped %u", Counters.Updates, Counters.Skipped);
+}
+
+int32_t
+Serial8051CacheOpen(void){
+
+	const SerialCacheTable *Map;
+	struct stat Stat;
+	const char *Name;
+	int Fd;
+
+	if(ReadTable != NULL)
+		return 1;
+
+	Name = getenv(SERIAL_CACHE_ENV);
+	if(Name == NULL || Name[0] == '\0')
+		Name = SERIAL_CACHE_NAME;
+
+	Fd = shm_open(Name, O_RDONLY, 0);
+	if(Fd == -1)
+		return CACHE_OPEN_FAIL;
+
+	/* Reading a mapping past the end of a smaller object would fault,
+	 * it's smaller while the Daemon is still creating it */
+	if(fstat(Fd, &Stat) == -1 || Stat.st_size < (off_t)sizeof(SerialCacheTable))
+	{
+		close(Fd);
+		return CACHE_BAD_TABLE;
+	}
+
+	Map = mmap(NULL, sizeof(SerialCacheTable), PROT_READ, MAP_SHARED, Fd, 0);
+	close(Fd);
+
+	if(Map == MAP_FAILED)
+		return CACHE_OPEN_FAIL;
+
+	if(__atomic_load_n(&Map->Magic, __ATOMIC_ACQUIRE) != CACHE_MAGIC || Map->Version != CACHE_VERSION ||
+			Map->SlotSize != sizeof(SerialCacheSlot))
+	{
+		munmap((void *)Map, sizeof(SerialCacheTable));
+		return CACHE_BAD_TABLE;
+	}
+
+	ReadTable = Map;
+	return 1;
+}
+
+void
+Serial8051CacheClose(void){
+
+	if(ReadTable == NULL)
+		return;
+
+	munmap((void *)ReadTable, sizeof(SerialCacheTable));
+	ReadTable = NULL;
+}
+
+int32_t
+Serial8051CacheRead(uint8_t MsgID, uint8_t *Buffer, int32_t BufferSize, RxMsgInfo *Info,
+		struct timespec *Received, uint32_t *Updates ){
+
+	const SerialCacheSlot *Slot;
+	SerialCacheSlot Copy;
+	uint32_t Before, After;
+	int32_t Retries;
+
+	if(ReadTable == NULL)
+		return CACHE_NOT_OPEN;
+
+	Slot = &ReadTable->Slots[MsgID];
+
+	for(Retries = 0; Retries < CACHE_READ_RETRIES; Retries++)
+	{
+		Before = __atomic_load_n(&Slot->Sequence, __ATOMIC_ACQUIRE);
+		if(Before & 1)
+			continue;
+
+		/* The header fields, then only as much payload as there is */
+		memcpy(&Copy, Slot, offsetof(SerialCacheSlot, Data));
+		if(Copy.Length > 0 && Copy.Length <= MAX_MSG_SIZE && Copy.Length <= BufferSize)
+			memcpy(Buffer, Slot->Data, (size_t)Copy.Length);
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		After = __atomic_load_n(&Slot->Sequence, __ATOMIC_RELAXED);
+
+		if(Before != After)
+			continue;
+
+		if(Copy.Updates == 0)
+			return CACHE_EMPTY;
+
+		if(Copy.Length > BufferSize)
+			return CACHE_BUFF_TOO_SMALL;
+
+		*Info = Copy.Info;
+		if(Received != NULL)
+			*Received = Copy.Received;
+		if(Updates != NULL)
+			*Updates = Copy.Updates;
+
+		return Copy.Length;
+	}
+
+	return CACHE_BUSY;
+}
@@ -0,0 +1,126 @@
+/*
+ * SerialCache.h
+ *
+ *  Last value cache. The Daemon keeps the latest payload of every
+ *  MsgID, decoded (and expanded if it was compressed), in a shared
+ *  memory table of 256 slots (SERIAL_CACHE_NAME, or -k). A client that
+ *  only wants the current value of a reading maps the table once with
+ *  Serial8051CacheOpen and reads slots from then on with no system
+ *  calls, and takes nothing off the RX queue other readers depend on.
+ *
+ *  Each slot is a seqlock: the Daemon makes its Sequence odd while it
+ *  writes and even again after, a reader copies the slot and keeps the
+ *  copy only if Sequence was even and unchanged across it. Readers
+ *  never hold up the Daemon.
+ *
+ *  Only whole messages are cached, fragments of a large message are
+ *  left to Serial8051ReceiveLarge. The table outlives the Daemon, so
+ *  the last values (and their times) are still there across a restart.
+ */
+
+#ifndef SERIALCACHE_H_
+#define SERIALCACHE_H_
+
+#include <time.h>
+
+#include "tlpi_hdr.h"
+#include "typedef.h"
+#include "SerialLib8051.h"
+
+#define CACHE_SLOTS				256
+
+/* Checked by readers, a table laid out differently isn't used */
+#define CACHE_MAGIC				0x38303531		/* "8051" */
+#define CACHE_VERSION			1
+
+/* Times a read looks again while the Daemon is writing the slot, some
+ * microseconds, a write takes less */
+#define CACHE_READ_RETRIES		10000
+
+/* Error Return Codes */
+#define CACHE_OPEN_FAIL			-1
+#define CACHE_BAD_TABLE			-2		/* Not a table this library knows */
+#define CACHE_NOT_OPEN			-3
+#define CACHE_EMPTY				-4		/* Nothing received with the MsgID yet */
+#define CACHE_BUSY				-5		/* Being written on every retry */
+#define CACHE_BUFF_TOO_SMALL	-6
+
+typedef struct SerialCacheSlot{
+		uint32_t	Sequence;		/* Odd while the Daemon is writing */
+		uint32_t	Updates;		/* Messages with this MsgID cached, 0 for none */
+		RxMsgInfo	Info;
+		int32_t		Length;			/* Bytes of payload in Data */
+		struct timespec	Received;	/* CLOCK_REALTIME */
+		uint8_t		Data[MAX_MSG_SIZE];
+	}SerialCacheSlot;
+
+typedef struct SerialCacheTable{
+		uint32_t	Magic;
+		uint32_t	Version;
+		uint32_t	SlotSize;		/* sizeof(SerialCacheSlot) */
+		uint32_t	Reserved;
+		SerialCacheSlot	Slots[CACHE_SLOTS];
+	}SerialCacheTable;
+
+
+/* Daemon side */
+
+/* Create the table, or map the one an earlier Daemon left
+ *
+ *  RETURNS:
+ *  1 if sucessful, CACHE_OPEN_FAIL if failure
+*/
+int32_t
+CacheOpen(const char *Name );
+
+/* Unmap the table, it stays for readers and the next Daemon */
+void
+CacheClose(void);
+
+/* Decode a received frame into its MsgID's slot. Fragments and
+ * payloads that won't expand are left out
+ *
+ *  INPUTS:
+ *  Frame - The whole frame, as it came off the tty
+ *  Info - Its parsed header
+*/
+void
+CacheUpdate(const ARM_char_t *Frame, const RxMsgInfo *Info );
+
+/* Write the cache counters to the system log */
+void
+CacheLogStats(void);
+
+
+/* Client side */
+
+/* Map the Daemon's table read only. The name is SERIAL_CACHE_NAME
+ * unless the environment variable SERIAL_CACHE_ENV gives another
+ *
+ *  RETURNS:
+ *  1 if sucessful, CACHE_OPEN_FAIL or CACHE_BAD_TABLE if failure
+*/
+int32_t
+Serial8051CacheOpen(void);
+
+void
+Serial8051CacheClose(void);
+
+/* Copy out the latest message with MsgID, without a system call
+ *
+ *  INPUTS:
+ *  Buffer, BufferSize - Where the payload goes
+ *  Info - Set to its header
+ *  Received - Set to when the Daemon took it off the tty, may be NULL
+ *  Updates - Set to the slot's update count, which changes with each
+ *  	new message, so a poller can tell a new value. May be NULL
+ *
+ *  RETURNS:
+ *  Bytes of payload, or CACHE_NOT_OPEN, CACHE_EMPTY, CACHE_BUSY or
+ *  CACHE_BUFF_TOO_SMALL
+*/
+int32_t
+Serial8051CacheRead(uint8_t MsgID, uint8_t *Buffer, int32_t BufferSize, RxMsgInfo *Info,
+		struct timespec *Received, uint32_t *Updates );
+
+#endif /* SERIALCACHE_H_ */
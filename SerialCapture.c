@@ -0,0 +1,246 @@
+/*
+ * SerialCapture.c
+ *
+ *  Binary capture of serial traffic, see SerialCapture.h
+ */
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+
+#include "SerialCapture.h"
+
+#define CAPTURE_ROUND_UP(n)		(((n) + CAPTURE_ALIGN - 1) & ~(size_t)(CAPTURE_ALIGN - 1))
+
+/* The capture being written, Map is NULL when there is none */
+static int CaptureFd = -1;
+static uint8_t *Map = NULL;
+static size_t MapLength = 0;
+static size_t MaxLength = 0;
+
+
+static uint64_t
+ClockNs(clockid_t Clock ){
+
+	struct timespec Now;
+
+	clock_gettime(Clock, &Now);
+
+	return (uint64_t)Now.tv_sec*1000000000ULL + (uint64_t)Now.tv_nsec;
+}
+
+/* Extend the file and its mapping to hold at least Needed bytes
+ *
+ *  RETURNS:
+ *  1 if sucessful, 0 if that would pass MaxLength or the remap fails
+*/
+static int32_t
+GrowCapture(size_t Needed ){
+
+	size_t NewLength = MapLength;
+	uint8_t *NewMap;
+
+	while(NewLength < Needed)
+		NewLength += CAPTURE_GROW_BYTES;
+
+	if(NewLength > MaxLength)
+		NewLength = MaxLength;
+
+	if(NewLength < Needed || ftruncate(CaptureFd, (off_t)NewLength) == -1)
+		return 0;
+
+	NewMap = mmap(NULL, NewLength, PROT_READ | PROT_WRITE, MAP_SHARED, CaptureFd, 0);
+	if(NewMap == MAP_FAILED)
+		return 0;
+
+	munmap(Map, MapLength);
+	Map = NewMap;
+	MapLength = NewLength;
+
+	return 1;
+}
+
+int32_t
+CaptureOpen(const char *Path, int64_t MaxBytes ){
+
+	SerialCaptureHdr *Hdr;
+
+	if(Map != NULL)
+		CaptureClose();
+
+	if(MaxBytes < (int64_t)CAPTURE_GROW_BYTES)
+		MaxBytes = CAPTURE_GROW_BYTES;
+
+	CaptureFd = open(Path, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if(CaptureFd == -1)
+		return CAPTURE_OPEN_FAIL;
+
+	if(ftruncate(CaptureFd, CAPTURE_GROW_BYTES) == -1){
+		close(CaptureFd);
+		CaptureFd = -1;
+		return CAPTURE_OPEN_FAIL;
+	}
+
+	Map = mmap(NULL, CAPTURE_GROW_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, CaptureFd, 0);
+	if(Map == MAP_FAILED){
+		Map = NULL;
+		close(CaptureFd);
+		CaptureFd = -1;
+		return CAPTURE_MAP_FAIL;
+	}
+
+	MapLength = CAPTURE_GROW_BYTES;
+	MaxLength = (size_t)MaxBytes;
+
+	Hdr = (SerialCaptureHdr *)Map;
+	Hdr->Magic = CAPTURE_MAGIC;
+	Hdr->Version = CAPTURE_VERSION;
+	Hdr->StartRealtimeNs = ClockNs(CLOCK_REALTIME);
+	Hdr->StartMonotonicNs = ClockNs(CLOCK_MONOTONIC);
+	Hdr->DataEnd = CAPTURE_ROUND_UP(sizeof(SerialCaptureHdr));
+	Hdr->RecordsDropped = 0;
+
+	return 1;
+}
+
+/* Append a record, does nothing unless a capture is open */
+void
+CaptureFrame(uint8_t Direction, const ARM_char_t *Data, int32_t Length ){
+
+	SerialCaptureHdr *Hdr;
+	SerialCaptureRec *Rec;
+	size_t Offset, End;
+
+	if(Map == NULL || Length <= 0)
+		return;
+
+	Hdr = (SerialCaptureHdr *)Map;
+	Offset = (size_t)Hdr->DataEnd;
+	End = Offset + CAPTURE_ROUND_UP(sizeof(SerialCaptureRec) + (size_t)Length);
+
+	if(End > MapLength && !GrowCapture(End)){
+		Hdr = (SerialCaptureHdr *)Map;
+		Hdr->RecordsDropped++;
+		return;
+	}
+
+	/* GrowCapture may have moved the mapping */
+	Hdr = (SerialCaptureHdr *)Map;
+	Rec = (SerialCaptureRec *)&Map[Offset];
+
+	Rec->TimestampNs = ClockNs(CLOCK_MONOTONIC);
+	Rec->Length = (uint32_t)Length;
+	Rec->Direction = Direction;
+	memset(Rec->Reserved, 0, sizeof(Rec->Reserved));
+	memcpy(&Map[Offset + sizeof(SerialCaptureRec)], Data, (size_t)Length);
+
+	/* Publish the record last, a reader never sees half of one */
+	__sync_synchronize();
+	Hdr->DataEnd = End;
+}
+
+void
+CaptureClose(void){
+
+	size_t DataEnd;
+
+	if(Map == NULL)
+		return;
+
+	DataEnd = (size_t)((SerialCaptureHdr *)Map)->DataEnd;
+
+	munmap(Map, MapLength);
+	Map = NULL;
+	MapLength = 0;
+
+	/* Should this fail the file keeps its slack at the end, which
+	 * readers skip since DataEnd says where the records stop */
+	if(ftruncate(CaptureFd, (off_t)DataEnd) == -1)
+		syslog(LOG_INFO, "Capture file not trimmed, error %i", errno);
+
+	close(CaptureFd);
+	CaptureFd = -1;
+}
+
+int32_t
+CaptureReaderOpen(const char *Path, SerialCaptureReader *Reader ){
+
+	struct stat Stat;
+	int Fd;
+	void *ReadMap;
+
+	memset(Reader, 0, sizeof(SerialCaptureReader));
+
+	Fd = open(Path, O_RDONLY);
+	if(Fd == -1)
+		return CAPTURE_OPEN_FAIL;
+
+	if(fstat(Fd, &Stat) == -1 || (size_t)Stat.st_size < sizeof(SerialCaptureHdr)){
+		close(Fd);
+		return CAPTURE_BAD_FILE;
+	}
+
+	ReadMap = mmap(NULL, (size_t)Stat.st_size, PROT_READ, MAP_SHARED, Fd, 0);
+	close(Fd);
+
+	if(ReadMap == MAP_FAILED)
+		return CAPTURE_MAP_FAIL;
+
+	Reader->Map = (const uint8_t *)ReadMap;
+	Reader->MapLength = (size_t)Stat.st_size;
+	Reader->Hdr = (const SerialCaptureHdr *)ReadMap;
+	Reader->Offset = CAPTURE_ROUND_UP(sizeof(SerialCaptureHdr));
+
+	if(Reader->Hdr->Magic != CAPTURE_MAGIC || Reader->Hdr->Version != CAPTURE_VERSION){
+		CaptureReaderClose(Reader);
+		return CAPTURE_BAD_FILE;
+	}
+
+	return 1;
+}
+
+int32_t
+CaptureReaderNext(SerialCaptureReader *Reader, const SerialCaptureRec **Rec, const ARM_char_t **Data ){
+
+	const SerialCaptureRec *Next;
+	size_t DataEnd = (size_t)Reader->Hdr->DataEnd;
+	int32_t Truncated = CAPTURE_BAD_FILE;
+
+	/* A capture still being written may have grown past our mapping,
+	 * stop at the last record we have all of */
+	if(DataEnd > Reader->MapLength){
+		DataEnd = Reader->MapLength;
+		Truncated = 0;
+	}
+
+	if(Reader->Offset >= DataEnd)
+		return 0;
+
+	if(DataEnd - Reader->Offset < sizeof(SerialCaptureRec))
+		return Truncated;
+
+	Next = (const SerialCaptureRec *)&Reader->Map[Reader->Offset];
+
+	if(DataEnd - Reader->Offset - sizeof(SerialCaptureRec) < Next->Length)
+		return Truncated;
+
+	*Rec = Next;
+	*Data = (const ARM_char_t *)&Reader->Map[Reader->Offset + sizeof(SerialCaptureRec)];
+	Reader->Offset += CAPTURE_ROUND_UP(sizeof(SerialCaptureRec) + Next->Length);
+
+	return 1;
+}
+
+void
+CaptureReaderClose(SerialCaptureReader *Reader ){
+
+	if(Reader->Map != NULL)
+		munmap((void *)Reader->Map, Reader->MapLength);
+
+	memset(Reader, 0, sizeof(SerialCaptureReader));
+}
@@ -0,0 +1,125 @@
+/*
+ * SerialCapture.h
+ *
+ *  Binary capture of the traffic on the serial link, for replaying a
+ *  field load pattern offline (see SerialReplay.c). The Daemon appends
+ *  every raw read from the tty and every frame written to it, with a
+ *  CLOCK_MONOTONIC timestamp and the direction, to a memory mapped
+ *  file. Appending is a copy into the mapping, no system call per
+ *  record, so capturing costs the RX / TX paths very little.
+ *
+ *  File layout:
+ *   SerialCaptureHdr
+ *   records: SerialCaptureRec, then Length bytes of data, padded out
+ *            to CAPTURE_ALIGN
+ *
+ *  DataEnd in the file header only moves past a record once the record
+ *  is complete, so a capture is readable while the Daemon is still
+ *  writing it, or after the Daemon was killed.
+ */
+
+#ifndef SERIALCAPTURE_H_
+#define SERIALCAPTURE_H_
+
+#include <stddef.h>
+
+#include "typedef.h"
+
+#define CAPTURE_MAGIC			0x50414353		/* "SCAP" */
+#define CAPTURE_VERSION			1
+
+#define CAPTURE_DIR_RX			0		/* Raw bytes read from the tty */
+#define CAPTURE_DIR_TX			1		/* A frame written to the tty */
+
+#define CAPTURE_ALIGN			8
+
+/* The file is extended (and remapped) this much at a time */
+#define CAPTURE_GROW_BYTES		(1024*1024)
+
+/* Largest capture file unless configured otherwise, records that
+ * won't fit are counted and dropped */
+#define CAPTURE_DEFAULT_MAX		(64*1024*1024)
+
+/* Error Return Codes */
+#define CAPTURE_OPEN_FAIL		-1
+#define CAPTURE_MAP_FAIL		-2
+#define CAPTURE_BAD_FILE		-3
+
+typedef struct SerialCaptureHdr{
+		uint32_t	Magic;
+		uint32_t	Version;
+		uint64_t	StartRealtimeNs;	/* Wall clock when the capture started */
+		uint64_t	StartMonotonicNs;	/* The same moment on the record clock */
+		uint64_t	DataEnd;			/* File offset past the last complete record */
+		uint32_t	RecordsDropped;		/* File was at its size limit */
+		uint32_t	Reserved;
+	}SerialCaptureHdr;
+
+typedef struct SerialCaptureRec{
+		uint64_t	TimestampNs;		/* CLOCK_MONOTONIC */
+		uint32_t	Length;				/* Data bytes following the record */
+		uint8_t		Direction;			/* CAPTURE_DIR_* */
+		uint8_t		Reserved[3];
+	}SerialCaptureRec;
+
+/* Capture file mapped for reading */
+typedef struct SerialCaptureReader{
+		const uint8_t			*Map;
+		size_t					MapLength;
+		size_t					Offset;		/* Of the next record */
+		const SerialCaptureHdr	*Hdr;
+	}SerialCaptureReader;
+
+
+/* Start capturing to Path, replacing whatever is there
+ *
+ *  INPUTS:
+ *  Path - Capture file
+ *  MaxBytes - Largest the file may grow to
+ *
+ *  RETURNS:
+ *  1 if sucessful, negative error code if failure
+*/
+int32_t
+CaptureOpen(const char *Path, int64_t MaxBytes );
+
+/* Append a record, does nothing unless a capture is open
+ *
+ *  INPUTS:
+ *  Direction - CAPTURE_DIR_RX or CAPTURE_DIR_TX
+ *  Data, Length - Bytes read from / written to the tty
+*/
+void
+CaptureFrame(uint8_t Direction, const ARM_char_t *Data, int32_t Length );
+
+/* Trim the file to the records written and stop capturing */
+void
+CaptureClose(void);
+
+/* Map a capture file for reading
+ *
+ *  RETURNS:
+ *  1 if sucessful, negative error code if the file can't be mapped or
+ *  isn't a capture
+*/
+int32_t
+CaptureReaderOpen(const char *Path, SerialCaptureReader *Reader );
+
+/* Step to the next record
+ *
+ *  INPUTS:
+ *  Reader - From CaptureReaderOpen
+ *  Rec - Set to the record header
+ *  Data - Set to the record's data, inside the mapping
+ *
+ *  RETURNS:
+ *  1 for a record, 0 at the end of the capture, CAPTURE_BAD_FILE if a
+ *  record runs past DataEnd
+*/
+int32_t
+CaptureReaderNext(SerialCaptureReader *Reader, const SerialCaptureRec **Rec, const ARM_char_t **Data );
+
+void
+CaptureReaderClose(SerialCaptureReader *Reader );
+
+#endif /* SERIALCAPTURE_H_ */
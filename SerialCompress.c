@@ -0,0 +1,149 @@
+/*
+ * SerialCompress.c
+ *
+ *  Small LZ77 style payload coder, see SerialCompress.h for the format
+ */
+
+#include <string.h>
+
+#include "SerialCompress.h"
+
+/* Hash of the next COMPRESS_MIN_MATCH bytes, picks a slot in the match table */
+#define COMPRESS_HASH_BITS		8
+#define COMPRESS_HASH(p)		((uint8_t)(((p)[0] << 3) ^ ((p)[1] << 1) ^ (p)[2]))
+
+
+/* Copy a pending literal run to the output. Returns the new output index,
+ * or -1 if it doesn't fit */
+static int32_t
+FlushLiterals(const uint8_t *Literals, int32_t Count, uint8_t *Out, int32_t OutIndex, int32_t OutSize ){
+
+	int32_t Run;
+
+	while(Count > 0){
+		Run = (Count > COMPRESS_MAX_LITERALS) ? COMPRESS_MAX_LITERALS : Count;
+
+		if(OutIndex + 1 + Run > OutSize)
+			return -1;
+
+		Out[OutIndex++] = (uint8_t)(Run - 1);
+		memcpy(&Out[OutIndex], Literals, (size_t)Run);
+		OutIndex += Run;
+
+		Literals += Run;
+		Count -= Run;
+	}
+
+	return OutIndex;
+}
+
+int32_t
+CompressPayload(const uint8_t *RawIn, int32_t Length, uint8_t *CompressedOut, int32_t OutSize ){
+
+	/* Last position each hash was seen at, +1 so 0 means never */
+	int32_t LastSeen[1 << COMPRESS_HASH_BITS];
+	int32_t InIndex = 0, OutIndex = COMPRESS_HEADER_LENGTH, LiteralStart = 0;
+	int32_t Candidate, MatchLength, MaxMatch;
+	uint8_t Hash;
+
+	if(OutSize < COMPRESS_HEADER_LENGTH || Length > 0xFFFF)
+		return COMPRESS_NO_GAIN;
+
+	memset(LastSeen, 0, sizeof(LastSeen));
+
+	CompressedOut[0] = (uint8_t)Length;
+	CompressedOut[1] = (uint8_t)(Length >> 8);
+
+	while(InIndex + COMPRESS_MIN_MATCH <= Length){
+
+		Hash = COMPRESS_HASH(&RawIn[InIndex]);
+		Candidate = LastSeen[Hash] - 1;
+		LastSeen[Hash] = InIndex + 1;
+
+		MatchLength = 0;
+
+		if(Candidate >= 0 && InIndex - Candidate <= COMPRESS_WINDOW){
+			MaxMatch = Length - InIndex;
+			if(MaxMatch > COMPRESS_MAX_MATCH)
+				MaxMatch = COMPRESS_MAX_MATCH;
+
+			/* Overlapping matches are fine, the decoder copies forward
+			 * a byte at a time */
+			while(MatchLength < MaxMatch && RawIn[Candidate + MatchLength] == RawIn[InIndex + MatchLength])
+				MatchLength++;
+		}
+
+		if(MatchLength < COMPRESS_MIN_MATCH){
+			InIndex++;
+			continue;
+		}
+
+		OutIndex = FlushLiterals(&RawIn[LiteralStart], InIndex - LiteralStart, CompressedOut, OutIndex, OutSize);
+		if(OutIndex < 0 || OutIndex + 2 > OutSize)
+			return COMPRESS_NO_GAIN;
+
+		CompressedOut[OutIndex++] = (uint8_t)(0x80 | (MatchLength - COMPRESS_MIN_MATCH));
+		CompressedOut[OutIndex++] = (uint8_t)(InIndex - Candidate - 1);
+
+		InIndex += MatchLength;
+		LiteralStart = InIndex;
+	}
+
+	OutIndex = FlushLiterals(&RawIn[LiteralStart], Length - LiteralStart, CompressedOut, OutIndex, OutSize);
+	if(OutIndex < 0)
+		return COMPRESS_NO_GAIN;
+
+	return OutIndex;
+}
+
+int32_t
+DecompressPayload(const uint8_t *CompressedIn, int32_t Length, uint8_t *RawOut, int32_t OutSize ){
+
+	int32_t InIndex = COMPRESS_HEADER_LENGTH, OutIndex = 0, RawLength, Count, Distance;
+	uint8_t Token;
+
+	if(Length < COMPRESS_HEADER_LENGTH)
+		return DECOMPRESS_CORRUPT;
+
+	RawLength = (int32_t)CompressedIn[0] | ((int32_t)CompressedIn[1] << 8);
+
+	if(RawLength > OutSize)
+		return DECOMPRESS_OVERFLOW;
+
+	while(InIndex < Length){
+
+		Token = CompressedIn[InIndex++];
+
+		if(Token < 0x80){
+			Count = Token + 1;
+
+			if(InIndex + Count > Length || OutIndex + Count > RawLength)
+				return DECOMPRESS_CORRUPT;
+
+			memcpy(&RawOut[OutIndex], &CompressedIn[InIndex], (size_t)Count);
+			InIndex += Count;
+			OutIndex += Count;
+		}
+		else{
+			if(InIndex >= Length)
+				return DECOMPRESS_CORRUPT;
+
+			Count = (Token & 0x7F) + COMPRESS_MIN_MATCH;
+			Distance = CompressedIn[InIndex++] + 1;
+
+			if(Distance > OutIndex || OutIndex + Count > RawLength)
+				return DECOMPRESS_CORRUPT;
+
+			/* Byte at a time, the match may overlap what it is writing */
+			while(Count-- > 0){
+				RawOut[OutIndex] = RawOut[OutIndex - Distance];
+				OutIndex++;
+			}
+		}
+	}
+
+	if(OutIndex != RawLength)
+		return DECOMPRESS_CORRUPT;
+
+	return RawLength;
+}
@@ -0,0 +1,67 @@
+/*
+ * SerialCompress.h
+ *
+ *  Small LZ77 style payload coder for messages going over the slow
+ *  UART link. Kept simple enough for the 8051 firmware to implement:
+ *  byte aligned tokens and a 256 byte window, so the decoder needs no
+ *  RAM beyond its output buffer.
+ *
+ *  Compressed format:
+ *   2 bytes  original length, little endian
+ *   tokens:
+ *    0x00-0x7F  literal run, (token + 1) bytes follow
+ *    0x80-0xFF  match, length (token & 0x7F) + COMPRESS_MIN_MATCH,
+ *               followed by one byte, distance back - 1
+ */
+
+#ifndef SERIALCOMPRESS_H_
+#define SERIALCOMPRESS_H_
+
+#include "typedef.h"
+
+#define COMPRESS_MIN_MATCH		3
+#define COMPRESS_MAX_MATCH		(0x7F + COMPRESS_MIN_MATCH)
+#define COMPRESS_MAX_LITERALS	0x80
+#define COMPRESS_WINDOW			256
+#define COMPRESS_HEADER_LENGTH	2
+
+/* Error Return Codes */
+#define COMPRESS_NO_GAIN		-1
+#define DECOMPRESS_CORRUPT		-2
+#define DECOMPRESS_OVERFLOW		-3
+
+/* Running totals, for working out the compression ratio */
+typedef struct SerialCompressStats{
+		uint32_t	MsgsCompressed;
+		uint32_t	MsgsSkipped;	/* Compression requested but didn't shrink the message */
+		uint32_t	BytesIn;		/* Original size of the compressed messages */
+		uint32_t	BytesOut;		/* Compressed size of the same */
+	}SerialCompressStats;
+
+
+/* Compress a payload
+ *
+ *  INPUTS:
+ *  RawIn - Payload to compress
+ *  Length - Bytes in RawIn
+ *  CompressedOut - Output buffer
+ *  OutSize - Give up once the output would pass this many bytes, pass
+ *  	Length - 1 to only accept output that is smaller than the input
+ *
+ *  RETURNS:
+ *  Bytes in CompressedOut if sucessful, COMPRESS_NO_GAIN if the output
+ *  would not fit in OutSize
+*/
+int32_t
+CompressPayload(const uint8_t *RawIn, int32_t Length, uint8_t *CompressedOut, int32_t OutSize );
+
+/* Reverse of CompressPayload
+ *
+ *  RETURNS:
+ *  Bytes in RawOut if sucessful, negative error code if the input is
+ *  corrupt or doesn't fit in OutSize
+*/
+int32_t
+DecompressPayload(const uint8_t *CompressedIn, int32_t Length, uint8_t *RawOut, int32_t OutSize );
+
+#endif /* SERIALCOMPRESS_H_ */
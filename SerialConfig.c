@@ -0,0 +1,562 @@
+/*
+ * SerialConfig.c
+ *
+ *  Run time configuration of the Serial Daemon, see SerialConfig.h
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+
+#include "tlpi_hdr.h"
+#include "SerialConfig.h"
+#include "SerialDaemon.h"
+#include "SerialCapture.h"
+#include "SerialLib8051.h"
+#include "SerialLink.h"
+#include "SerialAggregate.h"
+
+#define SERIAL_CONFIG_OPTIONS	"d:b:B:p:m:t:fr:c:C:P:w:D:F:s:R:a:LJ:l:u:e:k:n:g:G:x:j:"
+
+
+void
+SerialConfigDefaults(DaemonConfig *Config ){
+
+	memset(Config, 0, sizeof(DaemonConfig));
+
+	strncpy(Config->TtyPath, SERIAL_FILEPATH, sizeof(Config->TtyPath) - 1);
+	Config->RxBufferSize = RX_BUFF_DEFAULT_SIZE;
+	Config->RxBufferMax = RX_BUFF_DEFAULT_MAX;
+	Config->TtyProfile = TTY_PROFILE_LATENCY;
+	Config->VMin = CONFIG_UNSET;
+	Config->VTime = CONFIG_UNSET;
+	Config->HwFlowControl = FALSE;
+	Config->RxTrigBytes = CONFIG_UNSET;
+	Config->CaptureMaxBytes = CAPTURE_DEFAULT_MAX;
+	Config->PoolBlocks = POOL_DEFAULT_BLOCKS;
+	Config->WatchdogMs = WATCHDOG_DEFAULT_MS;
+	Config->DrainMs = DRAIN_DEFAULT_MS;
+	Config->RxBatchUs = RX_BATCH_DEFAULT_US;
+	Config->AggBytes = AGG_DEFAULT_BYTES;
+	strcpy(Config->SocketPath, SERIAL_SOCKET_PATH);
+	Config->IoEngine = IO_ENGINE_SIGNAL;
+	strcpy(Config->CacheName, SERIAL_CACHE_NAME);
+	strcpy(Config->JournalPath, SERIAL_JOURNAL_PATH);
+	Config->SchedPolicy = SCHED_OTHER;
+	Config->SchedPriority = CONFIG_UNSET;
+}
+
+/* Profile name to TTY_PROFILE_*, -1 if it isn't one */
+static int32_t
+TtyProfileFromName(const char *Name ){
+
+	if(strcmp(Name, "legacy") == 0)
+		return TTY_PROFILE_LEGACY;
+	if(strcmp(Name, "latency") == 0)
+		return TTY_PROFILE_LATENCY;
+	if(strcmp(Name, "throughput") == 0)
+		return TTY_PROFILE_THROUGHPUT;
+
+	return -1;
+}
+
+/* Scheduling policy name to SCHED_*, -1 if it isn't one */
+static int32_t
+SchedPolicyFromName(const char *Name ){
+
+	if(strcmp(Name, "other") == 0)
+		return SCHED_OTHER;
+	if(strcmp(Name, "fifo") == 0)
+		return SCHED_FIFO;
+	if(strcmp(Name, "rr") == 0)
+		return SCHED_RR;
+
+	return -1;
+}
+
+/* CPU list like 0,2-3 to a mask, 0 if it isn't one */
+static uint32_t
+CpuListToMask(const char *List ){
+
+	uint32_t Mask = 0;
+	long First, Last, Cpu;
+	char *End;
+
+	for( ;; )
+	{
+		First = strtol(List, &End, 10);
+		if(End == List || First < 0 || First > 31)
+			return 0;
+
+		Last = First;
+		if(*End == '-')
+		{
+			List = End + 1;
+			Last = strtol(List, &End, 10);
+			if(End == List || Last < First || Last > 31)
+				return 0;
+		}
+
+		for(Cpu = First; Cpu <= Last; Cpu++)
+			Mask |= 1U << Cpu;
+
+		if(*End == '\0')
+			return Mask;
+
+		if(*End != ',')
+			return 0;
+
+		List = End + 1;
+	}
+}
+
+/* MsgID list like 5,20-23 to a DELTA_ID_WORDS bit set
+ *
+ *  RETURNS:
+ *  MsgIDs in the set, -1 if it isn't a list of MsgIDs
+*/
+static int32_t
+MsgIdListToSet(const char *List, uint32_t *Set ){
+
+	long First, Last, MsgID;
+	int32_t Count = 0;
+	char *End;
+
+	memset(Set, 0, DELTA_ID_WORDS*sizeof(uint32_t));
+
+	for( ;; )
+	{
+		First = strtol(List, &End, 0);
+		if(End == List || First < 0 || First > 255)
+			return -1;
+
+		Last = First;
+		if(*End == '-')
+		{
+			List = End + 1;
+			Last = strtol(List, &End, 0);
+			if(End == List || Last < First || Last > 255)
+				return -1;
+		}
+
+		for(MsgID = First; MsgID <= Last; MsgID++)
+		{
+			if(!(Set[MsgID / 32] & (1U << (MsgID % 32))))
+				Count++;
+			Set[MsgID / 32] |= 1U << (MsgID % 32);
+		}
+
+		if(*End == '\0')
+			return Count;
+
+		if(*End != ',')
+			return -1;
+
+		List = End + 1;
+	}
+}
+
+/* Whole number option value, from Min to Max
+ *
+ *  RETURNS:
+ *  1 if sucessful, CONFIG_BAD_OPTION if Arg isn't one
+*/
+static int32_t
+OptionNumber(const char *Arg, long long Min, long long Max, long long *Value ){
+
+	char *End;
+
+	errno = 0;
+	*Value = strtoll(Arg, &End, 0);
+
+	if(errno != 0 || End == Arg || *End != '\0' || *Value < Min || *Value > Max)
+		return CONFIG_BAD_OPTION;
+
+	return 1;
+}
+
+/* OptionNumber for an int32_t setting, Value is left alone on failure */
+static int32_t
+OptionInt(const char *Arg, int32_t Min, int32_t *Value ){
+
+	long long Number;
+
+	if(OptionNumber(Arg, Min, INT32_MAX, &Number) < 0)
+		return CONFIG_BAD_OPTION;
+
+	*Value = (int32_t)Number;
+
+	return 1;
+}
+
+/* Apply one option, from getopt
+ *
+ *  RETURNS:
+ *  1 if sucessful, CONFIG_BAD_OPTION if the option or its value is bad
+*/
+static int32_t
+ApplyOption(int opt, const char *Arg, DaemonConfig *Config ){
+
+	long long Number;
+
+	switch(opt)
+	{
+	case 'd':
+		strncpy(Config->TtyPath, Arg, sizeof(Config->TtyPath) - 1);
+		break;
+
+	case 'b':
+		if(OptionInt(Arg, 1, &Config->RxBufferSize) < 0)
+			return CONFIG_BAD_OPTION;
+		break;
+
+	case 'B':
+		if(OptionInt(Arg, 1, &Config->RxBufferMax) < 0)
+			return CONFIG_BAD_OPTION;
+		break;
+
+	case 'p':
+		Config->TtyProfile = TtyProfileFromName(Arg);
+		if(Config->TtyProfile < 0)
+			return CONFIG_BAD_OPTION;
+		break;
+
+	case 'm':
+		if(OptionInt(Arg, 0, &Config->VMin) < 0)
+			return CONFIG_BAD_OPTION;
+		break;
+
+	case 't':
+		if(OptionInt(Arg, 0, &Config->VTime) < 0)
+			return CONFIG_BAD_OPTION;
+		break;
+
+	case 'f':
+		Config->HwFlowControl = TRUE;
+		break;
+
+	case 'r':
+		if(OptionInt(Arg, 1, &Config->RxTrigBytes) < 0)
+			return CONFIG_BAD_OPTION;
+		break;
+
+	case 'c':
+		strncpy(Config->CapturePath, Arg, sizeof(Config->CapturePath) - 1);
+		break;
+
+	case 'C':
+		if(OptionNumber(Arg, 1, INT64_MAX, &Number) < 0)
+			return CONFIG_BAD_OPTION;
+		Config->CaptureMaxBytes = (int64_t)Number;
+		break;
+
+	case 'P':
+		if(OptionInt(Arg, 1, &Config->PoolBlocks) < 0)
+			return CONFIG_BAD_OPTION;
+		break;
+
+	case 'w':
+		if(OptionInt(Arg, 0, &Config->WatchdogMs) < 0)
+			return CONFIG_BAD_OPTION;
+		break;
+
+	case 'D':
+		if(OptionInt(Arg, 0, &Config->DrainMs) < 0)
+			return CONFIG_BAD_OPTION;
+		break;
+
+	case 'F':
+		strncpy(Config->ConfigPath, Arg, sizeof(Config->ConfigPath) - 1);
+		break;
+
+	case 's':
+		Config->SchedPolicy = SchedPolicyFromName(Arg);
+		if(Config->SchedPolicy < 0)
+			return CONFIG_BAD_OPTION;
+		break;
+
+	case 'R':
+		if(OptionInt(Arg, 1, &Config->SchedPriority) < 0 || Config->SchedPriority > 99)
+			return CONFIG_BAD_OPTION;
+		break;
+
+	case 'a':
+		Config->CpuMask = CpuListToMask(Arg);
+		if(Config->CpuMask == 0)
+			return CONFIG_BAD_OPTION;
+		break;
+
+	case 'L':
+		Config->LockMemory = TRUE;
+		break;
+
+	case 'J':
+		if(OptionInt(Arg, 1, &Config->JitterSeconds) < 0)
+			return CONFIG_BAD_OPTION;
+		break;
+
+	case 'l':
+		if(OptionInt(Arg, 0, &Config->RxBatchUs) < 0)
+			return CONFIG_BAD_OPTION;
+		break;
+
+	case 'u':
+		if(strcmp(Arg, "none") == 0)
+			Config->SocketPath[0] = '\0';
+		else
+			strncpy(Config->SocketPath, Arg, sizeof(Config->SocketPath) - 1);
+		break;
+
+	case 'e':
+		if(strcmp(Arg, "signal") == 0)
+			Config->IoEngine = IO_ENGINE_SIGNAL;
+		else if(strcmp(Arg, "uring") == 0)
+			Config->IoEngine = IO_ENGINE_URING;
+		else
+			return CONFIG_BAD_OPTION;
+		break;
+
+	case 'k':
+		if(strcmp(Arg, "none") == 0)
+			Config->CacheName[0] = '\0';
+		else if(Arg[0] != '/' || strlen(Arg) >= sizeof(Config->CacheName))
+			return CONFIG_BAD_OPTION;
+		else
+			strcpy(Config->CacheName, Arg);
+		break;
+
+	case 'n':
+		if(OptionInt(Arg, 0, &Config->LinkMaxBps) < 0 ||
+				(Config->LinkMaxBps != 0 && LinkRateIndex(Config->LinkMaxBps) < 0))
+			return CONFIG_BAD_OPTION;
+		break;
+
+	case 'g':
+		if(OptionInt(Arg, 0, &Config->AggHoldUs) < 0)
+			return CONFIG_BAD_OPTION;
+		break;
+
+	case 'G':
+		if(OptionInt(Arg, AGG_MIN_BYTES, &Config->AggBytes) < 0 || Config->AggBytes > AGG_MAX_BYTES)
+			return CONFIG_BAD_OPTION;
+		break;
+
+	case 'x':
+		if(strcmp(Arg, "none") == 0)
+			memset(Config->DeltaIds, 0, sizeof(Config->DeltaIds));
+		else
+		{
+			Number = MsgIdListToSet(Arg, Config->DeltaIds);
+			if(Number < 0 || Number > DELTA_MAX_STREAMS)
+				return CONFIG_BAD_OPTION;
+		}
+		break;
+
+	case 'j':
+		if(strcmp(Arg, "none") == 0)
+			Config->JournalPath[0] = '\0';
+		else
+			strncpy(Config->JournalPath, Arg, sizeof(Config->JournalPath) - 1);
+		break;
+
+	default:
+		return CONFIG_BAD_OPTION;
+	}
+
+	return 1;
+}
+
+/* Run getopt over an argument list, the command line or a config file's
+ *
+ *  RETURNS:
+ *  1 if sucessful, CONFIG_BAD_OPTION at the first bad option, with
+ *  BadOpt set to it
+*/
+static int32_t
+ParseOptions(int argc, char *argv[], DaemonConfig *Config, int *BadOpt ){
+
+	int opt;
+
+	/* Start the scan over, the list may have been parsed before */
+	optind = 1;
+
+	while((opt = getopt(argc, argv, SERIAL_CONFIG_OPTIONS)) != -1)
+	{
+		if(ApplyOption(opt, optarg, Config) < 0)
+		{
+			*BadOpt = (opt == '?') ? optopt : opt;
+			return CONFIG_BAD_OPTION;
+		}
+	}
+
+	return 1;
+}
+
+/* Apply the options in a config file, see SerialConfig.h for the format
+ *
+ *  RETURNS:
+ *  1 if sucessful, CONFIG_FILE_FAIL if it can't be read, CONFIG_BAD_OPTION
+ *  if an option in it is bad
+*/
+static int32_t
+ParseConfigFile(const char *Path, DaemonConfig *Config, int *BadOpt ){
+
+	char Text[CONFIG_FILE_MAX_BYTES + 1];
+	char *Args[CONFIG_FILE_MAX_ARGS + 1];
+	char *Comment, *Line, *Token, *LineSave, *TokenSave;
+	int ArgCount = 0;
+	size_t Length;
+	FILE *File;
+
+	File = fopen(Path, "r");
+	if(File == NULL)
+		return CONFIG_FILE_FAIL;
+
+	Length = fread(Text, 1, sizeof(Text), File);
+	fclose(File);
+
+	/* Rather refuse the file than act on part of it */
+	if(Length > CONFIG_FILE_MAX_BYTES)
+		return CONFIG_FILE_FAIL;
+
+	Text[Length] = '\0';
+
+	/* getopt skips the first argument, the program name */
+	Args[ArgCount++] = (char *)Path;
+
+	for(Line = strtok_r(Text, "\n", &LineSave); Line != NULL; Line = strtok_r(NULL, "\n", &LineSave))
+	{
+		Comment = strchr(Line, '#');
+		if(Comment != NULL)
+			*Comment = '\0';
+
+		for(Token = strtok_r(Line, " \t\r", &TokenSave); Token != NULL; Token = strtok_r(NULL, " \t\r", &TokenSave))
+		{
+			if(ArgCount == CONFIG_FILE_MAX_ARGS)
+				return CONFIG_FILE_FAIL;
+
+			Args[ArgCount++] = Token;
+		}
+	}
+
+	Args[ArgCount] = NULL;
+
+	return ParseOptions(ArgCount, Args, Config, BadOpt);
+}
+
+/* Fill in what the options left to the profile, and keep the sizes sane */
+static void
+FinishConfig(DaemonConfig *Config ){
+
+	/* Fill in whatever wasn't given from the profile */
+	if(Config->VMin == CONFIG_UNSET)
+		Config->VMin = (Config->TtyProfile == TTY_PROFILE_THROUGHPUT) ? THROUGHPUT_VMIN : LATENCY_VMIN;
+
+	if(Config->VTime == CONFIG_UNSET)
+		Config->VTime = (Config->TtyProfile == TTY_PROFILE_THROUGHPUT) ? THROUGHPUT_VTIME : LATENCY_VTIME;
+
+	/* Termios holds these in a cc_t */
+	if(Config->VMin > 255)
+		Config->VMin = 255;
+
+	if(Config->VTime > 255)
+		Config->VTime = 255;
+
+	/* A blocking read with VMIN set and no VTIME would wait forever for
+	 * the rest of a short frame */
+	if(Config->TtyProfile == TTY_PROFILE_THROUGHPUT && Config->VTime == 0)
+		Config->VTime = THROUGHPUT_VTIME;
+
+	/* A whole frame has to fit, otherwise the largest messages could
+	 * never be received */
+	if(Config->RxBufferSize < PACKET_FRAME_LENGTH(MAX_MSG_SIZE))
+		Config->RxBufferSize = PACKET_FRAME_LENGTH(MAX_MSG_SIZE);
+
+	if(Config->RxBufferMax < Config->RxBufferSize)
+		Config->RxBufferMax = Config->RxBufferSize;
+
+	/* A priority alone means SCHED_FIFO, a real time policy alone gets
+	 * the default priority */
+	if(Config->SchedPolicy == SCHED_OTHER && Config->SchedPriority != CONFIG_UNSET)
+		Config->SchedPolicy = SCHED_FIFO;
+
+	if(Config->SchedPolicy != SCHED_OTHER && Config->SchedPriority == CONFIG_UNSET)
+		Config->SchedPriority = SCHED_DEFAULT_PRIORITY;
+}
+
+/* Defaults, then the config file, then the command line again so it
+ * wins over the file. The first pass over the command line finds -F
+ *
+ *  RETURNS:
+ *  1 if sucessful, negative error code if failure
+*/
+static int32_t
+BuildConfig(int argc, char *argv[], DaemonConfig *Config, int *BadOpt ){
+
+	int32_t Return;
+
+	SerialConfigDefaults(Config);
+
+	Return = ParseOptions(argc, argv, Config, BadOpt);
+	if(Return < 0 || Config->ConfigPath[0] == '\0')
+		return Return;
+
+	Return = ParseConfigFile(Config->ConfigPath, Config, BadOpt);
+	if(Return < 0)
+		return Return;
+
+	return ParseOptions(argc, argv, Config, BadOpt);
+}
+
+void
+SerialConfigParseArgs(int argc, char *argv[], DaemonConfig *Config ){
+
+	int32_t Return;
+	int BadOpt = 0;
+
+	Return = BuildConfig(argc, argv, Config, &BadOpt);
+
+	if(Return == CONFIG_FILE_FAIL)
+		fatal("Config file %s can't be read, or is over %i bytes / %i options",
+				Config->ConfigPath, CONFIG_FILE_MAX_BYTES, CONFIG_FILE_MAX_ARGS);
+
+	if(Return < 0)
+		usageErr("%s [-d tty] [-b rx-buffer-bytes] [-B rx-buffer-max-bytes] "
+				"[-p legacy|latency|throughput] [-m vmin] [-t vtime] [-f] [-r rx-trig-bytes] "
+				"[-c capture-file] [-C capture-max-bytes] [-P pool-blocks] [-w watchdog-ms] "
+				"[-D drain-ms] [-F config-file] [-s other|fifo|rr] [-R priority] [-a cpu-list] [-L] [-J jitter-secs] [-l rx-batch-us] [-u socket|none] [-e signal|uring] [-k cache|none] [-n max-baud] [-g hold-us] [-G aggregate-bytes] [-x msgid-list|none] [-j journal|none]\n"
+				"bad option or value: -%c\n", argv[0], BadOpt);
+
+	FinishConfig(Config);
+}
+
+/* Build the configuration again, for a reload. A running Daemon keeps
+ * its configuration if the file is bad
+ *
+ *  RETURNS:
+ *  1 if sucessful, CONFIG_FILE_FAIL or CONFIG_BAD_OPTION if failure
+*/
+int32_t
+SerialConfigReload(int argc, char *argv[], DaemonConfig *Config ){
+
+	DaemonConfig NewConfig;
+	int32_t Return;
+	int BadOpt = 0;
+
+	/* Options the Daemon was started with passed once, only the file
+	 * can be bad now. getopt's complaints would go to a closed stderr */
+	opterr = 0;
+	Return = BuildConfig(argc, argv, &NewConfig, &BadOpt);
+	opterr = 1;
+
+	if(Return < 0)
+		return Return;
+
+	FinishConfig(&NewConfig);
+	*Config = NewConfig;
+
+	return 1;
+}
@@ -0,0 +1,178 @@
+/*
+ * SerialConfig.h
+ *
+ *  Run time configuration of the Serial Daemon, filled in with the
+ *  defaults below and then overridden from the config file (-F), if
+ *  there is one, and the command line.
+ *
+ *  The config file takes the same options as the command line, any
+ *  number to a line, '#' starts a comment:
+ *   -p throughput -m 128
+ *   -w 500		# health check twice a second
+ *  Options given on the command line win over the file. The Daemon
+ *  reads the file again on SIGHUP, see SerialConfigReload.
+ */
+
+#ifndef SERIALCONFIG_H_
+#define SERIALCONFIG_H_
+
+#include <limits.h>
+#include <sched.h>
+
+#include "tlpi_hdr.h"
+#include "typedef.h"
+#include "SerialMsgUtils.h"
+#include "SerialDelta.h"
+
+/* RX accumulation buffer, big enough for a complete frame behind a
+ * partial one. It grows up to the max under a burst */
+#define RX_BUFF_DEFAULT_SIZE	(2*PACKET_FRAME_LENGTH(MAX_MSG_SIZE))
+#define RX_BUFF_DEFAULT_MAX		(8*PACKET_FRAME_LENGTH(MAX_MSG_SIZE))
+
+/* Queue message buffers / packet records the Daemon preallocates.
+ * SerialTx holds one of each while SerialWriteFrame may receive, which
+ * can take another to make room on a full RX queue */
+#define POOL_DEFAULT_BLOCKS		4
+
+/* Period of the Daemon's health check, 0 turns it off */
+#define WATCHDOG_DEFAULT_MS		1000
+
+/* Longest the Daemon spends sending what's queued when told to stop,
+ * or waiting for the tty to go quiet before a reload reopens it */
+#define DRAIN_DEFAULT_MS		2000
+
+/* Longest RX bytes are left in the driver while a frame is part way
+ * in, 0 reads on every byte's signal */
+#define RX_BATCH_DEFAULT_US		0
+
+/* I/O engine for the tty, see SerialUring.h
+ *  SIGNAL - read / write on the tty's RT signal
+ *  URING  - io_uring, multishot reads and linked TX writes. Falls back
+ *  		 to SIGNAL where it isn't built in or the kernel can't */
+#define IO_ENGINE_SIGNAL		0
+#define IO_ENGINE_URING			1
+
+/* Real time priority for -s fifo / rr without -R */
+#define SCHED_DEFAULT_PRIORITY	50
+
+/* Config file size limits */
+#define CONFIG_FILE_MAX_BYTES	4096
+#define CONFIG_FILE_MAX_ARGS	128
+
+/* Error Return Codes */
+#define CONFIG_FILE_FAIL		-1		/* Can't be read, or too big */
+#define CONFIG_BAD_OPTION		-2
+
+/* How the serial port is set up, see SerialConfigure()
+ *  LEGACY     - original settings, only ICRNL and ECHO cleared
+ *  LATENCY    - raw, driver low latency flag set, non-blocking reads
+ *  		     drained as soon as the first byte arrives
+ *  THROUGHPUT - raw, low latency flag cleared, blocking reads that
+ *  		     gather up to VMIN bytes or until the line is quiet for
+ *  		     VTIME, so a burst comes in with few reads */
+#define TTY_PROFILE_LEGACY		0
+#define TTY_PROFILE_LATENCY		1
+#define TTY_PROFILE_THROUGHPUT	2
+
+/* Termios VMIN / VTIME (tenths of a second) for each profile, used
+ * unless given on the command line */
+#define LATENCY_VMIN			1
+#define LATENCY_VTIME			0
+#define THROUGHPUT_VMIN			64
+#define THROUGHPUT_VTIME		1
+
+/* Leave a setting the way the profile / driver has it */
+#define CONFIG_UNSET			-1
+
+typedef struct DaemonConfig{
+		char		TtyPath[PATH_MAX];
+		int32_t		RxBufferSize;
+		int32_t		RxBufferMax;
+		int32_t		TtyProfile;
+		int32_t		VMin;
+		int32_t		VTime;
+		Boolean		HwFlowControl;	/* RTS/CTS */
+		int32_t		RxTrigBytes;	/* UART RX FIFO trigger level, where the driver allows it */
+		char		CapturePath[PATH_MAX];	/* Empty for no capture */
+		int64_t		CaptureMaxBytes;
+		int32_t		PoolBlocks;		/* Of each buffer pool */
+		int32_t		WatchdogMs;
+		int32_t		DrainMs;
+		char		ConfigPath[PATH_MAX];	/* Empty for none */
+		int32_t		SchedPolicy;	/* SCHED_OTHER, SCHED_FIFO or SCHED_RR */
+		int32_t		SchedPriority;
+		uint32_t	CpuMask;		/* CPUs to run on, 0 for any */
+		Boolean		LockMemory;
+		int32_t		JitterSeconds;	/* Measure instead of running, 0 for a normal run */
+		int32_t		RxBatchUs;		/* RX batching latency cap, 0 for none */
+		char		SocketPath[PATH_MAX];	/* Empty for no socket */
+		int32_t		IoEngine;
+		char		CacheName[NAME_MAX];	/* Empty for no last value cache */
+		int32_t		LinkMaxBps;		/* Negotiate the tty rate up to this, 0 for none */
+		int32_t		AggHoldUs;		/* Longest a small TX message is held, 0 for no aggregation */
+		int32_t		AggBytes;		/* Payload of an aggregated frame */
+		uint32_t	DeltaIds[DELTA_ID_WORDS];	/* MsgIDs sent delta coded, a bit each */
+		char		JournalPath[PATH_MAX];	/* Empty for no durable TX */
+	}DaemonConfig;
+
+
+/* Fill in Config with the compiled in defaults */
+void
+SerialConfigDefaults(DaemonConfig *Config );
+
+/* Override Config from the config file and the command line, exits
+ * with a usage message on a bad option or an unreadable file
+ *
+ *  Options:
+ *  -d path   serial device (default SERIAL_FILEPATH)
+ *  -b bytes  initial RX buffer size
+ *  -B bytes  largest size the RX buffer may grow to
+ *  -p name   tty profile, legacy, latency (default) or throughput
+ *  -m count  termios VMIN
+ *  -t tenths termios VTIME
+ *  -f        RTS/CTS hardware flow control
+ *  -r bytes  UART RX FIFO trigger level
+ *  -c path   capture the serial traffic to path, see SerialCapture.h
+ *  -C bytes  largest the capture file may grow to
+ *  -P count  blocks in each of the Daemon's buffer pools
+ *  -w ms     health check period, 0 for none
+ *  -D ms     time allowed to drain the TX queue and the tty on exit
+ *  -F path   config file
+ *  -s name   scheduling policy, other (default), fifo or rr
+ *  -R prio   real time priority, fifo unless -s says otherwise
+ *  -a cpus   CPUs to run on, a list like 0,2-3
+ *  -L        lock the Daemon's memory
+ *  -J secs   measure timer wakeup jitter with the settings above, then exit
+ *  -l us     batch RX reads, holding a part frame no longer than us
+ *  -u path   client socket (default SERIAL_SOCKET_PATH), none for no socket
+ *  -e name   I/O engine, signal (default) or uring
+ *  -k name   last value cache (default SERIAL_CACHE_NAME), none for no cache
+ *  -n bps    negotiate the tty rate with the MCU, up to bps, see SerialLink.h.
+ *            Falling back on errors needs the watchdog (-w), and blocks
+ *            RX / TX while the rates are tried
+ *  -g us     aggregate small messages, holding one no longer than us,
+ *            see SerialAggregate.h
+ *  -G bytes  payload of an aggregated frame (default AGG_DEFAULT_BYTES)
+ *  -x ids    MsgIDs the MCU sends delta coded, a list like 5,20-23, none
+ *            for none, see SerialDelta.h
+ *  -j path   durable TX journal (default SERIAL_JOURNAL_PATH), none for no
+ *            durable TX, see SerialJournal.h
+*/
+void
+SerialConfigParseArgs(int argc, char *argv[], DaemonConfig *Config );
+
+/* Build the configuration again from the defaults, the config file as
+ * it is now and the command line, for a reload. Nothing exits here, a
+ * running Daemon keeps its configuration if the file is bad
+ *
+ *  INPUTS:
+ *  argc, argv - The Daemon's command line
+ *  Config - Replaced only if sucessful
+ *
+ *  RETURNS:
+ *  1 if sucessful, CONFIG_FILE_FAIL or CONFIG_BAD_OPTION if failure
+*/
+int32_t
+SerialConfigReload(int argc, char *argv[], DaemonConfig *Config );
+
+#endif /* SERIALCONFIG_H_ */
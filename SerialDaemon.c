@@ -22,6 +22,10 @@
 #include <syslog.h>
 #include <string.h>
 #include <unistd.h>
+#include <limits.h>
+#include <sys/ioctl.h>
+#include <linux/serial.h>
+#include <poll.h>
 
 #include "tlpi_hdr.h"
 #include "tty_functions.h"
@@ -31,6 +35,20 @@
 #include "SerialLib8051.h"
 #include "typedef.h"
 #include "become_daemon.h"
+#include "SerialConfig.h"
+#include "SerialRxBuffer.h"
+#include "SerialRoute.h"
+#include "SerialCapture.h"
+#include "SerialPool.h"
+#include "SerialRealtime.h"
+#include "SerialSocket.h"
+#include "SerialUring.h"
+#include "SerialCache.h"
+#include "SerialTrace.h"
+#include "SerialLink.h"
+#include "SerialAggregate.h"
+#include "SerialDelta.h"
+#include "SerialJournal.h"
 
 
 /* Something required by RT Signals */
@@ -38,8 +56,19 @@
 //#define _POSIX_C_SOURCE 199309
 #define DEBUG_LEVEL 11
 
-/* RT Signal to indicate Serial Available */
-#define SERIAL_RX_SIG 1
+/* RT Signal to indicate Serial Available. These queue, so input
+ * signalled while we are busy isn't folded into another signal, and
+ * leave SIGHUP free for reloading the configuration */
+#define SERIAL_RX_SIG (SIGRTMIN)
+
+/* RT Signal from the RX batching timer, time to read what's gathered */
+#define SERIAL_RX_BATCH_SIG (SIGRTMIN + 1)
+
+/* RT Signal from the client socket, a connection or frames waiting */
+#define SERIAL_SOCK_SIG (SIGRTMIN + 2)
+
+/* RT Signal from the aggregation hold timer, send the held messages */
+#define SERIAL_TX_HOLD_SIG (SIGRTMIN + 3)
 
 /* Run in the foreground, not as a daemon */
 /* #define FOREGROUND_RUN */
@@ -47,18 +76,57 @@
 /* Globals set by the signal handler that the application
  * can use to determine what action to compelete when it
  * receives signal */
-static volatile sig_atomic_t gotSigio = 0, gotSigUsr1 = 0;
+static volatile sig_atomic_t gotSigio = 0, gotSigUsr1 = 0, gotSigUsr2 = 0, gotSigAlrm = 0;
+static volatile sig_atomic_t gotSigTerm = 0, gotSigHup = 0, gotSockIo = 0, gotTxHold = 0;
+
+/* Running counters, written to the system log on SIGUSR2 */
+SerialDaemonStats DaemonStats;
+
+/* Run time configuration, from the command line */
+DaemonConfig Config;
+
+/* Bytes read from the serial port that haven't made a complete frame yet */
+SerialRxBuffer RxAccum;
+
+/* Queue message buffers and packet records, preallocated in main */
+SerialPool FramePool, PacketPool;
 
 /* Original Termios Settings, for restoring at the dameon
  * exit  */
 struct termios OrigTermios;
 
+/* Once shutting down, CLOCK_MONOTONIC ms by which the TX drain has to
+ * be done. No write waits on the tty past it. 0 until then */
+int64_t DrainDeadlineMs = 0;
+
+/* Set when a read or write finds the serial port gone (unplugged, hung
+ * up). Nothing touches the tty again until RecoverTty reopens it */
+Boolean TtyFailed = FALSE;
+
+/* RX batching (Config.RxBatchUs): set while a frame is part way in, the
+ * tty's O_ASYNC is off and the batch timer says when to read again */
+static Boolean RxBatching = FALSE;
+static timer_t RxBatchTimer;
+static Boolean RxBatchTimerOk = FALSE;
+
+/* Bytes the last SerialRx pass read */
+static int32_t RxLastPassBytes = 0;
+
+/* Aggregation (Config.AggHoldUs): small TX messages held back to go out
+ * as one frame, the hold timer caps how long the first one waits */
+static SerialAggregator TxAgg;
+static uint32_t TxAggPrio;		/* TX queue priority of the first one held */
+static timer_t TxHoldTimer;
+static Boolean TxHoldTimerOk = FALSE;
+
+/* MsgIDs decoded as delta streams (Config.DeltaIds) */
+static int32_t DeltaStreams = 0;
+
 /* Log the Error Message */
-LogErrno(){
-char UsrMsg[50];
-char ErrMsg[50];
-ErrMsg=strerror(errno);
-sprintf(UsrMsg, "ERRNO = %i , %s", errno, ErrMsg);
+void
+LogErrno(const char *Where){
+char UsrMsg[100];
+snprintf(UsrMsg, sizeof(UsrMsg), "%s: ERRNO = %i , %s", Where, errno, strerror(errno));
 syslog(LOG_INFO, "%s", UsrMsg);
 }
 
@@ -73,6 +141,10 @@ SemaphoreInitialization(void){
 	/* Create named semaphore, if not available */
 	flags |= O_CREAT;
 
+	/* An existing one keeps its value, the PID of a Daemon that didn't
+	 * exit cleanly. Start from a new one so clients signal us */
+	sem_unlink(SERIAL_DAEMON_SEM);
+
 	/* Use the PID as the value of the Semphore, something can see then see the Serial DaemonSerialT
 	 * PID by checking the Sem Value */
 	sem = sem_open(SERIAL_DAEMON_SEM, flags, perms, (unsigned int)getpid());
@@ -94,9 +166,7 @@ SemaphoreInitialization(void){
 int ClearMessageQueue(mqd_t mqd , int NumberToClear){
 
 	struct mq_attr attr;
-	/*ARM_char_t *ASCII_Buff = (ARM_char_t*) malloc(attr.mq_msgsize);*/
-	/*uint32_t Length = malloc(attr.mq_msgsize);*/
-	ARM_char_t ASCII_Buff[2*MAX_MSG_SIZE + MSG_HEADER_LENGTH];
+	ARM_char_t *ASCII_Buff;
 	int32_t  numRead = 1, numCleared = 0;
 	uint32_t prio;
 
@@ -109,12 +179,21 @@ int ClearMessageQueue(mqd_t mqd , int NumberToClear){
 	      return SERIAL_RECEIVE_MESSAGE_ATTR_FAIL;
 	    }
 
+	    /* mq_receive wants room for the largest message the queue takes,
+	     * a frame sized buffer isn't enough */
+	    ASCII_Buff = (ARM_char_t *)PoolAlloc(&FramePool);
+	    if(ASCII_Buff == NULL || attr.mq_msgsize > FramePool.BlockSize)
+	    {
+	    	PoolFree(&FramePool, ASCII_Buff);
+	    	return SERIAL_RECEIVE_BUFF_ALLOCATE_FAIL;
+	    }
+
 	    /* Read Message as long as specified by user, which gives them
 	     * the ability to clear as many messages as they want, bail out if we stop
 	     * receiving bytes as well */
 	    while(NumberToClear > 0 && numRead > 0){
 
-	    	numRead = mq_receive(mqd, (char *)&ASCII_Buff, attr.mq_msgsize, &prio);
+	    	numRead = mq_receive(mqd, ASCII_Buff, attr.mq_msgsize, &prio);
 	    	mq_getattr(mqd, &attr);
 
 			#if DEBUG_LEVEL > 50
@@ -125,10 +204,60 @@ int ClearMessageQueue(mqd_t mqd , int NumberToClear){
 	    	numCleared++;
 	    }
 
+	 PoolFree(&FramePool, ASCII_Buff);
+
 	 return numCleared;
 }
 
-int SerialConfigure(const char *SerialFd, uint16_t BaudRate){
+/* Set or clear the driver's low latency flag, which makes it hand
+ * received bytes to the line discipline right away instead of batching
+ * them on a timer tick. Not every driver (or a pty) supports it */
+static int
+SerialSetLowLatency(int ttyFd, Boolean Enable)
+{
+	struct serial_struct SerialInfo;
+
+	if(ioctl(ttyFd, TIOCGSERIAL, &SerialInfo) == -1)
+		return -1;
+
+	if(Enable)
+		SerialInfo.flags |= ASYNC_LOW_LATENCY;
+	else
+		SerialInfo.flags &= ~ASYNC_LOW_LATENCY;
+
+	if(ioctl(ttyFd, TIOCSSERIAL, &SerialInfo) == -1)
+		return -1;
+
+	return 0;
+}
+
+/* Set the UART RX FIFO trigger level, only drivers that expose
+ * rx_trig_bytes in sysfs (8250 family) allow it */
+static int
+SerialSetRxTrigger(const char *SerialFd, int32_t TrigBytes)
+{
+	char SysfsPath[PATH_MAX];
+	const char *TtyName;
+	FILE *TrigFile;
+
+	TtyName = strrchr(SerialFd, '/');
+	TtyName = (TtyName == NULL) ? SerialFd : TtyName + 1;
+
+	snprintf(SysfsPath, sizeof(SysfsPath), "/sys/class/tty/%s/rx_trig_bytes", TtyName);
+
+	TrigFile = fopen(SysfsPath, "w");
+	if(TrigFile == NULL)
+		return -1;
+
+	fprintf(TrigFile, "%i", TrigBytes);
+
+	if(fclose(TrigFile) == EOF)
+		return -1;
+
+	return 0;
+}
+
+int SerialConfigure(const char *SerialFd, uint16_t BaudRate, const DaemonConfig *TtyConfig){
 
 	int32_t ttyFd, flags = 0;
 
@@ -150,43 +279,93 @@ int SerialConfigure(const char *SerialFd, uint16_t BaudRate){
 		 syslog(LOG_INFO, "Serial Interface Opened Sucessfully");
 	 }
 
-	    /* Acquire Current Serial Terminal settings so that we can go ahead and
-	      change and later restore them */
-	 if(tcgetattr(ttyFd, &OrigTermios)==-1)
+	 if(TtyConfig->TtyProfile == TTY_PROFILE_LEGACY)
 	 {
-		syslog(LOG_INFO, "tcgetattr failure");
-		return TCGETATTR_FAIL;
+		    /* Acquire Current Serial Terminal settings so that we can go ahead and
+		      change and later restore them */
+		 if(tcgetattr(ttyFd, &OrigTermios)==-1)
+		 {
+			syslog(LOG_INFO, "tcgetattr failure");
+			close(ttyFd);
+			return TCGETATTR_FAIL;
+
+		 }
+
+		 ModifiedTermios = OrigTermios;
 
+		 //Prevent Line clear conversion to new line character
+		 ModifiedTermios.c_iflag &= ~ICRNL;
+
+		 /*Prevent Echoing of Input characters (Received characters
+		 * retransmitted on TX line) */
+		 ModifiedTermios.c_lflag &= ~ECHO;
 	 }
+	 else
+	 {
+		 /* Raw mode, no line editing, signals, or translation of the header
+		  * bytes. Saves the current settings for restoring at exit */
+		 if(ttySetRaw(ttyFd, &OrigTermios)==-1)
+		 {
+			syslog(LOG_INFO, "Failed to set raw mode");
+			close(ttyFd);
+			return TCSETATTR_FAIL;
+		 }
 
-	 ModifiedTermios = OrigTermios;
+		 if(tcgetattr(ttyFd, &ModifiedTermios)==-1)
+		 {
+			syslog(LOG_INFO, "tcgetattr failure");
+			close(ttyFd);
+			return TCGETATTR_FAIL;
+		 }
 
-	 //Prevent Line clear conversion to new line character
-	 ModifiedTermios.c_iflag &= ~ICRNL;
+		 /* Read coalescing, see the TTY_PROFILE_* descriptions */
+		 ModifiedTermios.c_cc[VMIN] = (cc_t)TtyConfig->VMin;
+		 ModifiedTermios.c_cc[VTIME] = (cc_t)TtyConfig->VTime;
 
-	 /*Prevent Echoing of Input characters (Received characters
-	 * retransmitted on TX line) */
-	 ModifiedTermios.c_lflag &= ~ECHO;
+		 ModifiedTermios.c_cflag |= (CLOCAL | CREAD);
+	 }
+
+	 if(TtyConfig->HwFlowControl)
+		 ModifiedTermios.c_cflag |= CRTSCTS;
+	 else
+		 ModifiedTermios.c_cflag &= ~CRTSCTS;
 
 	 /* Set Baud Rate */
-	 if(cfsetospeed(&ModifiedTermios, BaudRate) == -1)
+	 if(cfsetospeed(&ModifiedTermios, BaudRate) == -1 ||
+		cfsetispeed(&ModifiedTermios, BaudRate) == -1)
 	 {
 		syslog(LOG_INFO, "Failed to Set BaudRate");
+		close(ttyFd);
 		return BAUDRATE_FAIL;
 	 }
 	 /*  Put in Cbreak mode where break signals lead to interrupts */
 	 if(tcsetattr(ttyFd, TCSAFLUSH, &ModifiedTermios)==-1)
 	 {
 		syslog(LOG_INFO, "Failed to modify terminal settings");
+		close(ttyFd);
 		return TCSETATTR_FAIL;
 	 }
 
+	 /* Driver tuning is best effort, the port works without it */
+	 if(TtyConfig->TtyProfile != TTY_PROFILE_LEGACY)
+	 {
+		 if(SerialSetLowLatency(ttyFd, TtyConfig->TtyProfile == TTY_PROFILE_LATENCY) == -1)
+			 syslog(LOG_INFO, "Driver low latency flag not supported, left as is");
+	 }
+
+	 if(TtyConfig->RxTrigBytes != CONFIG_UNSET)
+	 {
+		 if(SerialSetRxTrigger(SerialFd, TtyConfig->RxTrigBytes) == -1)
+			 syslog(LOG_INFO, "RX FIFO trigger level not supported by driver, left as is");
+	 }
+
 
 	 /* set owner process that is to receive "I/O possible" signal */
 	 /*NOTE: replace stdin_fileno with the /dev/tty04 or whatever */
 	 if (fcntl(ttyFd, F_SETOWN, getpid()) == -1)
 	 {
 		syslog(LOG_INFO, "ERROR: fcntl(F_SETOWN)");
+		close(ttyFd);
 		return SETOWN_FAIL;
 	 }
 
@@ -194,11 +373,18 @@ int SerialConfigure(const char *SerialFd, uint16_t BaudRate){
 
 	 /* enable "I/O Possible" signalling and make I/O nonblocking for FD
 	  * O_ASYNC flag causes signal to be routed to the owner process, set
-	  * above */
+	  * above. The throughput profile reads blocking, so VMIN / VTIME can
+	  * gather a burst, SerialRx only reads when bytes are waiting */
 	 flags = fcntl(ttyFd, F_GETFL );
-	 if (fcntl(ttyFd, F_SETFL, flags | O_ASYNC | O_NONBLOCK) == -1 )
+	 if(TtyConfig->TtyProfile == TTY_PROFILE_THROUGHPUT)
+		 flags = (flags | O_ASYNC) & ~O_NONBLOCK;
+	 else
+		 flags |= O_ASYNC | O_NONBLOCK;
+
+	 if (fcntl(ttyFd, F_SETFL, flags) == -1 )
 	 {
 			syslog(LOG_INFO, "ERROR: FCTNL mode");
+			close(ttyFd);
 			return FCNTL_MODE;
 	 }
 	 else
@@ -211,6 +397,341 @@ int SerialConfigure(const char *SerialFd, uint16_t BaudRate){
 
 
 
+static int SerialRx(int ttyFd, const char *FileName);
+
+/* Record a tty failure, the first report of it is logged. Error is
+ * the errno of the failed call, 0 for a hang up */
+static void
+MarkTtyFailed(const char *Where, int Error)
+{
+	if(TtyFailed)
+		return;
+
+	TtyFailed = TRUE;
+	DaemonStats.TtyFailures++;
+
+	if(Error != 0)
+	{
+		errno = Error;
+		LogErrno(Where);
+	}
+	else
+		syslog(LOG_INFO, "%s: tty hung up", Where);
+}
+
+/* TRUE once the far end of the tty has hung up, or the device is gone */
+static Boolean
+TtyHungUp(int ttyFd)
+{
+	struct pollfd Pfd;
+
+	Pfd.fd = ttyFd;
+	Pfd.events = 0;
+
+	if(poll(&Pfd, 1, 0) < 0)
+		return FALSE;
+
+	return (Pfd.revents & (POLLHUP | POLLERR | POLLNVAL)) != 0;
+}
+
+static int64_t
+MonotonicMs(void)
+{
+	struct timespec Now;
+
+	clock_gettime(CLOCK_MONOTONIC, &Now);
+
+	return (int64_t)Now.tv_sec*1000 + Now.tv_nsec/1000000;
+}
+
+/* The same clock as TxExpiryTrailer */
+static int64_t
+MonotonicUs(void)
+{
+	struct timespec Now;
+
+	clock_gettime(CLOCK_MONOTONIC, &Now);
+
+	return (int64_t)Now.tv_sec*1000000 + Now.tv_nsec/1000;
+}
+
+/* Open one of the Daemon's queues, creating it if it doesn't exist.
+ * Unlike Serial8051Open an existing queue is kept, along with the
+ * messages waiting in it */
+static mqd_t
+OpenDaemonQueue(const char *QueueName)
+{
+	return mq_open(QueueName, O_RDWR | O_CREAT | O_NONBLOCK,
+			S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, NULL);
+}
+
+/* Write a whole frame to the tty. The output buffer fills up when
+ * frames are queued back to back (a fragmented message), so a short
+ * write waits for it to drain rather than cutting the frame off.
+ * Input is still read while we wait, a long transmission would
+ * otherwise overrun the driver's receive buffer.
+ *
+ *  RETURNS:
+ *  Count if sucessful, -1 if the write fails or the tty won't take
+ *  the rest within TX_DRAIN_TIMEOUT_MS (or by DrainDeadlineMs)
+*/
+static int
+SerialWriteFrame(int ttyFd, const char *Frame, size_t Count)
+{
+	size_t Written = 0;
+	ssize_t WriteReturn;
+	struct pollfd Pfd;
+	int64_t TimeoutMs;
+
+	Pfd.fd = ttyFd;
+	Pfd.events = POLLOUT | POLLIN;
+
+	while(Written < Count)
+	{
+		WriteReturn = write(ttyFd, &Frame[Written], Count - Written);
+
+		if(WriteReturn > 0)
+		{
+			Written += (size_t)WriteReturn;
+			continue;
+		}
+
+		if(WriteReturn < 0 && errno == EINTR)
+			continue;
+
+		if(WriteReturn < 0 && errno != EAGAIN)
+		{
+			MarkTtyFailed("SerialTx write", errno);
+			return -1;
+		}
+
+		DaemonStats.TxWriteStalls++;
+
+		TimeoutMs = TX_DRAIN_TIMEOUT_MS;
+		if(DrainDeadlineMs > 0 && DrainDeadlineMs - MonotonicMs() < TimeoutMs)
+			TimeoutMs = (DrainDeadlineMs > MonotonicMs()) ? DrainDeadlineMs - MonotonicMs() : 0;
+
+		if(poll(&Pfd, 1, (int)TimeoutMs) <= 0)
+			return -1;
+
+		if(Pfd.revents & (POLLHUP | POLLERR | POLLNVAL))
+		{
+			MarkTtyFailed("SerialTx", 0);
+			return -1;
+		}
+
+		if(Pfd.revents & POLLIN)
+			SerialRx(ttyFd, SERIAL_RX_LOG_FILENAME);
+	}
+
+	return (int)Written;
+}
+
+/* One shot SERIAL_TX_HOLD_SIG in Us microseconds */
+static void
+ArmTxHoldTimer(int32_t Us)
+{
+	struct itimerspec Timer;
+
+	if(!TxHoldTimerOk)
+		return;
+
+	memset(&Timer, 0, sizeof(Timer));
+	Timer.it_value.tv_sec = Us / 1000000;
+	Timer.it_value.tv_nsec = (long)(Us % 1000000) * 1000;
+
+	timer_settime(TxHoldTimer, 0, &Timer, NULL);
+}
+
+/* Config.AggBytes, or less if a frame that size wouldn't fit a pool
+ * block, an aggregated frame may have to go back on the TX queue with
+ * its trailers */
+static int32_t
+AggregateLimit(void)
+{
+	int32_t Limit = (FramePool.BlockSize - PACKET_FRAME_LENGTH(0) - (int32_t)TX_TRAILERS_MAX) / 2;
+
+	return (Config.AggBytes < Limit) ? Config.AggBytes : Limit;
+}
+
+/* Trailers for a frame AggregateBuild made, before it goes back on the
+ * TX queue: ExpiresUs, from AggregateExpiry, and the TxBuiltTrailer
+ * that has SerialTx write it as it is. Frame has room for them
+ *
+ *  RETURNS:
+ *  Bytes to queue
+*/
+static int32_t
+MarkBuiltFrame(ARM_char_t *Frame, int32_t Length, int64_t ExpiresUs)
+{
+	if(ExpiresUs != 0)
+		Length = AppendTxExpiry(Frame, Length, ExpiresUs);
+
+	return AppendTxBuilt(Frame, Length);
+}
+
+/* Write the TX messages held for aggregation, as one frame. Those past
+ * their expiry are dropped first. They are in no queue any more, if
+ * the port has failed the frame goes back on the TX queue for when
+ * it's back
+ *
+ *  RETURNS:
+ *  Bytes written, 0 with nothing held, SERIAL_TX_WRITE_FAIL if failure
+*/
+static int
+AggregateFlush(int ttyFd)
+{
+	static ARM_char_t Frame[PACKET_FRAME_LENGTH(AGG_MAX_BYTES) + TX_TRAILERS_MAX];
+	RxMsgInfo Info;
+	int64_t ExpiresUs;
+	int Length, Written;
+	mqd_t mqd;
+
+	DaemonStats.TxExpired += AggregateExpire(&TxAgg, MonotonicUs());
+
+	ExpiresUs = AggregateExpiry(&TxAgg);
+	Length = AggregateBuild(&TxAgg, Frame, &Info);
+	if(Length == 0)
+		return 0;
+
+	Written = TtyFailed ? -1 : SerialWriteFrame(ttyFd, Frame, (size_t)Length);
+	if(Written < 0)
+	{
+		syslog(LOG_INFO, "SerialDaemon TX: Write of aggregated frame failed");
+
+		/* Kept if the port failed, dropped if it stalled, as SerialTx does */
+		if(TtyFailed)
+		{
+			mqd = mq_open(SERIAL_TX_QUEUE, O_WRONLY | O_NONBLOCK);
+			if(mqd != (mqd_t) -1)
+			{
+				Length = MarkBuiltFrame(Frame, Length, ExpiresUs);
+				if(mq_send(mqd, Frame, (size_t)Length, (unsigned int)sysconf(_SC_MQ_PRIO_MAX) - 1) == 0)
+					DaemonStats.TxRequeued++;
+
+				mq_close(mqd);
+			}
+		}
+
+		return SERIAL_TX_WRITE_FAIL;
+	}
+
+	DaemonStats.TxFrames++;
+	SERIAL_TRACE3(tx_write, Info.MsgID, Info.SeqCount, Written);
+	CaptureFrame(CAPTURE_DIR_TX, Frame, Written);
+
+	return Written;
+}
+
+/* A TX frame with an expiry trailer that has passed isn't worth the
+ * line time, it is dropped and counted
+ *
+ *  INPUTS:
+ *  Frame, Info - The frame, and its header
+ *  Queued - Bytes it was queued with, trailer included
+ *
+ *  RETURNS:
+ *  TRUE if the frame is to be dropped
+*/
+static Boolean
+TxExpired(const ARM_char_t *Frame, const RxMsgInfo *Info, int32_t Queued)
+{
+	int64_t ExpiresUs, NowUs;
+
+	ExpiresUs = TxExpiry(Frame, PACKET_FRAME_LENGTH((int32_t)Info->MsgLength), Queued);
+	if(ExpiresUs == 0)
+		return FALSE;
+
+	NowUs = MonotonicUs();
+
+	if(NowUs < ExpiresUs)
+		return FALSE;
+
+	DaemonStats.TxExpired++;
+	SERIAL_TRACE3(tx_expire, Info->MsgID, Info->SeqCount, NowUs - ExpiresUs);
+
+	return TRUE;
+}
+
+/* Clear the MsgFlags bits -g / -x have taken over for the link from a
+ * client's TX frame, so the MCU doesn't take it for an aggregate or a
+ * keyframe request. An empty MSG_FLAG_DELTA frame of a delta stream is
+ * one, from RequestKeyframe, and keeps the flag. Not called for a frame
+ * with a TxBuiltTrailer, the Daemon's own */
+static void
+ClearLinkFlags(ARM_char_t *Frame, RxMsgInfo *Info)
+{
+	uint8_t LinkFlags = 0;
+	PacketHdr Hdr;
+
+	if(Config.AggHoldUs > 0)
+		LinkFlags |= MSG_FLAG_AGGREGATE;
+
+	if(DeltaStreams > 0 && !(Info->MsgLength == 0 && DeltaIsStream(Info->MsgID)))
+		LinkFlags |= MSG_FLAG_DELTA;
+
+	if(!(Info->MsgFlags & LinkFlags))
+		return;
+
+	Info->MsgFlags &= ~LinkFlags;
+	BuildPacketHdr(Info->MsgLength, Info->MsgID, Info->MsgFlags, Info->SeqCount, &Hdr);
+	memcpy(Frame, &Hdr, MSG_HEADER_LENGTH);
+}
+
+/* Hold a small TX frame back to go out with the next ones, when
+ * aggregating, with its expiry from the Queued bytes' trailer. Held
+ * frames are written ahead of one that can't be held.
+ * A frame queued at a higher Prio than the first one held doesn't wait
+ * for the hold time, so holding doesn't undo the queue's priority
+ * order: the lot goes now, with it in if it fits
+ *
+ *  RETURNS:
+ *  TRUE if the frame is held or went out in the lot, FALSE if it goes
+ *  out now as it is
+*/
+static Boolean
+AggregateTx(int ttyFd, const ARM_char_t *Frame, const RxMsgInfo *Info, int32_t Queued, uint32_t Prio)
+{
+	Boolean Outranks;
+	int64_t ExpiresUs;
+	int32_t Held;
+
+	if(Config.AggHoldUs == 0)
+		return FALSE;
+
+	Outranks = (TxAgg.Count > 0 && Prio > TxAggPrio) ? TRUE : FALSE;
+	ExpiresUs = TxExpiry(Frame, PACKET_FRAME_LENGTH((int32_t)Info->MsgLength), Queued);
+
+	Held = AggregateAdd(&TxAgg, Frame, Info, ExpiresUs);
+
+	if(Held == AGG_FULL && !Outranks)
+	{
+		AggregateFlush(ttyFd);
+		Held = AggregateAdd(&TxAgg, Frame, Info, ExpiresUs);
+	}
+
+	if(Held < 0)
+	{
+		AggregateFlush(ttyFd);
+		return FALSE;
+	}
+
+	if(Outranks)
+	{
+		AggregateFlush(ttyFd);
+		return TRUE;
+	}
+
+	/* The hold time runs from the first message in */
+	if(Held == 1)
+	{
+		TxAggPrio = Prio;
+		ArmTxHoldTimer(Config.AggHoldUs);
+	}
+
+	return TRUE;
+}
+
 /* Grab data out of Tx Queue and write out to the 8051 File Descriptor */
 static int
 SerialTx(int ttyFd, const char *FileName)
@@ -222,17 +743,20 @@ SerialTx(int ttyFd, const char *FileName)
 	struct mq_attr attr;
 
 	int TotalTxBytes = 0, numRead = 0;
+	int32_t ProcessReturn = 0;
 	struct timeval CurrentTime;
 	char *CurrentTimeString;
 	char *ErrMsg;
 	char UsrMsg[100];
 	size_t count = 0;
+	RxMsgInfo MessageInfo;
+	ARM_char_t *ASCII_Buff;
+	SerialPacket *CurrentSerialPacket;
+	Boolean Held = FALSE;
 
-	SerialPacket * CurrentSerialPacket=malloc(sizeof(SerialPacket));
-
-	/* Open for Read, Create if not open, Open non-blocking-rcv and send will
-		 * fail unless they can complete immediately. */
-	flags = O_RDONLY | O_NONBLOCK;
+	/* Open for Read (and Write, to put back a frame the tty didn't take),
+	 * Open non-blocking-rcv and send will fail unless they can complete immediately. */
+	flags = O_RDWR | O_NONBLOCK;
 
 	mqd=mq_open( SERIAL_TX_QUEUE , flags);
 
@@ -265,88 +789,129 @@ SerialTx(int ttyFd, const char *FileName)
 		sprintf(UsrMsg, "SerialDaemon TX: mq_getattr failed with Error: %s", ErrMsg);
 		syslog(LOG_INFO, "%s", UsrMsg);
 
+		mq_close(mqd);
 		return SERIAL_RECEIVE_MESSAGE_ATTR_FAIL;
 	}
 
-	ARM_char_t *ASCII_Buff = (ARM_char_t*) malloc(attr.mq_msgsize);
+	/* Buffers come from the pools, set up in main, so transmitting does
+	 * no heap allocation. Every path below falls through to give them
+	 * back and close the queue */
+	ASCII_Buff = (ARM_char_t *)PoolAlloc(&FramePool);
+	CurrentSerialPacket = (SerialPacket *)PoolAlloc(&PacketPool);
 
-	numRead = mq_receive(mqd, (void*)ASCII_Buff, attr.mq_msgsize, &prio);
+	if(ASCII_Buff == NULL || CurrentSerialPacket == NULL || attr.mq_msgsize > FramePool.BlockSize)
+		numRead = SERIAL_RECEIVE_BUFF_ALLOCATE_FAIL;
+	else
+		numRead = mq_receive(mqd, (void*)ASCII_Buff, attr.mq_msgsize, &prio);
 
 	if(numRead > 0)
 	{
-		RxMsgInfo* MessageInfo = (RxMsgInfo*) malloc(sizeof(RxMsgInfo));
-
 			/* Figure out how many bytes are in this message so that we
 			 * can know how many bytes to write. */
-		ARM_char_t ProcessReturn = ProcessPacket(MessageInfo, ASCII_Buff );
+		ProcessReturn = ProcessPacket(&MessageInfo, ASCII_Buff );
 
 		if(ProcessReturn < 0)
 		{
 				#if DEBUG_LEVEL > 10
-					printf("SerialDaemon Tx:: ProcessPacket Fails with error = %u", ProcessReturn);
+					printf("SerialDaemon Tx:: ProcessPacket Fails with error = %i", ProcessReturn);
 				#endif
 
-			return ProcessReturn;
+			numRead = ProcessReturn;
+		}
+		else if(TxExpired(ASCII_Buff, &MessageInfo, numRead))
+		{
+			/* Dropped, numRead stays positive so the caller goes on to
+			 * the next frame */
 		}
+		else
+		{
+			/* Count should include ASCII encoded bytes (multiply by 2),
+			 * the header length, (+ MSG_HEADER_LENGTH) and one extra byte for the new line
+			 * character */
+			count = PACKET_FRAME_LENGTH((size_t)MessageInfo.MsgLength);
 
-		/* Count should include ASCII encoded bytes (multiply by 2),
-		 * the header length, (+ MSG_HEADER_LENGTH) and one extra byte for the new line
-		 * character */
-		count = ((size_t)MessageInfo->MsgLength)*2 + MSG_HEADER_LENGTH +1;
+			/* Never write past what was actually queued */
+			if(count > (size_t)numRead)
+				count = (size_t)numRead;
 
-		/* Read buffered Serial data using the file descriptor until we
-		   don't receive anymore */
+			SERIAL_TRACE3(tx_dequeue, MessageInfo.MsgID, MessageInfo.SeqCount, count);
 
-		TotalTxBytes=write(ttyFd, ASCII_Buff, count);
+			/* A small frame may be held back, to go out with the next
+			 * ones. One the Daemon built, requeued when the port failed,
+			 * goes as it is */
+			if(!TxBuilt(ASCII_Buff, PACKET_FRAME_LENGTH((int32_t)MessageInfo.MsgLength), numRead))
+			{
+				ClearLinkFlags(ASCII_Buff, &MessageInfo);
+				Held = AggregateTx(ttyFd, ASCII_Buff, &MessageInfo, numRead, prio);
+			}
 
-		if(TotalTxBytes < 0)
-		{
+			/* Read buffered Serial data using the file descriptor until we
+			   don't receive anymore */
 
-			#if DEBUG_LEVEL > 5
-				errMsg("SerialDaemonTx: Couldn't write to File Descriptor");
-			#endif
+			TotalTxBytes = Held ? (int)count : SerialWriteFrame(ttyFd, ASCII_Buff, count);
 
-			ErrMsg=strerror(errno);
-			sprintf(UsrMsg, "SerialDaemon TX: Write to ttyfd failed with: %s", ErrMsg);
-			syslog(LOG_INFO, "%s", UsrMsg);
+			if(TotalTxBytes < 0)
+			{
 
-			return SERIAL_TX_WRITE_FAIL;
-		}
+				#if DEBUG_LEVEL > 5
+					errMsg("SerialDaemonTx: Couldn't write to File Descriptor");
+				#endif
 
+				ErrMsg=strerror(errno);
+				sprintf(UsrMsg, "SerialDaemon TX: Write to ttyfd failed with: %s", ErrMsg);
+				syslog(LOG_INFO, "%s", UsrMsg);
 
-		if(TotalTxBytes == 0)
-		{
+				/* The port is gone, keep the frame for when it's back. Top
+				 * priority puts it in front of everything queued behind it */
+				if(TtyFailed && mq_send(mqd, ASCII_Buff, (size_t)numRead, (unsigned int)sysconf(_SC_MQ_PRIO_MAX) - 1) == 0)
+					DaemonStats.TxRequeued++;
 
-			#if DEBUG_LEVEL > 5
-				printf("SerialDaemonTx: Wrote Zero Bytes\n");
-			#endif
+				numRead = SERIAL_TX_WRITE_FAIL;
+			}
+			else if(TotalTxBytes == 0)
+			{
 
-			return SERIAL_TX_ZERO_BYTES;
-		}
+				#if DEBUG_LEVEL > 5
+					printf("SerialDaemonTx: Wrote Zero Bytes\n");
+				#endif
 
-		/* Get Current System Time, copy it to our serial packet header */
-		if (gettimeofday(&CurrentTime, NULL) == -1 )
-		{
+				numRead = SERIAL_TX_ZERO_BYTES;
+			}
+			else
+			{
+				/* A held frame is counted when it goes out */
+				if(!Held)
+				{
+					DaemonStats.TxFrames++;
+					SERIAL_TRACE3(tx_write, MessageInfo.MsgID, MessageInfo.SeqCount, TotalTxBytes);
+					CaptureFrame(CAPTURE_DIR_TX, ASCII_Buff, TotalTxBytes);
+				}
 
-				#if DEBUG_LEVEL > 20
-					printf("Couldn't get current time \n");
-				#endif
-				memset(&CurrentTime, 0x0, sizeof(CurrentTime));
-		}
-		else
-		{
-					CurrentTimeString = ctime(&CurrentTime.tv_sec);
-					strcpy(CurrentSerialPacket->TimeReceived,CurrentTimeString);
-		}
+				/* Get Current System Time, copy it to our serial packet header */
+				if (gettimeofday(&CurrentTime, NULL) == -1 )
+				{
 
-		#if DEBUG_LEVEL > 5
-			printf("SerialDaemonTx: New Complete Message Sent \n");
-		#endif
+						#if DEBUG_LEVEL > 20
+							printf("Couldn't get current time \n");
+						#endif
+						memset(&CurrentTime, 0x0, sizeof(CurrentTime));
+				}
+				else
+				{
+							CurrentTimeString = ctime(&CurrentTime.tv_sec);
+							strcpy(CurrentSerialPacket->TimeReceived,CurrentTimeString);
+				}
 
-			free(CurrentSerialPacket);
-			free(MessageInfo);
+				#if DEBUG_LEVEL > 5
+					printf("SerialDaemonTx: New Complete Message Sent \n");
+				#endif
+			}
+		}
 	}
 
+	PoolFree(&PacketPool, CurrentSerialPacket);
+	PoolFree(&FramePool, ASCII_Buff);
+
 	if(mq_close(mqd) < (int)0)
 	{
 		errMsg("SerialDaemonTx: Close Failed");
@@ -359,198 +924,1396 @@ return numRead;
 
 }
 
+/* Put TX frames the tty didn't take back at the front of the queue, in
+ * order, for when it's back
+ *
+ *  RETURNS:
+ *  Frames requeued
+*/
+static int32_t
+RequeueTxFrames(mqd_t mqd_tx, int32_t First, int32_t Count, const int32_t *Queued)
+{
+	unsigned int TopPrio = (unsigned int)sysconf(_SC_MQ_PRIO_MAX) - 1;
+	int32_t i, Requeued = 0;
 
-/* Receive incoming serial data from ttyFd and place in message queue and log file */
-static int
+	for(i = First; i < Count; i++)
+	{
+		if(mq_send(mqd_tx, UringTxBuffer(i), (size_t)Queued[i], TopPrio) == 0)
+			Requeued++;
+	}
+
+	DaemonStats.TxRequeued += Requeued;
+	return Requeued;
+}
+
+/* SerialTxBatch when aggregating. The frame just read into batch slot
+ * Slot, at queue priority Prio, is held back, or else the frames
+ * already held go in the batch as one frame, in Slot, and it moves up
+ * to the next slot. As AggregateTx, a frame that outranks the first
+ * one held doesn't wait for the hold time
+ *
+ *  RETURNS:
+ *  Batch slots used, 0 if the frame is held
+*/
+static int32_t
+AggregateBatchSlot(int32_t Slot, RxMsgInfo *Infos, int32_t *Lengths, int32_t *Queued, int32_t FrameBytes, uint32_t Prio)
+{
+	ARM_char_t *Frame = UringTxBuffer(Slot), *Next = UringTxBuffer(Slot + 1);
+	Boolean Outranks;
+	int64_t ExpiresUs, LotExpiresUs;
+	int32_t Held;
+
+	/* Those past their expiry don't go in the batch */
+	DaemonStats.TxExpired += AggregateExpire(&TxAgg, MonotonicUs());
+
+	Outranks = (TxAgg.Count > 0 && Prio > TxAggPrio) ? TRUE : FALSE;
+	ExpiresUs = TxExpiry(Frame, PACKET_FRAME_LENGTH((int32_t)Infos[Slot].MsgLength), FrameBytes);
+
+	Held = AggregateAdd(&TxAgg, Frame, &Infos[Slot], ExpiresUs);
+
+	/* The lot goes in this slot now, with the frame in it */
+	if(Held > 0 && Outranks)
+	{
+		ExpiresUs = AggregateExpiry(&TxAgg);
+		Lengths[Slot] = AggregateBuild(&TxAgg, Frame, &Infos[Slot]);
+		Queued[Slot] = MarkBuiltFrame(Frame, Lengths[Slot], ExpiresUs);
+		return 1;
+	}
+
+	if(Held > 0)
+	{
+		if(Held == 1)
+		{
+			TxAggPrio = Prio;
+			ArmTxHoldTimer(Config.AggHoldUs);
+		}
+		return 0;
+	}
+
+	Queued[Slot] = FrameBytes;
+	if(TxAgg.Count == 0)
+		return 1;
+
+	memcpy(Next, Frame, (size_t)FrameBytes);
+	Infos[Slot + 1] = Infos[Slot];
+	Lengths[Slot + 1] = Lengths[Slot];
+	Queued[Slot + 1] = FrameBytes;
+
+	LotExpiresUs = AggregateExpiry(&TxAgg);
+	Lengths[Slot] = AggregateBuild(&TxAgg, Frame, &Infos[Slot]);
+	Queued[Slot] = MarkBuiltFrame(Frame, Lengths[Slot], LotExpiresUs);
+
+	/* Full, it starts the next lot, or goes now if it outranks the lot */
+	if(Held == AGG_FULL && !Outranks && AggregateAdd(&TxAgg, Next, &Infos[Slot + 1], ExpiresUs) > 0)
+	{
+		TxAggPrio = Prio;
+		ArmTxHoldTimer(Config.AggHoldUs);
+		return 1;
+	}
+
+	return 2;
+}
+
+/* SerialTx for the io_uring engine. Up to URING_TX_BATCH frames come
+ * off the TX queue, on the Daemon's own handle, and are written with a
+ * single submission. What a short write left goes out the rest of the
+ * way with SerialWriteFrame, so the frames reach the tty in order
+ * either way
+ *
+ *  RETURNS:
+ *  Frames written, -1 if the queue was empty, SERIAL_TX_WRITE_FAIL if
+ *  the tty failed, frames not written are requeued then
+*/
+static int
+SerialTxBatch(int ttyFd, mqd_t mqd_tx)
+{
+	int32_t Lengths[URING_TX_BATCH], Written[URING_TX_BATCH], Queued[URING_TX_BATCH];
+	int32_t Count = 0, Slots, Whole, i;
+	ssize_t numRead = -1;
+	uint32_t prio;
+	RxMsgInfo Infos[URING_TX_BATCH];
+	ARM_char_t *Frame;
+
+	/* Aggregating, a slot is kept for the held frames */
+	Slots = (Config.AggHoldUs > 0) ? URING_TX_BATCH - 1 : URING_TX_BATCH;
+
+	while(Count < Slots)
+	{
+		Frame = UringTxBuffer(Count);
+		numRead = mq_receive(mqd_tx, Frame, (size_t)UringTxBufferSize(), &prio);
+		if(numRead <= 0)
+			break;
+
+		/* Dropped, as SerialTx does */
+		if(ProcessPacket(&Infos[Count], Frame) < 0 || TxExpired(Frame, &Infos[Count], (int32_t)numRead))
+			continue;
+
+		Lengths[Count] = PACKET_FRAME_LENGTH((int32_t)Infos[Count].MsgLength);
+		if(Lengths[Count] > numRead)
+			Lengths[Count] = (int32_t)numRead;
+
+		SERIAL_TRACE3(tx_dequeue, Infos[Count].MsgID, Infos[Count].SeqCount, Lengths[Count]);
+
+		/* The Daemon's own frames go as they are, as in SerialTx */
+		if(TxBuilt(Frame, PACKET_FRAME_LENGTH((int32_t)Infos[Count].MsgLength), (int32_t)numRead))
+		{
+			Queued[Count] = (int32_t)numRead;
+			Count++;
+			continue;
+		}
+
+		ClearLinkFlags(Frame, &Infos[Count]);
+
+		if(Config.AggHoldUs > 0)
+		{
+			Count += AggregateBatchSlot(Count, Infos, Lengths, Queued, (int32_t)numRead, prio);
+			continue;
+		}
+
+		Queued[Count] = (int32_t)numRead;
+		Count++;
+	}
+
+	if(Count == 0)
+		return (numRead < 0) ? -1 : SERIAL_TX_ZERO_BYTES;
+
+	memset(Written, 0, sizeof(Written));
+	Whole = UringWriteBatch(ttyFd, Count, Lengths, Written);
+	if(Whole < 0)
+		Whole = 0;
+
+	for(i = 0; i < Count; i++)
+	{
+		Frame = UringTxBuffer(i);
+
+		/* Where the write stopped, the rest of that frame and those after it */
+		if(i >= Whole && (TtyFailed ||
+				SerialWriteFrame(ttyFd, &Frame[Written[i]], (size_t)(Lengths[i] - Written[i])) < 0))
+		{
+			syslog(LOG_INFO, "SerialDaemon TX: Write to ttyfd failed with: %s", strerror(errno));
+
+			/* SerialTx drops a frame the tty stalled on and keeps one the
+			 * port failed on, the same here */
+			RequeueTxFrames(mqd_tx, TtyFailed ? i : i + 1, Count, Queued);
+			return SERIAL_TX_WRITE_FAIL;
+		}
+
+		DaemonStats.TxFrames++;
+		SERIAL_TRACE3(tx_write, Infos[i].MsgID, Infos[i].SeqCount, Lengths[i]);
+		CaptureFrame(CAPTURE_DIR_TX, Frame, Lengths[i]);
+	}
+
+	return Count;
+}
+
+
+/* Write a frame a socket client sent, see SocketService. No queue
+ * holds it, a frame the port fails on goes to SocketKeepFrame, one the
+ * tty stalled on is dropped as SerialTx drops it
+ *
+ *  RETURNS:
+ *  Bytes written, SOCKET_FRAME_REFUSED for a bad header,
+ *  SOCKET_FRAME_FAILED if the port has failed, SERIAL_TX_WRITE_FAIL
+ *  for a stalled write
+*/
+static int32_t
+SocketTxFrame(int ttyFd, ARM_char_t *Frame, int32_t Length, uint32_t Priority)
+{
+	RxMsgInfo MessageInfo;
+	int32_t FrameLength, Written;
+
+	if(TtyFailed)
+		return SOCKET_FRAME_FAILED;
+
+	if(ProcessPacket(&MessageInfo, Frame) < 0)
+		return SOCKET_FRAME_REFUSED;
+
+	FrameLength = PACKET_FRAME_LENGTH((int32_t)MessageInfo.MsgLength);
+	if(FrameLength > Length)
+		return SOCKET_FRAME_REFUSED;
+
+	/* Taken, but not written */
+	if(TxExpired(Frame, &MessageInfo, Length))
+		return FrameLength;
+
+	SERIAL_TRACE3(tx_dequeue, MessageInfo.MsgID, MessageInfo.SeqCount, FrameLength);
+
+	ClearLinkFlags(Frame, &MessageInfo);
+
+	/* Held back to go out with the next small ones */
+	if(AggregateTx(ttyFd, Frame, &MessageInfo, Length, Priority))
+		return FrameLength;
+
+	Written = SerialWriteFrame(ttyFd, Frame, (size_t)FrameLength);
+	if(Written <= 0)
+		return TtyFailed ? SOCKET_FRAME_FAILED : SERIAL_TX_WRITE_FAIL;
+
+	DaemonStats.TxFrames++;
+	SERIAL_TRACE3(tx_write, MessageInfo.MsgID, MessageInfo.SeqCount, Written);
+	CaptureFrame(CAPTURE_DIR_TX, Frame, Written);
+
+	return Written;
+}
+
+/* A socket frame the port failed on, see SocketService. It goes on the
+ * TX queue at its Priority, as RequeueTxFrames puts back a batch, to
+ * be sent once the tty is back
+ *
+ *  RETURNS:
+ *  0 if sucessful, MSG_SEND_FAIL if the queue wouldn't take it
+*/
+static int32_t
+SocketKeepFrame(ARM_char_t *Frame, int32_t Length, uint32_t Priority)
+{
+	unsigned int TopPrio = (unsigned int)sysconf(_SC_MQ_PRIO_MAX) - 1;
+	mqd_t mqd;
+	int Sent;
+
+	mqd = mq_open(SERIAL_TX_QUEUE, O_WRONLY | O_NONBLOCK);
+	if(mqd == (mqd_t) -1)
+		return MSG_SEND_FAIL;
+
+	Sent = mq_send(mqd, Frame, (size_t)Length, (Priority < TopPrio) ? Priority : TopPrio);
+	mq_close(mqd);
+
+	if(Sent == -1)
+		return MSG_SEND_FAIL;
+
+	DaemonStats.TxRequeued++;
+	return 0;
+}
+
+/* Write the durable TX messages in the journal, in order. One the tty
+ * doesn't take stays in the journal, for the next pass
+ *
+ *  RETURNS:
+ *  Frames written
+*/
+static int32_t
+JournalTx(int ttyFd)
+{
+	static ARM_char_t Frame[PACKET_FRAME_LENGTH(MAX_MSG_SIZE)];
+	RxMsgInfo MessageInfo;
+	int32_t Length, Sent = 0;
+	int Written;
+
+	if(!JournalPending())
+		return 0;
+
+	while(!TtyFailed && (Length = JournalNext(Frame)) > 0)
+	{
+		/* Dropped, as SerialTx does */
+		if(ProcessPacket(&MessageInfo, Frame) < 0 || PACKET_FRAME_LENGTH((int32_t)MessageInfo.MsgLength) != Length)
+		{
+			JournalConsume();
+			continue;
+		}
+
+		SERIAL_TRACE3(tx_dequeue, MessageInfo.MsgID, MessageInfo.SeqCount, Length);
+
+		ClearLinkFlags(Frame, &MessageInfo);
+
+		Written = SerialWriteFrame(ttyFd, Frame, (size_t)Length);
+		if(Written < 0)
+		{
+			syslog(LOG_INFO, "SerialDaemon TX: Write of durable frame failed, kept for a retry");
+			break;
+		}
+
+		JournalConsume();
+		Sent++;
+
+		DaemonStats.TxFrames++;
+		SERIAL_TRACE3(tx_write, MessageInfo.MsgID, MessageInfo.SeqCount, Written);
+		CaptureFrame(CAPTURE_DIR_TX, Frame, Written);
+	}
+
+	/* One checkpoint sync for the lot */
+	if(JournalCheckpoint() < 0)
+		LogErrno("Journal checkpoint");
+
+	return Sent;
+}
+
+/* Add bytes thrown away while hunting for a header to the stats */
+static void
+CountSkippedRxBytes(int32_t SkippedBytes)
+{
+	if(SkippedBytes <= 0)
+		return;
+
+	DaemonStats.RxSkippedBytes += SkippedBytes;
+	DaemonStats.RxResyncs++;
+
+	#if DEBUG_LEVEL > 10
+		syslog(LOG_INFO, "SerialDaemonRx: Resync, skipped %i bytes", SkippedBytes);
+	#endif
+}
+
+/* Send one received frame out on the RX message queue, making room
+ * by dropping the oldest message if the queue is full */
+static int
+PublishRxFrame(mqd_t mqd, const char *Frame, size_t Length)
+{
+	int SndMsgRtn = 0;
+	int ClearReturn = 0;
+
+	SndMsgRtn = mq_send(mqd, Frame, Length, 0);
+	if(SndMsgRtn < 0)
+	{
+
+		/* EAGAIN occurs when we have a full message queue,
+		 * we need to clear space to send new messages */
+		if (errno==EAGAIN){
+			/* This function will clear the message queue one message
+			 * at a time, oldest message first, freing up space for our
+			 * newest message */
+
+			ClearReturn = ClearMessageQueue(mqd , 1);
+			DaemonStats.RxQueueDrops += ClearReturn;
+
+			#if DEBUG_LEVEL > 50
+				printf("SerialRx:EAGAIN encountered, cleared %i Messages \n", ClearReturn);
+			#endif
+			/* Reattampt our send */
+
+			SndMsgRtn = mq_send(mqd, Frame, Length, 0);
+
+
+			/* If it fails this time, simply return */
+			if(SndMsgRtn < 0)
+			{
+				#if DEBUG_LEVEL > 5
+				syslog(LOG_INFO, "SerialDaemonRx: Msg RX Fails after attempting to clear queue");
+				errMsg("SerialDaemonRx: Msg RX Fails, after attempting to clear queue");
+				#endif
+				return MSG_SEND_FAIL;
+			}
+		}
+		else
+		{
+			#if DEBUG_LEVEL > 5
+				syslog(LOG_INFO, "SerialDaemonRx: Msg RX Fails");
+				errMsg("SerialDaemonRx: Msg Send Fails");
+			#endif
+		return MSG_SEND_FAIL;
+		}
+	}
+
+	return 1;
+}
+
+/* Hand a frame to the queues and socket clients subscribed to its
+ * MsgID, or the RX queue when there are none. A full or missing
+ * subscriber queue only costs that subscriber the frame */
+static int
+DispatchRxFrame(mqd_t mqd, const char *Frame, size_t Length, const RxMsgInfo *Info)
+{
+	mqd_t Subscribers[ROUTE_MAX];
+	int32_t SubscriberCnt, SocketCnt, i;
+	int PublishReturn;
+
+	SubscriberCnt = RouteLookup(Info->MsgID, Subscribers, ROUTE_MAX);
+	SocketCnt = SocketDeliver(Info->MsgID, Frame, (int32_t)Length);
+
+	if(SubscriberCnt == 0 && SocketCnt == 0)
+	{
+		PublishReturn = PublishRxFrame(mqd, Frame, Length);
+		SERIAL_TRACE4(rx_publish, Info->MsgID, Info->SeqCount, Length, PublishReturn);
+		return PublishReturn;
+	}
+
+	for(i = 0; i < SubscriberCnt; i++)
+	{
+		PublishReturn = PublishRxFrame(Subscribers[i], Frame, Length);
+		SERIAL_TRACE4(rx_publish, Info->MsgID, Info->SeqCount, Length, PublishReturn);
+
+		if(PublishReturn > 0)
+			DaemonStats.RxRouted++;
+	}
+
+	return 1;
+}
+
+/* Ask the MCU for the whole of a delta stream's next frame, see
+ * SerialDelta.h. It goes on the TX queue ahead of what's there */
+static void
+RequestKeyframe(uint8_t MsgID)
+{
+	ARM_char_t Frame[PACKET_FRAME_LENGTH(0)];
+	PacketHdr Hdr;
+	mqd_t mqd;
+
+	BuildPacketHdr(0, MsgID, MSG_FLAG_DELTA, 0, &Hdr);
+	memcpy(Frame, &Hdr, MSG_HEADER_LENGTH);
+	Frame[MSG_HEADER_LENGTH] = '\n';
+
+	mqd = mq_open(SERIAL_TX_QUEUE, O_WRONLY | O_NONBLOCK);
+	if(mqd == (mqd_t) -1)
+		return;
+
+	if(mq_send(mqd, Frame, sizeof(Frame), (unsigned int)sysconf(_SC_MQ_PRIO_MAX) - 1) < 0)
+		syslog(LOG_INFO, "SerialDaemonRx: Keyframe request for MsgID %u Failed", MsgID);
+
+	mq_close(mqd);
+
+	#if DEBUG_LEVEL > 10
+		syslog(LOG_INFO, "SerialDaemonRx: Delta for MsgID %u doesn't apply, keyframe requested", MsgID);
+	#endif
+}
+
+/* Send on a frame from the MCU, with a delta put back together first.
+ * A delta that doesn't apply is dropped
+ *
+ *  RETURNS:
+ *  As DispatchRxFrame, 0 for a dropped delta
+*/
+static int
+DeliverRxFrame(mqd_t mqd, const ARM_char_t *Frame, int32_t Length, const RxMsgInfo *Info)
+{
+	static ARM_char_t Whole[PACKET_FRAME_LENGTH(MAX_MSG_SIZE)];
+	RxMsgInfo WholeInfo;
+	int32_t DeltaReturn;
+	int SndMsgRtn;
+
+	SERIAL_TRACE3(rx_frame, Info->MsgID, Info->SeqCount, Length);
+
+	DeltaReturn = DeltaRx(Frame, Info, Whole, &WholeInfo);
+	if(DeltaReturn == DELTA_NEED_KEYFRAME)
+		RequestKeyframe(Info->MsgID);
+
+	if(DeltaReturn < 0)
+		return 0;
+
+	if(DeltaReturn > 0)
+	{
+		Frame = Whole;
+		Length = DeltaReturn;
+		Info = &WholeInfo;
+	}
+
+	SndMsgRtn = DispatchRxFrame(mqd, Frame, (size_t)Length, Info);
+	CacheUpdate(Frame, Info);
+
+	if(SndMsgRtn >= 0)
+		DaemonStats.RxFrames++;
+
+	return SndMsgRtn;
+}
+
+/* A message split out of an aggregated frame, sent on like any other */
+static void
+DispatchSplitFrame(const ARM_char_t *Frame, int32_t Length, const RxMsgInfo *Info, void *Context)
+{
+	DeliverRxFrame(*(mqd_t *)Context, Frame, Length, Info);
+}
+
+/* Pull every complete frame out of the RX buffer and send it out on the
+ * RX message queue, or its subscribers' queues. A partial frame stays in the buffer until the rest
+ * of it is read */
+static int
+ExtractRxFrames(mqd_t mqd)
+{
+	ARM_char_t *Data;
+	int32_t Length = 0, SkipBytes = 0, FrameLength = 0;
+	int SndMsgRtn = 0;
+	RxMsgInfo MessageInfo;
+
+	for( ;; )
+	{
+		Data = RxBufferData(&RxAccum);
+		Length = RxBufferLength(&RxAccum);
+
+		/* Throw away anything in front of the next header, we either
+		 * started mid packet or the line glitched */
+		SkipBytes = FindPacketHeader(Data, Length);
+		if(SkipBytes > 0)
+		{
+			CountSkippedRxBytes(SkipBytes);
+			RxBufferConsume(&RxAccum, SkipBytes);
+			continue;
+		}
+
+		/* Wait for the rest of the header */
+		if(Length < MSG_HEADER_LENGTH)
+			return 1;
+
+		if(ProcessPacket(&MessageInfo, Data) < 0)
+			FrameLength = -1;
+		else
+			FrameLength = PACKET_FRAME_LENGTH(MessageInfo.MsgLength);
+
+		/* Wait for the rest of the frame */
+		if(FrameLength > Length)
+			return 1;
+
+		/* Garbage header fields, or a frame that doesn't end on its new line
+		 * (bytes lost mid frame). Step past this magic and hunt for the next one */
+		if(FrameLength < 0 || Data[FrameLength - 1] != '\n')
+		{
+			DaemonStats.RxBadFrames++;
+			DaemonStats.RxSkippedBytes++;
+			RxBufferConsume(&RxAccum, 1);
+			continue;
+		}
+
+		/* A late reply to the link negotiation, not for clients */
+		if(MessageInfo.MsgID == LINK_MSGID && LinkEnabled())
+		{
+			LinkStrayFrame();
+			RxBufferConsume(&RxAccum, FrameLength);
+			continue;
+		}
+
+		/* Several messages from the MCU in one frame, when aggregating */
+		if((MessageInfo.MsgFlags & MSG_FLAG_AGGREGATE) && Config.AggHoldUs > 0)
+		{
+			if(AggregateSplit(Data, &MessageInfo, DispatchSplitFrame, &mqd) < 0)
+				DaemonStats.RxBadFrames++;
+
+			RxBufferConsume(&RxAccum, FrameLength);
+			continue;
+		}
+
+		SndMsgRtn = DeliverRxFrame(mqd, Data, FrameLength, &MessageInfo);
+		RxBufferConsume(&RxAccum, FrameLength);
+
+		if(SndMsgRtn < 0)
+			return SndMsgRtn;
+	}
+}
+
+/* Receive incoming serial data from ttyFd and place in message queue and log file */
+static int
 SerialRx(int ttyFd, const char *FileName)
 {
 
-	int TotalRxBytes = 0, AccumulatedRxByteCount = 0 , SndMsgRtn = 0;
+	int TotalRxBytes = 0, ExtractReturn = 1;
 	int flags = 0;
-	int ClearReturn =0;
+	int32_t FreeBytes = 0;
+	int PendingBytes = 0;
 	mqd_t mqd;
 
-	char RxBuffer[MAX_RX_BUFF_SIZE];
-	char ReadBuff[MAX_READ_BYTES];
-	char * CurrentArrayPosition;
 	struct timeval CurrentTime;
 	Boolean done = 0;
 	char *CurrentTimeString;
 
 
-	SerialPacket * CurrentSerialPacket=malloc(sizeof(SerialPacket));
+	SerialPacket * CurrentSerialPacket=(SerialPacket *)PoolAlloc(&PacketPool);
+
+	if(CurrentSerialPacket == NULL)
+		return SERIAL_RECEIVE_BUFF_ALLOCATE_FAIL;
+
+	/* Open for Write, Create if not open, Open non-blocking-rcv and send will
+	 * fail unless they can complete immediately. */
+	flags = O_RDWR | O_NONBLOCK;
+
+
+	mqd=mq_open( SERIAL_RX_QUEUE , flags);
+
+	/* check for fail condition, if we failed asssume we need to open a
+	 * message queue for the first time, then go ahead and do so
+	 * the function below creates a message queue if not already open*/
+	if(mqd == (mqd_t) -1)
+	{
+		mqd=OpenDaemonQueue(SERIAL_RX_QUEUE);
+		DaemonStats.QueueReopens++;
+
+		/* Return an error code now, something bad is happening */
+		if(mqd == (mqd_t) -1)
+		{
+			#if DEBUG_LEVEL > 5
+				errMsg("SerialDaemonWrite: Message Open Failed");
+			#endif
+		PoolFree(&PacketPool, CurrentSerialPacket);
+		return MSG_QUEUE_OPEN_FAIL;
+		}
+	}
+
+	/* Pick up new subscribers before routing anything */
+	RouteApplyRequests();
 
 	done=0;
-	TotalRxBytes=0;
-	AccumulatedRxByteCount = 0;
-	memset(ReadBuff, 0, sizeof(ReadBuff));
-	memset(RxBuffer, 0, sizeof(RxBuffer));
+	RxLastPassBytes = 0;
+	DaemonStats.RxPasses++;
 
      /* Read buffered Serial data using the file descriptor until we
-       don't receive anymore (signaled by done flag) */
+       don't receive anymore (signaled by done flag). Reads land
+       directly in the free space of the RX buffer */
 	while ( !done)  {
-		TotalRxBytes=read(ttyFd, ReadBuff, MAX_READ_BYTES);
+
+		FreeBytes = RxBufferReserve(&RxAccum);
+
+		/* Buffer is full and can't grow, send the complete frames to make room */
+		if(FreeBytes == 0)
+		{
+			ExtractReturn = ExtractRxFrames(mqd);
+			FreeBytes = RxBufferReserve(&RxAccum);
+
+			/* Still full, nothing in there will ever frame. Start over rather
+			 * than overflow */
+			if(FreeBytes == 0)
+			{
+				DaemonStats.RxOverflowBytes += RxBufferLength(&RxAccum);
+				RxBufferConsume(&RxAccum, RxBufferLength(&RxAccum));
+				FreeBytes = RxBufferReserve(&RxAccum);
+			}
+		}
+
+		/* Blocking reads (throughput profile) only while bytes are waiting,
+		 * VMIN / VTIME then gather the rest of the burst */
+		if(Config.TtyProfile == TTY_PROFILE_THROUGHPUT && !UringActive())
+		{
+			if(ioctl(ttyFd, FIONREAD, &PendingBytes) == -1 || PendingBytes <= 0)
+			{
+				done=1;
+				continue;
+			}
+		}
+
+		/* io_uring has already read it, this is only a copy */
+		if(UringActive())
+			TotalRxBytes = UringRead(RxBufferWritePtr(&RxAccum), FreeBytes);
+		else
+		{
+			TotalRxBytes=read(ttyFd, RxBufferWritePtr(&RxAccum), (size_t)FreeBytes);
+			DaemonStats.RxReads++;
+		}
 
 		/*Terminate Loop if we see 0 bytes returned, or an ERROR */
 		if(TotalRxBytes <= 0)
 		{
+			/* Anything but running out of bytes means the port is gone */
+			if(TotalRxBytes < 0 && errno != EAGAIN && errno != EINTR)
+				MarkTtyFailed("SerialRx read", errno);
+			else if(TotalRxBytes == 0 && TtyHungUp(ttyFd))
+				MarkTtyFailed("SerialRx", 0);
+
 			done=1;
 			continue;
 		}
+
+		CaptureFrame(CAPTURE_DIR_RX, RxBufferWritePtr(&RxAccum), TotalRxBytes);
+		RxBufferCommit(&RxAccum, TotalRxBytes);
+		SERIAL_TRACE2(rx_read, TotalRxBytes, RxBufferLength(&RxAccum));
+		RxLastPassBytes += TotalRxBytes;
+
+		#if DEBUG_LEVEL > 150
+			printf("\nSerialRx: Read %i bytes, %i buffered \n", TotalRxBytes, RxBufferLength(&RxAccum));
+		#endif
+	}
+
+	/* Outside the while loop. Process our received data */
+
+	/* Get Current System Time, copy it to our serial packet header */
+		if (gettimeofday(&CurrentTime, NULL) == -1 )
+		{
+				usageErr("Couldn't get current time \n");
+				memset(&CurrentTime, 0x0, sizeof(CurrentTime));
+		}
 		else
 		{
+				CurrentTimeString = ctime(&CurrentTime.tv_sec);
+				strcpy(CurrentSerialPacket->TimeReceived,CurrentTimeString);
+		}
+
+		/* Blast every complete frame out on the MSG QUEUE */
+		if(ExtractReturn > 0)
+			ExtractReturn = ExtractRxFrames(mqd);
+
+		#if DEBUG_LEVEL > 15
+			printf("SerialRx: Frames sent, %i bytes left for the next read \n", RxBufferLength(&RxAccum));
+		#endif
+
+		PoolFree(&PacketPool, CurrentSerialPacket);
+
+
+		if(mq_close(mqd) < (int)0)
+		{
+			errMsg("SerialDaemonRx: Close Failed");
+		}
+
+		/* If we haven't bailed out anywhere else up here, go ahead and send a positive
+		 * int as a return, meaning success */
+		if(ExtractReturn < 0)
+			return ExtractReturn;
+
+		return 1;
+}
+
+/* Signal Handler assigned to a Real Time signal, indicating
+ * we have received data on serial.  This is more specific
+ * than sigio, since we check the SI_CODE to indicated that
+ * we have input data, whereas SIGIO is triggered on any kind
+ * of input output */
+static void
+sigioHandler(int sig, siginfo_t *si, void *ucontext)
+{
+	if (sig == SERIAL_RX_SIG)
+	{
+		/* Only set gotSigio if we have input data (determined using
+		 * si_code). Other codes (POLL_OUT while we transmit) must not
+		 * clear it, that would lose input already signalled */
+		if(si->si_code == POLL_IN)
+			gotSigio = 1;
+	}
+}
+
+/* Signal Handler assigned to the SIGUSR2 signal, requests a stats dump */
+static void
+sigusr2Handler(int sig)
+{
+	if ( sig == SIGUSR2 )
+		gotSigUsr2 = 1;
+}
+
+/* Write the daemon counters to the system log */
+static void
+LogDaemonStats(void)
+{
+	syslog(LOG_INFO, "Stats: RxFrames %u, RxSkippedBytes %u, RxResyncs %u, RxBadFrames %u, "
+			"RxOverflowBytes %u, RxQueueDrops %u, RxRouted %u, TxFrames %u, TxWriteStalls %u, TxExpired %u",
+			DaemonStats.RxFrames, DaemonStats.RxSkippedBytes, DaemonStats.RxResyncs,
+			DaemonStats.RxBadFrames, DaemonStats.RxOverflowBytes, DaemonStats.RxQueueDrops,
+			DaemonStats.RxRouted,
+			DaemonStats.TxFrames, DaemonStats.TxWriteStalls, DaemonStats.TxExpired);
+
+	syslog(LOG_INFO, "RX batching: RxPasses %u, RxReads %u, RxBatchWaits %u",
+			DaemonStats.RxPasses, DaemonStats.RxReads, DaemonStats.RxBatchWaits);
+
+	syslog(LOG_INFO, "Recovery: TxRequeued %u, TtyFailures %u, TtyReopens %u, QueueReopens %u, "
+			"NotifyFailures %u, WatchdogKicks %u",
+			DaemonStats.TxRequeued, DaemonStats.TtyFailures, DaemonStats.TtyReopens,
+			DaemonStats.QueueReopens, DaemonStats.NotifyFailures, DaemonStats.WatchdogKicks);
+
+	PoolLogStats(&FramePool);
+	PoolLogStats(&PacketPool);
+	SocketLogStats();
+	UringLogStats();
+	CacheLogStats();
+	LinkLogStats();
+
+	if(Config.AggHoldUs > 0)
+		AggregateLogStats();
+
+	if(DeltaStreams > 0)
+		DeltaLogStats();
+
+	JournalLogStats();
+}
+
+/* Preallocate the frame buffers and packet records. Frames are sized
+ * for the largest message either queue takes */
+static int
+InitDaemonPools(mqd_t mqd_tx, mqd_t mqd_rx)
+{
+	struct mq_attr TxAttr, RxAttr;
+	long FrameSize;
+
+	if(mq_getattr(mqd_tx, &TxAttr) == -1 || mq_getattr(mqd_rx, &RxAttr) == -1)
+		return POOL_ALLOCATE_FAIL;
+
+	FrameSize = (TxAttr.mq_msgsize > RxAttr.mq_msgsize) ? TxAttr.mq_msgsize : RxAttr.mq_msgsize;
+
+	if(PoolInit(&FramePool, "Frames", (int32_t)FrameSize, Config.PoolBlocks) < 0)
+		return POOL_ALLOCATE_FAIL;
+
+	return PoolInit(&PacketPool, "Packets", (int32_t)sizeof(SerialPacket), Config.PoolBlocks);
+}
+
+/* Signal Handler assigned to SERIAL_RX_BATCH_SIG, the batch timer ran
+ * out, read and publish what has come in */
+static void
+sigrxbatchHandler(int sig)
+{
+	if ( sig == SERIAL_RX_BATCH_SIG )
+		gotSigio = 1;
+}
+
+/* Signal Handler assigned to SERIAL_TX_HOLD_SIG, the aggregation hold
+ * timer ran out */
+static void
+sigtxholdHandler(int sig)
+{
+	if ( sig == SERIAL_TX_HOLD_SIG )
+		gotTxHold = 1;
+}
+
+/* Signal Handler assigned to SERIAL_SOCK_SIG, a client connected or
+ * sent something */
+static void
+sigsockHandler(int sig)
+{
+	if ( sig == SERIAL_SOCK_SIG )
+		gotSockIo = 1;
+}
+
+/* Line time of one character (start, 8 data, stop bits) at the tty's
+ * output speed, in microseconds. The tty is at TTYBAUDRATE or a rate
+ * LinkNegotiate moved it to, see LinkSpeedBps */
+static int32_t
+TtyCharTimeUs(int ttyFd)
+{
+	struct termios Termios;
+	int32_t Bps;
+
+	if(tcgetattr(ttyFd, &Termios) == -1)
+		return 10000000 / 9600;
+
+	/* A pty or an odd rate, assume the slowest we use */
+	Bps = LinkSpeedBps(cfgetospeed(&Termios));
+	if(Bps == LINK_BAD_RATE)
+		return 10000000 / 9600;
+
+	return 10000000 / Bps;
+}
+
+/* Bytes the frame at the front of RxAccum still needs, at least the
+ * rest of the header when that isn't in yet */
+static int32_t
+RxBytesMissing(void)
+{
+	RxMsgInfo Info;
+	int32_t Length = RxBufferLength(&RxAccum), Missing;
+
+	if(Length < MSG_HEADER_LENGTH)
+		return MSG_HEADER_LENGTH - Length;
+
+	if(ProcessPacket(&Info, RxBufferData(&RxAccum)) < 0)
+		return 1;
+
+	Missing = PACKET_FRAME_LENGTH(Info.MsgLength) - Length;
+
+	return (Missing > 0) ? Missing : 1;
+}
+
+static void
+SetTtyAsync(int ttyFd, Boolean Enable)
+{
+	int flags = fcntl(ttyFd, F_GETFL);
+
+	if(flags == -1)
+		return;
+
+	flags = Enable ? (flags | O_ASYNC) : (flags & ~O_ASYNC);
+
+	if(fcntl(ttyFd, F_SETFL, flags) == -1)
+		LogErrno("SetTtyAsync");
+}
+
+/* One shot SERIAL_RX_BATCH_SIG in Us microseconds */
+static void
+ArmRxBatchTimer(int32_t Us)
+{
+	struct itimerspec Timer;
+
+	memset(&Timer, 0, sizeof(Timer));
+	Timer.it_value.tv_sec = Us / 1000000;
+	Timer.it_value.tv_nsec = (long)(Us % 1000000) * 1000;
+
+	timer_settime(RxBatchTimer, 0, &Timer, NULL);
+}
+
+/* After a SerialRx pass, decide how the next bytes are picked up.
+ * Between frames, or once the line has gone quiet, any byte in raises
+ * SERIAL_RX_SIG as before. With a frame part way in, the signals are
+ * turned off and the batch timer is set for the time the rest of the
+ * frame takes on the line, capped at Config.RxBatchUs. Under a steady
+ * stream one wakeup then reads a frame or more rather than a few bytes,
+ * while a frame is never held more than the cap past its last byte */
+static void
+RxBatchUpdate(int ttyFd)
+{
+	int32_t WaitUs;
+	int PendingBytes = 0;
+
+	if(TtyFailed)
+	{
+		RxBatching = FALSE;
+		return;
+	}
+
+	if(Config.RxBatchUs == 0 || !RxBatchTimerOk || RxBufferLength(&RxAccum) == 0 || RxLastPassBytes == 0)
+	{
+		if(RxBatching)
+		{
+			RxBatching = FALSE;
+			SetTtyAsync(ttyFd, TRUE);
+
+			/* Bytes that came in since the last read raised no signal */
+			if((ioctl(ttyFd, FIONREAD, &PendingBytes) == 0 && PendingBytes > 0) || UringRxPending())
+				gotSigio = 1;
+		}
+		return;
+	}
+
+	/* One character spare for the UART's receive timeout */
+	WaitUs = (RxBytesMissing() + 1) * TtyCharTimeUs(ttyFd);
+	if(WaitUs > Config.RxBatchUs)
+		WaitUs = Config.RxBatchUs;
+
+	if(!RxBatching)
+	{
+		RxBatching = TRUE;
+		SetTtyAsync(ttyFd, FALSE);
+	}
+
+	ArmRxBatchTimer(WaitUs);
+	DaemonStats.RxBatchWaits++;
+}
+
+/* Signal Handler assigned to SIGALRM, the watchdog / recovery timer */
+static void
+sigalrmHandler(int sig)
+{
+	if ( sig == SIGALRM )
+		gotSigAlrm = 1;
+}
+
+/* One shot SIGALRM in Ms milliseconds, 0 cancels it */
+static void
+ArmWatchdog(int32_t Ms)
+{
+	struct itimerval Timer;
+
+	memset(&Timer, 0, sizeof(Timer));
+	Timer.it_value.tv_sec = Ms / 1000;
+	Timer.it_value.tv_usec = (Ms % 1000) * 1000;
+
+	setitimer(ITIMER_REAL, &Timer, NULL);
+}
+
+/* Hand a newly opened tty's reads to io_uring, when that engine is
+ * running. If it won't take the tty the Daemon carries on with the
+ * signal driven reads */
+static void
+UringAttach(int ttyFd)
+{
+	if(!UringActive())
+		return;
+
+	if(UringAttachTty(ttyFd) < 0)
+	{
+		syslog(LOG_INFO, "io_uring: tty read not armed, falling back to signal driven I/O");
+		UringClose();
+	}
+}
+
+/* A frame that came in while the link was being negotiated, into the
+ * RX buffer for the next SerialRx pass */
+static void
+LinkDeliver(const ARM_char_t *Frame, int32_t Length)
+{
+	if(RxBufferReserve(&RxAccum) < Length)
+	{
+		DaemonStats.RxOverflowBytes += Length;
+		return;
+	}
+
+	memcpy(RxBufferWritePtr(&RxAccum), Frame, (size_t)Length);
+	CaptureFrame(CAPTURE_DIR_RX, RxBufferWritePtr(&RxAccum), Length);
+	RxBufferCommit(&RxAccum, Length);
+	gotSigio = 1;
+}
+
+/* Open and configure the tty named in Config, with its input
+ * signalled by SERIAL_RX_SIG. With -n the link is negotiated up to
+ * its best rate before anything else reads it
+ *
+ *  RETURNS:
+ *  The descriptor, -1 if failure
+*/
+static int
+OpenTty(void)
+{
+	int NewFd;
+
+	NewFd = SerialConfigure(Config.TtyPath, TTYBAUDRATE, &Config);
+	if(NewFd < 0)
+		return -1;
+
+	if(fcntl(NewFd, F_SETSIG, SERIAL_RX_SIG) == -1)
+	{
+		LogErrno("OpenTty: F_SETSIG");
+		close(NewFd);
+		return -1;
+	}
+
+	/* Opened with O_ASYNC on */
+	RxBatching = FALSE;
+
+	if(LinkEnabled() && LinkNegotiate(NewFd, LinkDeliver) < 0)
+	{
+		close(NewFd);
+		return -1;
+	}
+
+	UringAttach(NewFd);
+
+	return NewFd;
+}
+
+/* Close a failed tty and try to open and configure it again
+ *
+ *  RETURNS:
+ *  The new descriptor, -1 if the port still can't be opened
+*/
+static int
+RecoverTty(int ttyFd)
+{
+	int NewFd;
+
+	UringDetachTty();
+
+	if(ttyFd >= 0)
+		close(ttyFd);
+
+	NewFd = OpenTty();
+	if(NewFd < 0)
+		return -1;
+
+	/* A frame cut off by the failure will never complete */
+	RxBufferConsume(&RxAccum, RxBufferLength(&RxAccum));
+
+	TtyFailed = FALSE;
+	DaemonStats.TtyReopens++;
+	syslog(LOG_INFO, "Recovery: %s reopened", Config.TtyPath);
+
+	return NewFd;
+}
+
+/* Ask for SIGUSR1 when the TX queue goes from empty to not empty. If
+ * that fails the queue is reopened, the old handle may refer to a
+ * queue that was removed. Messages already waiting never trigger the
+ * notification, gotSigUsr1 is set to send them now
+ *
+ *  RETURNS:
+ *  The TX queue handle, a new one if the queue was reopened
+*/
+static mqd_t
+RearmTxNotify(mqd_t mqd_tx, const struct sigevent *sev)
+{
+	struct mq_attr attr;
+	mqd_t NewMqd;
+
+	/* EBUSY, still registered from before */
+	if(mq_notify(mqd_tx, sev) == -1 && errno != EBUSY)
+	{
+		DaemonStats.NotifyFailures++;
+		LogErrno("Recovery: mq_notify");
+
+		NewMqd = OpenDaemonQueue(SERIAL_TX_QUEUE);
+		if(NewMqd == (mqd_t) -1)
+		{
+			/* The watchdog tries again */
+			LogErrno("Recovery: TX queue reopen");
+			return mqd_tx;
+		}
+
+		mq_close(mqd_tx);
+		mqd_tx = NewMqd;
+		DaemonStats.QueueReopens++;
+		syslog(LOG_INFO, "Recovery: TX queue reopened");
+
+		if(mq_notify(mqd_tx, sev) == -1 && errno != EBUSY)
+			LogErrno("Recovery: mq_notify after reopen");
+	}
+
+	if(mq_getattr(mqd_tx, &attr) == 0 && attr.mq_curmsgs > 0)
+		gotSigUsr1 = 1;
+
+	return mqd_tx;
+}
+
+/* Periodic health check, catches what no signal reported: input left
+ * on the tty (the RT signal queue can overflow), TX messages whose
+ * notification was lost, a hung up tty, or a TX queue removed under us
+ *
+ *  RETURNS:
+ *  The TX queue handle, a new one if the queue was reopened
+*/
+static mqd_t
+WatchdogCheck(int ttyFd, mqd_t mqd_tx, const struct sigevent *sev)
+{
+	mqd_t Probe;
+	int PendingBytes = 0;
+	Boolean TxWaiting;
+
+	if(TtyHungUp(ttyFd))
+	{
+		MarkTtyFailed("Watchdog", 0);
+		return mqd_tx;
+	}
+
+	if(((ioctl(ttyFd, FIONREAD, &PendingBytes) == 0 && PendingBytes > 0) || UringRxPending()) && !gotSigio)
+	{
+		gotSigio = 1;
+		DaemonStats.WatchdogKicks++;
+	}
+
+	/* Still the queue clients send to */
+	Probe = mq_open(SERIAL_TX_QUEUE, O_RDONLY);
+	if(Probe == (mqd_t) -1 && errno == ENOENT)
+	{
+		syslog(LOG_INFO, "Watchdog: TX queue removed, recreating it");
+		mq_close(mqd_tx);
+		mqd_tx = OpenDaemonQueue(SERIAL_TX_QUEUE);
+		DaemonStats.QueueReopens++;
+	}
+	else if(Probe != (mqd_t) -1)
+		mq_close(Probe);
+
+	TxWaiting = gotSigUsr1;
+	mqd_tx = RearmTxNotify(mqd_tx, sev);
+
+	/* Durable messages whose signal was lost, or a write to retry */
+	if(JournalPending())
+		gotSigUsr1 = 1;
+
+	if(gotSigUsr1 && !TxWaiting)
+		DaemonStats.WatchdogKicks++;
+
+	/* The line keeps failing at the negotiated rate, step down. A frame
+	 * part read at the old rate will never complete */
+	if(LinkCheckErrors(ttyFd, DaemonStats.RxBadFrames))
+	{
+		UringDetachTty();
+		RxBufferConsume(&RxAccum, RxBufferLength(&RxAccum));
+
+		if(LinkNegotiate(ttyFd, LinkDeliver) < 0)
+			MarkTtyFailed("Link fall back", errno);
+		else
+			UringAttach(ttyFd);
+	}
+
+	return mqd_tx;
+}
+
+/* Wait for the tty to send what's in its output buffer, until
+ * DeadlineMs (CLOCK_MONOTONIC). tcdrain() alone could wait forever on
+ * a link held off by flow control
+ *
+ *  RETURNS:
+ *  Bytes still unsent
+*/
+static int
+DrainTtyOutput(int ttyFd, int64_t DeadlineMs)
+{
+	struct timespec Pause;
+	int Unsent = 0;
+
+	Pause.tv_sec = 0;
+	Pause.tv_nsec = 10*1000*1000;
+
+	while(ioctl(ttyFd, TIOCOUTQ, &Unsent) == 0 && Unsent > 0)
+	{
+		if(MonotonicMs() >= DeadlineMs)
+			return Unsent;
+
+		nanosleep(&Pause, NULL);
+	}
+
+	/* The driver buffer is empty, what's left is in the UART FIFO */
+	tcdrain(ttyFd);
+
+	return 0;
+}
+
+/* Send the messages waiting in the TX queue, until DeadlineMs. Messages
+ * posted after the call stay queued
+ *
+ *  RETURNS:
+ *  Messages left unsent in the queue
+*/
+static long
+DrainTxQueue(int ttyFd, mqd_t mqd_tx, int64_t DeadlineMs)
+{
+	struct mq_attr attr;
+	long Waiting;
+
+	if(mq_getattr(mqd_tx, &attr) == -1)
+		return 0;
+
+	Waiting = attr.mq_curmsgs;
+
+	while(Waiting > 0 && !TtyFailed && MonotonicMs() < DeadlineMs)
+	{
+		SerialTx(ttyFd, SERIAL_RX_LOG_FILENAME);
+		Waiting--;
+	}
 
-			//Copy bytes received this loop iteration into the RxBuff
-			CurrentArrayPosition=&RxBuffer[AccumulatedRxByteCount];
-			strncpy(CurrentArrayPosition, ReadBuff, TotalRxBytes);
-			memset(ReadBuff, 0, sizeof(ReadBuff));
+	/* Fewer if someone else took some, a frame requeued by a failed
+	 * write is among those left */
+	if(mq_getattr(mqd_tx, &attr) == 0 && attr.mq_curmsgs < Waiting)
+		Waiting = attr.mq_curmsgs;
 
-			#if DEBUG_LEVEL > 10
-				printf("\nRxBuffer %s ",RxBuffer);
-			#endif
+	return Waiting;
+}
+
+/* Close the tty without losing what's in flight on it: the output
+ * buffer drains (until DeadlineMs), whole frames already received go
+ * to the RX queue, and the settings it had before we opened it are
+ * put back */
+static void
+CloseTty(int ttyFd, int64_t DeadlineMs)
+{
+	int Unsent;
 
-			AccumulatedRxByteCount+=TotalRxBytes;
+	/* Messages held back for aggregation go out with the rest */
+	AggregateFlush(ttyFd);
 
-			#if DEBUG_VERBOSITY > 150
-			printf("\nCurrent Array Positions is %i \n", *CurrentArrayPosition);
-			#endif
-		}
+	Unsent = DrainTtyOutput(ttyFd, DeadlineMs);
+	if(Unsent > 0)
+	{
+		syslog(LOG_INFO, "CloseTty: %i bytes unsent at the drain deadline, discarded", Unsent);
+		tcflush(ttyFd, TCOFLUSH);
 	}
 
-	/* Outside the while loop. Process our received data */
+	SerialRx(ttyFd, SERIAL_RX_LOG_FILENAME);
 
-	/* Get Current System Time, copy it to our serial packet header */
-		if (gettimeofday(&CurrentTime, NULL) == -1 )
-		{
-				usageErr("Couldn't get current time \n");
-				memset(&CurrentTime, 0x0, sizeof(CurrentTime));
-		}
-		else
-		{
-				CurrentTimeString = ctime(&CurrentTime.tv_sec);
-				strcpy(CurrentSerialPacket->TimeReceived,CurrentTimeString);
-		}
+	/* The link goes back to the safe rate, where the next open looks
+	 * for the MCU */
+	UringDetachTty();
+	LinkRelease(ttyFd);
 
-	#if DEBUG_LEVEL > 15
-		printf("New Complete Message Received \n");
-	#endif
+	if(tcsetattr(ttyFd, TCSANOW, &OrigTermios) == -1)
+		LogErrno("CloseTty: restoring terminal settings");
 
-		/* Blast this message out on the MSG QUEUE */
-		/* Open for Write, Create if not open, Open non-blocking-rcv and send will
-		 * fail unless they can complete immediately. */
-		flags = O_RDWR | O_NONBLOCK;
+	close(ttyFd);
+}
 
+/* SIGHUP, read the config file again. The tty is closed and reopened
+ * if its settings changed, once what's in flight on it is through.
+ * TX messages wait in their queue meanwhile, so a reload loses no
+ * frames. Buffer and pool sizes are fixed at startup
+ *
+ *  RETURNS:
+ *  The tty descriptor, -1 if reopening it failed (recovery takes over)
+*/
+static int
+ReloadConfig(int argc, char *argv[], int ttyFd)
+{
+	DaemonConfig NewConfig;
+	Boolean TtyChanged, CaptureChanged, RealtimeChanged, AggChanged, DeltaChanged;
 
-		mqd=mq_open( SERIAL_RX_QUEUE , flags);
+	if(SerialConfigReload(argc, argv, &NewConfig) < 0)
+	{
+		syslog(LOG_INFO, "Reload: %s is bad, configuration unchanged", Config.ConfigPath);
+		return ttyFd;
+	}
 
-		/* check for fail condition, if we failed asssume we need to open a
-		 * message queue for the first time, then go ahead and do so
-		 * the function below creates a message queue if not already open*/
-		if(mqd == (mqd_t) -1)
-		{
-			mqd=Serial8051Open(SERIAL_RX_QUEUE);
+	if(NewConfig.RxBufferSize != Config.RxBufferSize || NewConfig.RxBufferMax != Config.RxBufferMax ||
+			NewConfig.PoolBlocks != Config.PoolBlocks || strcmp(NewConfig.SocketPath, Config.SocketPath) != 0 ||
+			NewConfig.IoEngine != Config.IoEngine || strcmp(NewConfig.CacheName, Config.CacheName) != 0 ||
+			strcmp(NewConfig.JournalPath, Config.JournalPath) != 0)
+		syslog(LOG_INFO, "Reload: buffer and pool sizes, the socket, the I/O engine, the cache and the journal only change on a restart");
 
-			/* Return an error code now, something bad is happening */
-			if(mqd == (mqd_t) -1)
-			{
-				#if DEBUG_LEVEL > 5
-					errMsg("SerialDaemonWrite: Message Open Failed");
-				#endif
-			return MSG_QUEUE_OPEN_FAIL;
-			}
-		}
+	NewConfig.RxBufferSize = Config.RxBufferSize;
+	NewConfig.RxBufferMax = Config.RxBufferMax;
+	NewConfig.PoolBlocks = Config.PoolBlocks;
+	strcpy(NewConfig.SocketPath, Config.SocketPath);
+	NewConfig.IoEngine = Config.IoEngine;
+	strcpy(NewConfig.CacheName, Config.CacheName);
+	strcpy(NewConfig.JournalPath, Config.JournalPath);
 
-		/* Send the Message  */
-		#if DEBUG_LEVEL > 150
-		/* Print the raw hex values, for debugging */
-			printf("\n RxBuffer ");
-				int i=0;
-				for(i=0; i<AccumulatedRxByteCount; i++)
-				{
-					printf(" %x",RxBuffer[i]);
-				}
+	/* No hold timer, no aggregation */
+	if(!TxHoldTimerOk)
+		NewConfig.AggHoldUs = 0;
 
-				struct mq_attr attr;
-				mq_getattr(mqd, &attr);
+	TtyChanged = strcmp(NewConfig.TtyPath, Config.TtyPath) != 0 ||
+			NewConfig.TtyProfile != Config.TtyProfile ||
+			NewConfig.VMin != Config.VMin || NewConfig.VTime != Config.VTime ||
+			NewConfig.HwFlowControl != Config.HwFlowControl ||
+			NewConfig.RxTrigBytes != Config.RxTrigBytes ||
+			NewConfig.LinkMaxBps != Config.LinkMaxBps;
 
-				printf("\nSerialRx MqAttr = %u \n", attr.mq_msgsize);
-		#endif
+	CaptureChanged = strcmp(NewConfig.CapturePath, Config.CapturePath) != 0 ||
+			NewConfig.CaptureMaxBytes != Config.CaptureMaxBytes;
 
-		SndMsgRtn = mq_send(mqd, RxBuffer, (size_t)(AccumulatedRxByteCount), 0);
-		if(SndMsgRtn < 0)
-		{
+	AggChanged = NewConfig.AggHoldUs != Config.AggHoldUs || NewConfig.AggBytes != Config.AggBytes;
 
-			/* EAGAIN occurs when we have a full message queue,
-			 * we need to clear space to send new messages */
-			if (errno==EAGAIN){
-				/* This function will clear the message queue one message
-				 * at a time, oldest message first, freing up space for our
-				 * newest message */
+	DeltaChanged = memcmp(NewConfig.DeltaIds, Config.DeltaIds, sizeof(Config.DeltaIds)) != 0;
 
-				ClearReturn = ClearMessageQueue(mqd , 1);
+	RealtimeChanged = NewConfig.SchedPolicy != Config.SchedPolicy ||
+			NewConfig.SchedPriority != Config.SchedPriority ||
+			NewConfig.CpuMask != Config.CpuMask || NewConfig.LockMemory != Config.LockMemory;
 
-				#if DEBUG_LEVEL > 50
-					printf("SerialRx:EAGAIN encountered, cleared %i Messages \n", ClearReturn);
-				#endif
-				/* Reattampt our send */
+	Config = NewConfig;
+	LinkEnable(Config.LinkMaxBps);
+	syslog(LOG_INFO, "Reload: configuration read");
 
-				SndMsgRtn = mq_send(mqd, RxBuffer, (size_t)(AccumulatedRxByteCount), 0);
+	if(CaptureChanged)
+	{
+		CaptureClose();
 
+		if(Config.CapturePath[0] != '\0' && CaptureOpen(Config.CapturePath, Config.CaptureMaxBytes) < 0)
+			syslog(LOG_INFO, "Reload: capture to %s Failed", Config.CapturePath);
+	}
 
-				/* If it fails this time, simply return */
-				if(SndMsgRtn < 0)
-				{
-					#if DEBUG_LEVEL > 5
-					syslog(LOG_INFO, "SerialDaemonRx: Msg RX Fails after attempting to clear queue");
-					errMsg("SerialDaemonRx: Msg RX Fails, after attempting to clear queue");
-					#endif
-					return MSG_SEND_FAIL;
-				}
-			}
-			else
-			{
-				#if DEBUG_LEVEL > 5
-					syslog(LOG_INFO, "SerialDaemonRx: Msg RX Fails");
-					errMsg("SerialDaemonRx: Msg Send Fails");
-				#endif
-			return MSG_SEND_FAIL;
-			}
-		}
+	if(RealtimeChanged)
+		RealtimeApply(&Config);
 
-		memset(RxBuffer, 0 ,MAX_RX_BUFF_SIZE);
-		free(CurrentSerialPacket);
+	/* What's held goes out under the old settings */
+	if(AggChanged)
+	{
+		AggregateFlush(ttyFd);
+		AggregateInit(&TxAgg, AggregateLimit());
+	}
 
+	/* Streams start again from their next keyframe */
+	if(DeltaChanged)
+		DeltaStreams = DeltaConfigure(Config.DeltaIds);
 
-		if(mq_close(mqd) < (int)0)
-		{
-			errMsg("SerialDaemonRx: Close Failed");
-		}
+	/* Recovery reopens a failed tty with the new settings */
+	if(!TtyChanged || TtyFailed)
+		return ttyFd;
 
-		/* If we haven't bailed out anywhere else up here, go ahead and send a positive
-		 * int as a return, meaning success */
-			return 1;
+	CloseTty(ttyFd, MonotonicMs() + Config.DrainMs);
+
+	ttyFd = OpenTty();
+	if(ttyFd < 0)
+	{
+		MarkTtyFailed("Reload", errno);
+		return -1;
+	}
+
+	/* Pick up whatever came in while it was closed */
+	gotSigio = 1;
+	syslog(LOG_INFO, "Reload: %s reopened", Config.TtyPath);
+
+	return ttyFd;
 }
 
-/* Signal Handler assigned to a Real Time signal, indicating
- * we have received data on serial.  This is more specific
- * than sigio, since we check the SI_CODE to indicated that
- * we have input data, whereas SIGIO is triggered on any kind
- * of input output */
+/* Signal Handler assigned to SIGTERM and SIGINT, an orderly shutdown */
 static void
-sigioHandler(int sig, siginfo_t *si, void *ucontext)
+sigtermHandler(int sig)
 {
-	if (sig == SERIAL_RX_SIG)
-	{
-		if(si->si_code == POLL_IN)
-		{ /* Only set gotSigio if we have input data (determined using
-		 	 si_code */
-			gotSigio = 1;
-		}
-		else
-		{
-			gotSigio = 0;
-		}
-	}
+	if ( sig == SIGTERM || sig == SIGINT )
+		gotSigTerm = 1;
+}
+
+/* Signal Handler assigned to SIGHUP, reload the configuration */
+static void
+sighupHandler(int sig)
+{
+	if ( sig == SIGHUP )
+		gotSigHup = 1;
+}
+
+/* SIGTERM / SIGINT are blocked outside sigsuspend, a long TX burst
+ * looks for them so it doesn't hold up the shutdown */
+static Boolean
+StopRequested(void)
+{
+	sigset_t Pending;
+
+	if(gotSigTerm)
+		return TRUE;
+
+	if(sigpending(&Pending) == -1)
+		return FALSE;
+
+	return sigismember(&Pending, SIGTERM) || sigismember(&Pending, SIGINT);
 }
 
 /* Signal Handler assigned to the SIGUSR1 signal */
@@ -564,24 +2327,43 @@ sigusr1Handler(int sig)
 int
 main(int argc, char *argv[])
 {
-	struct termios OrigTermios, ModifiedTermios;
-	struct timespec;
-
 	struct sigevent sev;
 	int flags = 0, Return = 0;
-	int ttyFd;
+	int ttyFd = -1;
 	volatile int32_t TX_Return = 1;
 	volatile int32_t TX_Active = 0;
+	int32_t BackoffMs = RECOVERY_BACKOFF_MIN_MS;
+	Boolean RecoveryScheduled = FALSE;
+	long TxUnsent = 0;
+	Boolean SocketMore = FALSE;
+	static JitterStats Jitter;
 	mqd_t mqd_tx , mqd_rx;
 	char UsrMsg[100];
 	char *ErrMsg;
 
 	//Used by sig handler to control process behavior when the signal arrives
-	struct sigaction sa, sa1;
+	struct sigaction sa, sa1, sa2, sa3, sa4, sa5, sa6, sa7, sa8;
+	struct sigevent RxBatchSev;
+	struct sigevent TxHoldSev;
 
 	/* Mask to block and restore signals prior to system calls */
 	sigset_t blockSet, emptyMask;
 
+	/* Settle the configuration first, a bad option should fail before we fork */
+	SerialConfigDefaults(&Config);
+	SerialConfigParseArgs(argc, argv, &Config);
+
+	/* Jitter mode measures under the real time settings, no Daemon */
+	if(Config.JitterSeconds > 0)
+	{
+		openlog(DAEMON8051_LOG_NAME, LOG_CONS | LOG_NDELAY | LOG_PERROR | LOG_PID, LOG_USER );
+		RealtimeApply(&Config);
+		JitterMeasure(Config.JitterSeconds, &Jitter);
+		JitterReport(&Jitter, &Config);
+		closelog();
+		exit(EXIT_SUCCESS);
+	}
+
 #ifndef FOREGROUND_RUN
 	openlog(DAEMON8051_LOG_NAME, LOG_CONS | LOG_NDELAY | LOG_PERROR | LOG_PID, LOG_USER );
 	syslog(LOG_INFO, "Starting Daemon");
@@ -589,14 +2371,7 @@ main(int argc, char *argv[])
 	/* Start the process as a daemon,
 	 * (forks and creates a child without controlling terminal, parent exits */
 	if(becomeDaemon(BD_NO_CHDIR | BD_NO_CLOSE_FILES ) < 0 )
-	{	 /* set owner process that is to receive "I/O possible" signal */
-		 /*NOTE: replace stdin_fileno with the /dev/tty04 or whatever */
-		 if (fcntl(ttyFd, F_SETOWN, getpid()) == -1)
-		 {
-			syslog(LOG_INFO, "fcntl(F_SETOWN)");
-			closelog();
-			errExit("fcntl(F_SETOWN)");
-		 }
+	{
 		syslog(LOG_INFO, "Failed to Become Daemon");
 		closelog();
 		return(DAEMON_FAIL);
@@ -622,13 +2397,23 @@ main(int argc, char *argv[])
 		errExit("SerialDaemon: Failed  to Open PID semaphore, cannot communicate with SerialWrite Message Queues!!!");
 	}
 
-	ttyFd = SerialConfigure(SERIAL_FILEPATH, TTYBAUDRATE);
+	if(RxBufferInit(&RxAccum, Config.RxBufferSize, Config.RxBufferMax) < 0)
+	{
+		syslog(LOG_INFO, "RX buffer allocation Failed, Exiting");
+		closelog();
+		errExit("RX buffer allocation Failed");
+	}
+
+	ttyFd = SerialConfigure(Config.TtyPath, TTYBAUDRATE, &Config);
 
+	/* Not fatal, the port may just not be there yet. RecoverTty keeps
+	 * trying once the main loop is running */
 	if(ttyFd < 0)
 	{
-		syslog(LOG_INFO, "Serial Open Failed, Exiting");
-		closelog();
-		errExit("Serial Open Failed");
+		syslog(LOG_INFO, "Serial Open Failed, will retry");
+		ttyFd = -1;
+		TtyFailed = TRUE;
+		DaemonStats.TtyFailures++;
 	}
 
 	/*
@@ -707,6 +2492,14 @@ main(int argc, char *argv[])
 	sigemptyset(&blockSet);
 	sigaddset(&blockSet, SIGUSR1);
 	sigaddset(&blockSet, SIGIO);
+	sigaddset(&blockSet, SIGALRM);
+	sigaddset(&blockSet, SERIAL_RX_SIG);
+	sigaddset(&blockSet, SERIAL_RX_BATCH_SIG);
+	sigaddset(&blockSet, SERIAL_SOCK_SIG);
+	sigaddset(&blockSet, SERIAL_TX_HOLD_SIG);
+	sigaddset(&blockSet, SIGTERM);
+	sigaddset(&blockSet, SIGINT);
+	sigaddset(&blockSet, SIGHUP);
 
 	/* Block Signals while we are configuring them */
 	if(sigprocmask(SIG_BLOCK, &blockSet, NULL)==-1)
@@ -730,8 +2523,9 @@ main(int argc, char *argv[])
 
 	syslog(LOG_INFO, "Opening Serial_TX Queues ");
 	/* Open the message queues, and configure the notification for the
-	 * write side (messages from SerialLib8051 write to this interface) */
-	mqd_tx = Serial8051Open(SERIAL_TX_QUEUE);
+	 * write side (messages from SerialLib8051 write to this interface).
+	 * Queues left by an earlier run are kept, with their messages */
+	mqd_tx = OpenDaemonQueue(SERIAL_TX_QUEUE);
 	if(mqd_tx == (mqd_t) -1 )
 	{
 		syslog(LOG_INFO, "SERIAL_TX mq_open Failed ");
@@ -744,7 +2538,7 @@ main(int argc, char *argv[])
 	}
 
 	syslog(LOG_INFO, "Opening Serial_RX Queues ");
-	mqd_rx = Serial8051Open(SERIAL_RX_QUEUE);
+	mqd_rx = OpenDaemonQueue(SERIAL_RX_QUEUE);
 	if(mqd_rx == (mqd_t) -1 )
 	{
 		syslog(LOG_INFO, "SERIAL_RX mq_open Failed");
@@ -756,6 +2550,49 @@ main(int argc, char *argv[])
 		syslog(LOG_INFO, "SERIAL_RX mq_open Sucessful ");
 	}
 
+	if(InitDaemonPools(mqd_tx, mqd_rx) < 0)
+	{
+		syslog(LOG_INFO, "Buffer pool allocation Failed, Exiting");
+		closelog();
+		errExit("Buffer pool allocation Failed");
+	}
+
+	AggregateInit(&TxAgg, AggregateLimit());
+	DeltaStreams = DeltaConfigure(Config.DeltaIds);
+
+	if(RouteTableOpen() < 0)
+	{
+		syslog(LOG_INFO, "SERIAL_SUB mq_open Failed, RX subscriptions disabled");
+	}
+
+	/* Readers fall back to the RX queue, no cache isn't fatal */
+	if(Config.CacheName[0] != '\0' && CacheOpen(Config.CacheName) < 0)
+		syslog(LOG_INFO, "Last value cache %s Failed, continuing without it", Config.CacheName);
+
+	/* Durable TX, what the Daemon before us didn't send goes out first */
+	if(Config.JournalPath[0] != '\0')
+	{
+		if(JournalOpen(Config.JournalPath) < 0)
+			syslog(LOG_INFO, "Journal %s Failed, continuing without durable TX", Config.JournalPath);
+		else if((Return = JournalRecover()) > 0)
+		{
+			syslog(LOG_INFO, "Journal: %i durable TX messages from before the start", Return);
+			gotSigUsr1 = 1;
+		}
+	}
+
+	if(Config.CapturePath[0] != '\0')
+	{
+		if(CaptureOpen(Config.CapturePath, Config.CaptureMaxBytes) < 0)
+			syslog(LOG_INFO, "Capture to %s Failed, continuing without it", Config.CapturePath);
+		else
+			syslog(LOG_INFO, "Capturing serial traffic to %s", Config.CapturePath);
+	}
+
+	/* With the buffers allocated, so locking memory faults them in */
+	if(RealtimeApply(&Config) < 0)
+		syslog(LOG_INFO, "Realtime settings not all applied, continuing");
+
 	/*Initialize  Signal Mask for Serial Receive*/
 	sigemptyset(&sa.sa_mask);
 
@@ -782,7 +2619,7 @@ main(int argc, char *argv[])
 	/* Tell the kernel that we want to see an alternative signal
 	 * delivered to the process whenever we see activity on the serial FD */
 
-	if(fcntl(ttyFd, F_SETSIG, SERIAL_RX_SIG)==-1)
+	if(ttyFd >= 0 && fcntl(ttyFd, F_SETSIG, SERIAL_RX_SIG)==-1)
 	{
 		syslog(LOG_INFO, "SerialDameon Main: Couldn't set SERIAL_RX_SIG");
 		closelog();
@@ -800,15 +2637,158 @@ main(int argc, char *argv[])
 		errExit("SerialDameon Main: SIGUSR1");
 	}
 
-	/* configure the notification to notify when message available in the
-	 * write queue (messages from SerialLib8051 write to this interface) */
-	if (mq_notify(mqd_tx, &sev)==-1)
+	/* SIGUSR2 asks for the stats to be written to the system log */
+	sigemptyset(&sa2.sa_mask);
+	sa2.sa_handler = sigusr2Handler;
+	sa2.sa_flags    = 0;
+
+	if (sigaction(SIGUSR2, &sa2, NULL) == -1)
+	{
+		syslog(LOG_INFO, "SerialDameon Main: sigaction - SIGUSR2");
+		closelog();
+		errExit("SerialDameon Main: SIGUSR2");
+	}
+
+	/* SIGALRM runs the watchdog, and paces tty recovery */
+	sigemptyset(&sa3.sa_mask);
+	sa3.sa_handler = sigalrmHandler;
+	sa3.sa_flags    = 0;
+
+	if (sigaction(SIGALRM, &sa3, NULL) == -1)
+	{
+		syslog(LOG_INFO, "SerialDameon Main: sigaction - SIGALRM");
+		closelog();
+		errExit("SerialDameon Main: SIGALRM");
+	}
+
+	/* SERIAL_RX_BATCH_SIG comes from the RX batching timer */
+	sigemptyset(&sa6.sa_mask);
+	sa6.sa_handler = sigrxbatchHandler;
+	sa6.sa_flags    = 0;
+
+	if (sigaction(SERIAL_RX_BATCH_SIG, &sa6, NULL) == -1)
+	{
+		syslog(LOG_INFO, "SerialDameon Main: sigaction - SERIAL_RX_BATCH_SIG");
+		closelog();
+		errExit("SerialDameon Main: SERIAL_RX_BATCH_SIG");
+	}
+
+	/* Created whether batching is on or not, a reload may turn it on */
+	memset(&RxBatchSev, 0, sizeof(RxBatchSev));
+	RxBatchSev.sigev_notify = SIGEV_SIGNAL;
+	RxBatchSev.sigev_signo = SERIAL_RX_BATCH_SIG;
+
+	if(timer_create(CLOCK_MONOTONIC, &RxBatchSev, &RxBatchTimer) == -1)
+		LogErrno("RX batching disabled, timer_create");
+	else
+		RxBatchTimerOk = TRUE;
+
+	/* SERIAL_TX_HOLD_SIG comes from the aggregation hold timer */
+	sigemptyset(&sa8.sa_mask);
+	sa8.sa_handler = sigtxholdHandler;
+	sa8.sa_flags    = 0;
+
+	if (sigaction(SERIAL_TX_HOLD_SIG, &sa8, NULL) == -1)
+	{
+		syslog(LOG_INFO, "SerialDameon Main: sigaction - SERIAL_TX_HOLD_SIG");
+		closelog();
+		errExit("SerialDameon Main: SERIAL_TX_HOLD_SIG");
+	}
+
+	/* Without the timer nothing would bound the hold time, so no
+	 * aggregation */
+	memset(&TxHoldSev, 0, sizeof(TxHoldSev));
+	TxHoldSev.sigev_notify = SIGEV_SIGNAL;
+	TxHoldSev.sigev_signo = SERIAL_TX_HOLD_SIG;
+
+	if(timer_create(CLOCK_MONOTONIC, &TxHoldSev, &TxHoldTimer) == -1)
+	{
+		LogErrno("Aggregation disabled, timer_create");
+		Config.AggHoldUs = 0;
+	}
+	else
+		TxHoldTimerOk = TRUE;
+
+	/* SIGTERM / SIGINT stop the Daemon, once the TX queue is drained */
+	sigemptyset(&sa4.sa_mask);
+	sa4.sa_handler = sigtermHandler;
+	sa4.sa_flags    = 0;
+
+	if (sigaction(SIGTERM, &sa4, NULL) == -1 || sigaction(SIGINT, &sa4, NULL) == -1)
+	{
+		syslog(LOG_INFO, "SerialDameon Main: sigaction - SIGTERM");
+		closelog();
+		errExit("SerialDameon Main: SIGTERM");
+	}
+
+	/* SIGHUP reloads the configuration */
+	sigemptyset(&sa5.sa_mask);
+	sa5.sa_handler = sighupHandler;
+	sa5.sa_flags    = 0;
+
+	if (sigaction(SIGHUP, &sa5, NULL) == -1)
+	{
+		syslog(LOG_INFO, "SerialDameon Main: sigaction - SIGHUP");
+		closelog();
+		errExit("SerialDameon Main: SIGHUP");
+	}
+
+	/* SERIAL_SOCK_SIG comes from the client socket and its connections */
+	sigemptyset(&sa7.sa_mask);
+	sa7.sa_handler = sigsockHandler;
+	sa7.sa_flags    = 0;
+
+	if (sigaction(SERIAL_SOCK_SIG, &sa7, NULL) == -1)
 	{
-		syslog(LOG_INFO, "SerialDameon Main: mq_notify");
+		syslog(LOG_INFO, "SerialDameon Main: sigaction - SERIAL_SOCK_SIG");
 		closelog();
-		errExit("SerialDameon Main: mq_notify");
+		errExit("SerialDameon Main: SERIAL_SOCK_SIG");
+	}
+
+	/* Clients can always fall back to the queues, so no socket isn't fatal */
+	if(Config.SocketPath[0] != '\0')
+	{
+		Return = SocketOpen(Config.SocketPath, SERIAL_SOCK_SIG);
+
+		if(Return < 0)
+			syslog(LOG_INFO, "Socket %s Failed with error %i, clients use the queues", Config.SocketPath, Return);
+		else
+			syslog(LOG_INFO, "Listening for clients on %s", Config.SocketPath);
 	}
 
+	/* Before anything else reads the tty, frames for clients that come
+	 * in meanwhile wait in the RX buffer */
+	LinkEnable(Config.LinkMaxBps);
+
+	if(LinkEnabled() && Config.WatchdogMs == 0)
+		syslog(LOG_INFO, "Link: the watchdog is off (-w 0), the link won't fall back on errors");
+
+	if(!TtyFailed && LinkEnabled() && LinkNegotiate(ttyFd, LinkDeliver) < 0)
+		MarkTtyFailed("Link negotiation", errno);
+
+	/* The signal driven path is always there to fall back on. TX frames
+	 * are received into the engine's own buffers, sized like the pool's */
+	if(Config.IoEngine == IO_ENGINE_URING)
+	{
+		if(UringOpen(FramePool.BlockSize) < 0)
+			syslog(LOG_INFO, "io_uring engine unavailable, using signal driven I/O");
+		else if(!TtyFailed)
+			UringAttach(ttyFd);
+	}
+
+	/* configure the notification to notify when message available in the
+	 * write queue (messages from SerialLib8051 write to this interface).
+	 * Failing that the watchdog keeps trying */
+	mqd_tx = RearmTxNotify(mqd_tx, &sev);
+
+	if(TtyFailed)
+	{
+		ArmWatchdog(BackoffMs);
+		RecoveryScheduled = TRUE;
+	}
+	else if(Config.WatchdogMs > 0)
+		ArmWatchdog(Config.WatchdogMs);
+
 	TX_Return = 1;
 
 	/* Create an Empty Signal Mask that sigsuspend will use to
@@ -823,8 +2803,74 @@ main(int argc, char *argv[])
 	{
 		/* Wait for signal, if we receive one, apply empty mask to block incoming signals.
 		 * Complete tasks below uninterrupted, and once the loop restarts, call to same function
-		 * activates signals again and waits for incoming message. */
-		sigsuspend( &emptyMask );
+		 * activates signals again and waits for incoming message. Work found
+		 * by the watchdog or recovery last time round is done without waiting */
+		if(!gotSigio && !gotSigUsr1 && !gotSigUsr2 && !gotSigAlrm && !gotSigTerm && !gotSigHup && !gotSockIo &&
+				!gotTxHold)
+			sigsuspend( &emptyMask );
+
+		/* Pending counts too, work left over from last time round skips
+		 * the sigsuspend that would deliver it */
+		if(StopRequested())
+			break;
+
+		if(gotSigHup)
+		{
+			gotSigHup = 0;
+			ttyFd = ReloadConfig(argc, argv, ttyFd);
+
+			/* The period may have changed */
+			if(!TtyFailed)
+				ArmWatchdog(Config.WatchdogMs);
+		}
+
+		if(gotSigAlrm)
+		{
+			gotSigAlrm = 0;
+
+			if(TtyFailed)
+			{
+				ttyFd = RecoverTty(ttyFd);
+
+				if(TtyFailed)
+				{
+					BackoffMs = (2*BackoffMs > RECOVERY_BACKOFF_MAX_MS) ? RECOVERY_BACKOFF_MAX_MS : 2*BackoffMs;
+				}
+				else
+				{
+					/* Pick up whatever waited on either side while it was down */
+					BackoffMs = RECOVERY_BACKOFF_MIN_MS;
+					gotSigio = 1;
+					gotSockIo = 1;
+					mqd_tx = RearmTxNotify(mqd_tx, &sev);
+
+					if(JournalPending())
+						gotSigUsr1 = 1;
+				}
+			}
+			else
+			{
+				mqd_tx = WatchdogCheck(ttyFd, mqd_tx, &sev);
+
+				/* Socket input whose signal was lost, a pass costs little */
+				if(SocketListening())
+					gotSockIo = 1;
+			}
+
+			RecoveryScheduled = TtyFailed;
+
+			if(TtyFailed)
+				ArmWatchdog(BackoffMs);
+			else if(Config.WatchdogMs > 0)
+				ArmWatchdog(Config.WatchdogMs);
+		}
+
+		/* The tty is left alone until it's reopened, TX messages stay queued */
+		if(TtyFailed)
+		{
+			gotSigio = 0;
+			gotSigUsr1 = 0;
+		}
 
 		/* Reinitialize our mq_notify mechanism, if gotSigUsr1 signal caused sigsuspend to
 		 * end, and not gotSigio */
@@ -857,6 +2903,13 @@ main(int argc, char *argv[])
 				#endif
 			}
 
+			RxBatchUpdate(ttyFd);
+		}
+
+		if(gotSigUsr2)
+		{
+			gotSigUsr2 = 0;
+			LogDaemonStats();
 		}
 
 		/* Sent when user places a message in the outgoing queue, via Serial8051Write */
@@ -868,12 +2921,18 @@ main(int argc, char *argv[])
 				syslog(LOG_INFO, "Got SigHandlerio1");
 			#endif
 
+			/* Durable messages first, they have waited longest */
+			JournalTx(ttyFd);
+
 			/* Transmit all messages in queue, until we see a failure */
 			TX_Return = 1;
 			TX_Active = 0;
-			while(TX_Return > 0)
+			while(TX_Return > 0 && !StopRequested())
 			{
-					TX_Return = SerialTx(ttyFd, SERIAL_RX_LOG_FILENAME);
+					if(UringActive())
+						TX_Return = SerialTxBatch(ttyFd, mqd_tx);
+					else
+						TX_Return = SerialTx(ttyFd, SERIAL_RX_LOG_FILENAME);
 
 					#if DEBUG_LEVEL > 10
 						if(TX_Return>0)
@@ -901,49 +2960,123 @@ main(int argc, char *argv[])
 						TX_Active = 0;
 
 			}
-			if (mq_notify(mqd_tx, &sev)==-1)
-				{
-					syslog(LOG_INFO, "FAILURE: SerialDameon Main: mq_notify(inside loop)");
-					closelog();
-					errExit("SerialDameon Main: mq_notify(post sig suspend)");
-				}
+
+			/* Input that arrived while we were writing is read now, rather
+			 * than on another trip round the loop */
+			if(!TtyFailed)
+			{
+				Return = SerialRx(ttyFd, SERIAL_RX_LOG_FILENAME);
+				RxBatchUpdate(ttyFd);
+			}
+
+			/* Sets gotSigUsr1 again if more came in since the queue emptied */
+			if(!TtyFailed)
+				mqd_tx = RearmTxNotify(mqd_tx, &sev);
 
 		}
 
+		/* The first message held for aggregation has waited long enough */
+		if(gotTxHold)
+		{
+			gotTxHold = 0;
+			AggregateFlush(ttyFd);
+		}
+
+		/* Frames from socket clients go straight to the tty. While it's
+		 * down only new clients are taken, frames wait in the sockets */
+		if(gotSockIo)
+		{
+			gotSockIo = 0;
+			SocketService(ttyFd, TtyFailed ? NULL : SocketTxFrame, SocketKeepFrame, &SocketMore);
+
+			/* A busy client gets another batch after the other work */
+			if(SocketMore && !TtyFailed)
+				gotSockIo = 1;
+		}
+
+		/* A failure found above gets its first reopen attempt soon, not
+		 * at the next watchdog tick */
+		if(TtyFailed && !RecoveryScheduled)
+		{
+			ArmWatchdog(BackoffMs);
+			RecoveryScheduled = TRUE;
+		}
+
 	}
 
 	syslog(LOG_INFO, "Exiting Loop");
 
 	/* Close system log prior to exiting */
-	syslog(LOG_INFO, "Daemon Exiting, Restoring Original Settings");
+	syslog(LOG_INFO, "Daemon Exiting, Draining TX and Restoring Original Settings");
 
-	/* Restore original terminal settings */
-	if(tcsetattr(ttyFd, TCSAFLUSH, &OrigTermios)==-1)
+	ArmWatchdog(0);
+
+	if(RxBatchTimerOk)
+		timer_delete(RxBatchTimer);
+
+	/* Stop taking TX. Without the semaphore clients can't find us, what
+	 * they post from here on waits in the queue for the next Daemon */
+	if(sem_unlink(SERIAL_DAEMON_SEM)==-1)
+		syslog(LOG_INFO, "Failed to unlink semaphore");
+
+	mq_notify(mqd_tx, NULL);
+
+	/* Send what was queued before the signal, then let the tty finish
+	 * writing it, all within the drain time */
+	DrainDeadlineMs = MonotonicMs() + Config.DrainMs;
+
+	if(!TtyFailed)
 	{
-		syslog(LOG_INFO, "Failed to restore original terminal settings");
-		closelog();
-		errExit(" Couldn't restore original terminal settings ");
+		JournalTx(ttyFd);
+		TxUnsent = DrainTxQueue(ttyFd, mqd_tx, DrainDeadlineMs);
 	}
 
-	/* Close Serial Daemon Semaphore, which will make it very obvious that the Serial Daemon is not running */
-	if(sem_unlink(SERIAL_DAEMON_SEM)==-1)
+	if(JournalPending())
+		syslog(LOG_INFO, "Durable TX messages left in the journal for the next start");
+
+	if(TxUnsent > 0)
+		syslog(LOG_INFO, "%li TX messages left queued for the next start", TxUnsent);
+
+	/* Frames clients had already sent on the socket, in the same time */
+	while(!TtyFailed && MonotonicMs() < DrainDeadlineMs && SocketService(ttyFd, SocketTxFrame, SocketKeepFrame, &SocketMore) > 0)
+		;
+
+	SocketClose();
+
+	/* Kept on the TX queue if the tty is down */
+	AggregateFlush(ttyFd);
+
+	/* Restore original terminal settings */
+	if(!TtyFailed)
+		CloseTty(ttyFd, DrainDeadlineMs);
+	else if(ttyFd >= 0)
 	{
-		syslog(LOG_INFO, "Failed to unlink semaphore");
-		closelog();
-		errExit("SerialDaemon: Failed to close Semaphore");
+		UringDetachTty();
+		close(ttyFd);
 	}
 
-    if (mq_unlink(SERIAL_TX_QUEUE) == -1)
-        syslog(LOG_INFO, "Failed to unlink Serial Tx Queue");
+	UringClose();
 
-    if (mq_unlink(SERIAL_RX_QUEUE) == -1)
-        syslog(LOG_INFO, "Failed to unlink Serial Rx Queue");
+	/* The queues aren't unlinked, messages in them (TX not yet sent, RX
+	 * not yet read) are kept for the next Daemon and its clients */
+	mq_close(mqd_tx);
+	mq_close(mqd_rx);
+
+	LogDaemonStats();
+
+    RouteTableClose();
+    CaptureClose();
+    CacheClose();
+    JournalClose();
+
+    RxBufferRelease(&RxAccum);
+    PoolRelease(&FramePool);
+    PoolRelease(&PacketPool);
 
 	/* Close system log prior to exiting */
 	syslog(LOG_INFO, "Daemon Cleanup complete");
 
 	closelog();
-	exit(1);
+	exit(EXIT_SUCCESS);
 
 }
-
@@ -8,6 +8,8 @@
 #ifndef SERIALDAEMON_H_
 #define SERIALDAEMON_H_
 
+#include "typedef.h"
+
 #define SERIAL_DAEMON_SEM "/SerialDaemonSem"
 
 #define SERIAL_RX_LOG_FILENAME "SerialRXLog.txt"
@@ -18,8 +20,6 @@
 
 #define SERIAL_FILEPATH "/dev/ttyO4"
 //#define FILE_OUT_BUFF_SIZE_DAEMON	60
-#define MAX_READ_BYTES 		255
-#define MAX_RX_BUFF_SIZE 	1020
 
 /* Error Return Codes */
 #define SEM_OPEN_FAIL -1
@@ -42,6 +42,37 @@
 #define DAEMON_FAIL 		 -100
 
 
+/* Running counters kept by the daemon, written to the system
+ * log on SIGUSR2 */
+typedef struct SerialDaemonStats{
+		uint32_t	RxFrames;
+		uint32_t	RxSkippedBytes;		/* Junk discarded hunting for a header */
+		uint32_t	RxResyncs;			/* Times the junk above was found */
+		uint32_t	RxBadFrames;		/* Headers with bad fields, or frames cut short */
+		uint32_t	RxOverflowBytes;	/* Dropped because the RX buffer was full */
+		uint32_t	RxQueueDrops;		/* Old messages dropped from a full RX queue */
+		uint32_t	RxRouted;			/* Copies delivered to subscriber queues */
+		uint32_t	RxPasses;			/* SerialRx calls */
+		uint32_t	RxReads;			/* read() calls on the tty */
+		uint32_t	RxBatchWaits;		/* Times the batch timer was set for a part frame */
+		uint32_t	TxFrames;
+		uint32_t	TxWriteStalls;		/* Waits for room in the tty output buffer */
+		uint32_t	TxRequeued;			/* Frames put back on the TX queue when the tty failed */
+		uint32_t	TxExpired;			/* Dropped past their TTL, see Serial8051SendTtl */
+		uint32_t	TtyFailures;
+		uint32_t	TtyReopens;
+		uint32_t	QueueReopens;		/* Queue handles rebuilt, or queues recreated */
+		uint32_t	NotifyFailures;		/* mq_notify on the TX queue failed */
+		uint32_t	WatchdogKicks;		/* Work the watchdog found that no signal reported */
+	}SerialDaemonStats;
+
+/* Longest SerialTx waits for the tty to take the rest of a frame */
+#define TX_DRAIN_TIMEOUT_MS		2000
+
+/* Wait between attempts to reopen a failed tty, doubling each time */
+#define RECOVERY_BACKOFF_MIN_MS	100
+#define RECOVERY_BACKOFF_MAX_MS	5000
+
 /* Baud Rates of Serial Ports
  * Valid Baud Rates = B300, B2400, B9600, B38400
  * Don't forget the B in front!!! */
@@ -0,0 +1,259 @@
+/*
+ * SerialDelta.c
+ *
+ *  Delta coding of periodic messages, see SerialDelta.h for the format
+ */
+
+#include <string.h>
+#include <syslog.h>
+
+#include "tlpi_hdr.h"
+#include "SerialDelta.h"
+
+/* Flags a delta can't be combined with */
+#define DELTA_EXCLUDED_FLAGS	(MSG_FLAG_COMPRESSED | MSG_FLAG_MORE_FRAGMENTS | MSG_FLAG_FRAGMENT)
+
+typedef struct{
+	uint8_t		MsgID;
+	Boolean		Held;			/* Payload is the frame the next delta applies to */
+	Boolean		Requested;		/* A keyframe has been asked for since it was lost */
+	uint16_t	SeqCount;
+	int32_t		Length;
+	uint8_t		Payload[MAX_MSG_SIZE];
+}DeltaStream;
+
+typedef struct{
+	uint32_t RxKeyframes;
+	uint32_t RxDeltas;			/* Put back together */
+	uint32_t RxBytesSaved;		/* Line bytes, against whole frames */
+	uint32_t RxNoBase;			/* Dropped, the frame before was lost */
+	uint32_t RxCorrupt;
+	uint32_t KeyframeRequests;
+}DeltaCounters;
+
+static DeltaStream Streams[DELTA_MAX_STREAMS];
+static int32_t StreamCount;
+
+/* Streams index + 1 for each MsgID, 0 if it isn't a stream */
+static uint8_t StreamIndex[256];
+
+static DeltaCounters Counters;
+
+
+int32_t
+DeltaEncode(const uint8_t *Base, const uint8_t *Raw, int32_t Length, uint16_t BaseSeq, uint8_t *DeltaOut, int32_t OutSize ){
+
+	int32_t InIndex = 0, OutIndex = DELTA_HEADER_LENGTH, Start, End;
+
+	if(OutSize < DELTA_HEADER_LENGTH)
+		return DELTA_NO_GAIN;
+
+	DeltaOut[0] = (uint8_t)BaseSeq;
+	DeltaOut[1] = (uint8_t)(BaseSeq >> 8);
+
+	for( ;; )
+	{
+		while(InIndex < Length && Base[InIndex] == Raw[InIndex])
+			InIndex++;
+
+		if(InIndex == Length)
+			return OutIndex;
+
+		/* A range runs on over a gap shorter than a range header */
+		Start = InIndex;
+		End = ++InIndex;
+
+		while(InIndex < Length && InIndex - Start < DELTA_RANGE_MAX)
+		{
+			if(Base[InIndex] != Raw[InIndex])
+				End = InIndex + 1;
+			else if(InIndex - End >= DELTA_RANGE_HEADER)
+				break;
+
+			InIndex++;
+		}
+
+		if(OutIndex + DELTA_RANGE_HEADER + (End - Start) > OutSize)
+			return DELTA_NO_GAIN;
+
+		DeltaOut[OutIndex++] = (uint8_t)Start;
+		DeltaOut[OutIndex++] = (uint8_t)(Start >> 8);
+		DeltaOut[OutIndex++] = (uint8_t)(End - Start);
+		memcpy(&DeltaOut[OutIndex], &Raw[Start], (size_t)(End - Start));
+		OutIndex += End - Start;
+
+		InIndex = End;
+	}
+}
+
+int32_t
+DeltaApply(const uint8_t *DeltaIn, int32_t Length, uint8_t *RawInOut, int32_t RawLength ){
+
+	int32_t Index, Offset, Count, Pass;
+
+	if(Length < DELTA_HEADER_LENGTH)
+		return DELTA_CORRUPT;
+
+	/* Checked all the way through first, a bad delta leaves the payload alone */
+	for(Pass = 0; Pass < 2; Pass++)
+	{
+		Index = DELTA_HEADER_LENGTH;
+
+		while(Index < Length)
+		{
+			if(Index + DELTA_RANGE_HEADER > Length)
+				return DELTA_CORRUPT;
+
+			Offset = DeltaIn[Index] | DeltaIn[Index + 1] << 8;
+			Count = DeltaIn[Index + 2];
+			Index += DELTA_RANGE_HEADER;
+
+			if(Count == 0 || Index + Count > Length || Offset + Count > RawLength)
+				return DELTA_CORRUPT;
+
+			if(Pass == 1)
+				memcpy(&RawInOut[Offset], &DeltaIn[Index], (size_t)Count);
+
+			Index += Count;
+		}
+	}
+
+	return 1;
+}
+
+int32_t
+DeltaConfigure(const uint32_t *IdSet ){
+
+	int32_t MsgID;
+
+	memset(StreamIndex, 0, sizeof(StreamIndex));
+	StreamCount = 0;
+
+	for(MsgID = 0; MsgID < 256; MsgID++)
+	{
+		if(!(IdSet[MsgID / 32] & (1U << (MsgID % 32))))
+			continue;
+
+		if(StreamCount == DELTA_MAX_STREAMS)
+		{
+			memset(StreamIndex, 0, sizeof(StreamIndex));
+			StreamCount = 0;
+			return DELTA_TOO_MANY;
+		}
+
+		Streams[StreamCount].MsgID = (uint8_t)MsgID;
+		Streams[StreamCount].Held = FALSE;
+		Streams[StreamCount].Requested = FALSE;
+		StreamIndex[MsgID] = (uint8_t)(++StreamCount);
+	}
+
+	return StreamCount;
+}
+
+Boolean
+DeltaIsStream(uint8_t MsgID ){
+
+	return (StreamIndex[MsgID] != 0) ? TRUE : FALSE;
+}
+
+int32_t
+DeltaRx(const ARM_char_t *Frame, const RxMsgInfo *Info, ARM_char_t *Out, RxMsgInfo *OutInfo ){
+
+	uint8_t Delta[MAX_MSG_SIZE];
+	DeltaStream *Stream;
+	PacketHdr Hdr;
+	int32_t Length;
+
+	/* With streams set up the flag is the link's, a delta for any other
+	 * MsgID has nothing to apply to */
+	if(StreamIndex[Info->MsgID] == 0)
+	{
+		if(StreamCount > 0 && (Info->MsgFlags & MSG_FLAG_DELTA))
+		{
+			Counters.RxCorrupt++;
+			return DELTA_CORRUPT;
+		}
+
+		return 0;
+	}
+
+	Stream = &Streams[StreamIndex[Info->MsgID] - 1];
+
+	/* A keyframe, or a frame that ends the chain */
+	if(!(Info->MsgFlags & MSG_FLAG_DELTA))
+	{
+		Stream->Held = FALSE;
+
+		if(!(Info->MsgFlags & DELTA_EXCLUDED_FLAGS) && Info->MsgLength <= MAX_MSG_SIZE)
+		{
+			ASCIIHexToBytes((ARM_char_t *)&Frame[MSG_HEADER_LENGTH], Stream->Payload, 2*Info->MsgLength);
+			Stream->Length = Info->MsgLength;
+			Stream->SeqCount = Info->SeqCount;
+			Stream->Held = TRUE;
+			Stream->Requested = FALSE;
+			Counters.RxKeyframes++;
+		}
+
+		return 0;
+	}
+
+	if(Info->MsgLength > MAX_MSG_SIZE || (Info->MsgFlags & DELTA_EXCLUDED_FLAGS))
+		Length = DELTA_CORRUPT;
+	else
+	{
+		ASCIIHexToBytes((ARM_char_t *)&Frame[MSG_HEADER_LENGTH], Delta, 2*Info->MsgLength);
+		Length = Info->MsgLength;
+	}
+
+	if(Length < DELTA_HEADER_LENGTH)
+		Length = DELTA_CORRUPT;
+	else if(!Stream->Held || (uint16_t)(Delta[0] | Delta[1] << 8) != Stream->SeqCount)
+		Length = DELTA_NO_BASE;
+	else
+		Length = DeltaApply(Delta, Length, Stream->Payload, Stream->Length);
+
+	/* Dropped, nothing more applies until a keyframe. Asked for once */
+	if(Length < 0)
+	{
+		if(Length == DELTA_CORRUPT)
+			Counters.RxCorrupt++;
+		else
+			Counters.RxNoBase++;
+
+		Stream->Held = FALSE;
+
+		if(Stream->Requested)
+			return DELTA_NO_BASE;
+
+		Stream->Requested = TRUE;
+		Counters.KeyframeRequests++;
+		return DELTA_NEED_KEYFRAME;
+	}
+
+	Stream->SeqCount = Info->SeqCount;
+
+	*OutInfo = *Info;
+	OutInfo->MsgFlags &= ~MSG_FLAG_DELTA;
+	OutInfo->MsgLength = (uint16_t)Stream->Length;
+
+	BuildPacketHdr(Stream->Length, OutInfo->MsgID, OutInfo->MsgFlags, OutInfo->SeqCount, &Hdr);
+	memcpy(Out, &Hdr, MSG_HEADER_LENGTH);
+	BytesToASCIIHex(Stream->Payload, (uint8_t *)&Out[MSG_HEADER_LENGTH], Stream->Length);
+
+	Length = PACKET_FRAME_LENGTH(Stream->Length);
+	Out[Length - 1] = '\n';
+
+	Counters.RxDeltas++;
+	Counters.RxBytesSaved += Length - PACKET_FRAME_LENGTH(Info->MsgLength);
+
+	return Length;
+}
+
+void
+DeltaLogStats(void){
+
+	syslog(LOG_INFO, "Delta: Streams %i, RxKeyframes %u, RxDeltas %u, RxBytesSaved %u, "
+			"RxNoBase %u, RxCorrupt %u, KeyframeRequests %u", StreamCount, Counters.RxKeyframes,
+			Counters.RxDeltas, Counters.RxBytesSaved, Counters.RxNoBase, Counters.RxCorrupt,
+			Counters.KeyframeRequests);
+}
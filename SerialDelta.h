@@ -0,0 +1,126 @@
+/*
+ * SerialDelta.h
+ *
+ *  Delta coding of periodic messages from the MCU (-x). Status structs
+ *  go out every cycle with only a few bytes changed. For a MsgID that
+ *  is a delta stream the MCU sends, in place of the whole payload, the
+ *  byte ranges that changed since the frame before, flagged
+ *  MSG_FLAG_DELTA. The Daemon puts the whole payload back together
+ *  before the frame goes to clients and the cache, which never see a
+ *  delta.
+ *
+ *  Delta payload:
+ *   2 bytes  SeqCount of the frame it applies to, little endian
+ *   ranges:
+ *    2 bytes  offset, little endian
+ *    1 byte   count, 1 - 255
+ *    count bytes to put at offset
+ *  The message is as long as the one it applies to, a frame with no
+ *  ranges repeats it. Any frame of the MsgID without MSG_FLAG_DELTA is
+ *  a keyframe, sent whole, and what the next delta applies to.
+ *
+ *  Nothing on the link is acknowledged, so the MCU codes each frame
+ *  against the one it sent before and sends a keyframe every so often
+ *  (DELTA_KEYFRAME_INTERVAL), when the length changes and when the
+ *  Daemon asks for one. A delta that doesn't apply to the frame the
+ *  Daemon has, because one was lost, is dropped, and the Daemon asks
+ *  for a keyframe: a frame to the MCU with that MsgID, MSG_FLAG_DELTA
+ *  and no payload. Compressed frames and fragments aren't delta coded,
+ *  either one ends the chain until the next keyframe.
+ *
+ *  MSG_FLAG_DELTA is the link's only while -x names a stream, the
+ *  Daemon then clears it from what clients send. Without -x it is an
+ *  application flag like the others.
+ */
+
+#ifndef SERIALDELTA_H_
+#define SERIALDELTA_H_
+
+#include "typedef.h"
+#include "SerialMsgUtils.h"
+
+#define DELTA_HEADER_LENGTH		2
+#define DELTA_RANGE_HEADER		3
+#define DELTA_RANGE_MAX			255
+
+/* MsgIDs that can be delta streams at once */
+#define DELTA_MAX_STREAMS		16
+
+/* A bit per MsgID, for DeltaConfigure */
+#define DELTA_ID_WORDS			(256/32)
+
+/* MCU side, frames between keyframes */
+#define DELTA_KEYFRAME_INTERVAL	32
+
+/* Error Return Codes */
+#define DELTA_NO_GAIN			-1		/* No smaller than the whole payload */
+#define DELTA_NO_BASE			-2		/* Doesn't apply to the frame held */
+#define DELTA_NEED_KEYFRAME		-3		/* DELTA_NO_BASE, the first since the last keyframe */
+#define DELTA_CORRUPT			-4
+#define DELTA_TOO_MANY			-5		/* More than DELTA_MAX_STREAMS */
+
+
+/* Code a payload against the one before it
+ *
+ *  INPUTS:
+ *  Base - The payload sent before, Length bytes too
+ *  Raw - Payload to code
+ *  BaseSeq - SeqCount Base went out with
+ *  DeltaOut - Output buffer
+ *  OutSize - Give up once the output would pass this many bytes, pass
+ *  	Length - 1 to only accept output that is smaller than the input
+ *
+ *  RETURNS:
+ *  Bytes in DeltaOut if sucessful, DELTA_NO_GAIN if the output would
+ *  not fit in OutSize
+*/
+int32_t
+DeltaEncode(const uint8_t *Base, const uint8_t *Raw, int32_t Length, uint16_t BaseSeq, uint8_t *DeltaOut, int32_t OutSize );
+
+/* Reverse of DeltaEncode, RawInOut holds the base going in and the
+ * payload coming out
+ *
+ *  RETURNS:
+ *  1 if sucessful, DELTA_CORRUPT if a range is out of bounds
+*/
+int32_t
+DeltaApply(const uint8_t *DeltaIn, int32_t Length, uint8_t *RawInOut, int32_t RawLength );
+
+/* Set the MsgIDs that are delta streams and forget every frame held
+ *
+ *  INPUTS:
+ *  IdSet - DELTA_ID_WORDS words, bit (MsgID % 32) of word (MsgID / 32)
+ *
+ *  RETURNS:
+ *  Streams set up, DELTA_TOO_MANY if there are too many, none are then
+*/
+int32_t
+DeltaConfigure(const uint32_t *IdSet );
+
+/* TRUE if the MsgID is a delta stream */
+Boolean
+DeltaIsStream(uint8_t MsgID );
+
+/* Pass a received frame through the decoder. Frames of a delta stream
+ * are kept to apply the next delta to
+ *
+ *  INPUTS:
+ *  Frame - The whole frame, as it came off the line
+ *  Info - Its header, from ProcessPacket
+ *  Out - PACKET_FRAME_LENGTH(MAX_MSG_SIZE) bytes, the frame rebuilt
+ *  OutInfo - Filled in with the rebuilt frame's header
+ *
+ *  RETURNS:
+ *  0 if the frame goes on as it is, bytes in Out for a delta put back
+ *  together, DELTA_NEED_KEYFRAME, DELTA_NO_BASE or DELTA_CORRUPT for a
+ *  delta that has to be dropped, DELTA_CORRUPT too for a delta whose
+ *  MsgID isn't a stream
+*/
+int32_t
+DeltaRx(const ARM_char_t *Frame, const RxMsgInfo *Info, ARM_char_t *Out, RxMsgInfo *OutInfo );
+
+/* Write the counters to the system log */
+void
+DeltaLogStats(void);
+
+#endif /* SERIALDELTA_H_ */
@@ -0,0 +1,185 @@
+/*
+ * SerialFragment.c
+ *
+ *  Reassembly of fragmented messages, see SerialFragment.h
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "tlpi_hdr.h"
+#include "SerialFragment.h"
+
+#define FRAGMENT_FLAGS		(MSG_FLAG_MORE_FRAGMENTS | MSG_FLAG_FRAGMENT)
+
+typedef struct ReassemblySlot{
+		Boolean		InUse;
+		uint8_t		MsgID;
+		uint8_t		MsgFlags;		/* From the first fragment */
+		uint16_t	FirstSeq;
+		uint16_t	NextSeq;		/* SeqCount the next fragment has to carry */
+		int32_t		Length;			/* Bytes collected so far */
+		int64_t		LastFragmentMs;
+		uint8_t		*Data;			/* MAX_FRAGMENTED_MSG_SIZE, kept between messages */
+	}ReassemblySlot;
+
+static ReassemblySlot Slots[REASSEMBLY_SLOTS];
+static SerialFragmentStats FragmentStats;
+
+
+static int64_t
+MonotonicMs(void){
+
+	struct timespec Now;
+
+	clock_gettime(CLOCK_MONOTONIC, &Now);
+
+	return (int64_t)Now.tv_sec*1000 + Now.tv_nsec/1000000;
+}
+
+/* Give up on a partly reassembled message */
+static void
+AbandonSlot(ReassemblySlot *Slot ){
+
+	Slot->InUse = FALSE;
+	FragmentStats.ReassemblyTimeouts++;
+}
+
+/* Drop messages whose next fragment is overdue, the sender has either
+ * gone away or a fragment was lost on the line */
+static void
+ExpireSlots(int64_t NowMs ){
+
+	int32_t i;
+
+	for(i = 0; i < REASSEMBLY_SLOTS; i++){
+		if(Slots[i].InUse && NowMs - Slots[i].LastFragmentMs > REASSEMBLY_TIMEOUT_MS)
+			AbandonSlot(&Slots[i]);
+	}
+}
+
+/* Slot already holding MsgID, NULL if there isn't one */
+static ReassemblySlot *
+FindSlot(uint8_t MsgID ){
+
+	int32_t i;
+
+	for(i = 0; i < REASSEMBLY_SLOTS; i++){
+		if(Slots[i].InUse && Slots[i].MsgID == MsgID)
+			return &Slots[i];
+	}
+
+	return NULL;
+}
+
+/* Slot for a new message, the one idle the longest is evicted if all
+ * of them are busy */
+static ReassemblySlot *
+ClaimSlot(void){
+
+	int32_t i;
+	ReassemblySlot *Oldest = &Slots[0];
+
+	for(i = 0; i < REASSEMBLY_SLOTS; i++){
+		if(!Slots[i].InUse)
+			return &Slots[i];
+
+		if(Slots[i].LastFragmentMs < Oldest->LastFragmentMs)
+			Oldest = &Slots[i];
+	}
+
+	AbandonSlot(Oldest);
+
+	return Oldest;
+}
+
+int32_t
+FragmentReassemble(const RxMsgView *Fragment, uint8_t *MsgOut, int32_t OutSize, RxMsgInfo *MsgInfo ){
+
+	ReassemblySlot *Slot;
+	int64_t NowMs = MonotonicMs();
+	uint8_t Flags = Fragment->Info.MsgFlags;
+
+	ExpireSlots(NowMs);
+
+	Slot = FindSlot(Fragment->Info.MsgID);
+
+	if(!(Flags & MSG_FLAG_FRAGMENT)){
+		/* First fragment, anything still collected under this MsgID
+		 * lost its tail */
+		if(Slot != NULL)
+			AbandonSlot(Slot);
+		else
+			Slot = ClaimSlot();
+
+		if(Slot->Data == NULL){
+			Slot->Data = (uint8_t *)malloc(MAX_FRAGMENTED_MSG_SIZE);
+
+			if(Slot->Data == NULL){
+				FragmentStats.FragmentsDropped++;
+				return FRAGMENT_ALLOCATE_FAIL;
+			}
+		}
+
+		Slot->InUse = TRUE;
+		Slot->MsgID = Fragment->Info.MsgID;
+		Slot->MsgFlags = Flags & ~(FRAGMENT_FLAGS | MSG_FLAG_COMPRESSED);
+		Slot->FirstSeq = Fragment->Info.SeqCount;
+		Slot->Length = 0;
+	}
+	else if(Slot == NULL || Slot->NextSeq != Fragment->Info.SeqCount){
+		/* Nothing to attach to, or one in between went missing, in
+		 * which case the message can't be completed either */
+		if(Slot != NULL)
+			AbandonSlot(Slot);
+
+		FragmentStats.FragmentsDropped++;
+		return FRAGMENT_OUT_OF_ORDER;
+	}
+
+	if(Slot->Length + Fragment->Length > MAX_FRAGMENTED_MSG_SIZE){
+		AbandonSlot(Slot);
+		FragmentStats.FragmentsDropped++;
+		return FRAGMENT_TOO_LARGE;
+	}
+
+	memcpy(&Slot->Data[Slot->Length], Fragment->Data, (size_t)Fragment->Length);
+	Slot->Length += Fragment->Length;
+	Slot->NextSeq = (uint16_t)(Fragment->Info.SeqCount + 1);
+	Slot->LastFragmentMs = NowMs;
+
+	if(Flags & MSG_FLAG_MORE_FRAGMENTS)
+		return FRAGMENT_PENDING;
+
+	/* Last one in, hand the whole message over */
+	Slot->InUse = FALSE;
+
+	if(Slot->Length > OutSize){
+		FragmentStats.MsgsTooLarge++;
+		return FRAGMENT_TOO_LARGE;
+	}
+
+	memcpy(MsgOut, Slot->Data, (size_t)Slot->Length);
+
+	MsgInfo->MsgID = Slot->MsgID;
+	MsgInfo->MsgLength = (uint16_t)Slot->Length;
+	MsgInfo->MsgFlags = Slot->MsgFlags;
+	MsgInfo->SeqCount = Slot->FirstSeq;
+
+	FragmentStats.MsgsReassembled++;
+
+	return Slot->Length;
+}
+
+void
+FragmentGetStats(SerialFragmentStats *Stats ){
+	*Stats = FragmentStats;
+}
+
+void
+FragmentCountSent(int32_t Fragments ){
+
+	FragmentStats.MsgsFragmented++;
+	FragmentStats.FragmentsSent += (uint32_t)Fragments;
+}
@@ -0,0 +1,75 @@
+/*
+ * SerialFragment.h
+ *
+ *  Reassembly of messages too large for a single frame. The sender
+ *  (Serial8051Send) splits such a message into frames with consecutive
+ *  SeqCounts:
+ *   first   MSG_FLAG_MORE_FRAGMENTS
+ *   middle  MSG_FLAG_MORE_FRAGMENTS | MSG_FLAG_FRAGMENT
+ *   last    MSG_FLAG_FRAGMENT
+ *  all sharing the MsgID. The receiver collects them here in a small
+ *  table, one slot per message in flight, keyed by MsgID and the
+ *  SeqCount of the next expected fragment.
+ */
+
+#ifndef SERIALFRAGMENT_H_
+#define SERIALFRAGMENT_H_
+
+#include "typedef.h"
+#include "SerialMsgUtils.h"
+
+/* Largest message that will be fragmented / reassembled, it has to
+ * fit in RxMsgInfo's MsgLength */
+#define MAX_FRAGMENTED_MSG_SIZE		16384
+
+/* Messages that can be part way through reassembly at once */
+#define REASSEMBLY_SLOTS			4
+
+/* A partly reassembled message is dropped when no fragment has arrived
+ * for it in this long */
+#define REASSEMBLY_TIMEOUT_MS		2000
+
+/* FragmentReassemble return codes */
+#define FRAGMENT_PENDING			0
+#define FRAGMENT_OUT_OF_ORDER		-1
+#define FRAGMENT_TOO_LARGE			-2
+#define FRAGMENT_ALLOCATE_FAIL		-3
+
+/* Running totals, for both ends of the link */
+typedef struct SerialFragmentStats{
+		uint32_t	MsgsFragmented;		/* Messages split up by the sender */
+		uint32_t	FragmentsSent;
+		uint32_t	MsgsReassembled;
+		uint32_t	FragmentsDropped;	/* Out of order, or no message to attach to */
+		uint32_t	ReassemblyTimeouts;	/* Messages given up on, timed out or evicted */
+		uint32_t	MsgsTooLarge;		/* Complete, but bigger than MsgOut, lost */
+	}SerialFragmentStats;
+
+
+/* Add a received fragment to its message
+ *
+ *  INPUTS:
+ *  Fragment - Decoded (and expanded) frame with one of the fragment
+ *  	flags set
+ *  MsgOut - Where the complete message is copied
+ *  OutSize - Size of MsgOut
+ *  MsgInfo - Filled in for the complete message, SeqCount is that of
+ *  	the first fragment and the fragment flags are cleared
+ *
+ *  RETURNS:
+ *  Bytes in MsgOut once the last fragment is in, FRAGMENT_PENDING while
+ *  more are needed, or a negative error code if the fragment was dropped.
+ *  FRAGMENT_TOO_LARGE too when the message is complete but more than
+ *  OutSize, it is dropped then and can't be had again
+*/
+int32_t
+FragmentReassemble(const RxMsgView *Fragment, uint8_t *MsgOut, int32_t OutSize, RxMsgInfo *MsgInfo );
+
+/* Copy out the totals, and count fragments sent from Serial8051Send */
+void
+FragmentGetStats(SerialFragmentStats *Stats );
+
+void
+FragmentCountSent(int32_t Fragments );
+
+#endif /* SERIALFRAGMENT_H_ */
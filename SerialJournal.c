@@ -0,0 +1,422 @@
+/*
+ * SerialJournal.c
+ *
+ *  Durable TX queue, see SerialJournal.h
+ */
+
+#include <fcntl.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "tlpi_hdr.h"
+#include "SerialJournal.h"
+
+typedef struct{
+	uint32_t Replayed;			/* Found unsent at the start */
+	uint32_t Sent;
+	uint32_t Checkpoints;
+	uint32_t Dropped;			/* Records that failed their Check */
+}JournalCounters;
+
+static SerialJournalHeader *Header = NULL;
+static uint8_t *Ring;
+static size_t MapBytes;
+static int JournalFd = -1;
+
+/* Sender, between JournalBegin and JournalEnd */
+static Boolean Appending = FALSE;
+static uint32_t AppendTail;
+static uint32_t AppendCount;
+
+/* Daemon, the record to send next and its size once read */
+static Boolean Recovered = FALSE;
+static uint32_t Next;
+static uint32_t NextBytes;
+
+static JournalCounters Counters;
+
+
+/* Wait for a lock on one byte of the file, Type F_WRLCK or F_UNLCK */
+static int32_t
+JournalLock(off_t Byte, short Type ){
+
+	struct flock Lock;
+
+	memset(&Lock, 0, sizeof(Lock));
+	Lock.l_type = Type;
+	Lock.l_whence = SEEK_SET;
+	Lock.l_start = Byte;
+	Lock.l_len = 1;
+
+	while(fcntl(JournalFd, F_SETLKW, &Lock) == -1)
+	{
+		if(errno != EINTR)
+			return -1;
+	}
+
+	return 1;
+}
+
+/* FNV-1a over where a record is, its length and its frame. A record
+ * left from the ring's last time round fails at its new offset */
+static uint32_t
+RecordCheck(uint32_t Offset, const ARM_char_t *Frame, int32_t Length ){
+
+	uint32_t Hash = 2166136261U;
+	int32_t i;
+
+	for(i = 0; i < 4; i++)
+		Hash = (Hash ^ (uint8_t)(Offset >> (8*i))) * 16777619U;
+
+	Hash = (Hash ^ (uint8_t)Length) * 16777619U;
+	Hash = (Hash ^ (uint8_t)(Length >> 8)) * 16777619U;
+
+	for(i = 0; i < Length; i++)
+		Hash = (Hash ^ (uint8_t)Frame[i]) * 16777619U;
+
+	return Hash;
+}
+
+/* Copy to and from the ring, across its end if need be */
+static void
+RingWrite(uint32_t Offset, const void *Src, uint32_t Length ){
+
+	uint32_t Pos = Offset & (Header->DataSize - 1);
+	uint32_t First = (Length < Header->DataSize - Pos) ? Length : Header->DataSize - Pos;
+
+	memcpy(&Ring[Pos], Src, First);
+	memcpy(Ring, (const uint8_t *)Src + First, Length - First);
+}
+
+static void
+RingRead(uint32_t Offset, void *Dst, uint32_t Length ){
+
+	uint32_t Pos = Offset & (Header->DataSize - 1);
+	uint32_t First = (Length < Header->DataSize - Pos) ? Length : Header->DataSize - Pos;
+
+	memcpy(Dst, &Ring[Pos], First);
+	memcpy((uint8_t *)Dst + First, Ring, Length - First);
+}
+
+/* Copy out the record at Offset if its Check holds
+ *
+ *  RETURNS:
+ *  Bytes in Frame, 0 if there is no good record there
+*/
+static int32_t
+ReadRecord(uint32_t Offset, ARM_char_t *Frame ){
+
+	JournalRecordHdr Rec;
+
+	RingRead(Offset, &Rec, sizeof(Rec));
+
+	if(Rec.Marker != JOURNAL_RECORD_MARKER || Rec.Length == 0 ||
+			Rec.Length > PACKET_FRAME_LENGTH(MAX_MSG_SIZE))
+		return 0;
+
+	RingRead(Offset + sizeof(Rec), Frame, Rec.Length);
+
+	if(RecordCheck(Offset, Frame, Rec.Length) != Rec.Check)
+		return 0;
+
+	return Rec.Length;
+}
+
+int32_t
+JournalOpen(const char *Path ){
+
+	struct stat Stat;
+	size_t Bytes = JOURNAL_DATA_OFFSET + JOURNAL_DEFAULT_BYTES;
+	SerialJournalHeader *Map = MAP_FAILED;
+	mode_t Perms = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH;
+
+	if(Header != NULL)
+		return 1;
+
+	JournalFd = open(Path, O_RDWR | O_CREAT | O_CLOEXEC, Perms);
+	if(JournalFd == -1)
+		return JOURNAL_OPEN_FAIL;
+
+	/* Whoever finds it new sets it up, the others wait on the lock */
+	if(JournalLock(JOURNAL_LOCK_APPEND, F_WRLCK) < 0 || fstat(JournalFd, &Stat) == -1)
+		goto Fail;
+
+	if(Stat.st_size > (off_t)Bytes)
+		Bytes = (size_t)Stat.st_size;
+	else if(Stat.st_size < (off_t)Bytes && ftruncate(JournalFd, (off_t)Bytes) == -1)
+		goto Fail;
+
+	Map = mmap(NULL, Bytes, PROT_READ | PROT_WRITE, MAP_SHARED, JournalFd, 0);
+	if(Map == MAP_FAILED)
+		goto Fail;
+
+	if(__atomic_load_n(&Map->Magic, __ATOMIC_ACQUIRE) != JOURNAL_MAGIC || Map->Version != JOURNAL_VERSION ||
+			Map->DataSize == 0 || (Map->DataSize & (Map->DataSize - 1)) != 0 ||
+			Map->DataSize > Bytes - JOURNAL_DATA_OFFSET)
+	{
+		if(Stat.st_size > 0)
+			syslog(LOG_INFO, "Journal: %s isn't a journal this library knows, started again", Path);
+
+		memset(Map, 0, Bytes);
+		Map->Version = JOURNAL_VERSION;
+		Map->DataSize = JOURNAL_DEFAULT_BYTES;
+		__atomic_store_n(&Map->Magic, JOURNAL_MAGIC, __ATOMIC_RELEASE);
+
+		/* The umask took some of these off */
+		fchmod(JournalFd, Perms);
+
+		if(msync(Map, Bytes, MS_SYNC) == -1)
+			goto Fail;
+	}
+
+	JournalLock(JOURNAL_LOCK_APPEND, F_UNLCK);
+
+	Header = Map;
+	Ring = (uint8_t *)Map + JOURNAL_DATA_OFFSET;
+	MapBytes = Bytes;
+
+	return 1;
+
+Fail:
+	syslog(LOG_INFO, "Journal: %s can't be opened, error %s", Path, strerror(errno));
+
+	if(Map != MAP_FAILED)
+		munmap(Map, Bytes);
+
+	close(JournalFd);
+	JournalFd = -1;
+
+	return JOURNAL_OPEN_FAIL;
+}
+
+void
+JournalClose(void){
+
+	if(Header == NULL)
+		return;
+
+	if(Recovered)
+		JournalCheckpoint();
+
+	munmap(Header, MapBytes);
+	close(JournalFd);
+
+	Header = NULL;
+	JournalFd = -1;
+	Recovered = FALSE;
+}
+
+int32_t
+JournalBegin(void){
+
+	if(Header == NULL)
+		return JOURNAL_NOT_OPEN;
+
+	if(JournalLock(JOURNAL_LOCK_APPEND, F_WRLCK) < 0)
+		return JOURNAL_OPEN_FAIL;
+
+	AppendTail = Header->Tail;
+	AppendCount = 0;
+	Appending = TRUE;
+
+	return 1;
+}
+
+int32_t
+JournalAppend(const ARM_char_t *Frame, int32_t Length ){
+
+	JournalRecordHdr Rec;
+	uint32_t Need;
+
+	if(!Appending)
+		return JOURNAL_NOT_OPEN;
+
+	if(Length <= 0 || Length > PACKET_FRAME_LENGTH(MAX_MSG_SIZE))
+		return JOURNAL_BAD_FRAME;
+
+	Need = JOURNAL_RECORD_BYTES(Length);
+
+	/* Only space a checkpoint on disk has freed */
+	if(AppendTail + Need - __atomic_load_n(&Header->Reusable, __ATOMIC_ACQUIRE) > Header->DataSize)
+		return JOURNAL_FULL;
+
+	Rec.Check = RecordCheck(AppendTail, Frame, Length);
+	Rec.Length = (uint16_t)Length;
+	Rec.Marker = JOURNAL_RECORD_MARKER;
+
+	RingWrite(AppendTail, &Rec, sizeof(Rec));
+	RingWrite(AppendTail + sizeof(Rec), Frame, (uint32_t)Length);
+
+	AppendTail += Need;
+	AppendCount++;
+
+	return 1;
+}
+
+uint32_t
+JournalEnd(Boolean Keep ){
+
+	uint32_t End;
+
+	if(!Appending)
+		return 0;
+
+	/* The Daemon reads up to Tail, the records are all there first */
+	if(Keep && AppendCount > 0)
+	{
+		__atomic_add_fetch(&Header->Appended, AppendCount, __ATOMIC_RELAXED);
+		__atomic_store_n(&Header->Tail, AppendTail, __ATOMIC_RELEASE);
+	}
+
+	End = Header->Tail;
+	Appending = FALSE;
+
+	JournalLock(JOURNAL_LOCK_APPEND, F_UNLCK);
+
+	return End;
+}
+
+int32_t
+JournalSync(uint32_t End ){
+
+	uint32_t Target;
+	int32_t Return = 1;
+
+	if(Header == NULL)
+		return JOURNAL_NOT_OPEN;
+
+	if((int32_t)(__atomic_load_n(&Header->Synced, __ATOMIC_ACQUIRE) - End) >= 0)
+		return 1;
+
+	if(JournalLock(JOURNAL_LOCK_SYNC, F_WRLCK) < 0)
+		return JOURNAL_SYNC_FAIL;
+
+	/* The sync before may have taken these records along while we waited */
+	if((int32_t)(Header->Synced - End) < 0)
+	{
+		Target = __atomic_load_n(&Header->Tail, __ATOMIC_ACQUIRE);
+
+		if(msync(Header, MapBytes, MS_SYNC) == -1)
+			Return = JOURNAL_SYNC_FAIL;
+		else
+		{
+			__atomic_store_n(&Header->Synced, Target, __ATOMIC_RELEASE);
+			__atomic_add_fetch(&Header->Syncs, 1, __ATOMIC_RELAXED);
+		}
+	}
+
+	JournalLock(JOURNAL_LOCK_SYNC, F_UNLCK);
+
+	return Return;
+}
+
+int32_t
+JournalRecover(void){
+
+	static ARM_char_t Frame[PACKET_FRAME_LENGTH(MAX_MSG_SIZE)];
+	uint32_t Offset;
+	int32_t Length, Count = 0;
+
+	if(Header == NULL || JournalLock(JOURNAL_LOCK_APPEND, F_WRLCK) < 0)
+		return 0;
+
+	/* Tail may be ahead of records a power cut didn't let reach the
+	 * disk, the good ones from the checkpoint on are what's pending */
+	Offset = Header->Consumed;
+
+	while(Offset - Header->Consumed < Header->DataSize)
+	{
+		Length = ReadRecord(Offset, Frame);
+		if(Length == 0)
+			break;
+
+		Offset += JOURNAL_RECORD_BYTES(Length);
+		Count++;
+	}
+
+	if(Offset != Header->Tail)
+		syslog(LOG_INFO, "Journal: %u bytes past the last good record dropped", Header->Tail - Offset);
+
+	Header->Tail = Offset;
+	Header->Synced = Offset;
+	__atomic_store_n(&Header->Reusable, Header->Consumed, __ATOMIC_RELEASE);
+
+	JournalLock(JOURNAL_LOCK_APPEND, F_UNLCK);
+
+	Next = Header->Consumed;
+	NextBytes = 0;
+	Recovered = TRUE;
+	Counters.Replayed = (uint32_t)Count;
+
+	return Count;
+}
+
+Boolean
+JournalPending(void){
+
+	return (Recovered && Next != __atomic_load_n(&Header->Tail, __ATOMIC_ACQUIRE)) ? TRUE : FALSE;
+}
+
+int32_t
+JournalNext(ARM_char_t *Frame ){
+
+	int32_t Length;
+
+	if(!JournalPending())
+		return 0;
+
+	Length = ReadRecord(Next, Frame);
+
+	/* Overwritten under us, nothing after it can be trusted either */
+	if(Length == 0)
+	{
+		syslog(LOG_INFO, "Journal: bad record at %u, %u bytes dropped", Next, Header->Tail - Next);
+		Counters.Dropped++;
+		Next = __atomic_load_n(&Header->Tail, __ATOMIC_ACQUIRE);
+		return 0;
+	}
+
+	NextBytes = JOURNAL_RECORD_BYTES(Length);
+
+	return Length;
+}
+
+void
+JournalConsume(void){
+
+	Next += NextBytes;
+	NextBytes = 0;
+	Counters.Sent++;
+}
+
+int32_t
+JournalCheckpoint(void){
+
+	if(!Recovered || Header->Consumed == Next)
+		return 1;
+
+	Header->Consumed = Next;
+
+	if(msync(Header, JOURNAL_DATA_OFFSET, MS_SYNC) == -1)
+		return JOURNAL_SYNC_FAIL;
+
+	/* Senders may write over what it freed now it's on disk */
+	__atomic_store_n(&Header->Reusable, Next, __ATOMIC_RELEASE);
+	Counters.Checkpoints++;
+
+	return 1;
+}
+
+void
+JournalLogStats(void){
+
+	if(Header == NULL)
+		return;
+
+	syslog(LOG_INFO, "Journal: PendingBytes %u, Appended %u, Syncs %u, Replayed %u, Sent %u, "
+			"Checkpoints %u, Dropped %u", __atomic_load_n(&Header->Tail, __ATOMIC_ACQUIRE) - Next,
+			Header->Appended, Header->Syncs, Counters.Replayed, Counters.Sent, Counters.Checkpoints,
+			Counters.Dropped);
+}
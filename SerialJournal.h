@@ -0,0 +1,178 @@
+/*
+ * SerialJournal.h
+ *
+ *  Durable TX queue. A message sent with SERIAL_TX_DURABLE in its
+ *  Priority doesn't go on the TX queue, which lives in kernel memory
+ *  and is lost with the Daemon or the board, but into a journal file
+ *  (SERIAL_JOURNAL_PATH, or -j). Serial8051Send returns once it is on
+ *  disk, and the Daemon writes it to the tty from there. What the
+ *  Daemon hadn't sent when it stopped, for whatever reason, it sends
+ *  when it starts again.
+ *
+ *  The file is mapped by every process using it: a header, then a ring
+ *  of DataSize bytes records are appended to. Offsets into the ring
+ *  only ever grow (modulo 2^32), DataSize is a power of two. Each
+ *  record is a JournalRecordHdr and the frame as it goes on the line,
+ *  padded to 4 bytes, the Check covers its offset, length and frame.
+ *
+ *  Senders append under a write lock on the file, then make the ring
+ *  durable. That is a group commit: one msync covers every record
+ *  appended up to then, a sender whose records an msync already took
+ *  along doesn't make another. The Daemon sends records in order from
+ *  Consumed, and moves Consumed up (the checkpoint, synced once per TX
+ *  pass). Space is only reused once the checkpoint that frees it is on
+ *  disk, so starting up the Daemon trusts nothing but the checkpoint:
+ *  it walks the records from there while their Checks hold.
+ *
+ *  Delivery is at least once, a crash between writing frames and the
+ *  checkpoint sends them again. Durable messages keep their order among
+ *  themselves, not with messages on the queue or socket.
+ */
+
+#ifndef SERIALJOURNAL_H_
+#define SERIALJOURNAL_H_
+
+#include "tlpi_hdr.h"
+#include "typedef.h"
+#include "SerialMsgUtils.h"
+
+/* Checked on open, a file laid out differently is started again */
+#define JOURNAL_MAGIC			0x4C4E524A		/* "JRNL" */
+#define JOURNAL_VERSION			1
+
+/* Ring size of a new journal, a power of two */
+#define JOURNAL_DEFAULT_BYTES	(256*1024)
+
+/* Ring starts a page in, the header is synced on its own */
+#define JOURNAL_DATA_OFFSET		4096
+
+#define JOURNAL_RECORD_MARKER	0x4A52
+#define JOURNAL_RECORD_BYTES(Length)	((sizeof(JournalRecordHdr) + (uint32_t)(Length) + 3) & ~3U)
+
+/* Bytes of the file locked, by fcntl, for appending and for syncing */
+#define JOURNAL_LOCK_APPEND		0
+#define JOURNAL_LOCK_SYNC		1
+
+/* Error Return Codes */
+#define JOURNAL_OPEN_FAIL		-1
+#define JOURNAL_NOT_OPEN		-2
+#define JOURNAL_FULL			-3		/* Until the Daemon sends what's there */
+#define JOURNAL_SYNC_FAIL		-4
+#define JOURNAL_BAD_FRAME		-5
+
+typedef struct SerialJournalHeader{
+		uint32_t	Magic;
+		uint32_t	Version;
+		uint32_t	DataSize;
+		uint32_t	Tail;			/* Next record goes here */
+		uint32_t	Synced;			/* Records before it are on disk */
+		uint32_t	Consumed;		/* Checkpoint, records before it have been sent */
+		uint32_t	Reusable;		/* Consumed, once that is on disk */
+		uint32_t	Appended;		/* Counters, for the Daemon's statistics */
+		uint32_t	Syncs;
+	}SerialJournalHeader;
+
+typedef struct JournalRecordHdr{
+		uint32_t	Check;
+		uint16_t	Length;			/* Of the frame */
+		uint16_t	Marker;
+	}JournalRecordHdr;
+
+
+/* Both sides */
+
+/* Map the journal, creating it if it isn't there
+ *
+ *  RETURNS:
+ *  1 if sucessful, JOURNAL_OPEN_FAIL if failure
+*/
+int32_t
+JournalOpen(const char *Path );
+
+/* Unmap the journal, the Daemon's checkpoint is synced first */
+void
+JournalClose(void);
+
+
+/* Sender side, Serial8051Send */
+
+/* Start appending, takes the write lock. Records appended before
+ * JournalEnd go in together or not at all
+ *
+ *  RETURNS:
+ *  1 if sucessful, JOURNAL_NOT_OPEN or JOURNAL_OPEN_FAIL if failure
+*/
+int32_t
+JournalBegin(void);
+
+/* Append a frame
+ *
+ *  RETURNS:
+ *  1 if sucessful, JOURNAL_FULL, JOURNAL_BAD_FRAME if it's over
+ *  PACKET_FRAME_LENGTH(MAX_MSG_SIZE)
+*/
+int32_t
+JournalAppend(const ARM_char_t *Frame, int32_t Length );
+
+/* Finish appending, publishing the records (Keep) or dropping them,
+ * and give up the write lock
+ *
+ *  RETURNS:
+ *  The offset the records end at, for JournalSync
+*/
+uint32_t
+JournalEnd(Boolean Keep );
+
+/* Make sure the records up to End are on disk
+ *
+ *  RETURNS:
+ *  1 if sucessful, JOURNAL_SYNC_FAIL if failure
+*/
+int32_t
+JournalSync(uint32_t End );
+
+
+/* Daemon side */
+
+/* Find the records still to be sent, after a start. Call once, before
+ * anything is sent
+ *
+ *  RETURNS:
+ *  Records to send
+*/
+int32_t
+JournalRecover(void);
+
+/* TRUE while there is a record to send */
+Boolean
+JournalPending(void);
+
+/* Copy out the next record to send, it stays next until
+ * JournalConsume
+ *
+ *  INPUTS:
+ *  Frame - PACKET_FRAME_LENGTH(MAX_MSG_SIZE) bytes
+ *
+ *  RETURNS:
+ *  Bytes in Frame, 0 with nothing to send
+*/
+int32_t
+JournalNext(ARM_char_t *Frame );
+
+/* The record JournalNext returned has been written to the tty */
+void
+JournalConsume(void);
+
+/* Move the checkpoint up to what has been sent, and sync it
+ *
+ *  RETURNS:
+ *  1 if sucessful, JOURNAL_SYNC_FAIL if failure
+*/
+int32_t
+JournalCheckpoint(void);
+
+/* Write the counters to the system log */
+void
+JournalLogStats(void);
+
+#endif /* SERIALJOURNAL_H_ */
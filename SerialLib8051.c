@@ -5,6 +5,9 @@
  *      Author: mbezold
  */
 
+/* sendmmsg */
+#define _GNU_SOURCE
+
 #include <signal.h>
 #include <ctype.h>
 #include <fcntl.h>
@@ -17,6 +20,8 @@
 #include <signal.h>
 #include <semaphore.h>
 #include <syslog.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include "tlpi_hdr.h"
 #include "tty_functions.h"
@@ -24,6 +29,8 @@
 #include "SerialDaemon.h"
 #include "SerialPacket.h"
 #include "SerialMsgUtils.h"
+#include "SerialTrace.h"
+#include "SerialJournal.h"
 
 
 #define SERIAL_FILEPATH "/dev/ttyO4"
@@ -38,10 +45,58 @@
 
 #define DEBUG_LEVEL 16
 
+/* MsgFlags the library sets itself, cleared from what the application
+ * passes */
+#define LIBRARY_MSG_FLAGS	(MSG_FLAG_MORE_FRAGMENTS | MSG_FLAG_FRAGMENT)
+
 /* Builds the file with a main, to facillitate testing of library
  * functions contained herein */
 // #define TESTMODE
 
+/* Compression totals for this process */
+static SerialCompressStats CompressStats;
+
+/* This process's connection to the Daemon's socket, -1 when there
+ * isn't one. Subscribed once it has asked for RX frames */
+static int DaemonSocket = -1;
+static Boolean SocketSubscribed = FALSE;
+
+/* Copy out the compression totals for messages this process has sent,
+ * BytesOut / BytesIn is the compression ratio */
+void
+Serial8051CompressionStats(SerialCompressStats *Stats){
+	*Stats = CompressStats;
+}
+
+/* Copy out the fragmentation totals, fragments sent from this process
+ * and messages it has reassembled */
+void
+Serial8051FragmentStats(SerialFragmentStats *Stats){
+	FragmentGetStats(Stats);
+}
+
+/* Undo sender side payload coding on a message decoded in place, Out
+ * must hold MAX_MSG_SIZE bytes. View is updated to point at Out */
+static int32_t
+ExpandPayload(RxMsgView *View, uint8_t *Out, int32_t OutSize){
+
+	int32_t RawLength;
+
+	if(!(View->Info.MsgFlags & MSG_FLAG_COMPRESSED))
+		return View->Length;
+
+	RawLength = DecompressPayload(View->Data, View->Length, Out, OutSize);
+	if(RawLength < 0)
+		return SERIAL_RECEIVE_DECOMPRESS_FAIL;
+
+	View->Info.MsgFlags &= ~MSG_FLAG_COMPRESSED;
+	View->Info.MsgLength = (uint16_t)RawLength;
+	View->Data = Out;
+	View->Length = RawLength;
+
+	return RawLength;
+}
+
 /* Use to notify the Serial Daemon that it has outgoing data, via a signal sending */
 int32_t
 SerialDaemonNotify(void){
@@ -82,6 +137,8 @@ SerialDaemonNotify(void){
 		return SEM_QUEUE_FAIL;
 	}
 
+	SERIAL_TRACE1(notify, SerialDaemonPID);
+
 	/* Close the semaphore, as we don't need it and don't want it registered with the
 	 * kernel */
 	if(sem_close(sem)==-1){
@@ -96,6 +153,66 @@ SerialDaemonNotify(void){
 
 	return 1;
 }
+
+static void
+CloseDaemonSocket(void){
+
+	if(DaemonSocket >= 0)
+		close(DaemonSocket);
+
+	DaemonSocket = -1;
+	SocketSubscribed = FALSE;
+}
+
+/* Connect to the Daemon's socket, if we aren't already and it's
+ * listening
+ *
+ *  RETURNS:
+ *  The socket, -1 if the queues have to be used
+*/
+static int
+ConnectDaemonSocket(void){
+
+	struct sockaddr_un Addr;
+	struct timeval Timeout;
+	const char *Path;
+	int fd;
+
+	if(DaemonSocket >= 0)
+		return DaemonSocket;
+
+	Path = getenv(SERIAL_SOCKET_ENV);
+	if(Path == NULL)
+		Path = SERIAL_SOCKET_PATH;
+
+	if(strlen(Path) >= sizeof(Addr.sun_path))
+		return -1;
+
+	memset(&Addr, 0, sizeof(Addr));
+	Addr.sun_family = AF_UNIX;
+	strcpy(Addr.sun_path, Path);
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if(fd < 0)
+		return -1;
+
+	if(connect(fd, (struct sockaddr *)&Addr, sizeof(Addr)) == -1){
+		close(fd);
+		return -1;
+	}
+
+	/* A send that waits for room (fragments) gives up when a queued
+	 * one would */
+	Timeout.tv_sec = FRAGMENT_SEND_TIMEOUT_S;
+	Timeout.tv_usec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &Timeout, sizeof(Timeout));
+
+	DaemonSocket = fd;
+	SocketSubscribed = FALSE;
+
+	return DaemonSocket;
+}
+
 /* Call this to initialize the message queue, the first time */
 int32_t Serial8051Open(const char* QueueName){
 	int32_t flags;
@@ -146,38 +263,309 @@ int32_t Serial8051Open(const char* QueueName){
 }
 
 
+/* Build a single frame in CompleteMessage, which holds
+ * PACKET_FRAME_LENGTH(MAX_MSG_SIZE/2) bytes. Length is at most
+ * MAX_MSG_SIZE/2
+ *
+ *  RETURNS:
+ *  Length of the frame
+*/
+static int32_t
+BuildFrame(uint8_t *TxBuffer, int32_t Length, uint8_t MsgID, uint16_t SequenceCount,
+		uint8_t MsgFlags, char *CompleteMessage){
+
+	int32_t PktHdrLength, ASCIIByteCnt, CompressedLength;
+	uint8_t CompressedBuff[MAX_MSG_SIZE/2 + 1];
+	PacketHdr CurrentPacketHdr;
+
+	/* Compression was asked for, only keep it if the message actually
+	 * gets smaller, otherwise send it as is with the flag cleared */
+	if(MsgFlags & MSG_FLAG_COMPRESSED){
+		MsgFlags &= ~MSG_FLAG_COMPRESSED;
+
+		CompressedLength = CompressPayload(TxBuffer, Length, CompressedBuff, Length - 1);
+
+		if(CompressedLength > 0){
+			CompressStats.MsgsCompressed++;
+			CompressStats.BytesIn += Length;
+			CompressStats.BytesOut += CompressedLength;
+
+			TxBuffer = CompressedBuff;
+			Length = CompressedLength;
+			MsgFlags |= MSG_FLAG_COMPRESSED;
+		}
+		else{
+			CompressStats.MsgsSkipped++;
+		}
+	}
+
+	PktHdrLength = BuildPacketHdr(Length, MsgID, MsgFlags, SequenceCount, &CurrentPacketHdr );
+
+	/* Header, then the ASCII encoding of the hex values representing the
+	 * raw bytes straight after it */
+	memcpy(CompleteMessage, &CurrentPacketHdr, (size_t)PktHdrLength );
+
+	ASCIIByteCnt = BytesToASCIIHex( TxBuffer, (uint8_t *)&CompleteMessage[PktHdrLength], Length );
+
+	/* The new line is counted in the header's FrameLength */
+	CompleteMessage[PktHdrLength+ASCIIByteCnt] = '\n';
+
+	return PktHdrLength+ASCIIByteCnt+1;
+}
+
+/* Expiry trailer time for a message sent with TtlMs, 0 for none */
+static int64_t
+TtlExpiresUs(uint32_t TtlMs){
+
+	struct timespec Now;
+
+	if(TtlMs == 0)
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &Now);
+
+	return (int64_t)Now.tv_sec*1000000 + Now.tv_nsec/1000 + (int64_t)TtlMs*1000;
+}
+
+/* Build a single frame and put it on the TX queue, or the Daemon's
+ * socket when mqd is -1. Length is at most MAX_MSG_SIZE/2. A non zero
+ * ExpiresUs goes after the frame, see TxExpiryTrailer, and on the
+ * socket a non zero Priority after that, see TxPriorityTrailer. Without a
+ * Deadline the send fails straight away when the queue is full, with
+ * one it waits for the Daemon to make room */
+static int32_t
+SendFrame(mqd_t mqd, uint8_t *TxBuffer, int32_t Length, uint8_t MsgID, uint16_t SequenceCount,
+		uint8_t MsgFlags, uint32_t Priority, int64_t ExpiresUs, const struct timespec *Deadline){
+
+	int32_t FrameLength, SndMsgRtn;
+	char CompleteMessage[PACKET_FRAME_LENGTH(MAX_MSG_SIZE/2) + sizeof(TxExpiryTrailer) + sizeof(TxPriorityTrailer)];
+
+	FrameLength = BuildFrame(TxBuffer, Length, MsgID, SequenceCount, MsgFlags, CompleteMessage);
+
+	if(ExpiresUs != 0)
+		FrameLength = AppendTxExpiry(CompleteMessage, FrameLength, ExpiresUs);
+
+	/* The queue keeps the priority itself */
+	if(mqd == (mqd_t) -1 && Priority != 0)
+		FrameLength = AppendTxPriority(CompleteMessage, FrameLength, Priority);
+
+	if(mqd == (mqd_t) -1){
+		/* Waiting on the socket is bounded by its SO_SNDTIMEO */
+		SndMsgRtn = (int32_t)send(DaemonSocket, CompleteMessage, (size_t)FrameLength,
+				(Deadline == NULL) ? (MSG_DONTWAIT | MSG_NOSIGNAL) : MSG_NOSIGNAL);
+
+		/* The Daemon went away, the next send connects again or uses the queue */
+		if(SndMsgRtn < 0 && errno != EAGAIN)
+			CloseDaemonSocket();
+	}
+	else if(Deadline == NULL)
+		SndMsgRtn = mq_send(mqd, CompleteMessage, (size_t)FrameLength, Priority);
+	else
+		SndMsgRtn = mq_timedsend(mqd, CompleteMessage, (size_t)FrameLength, Priority, Deadline);
+
+	if(SndMsgRtn < 0){
+		#if DEBUG_LEVEL > 10
+			printf("Serial8051Send: Msg Send Fails, Error Code = %i\n", SndMsgRtn);
+		#endif
+		return MSG_SEND_FAIL;
+	}
+
+	SERIAL_TRACE4(send_enqueue, MsgID, SequenceCount, FrameLength, mqd == (mqd_t) -1);
+
+	return 1;
+}
+
+/* Queue a message too big for one frame as a run of fragments with
+ * consecutive SeqCounts. The Daemon is woken after the first one so it
+ * is already writing while the rest are queued, after that we wait on
+ * a full queue rather than failing, so the line stays busy until the
+ * last fragment is out. With mqd -1 they go on the Daemon's socket,
+ * which needs no waking */
+static int32_t
+SendFragments(mqd_t mqd, uint8_t *TxBuffer, int32_t Length, uint8_t MsgID, uint16_t SequenceCount,
+		uint8_t MsgFlags, uint32_t Priority, int64_t ExpiresUs){
+
+	struct mq_attr attr;
+	struct timespec Deadline;
+	int32_t Offset, FragmentLength, Fragments = 0, SendReturn, NotifyReturn;
+	uint8_t FragmentFlags;
+
+	/* Blocking only on this descriptor, mq_timedsend keeps it bounded */
+	attr.mq_flags = 0;
+	if(mqd != (mqd_t) -1 && mq_setattr(mqd, &attr, NULL) == -1)
+		return MSG_SEND_FAIL;
+
+	for(Offset = 0; Offset < Length; Offset += FragmentLength){
+
+		FragmentLength = Length - Offset;
+		if(FragmentLength > MAX_MSG_SIZE/2)
+			FragmentLength = MAX_MSG_SIZE/2;
+
+		FragmentFlags = MsgFlags;
+		if(Offset > 0)
+			FragmentFlags |= MSG_FLAG_FRAGMENT;
+		if(Offset + FragmentLength < Length)
+			FragmentFlags |= MSG_FLAG_MORE_FRAGMENTS;
+
+		clock_gettime(CLOCK_REALTIME, &Deadline);
+		Deadline.tv_sec += FRAGMENT_SEND_TIMEOUT_S;
+
+		SendReturn = SendFrame(mqd, &TxBuffer[Offset], FragmentLength, MsgID,
+				(uint16_t)(SequenceCount + Fragments), FragmentFlags, Priority, ExpiresUs, &Deadline);
+
+		if(SendReturn < 0)
+			return SendReturn;
+
+		Fragments++;
+
+		if(Fragments == 1 && mqd != (mqd_t) -1){
+			NotifyReturn = SerialDaemonNotify();
+
+			if(NotifyReturn < 0)
+				return NotifyReturn;
+		}
+	}
+
+	FragmentCountSent(Fragments);
+
+	return 1;
+}
+
+/* Put messages in the journal, fragmented if need be, all of them or
+ * none. They are on disk before this returns. The Daemon is woken, one
+ * that isn't running sends them when it starts
+ *
+ *  RETURNS:
+ *  1 if sucessful, a negative JOURNAL_* code if failure
+ */
+static int32_t
+SendDurable(const SerialTxRequest *Requests, int32_t Count){
+
+	static Boolean JournalOpened = FALSE;
+	char Frame[PACKET_FRAME_LENGTH(MAX_MSG_SIZE/2)];
+	const char *Path;
+	int32_t i, Offset, FragmentLength, Fragments, FrameLength, Return;
+	uint8_t MsgFlags;
+	uint32_t End;
+
+	if(!JournalOpened){
+		Path = getenv(SERIAL_JOURNAL_ENV);
+		if(Path == NULL || Path[0] == '\0')
+			Path = SERIAL_JOURNAL_PATH;
+
+		if(JournalOpen(Path) < 0)
+			return JOURNAL_OPEN_FAIL;
+
+		JournalOpened = TRUE;
+	}
+
+	Return = JournalBegin();
+
+	for(i = 0; i < Count && Return > 0; i++){
+
+		Offset = 0;
+		Fragments = 0;
+
+		do{
+			FragmentLength = Requests[i].Length - Offset;
+			if(FragmentLength > MAX_MSG_SIZE/2)
+				FragmentLength = MAX_MSG_SIZE/2;
+
+			MsgFlags = Requests[i].MsgFlags & ~LIBRARY_MSG_FLAGS;
+			if(Offset > 0)
+				MsgFlags |= MSG_FLAG_FRAGMENT;
+			if(Offset + FragmentLength < Requests[i].Length)
+				MsgFlags |= MSG_FLAG_MORE_FRAGMENTS;
+
+			FrameLength = BuildFrame(&Requests[i].TxBuffer[Offset], FragmentLength, Requests[i].MsgID,
+					(uint16_t)(Requests[i].SequenceCount + Fragments), MsgFlags, Frame);
+
+			Return = JournalAppend(Frame, FrameLength);
+
+			SERIAL_TRACE4(send_enqueue, Requests[i].MsgID, (uint16_t)(Requests[i].SequenceCount + Fragments),
+					FrameLength, 0);
+
+			Offset += FragmentLength;
+			Fragments++;
+		}while(Offset < Requests[i].Length && Return > 0);
+
+		if(Fragments > 1 && Return > 0)
+			FragmentCountSent(Fragments);
+	}
+
+	End = JournalEnd((Return > 0) ? TRUE : FALSE);
+	if(Return < 0)
+		return Return;
+
+	Return = JournalSync(End);
+	if(Return < 0)
+		return Return;
+
+	SerialDaemonNotify();
+
+	return 1;
+}
+
 /* Pass message to Serial drivers, for output to the 8051
  * Messages are passed to the serial interface through
  * a Msg Queue, which is created here if it doesn't already
  * exist. Input buffer is also converted to an ASCII representation
- * which is suitable for terminal IO
+ * which is suitable for terminal IO. Messages over MAX_MSG_SIZE/2
+ * go out as several fragments, see SerialFragment.h
 
  * INPUTS:
  * TxBuferPass- Raw byte buffer to be transmitted
- * Length- Number of bytes in the buffer
+ * Length- Number of bytes in the buffer, up to MAX_FRAGMENTED_MSG_SIZE
  * MsgID- A component of the header that identifies
  * 	the message type, or delivery endpoint, for higher
  * 	level software
+ * SequenceCount- SeqCount of the frame, a fragmented message uses
+ * 	this and the ones following it
+ * MsgFlags- Application flags (MSG_FLAGS_USER_MASK), plus
+ * 	MSG_FLAG_COMPRESSED to compress the payload when that
+ * 	makes the frame smaller. The fragment flags are cleared,
+ * 	MSG_FLAG_AGGREGATE / MSG_FLAG_DELTA too by a Daemon
+ * 	running with -g / -x
+ * Priority- TX queue priority, the Daemon's socket carries it too,
+ * 	SERIAL_TX_DURABLE for a message that has to get there, see
+ * 	SerialJournal.h
 
  * RETURNS:
  * Error generated by failed system calls, a negative
- * int defined in SeriaLib8051.h
+ * int defined in SeriaLib8051.h, or SerialJournal.h for a durable
+ * message
  */
 
 
 int32_t Serial8051Send(uint8_t *TxBuffer, int32_t Length, uint8_t MsgID, uint16_t SequenceCount, uint8_t MsgFlags, uint32_t Priority){
-	int32_t flags, ASCIIByteCnt = 0, PktHdrLength, SndMsgRtn = 0;
-	mqd_t mqd;
 
-	uint8_t *ASCIIHexReturnPntr;
-	const char *CompleteMessage;
+	return Serial8051SendTtl(TxBuffer, Length, MsgID, SequenceCount, MsgFlags, Priority, 0);
+}
+
+/* Serial8051Send for a message that is no use late, a setpoint say.
+ * One the Daemon gets to more than TtlMs after this call, behind a
+ * backlog on a slow or busy link, is dropped instead of written, and
+ * counted in its TxExpired. Each fragment of a large message is
+ * dropped on its own, the MCU throws away what it can't put together.
+ * A durable message is always sent, TtlMs is ignored
+
+ * INPUTS:
+ * TtlMs- Latency budget, 0 for none
+ * The rest as Serial8051Send
 
-	/* Initialize packet header struct to use with BuildPacketHdr */
-	PacketHdr * CurrentPacketHdr = malloc(MSG_HEADER_LENGTH);
+ * RETURNS:
+ * As Serial8051Send, a message that expires has still been sent
+ */
+int32_t Serial8051SendTtl(uint8_t *TxBuffer, int32_t Length, uint8_t MsgID, uint16_t SequenceCount, uint8_t MsgFlags, uint32_t Priority, uint32_t TtlMs){
+	int32_t flags, SndMsgRtn;
+	int64_t ExpiresUs;
+	mqd_t mqd;
+	SerialTxRequest Request;
 
+	SERIAL_TRACE3(send_entry, MsgID, SequenceCount, Length);
 
 	/* Check for message being too large */
-	if(Length > MAX_MSG_SIZE/2){
+	if(Length > MAX_FRAGMENTED_MSG_SIZE){
 			#if DEBUG_LEVEL > 10
 			errMsg("Serial8051Send: Message is too big for Message Queue");
 			#endif
@@ -185,6 +573,35 @@ int32_t Serial8051Send(uint8_t *TxBuffer, int32_t Length, uint8_t MsgID, uint16_
 			return OVERSIZE_MSG_ERROR;
 	}
 
+	/* The library sets these itself */
+	MsgFlags &= ~LIBRARY_MSG_FLAGS;
+
+	/* Into the journal, rather than a queue or the socket */
+	if(Priority & SERIAL_TX_DURABLE){
+		Request.TxBuffer = TxBuffer;
+		Request.Length = Length;
+		Request.MsgID = MsgID;
+		Request.SequenceCount = SequenceCount;
+		Request.MsgFlags = MsgFlags;
+		Request.Priority = Priority;
+		Request.TtlMs = 0;
+
+		return SendDurable(&Request, 1);
+	}
+
+	/* From now, not from when the frame is queued */
+	ExpiresUs = TtlExpiresUs(TtlMs);
+
+	/* The Daemon's socket when it's listening, there is no queue to
+	 * open and the Daemon doesn't need a signal */
+	if(ConnectDaemonSocket() >= 0){
+		if(Length > MAX_MSG_SIZE/2)
+			SndMsgRtn = SendFragments((mqd_t) -1, TxBuffer, Length, MsgID, SequenceCount, MsgFlags, Priority, ExpiresUs);
+		else
+			SndMsgRtn = SendFrame((mqd_t) -1, TxBuffer, Length, MsgID, SequenceCount, MsgFlags, Priority, ExpiresUs, NULL);
+
+		return (SndMsgRtn < 0) ? SndMsgRtn : 1;
+	}
 
 	/* Open for Write, Create if not open, Open non-blocking-rcv and send will
 	 * fail unless they can complete immediately. */
@@ -209,70 +626,317 @@ int32_t Serial8051Send(uint8_t *TxBuffer, int32_t Length, uint8_t MsgID, uint16_
 
 	}
 
-	PktHdrLength= BuildPacketHdr(Length, MsgID, MsgFlags, SequenceCount, CurrentPacketHdr );
+	if(Length > MAX_MSG_SIZE/2)
+		SndMsgRtn = SendFragments(mqd, TxBuffer, Length, MsgID, SequenceCount, MsgFlags, Priority, ExpiresUs);
+	else
+		SndMsgRtn = SendFrame(mqd, TxBuffer, Length, MsgID, SequenceCount, MsgFlags, Priority, ExpiresUs, NULL);
 
+	if(mq_close(mqd) < (int32_t)0){
+		errMsg("Seral8051Send: Close Failed");
+		return MSG_CLOSE_FAIL;
+	}
 
-	/* Initialize storage for the ASCII hex bytes, multiply by two because
-	 * each nibble of the Raw Bytes is represented by an ASCII character,
-	 * encoding the hex values */
-	ASCIIHexReturnPntr = (uint8_t*)malloc((uint16_t)Length*2);
+	if(SndMsgRtn < 0)
+		return SndMsgRtn;
 
-	/* Convert to ASCII encoding of the hex values representing the raw bytes */
-	ASCIIByteCnt = BytesToASCIIHex( TxBuffer, ASCIIHexReturnPntr, Length );
+	int32_t NotifyReturn = SerialDaemonNotify();
+	/* Notify Serial Daemon that it has a message waiting for it */
+	if( NotifyReturn < 0 ){
 
-	/* Allocate memory for our Compelte Message  */
-	CompleteMessage = (const char *) malloc(PktHdrLength+ASCIIByteCnt);
+		#if DEBUG_LEVEL > 10
+			printf("Serial8051Send: Failed to notify Serial Daemon\n");
+		#endif
 
-	/* Build complete message by combining header with data */
-	memcpy((void *)CompleteMessage, (void *)CurrentPacketHdr, (size_t)PktHdrLength );
+		return NotifyReturn;
 
-	/* Adding packet length to CompleteMessage Pointer will drop the data starting in the next byte
-	 * address after the last byte in the PacketHeader  */
-	memcpy((void *)(CompleteMessage+PktHdrLength), (void *)ASCIIHexReturnPntr, (size_t)ASCIIByteCnt );
 
-	SndMsgRtn = mq_send(mqd, CompleteMessage, (size_t)(PktHdrLength+ASCIIByteCnt), Priority);
+	}
 
-	if(SndMsgRtn < 0){
-		#if DEBUG_LEVEL > 10
-			printf("Serial8051Send: Msg Send Fails, Error Code = %i\nn", SndMsgRtn);
-		#endif
-		return MSG_SEND_FAIL;
+	return 1;
+
+}
+
+/* Send several messages at once. On the Daemon's socket they go to the
+ * kernel SERIAL_SEND_BATCH_MAX at a time with sendmmsg, otherwise each
+ * one is queued as Serial8051Send would. A batch of durable messages
+ * goes into the journal with a single sync, a batch with some durable
+ * messages is sent one message at a time. Each message must fit in one
+ * frame
+
+ * INPUTS:
+ * Requests- The messages, Serial8051SendTtl's arguments for each
+ * Count- Number of messages
+
+ * RETURNS:
+ * Messages sent, fewer than Count when the socket or queue fills up,
+ * or a negative int defined in SeriaLib8051.h if none were
+ */
+int32_t Serial8051SendBatch(const SerialTxRequest *Requests, int32_t Count){
+
+	char Frames[SERIAL_SEND_BATCH_MAX][PACKET_FRAME_LENGTH(MAX_MSG_SIZE/2) + sizeof(TxExpiryTrailer) + sizeof(TxPriorityTrailer)];
+	struct mmsghdr Msgs[SERIAL_SEND_BATCH_MAX];
+	struct iovec Iov[SERIAL_SEND_BATCH_MAX];
+	int32_t Sent = 0, Batch, Accepted, i, SndMsgRtn, FrameLength, Durable = 0;
+	uint8_t MsgFlags;
+
+	for(i = 0; i < Count; i++){
+		if(Requests[i].Length > MAX_MSG_SIZE/2){
+			Count = i;
+			break;
+		}
+
+		if(Requests[i].Priority & SERIAL_TX_DURABLE)
+			Durable++;
 	}
 
+	if(Count == 0)
+		return OVERSIZE_MSG_ERROR;
 
-	/* Free all the pointers we created (including in called functions) to avoid memory leaks */
-	free( (void*)CompleteMessage);
-	free( (void*)ASCIIHexReturnPntr);
-	free( (void*)CurrentPacketHdr);
+	/* All durable, one commit covers them */
+	if(Durable == Count){
+		SndMsgRtn = SendDurable(Requests, Count);
+		return (SndMsgRtn < 0) ? SndMsgRtn : Count;
+	}
 
+	if(Durable > 0 || ConnectDaemonSocket() < 0){
+		for(Sent = 0; Sent < Count; Sent++){
+			SndMsgRtn = Serial8051SendTtl(Requests[Sent].TxBuffer, Requests[Sent].Length, Requests[Sent].MsgID,
+					Requests[Sent].SequenceCount, Requests[Sent].MsgFlags, Requests[Sent].Priority,
+					Requests[Sent].TtlMs);
 
-	if(mq_close(mqd) < (int32_t)0){
-		errMsg("Seral8051Send: Close Failed");
-		return MSG_CLOSE_FAIL;
+			if(SndMsgRtn < 0)
+				return (Sent > 0) ? Sent : SndMsgRtn;
+		}
+
+		return Sent;
 	}
 
-	int32_t NotifyReturn = SerialDaemonNotify();
-	/* Notify Serial Daemon that it has a message waiting for it */
-	if( NotifyReturn < 0 ){
+	while(Sent < Count){
+		Batch = Count - Sent;
+		if(Batch > SERIAL_SEND_BATCH_MAX)
+			Batch = SERIAL_SEND_BATCH_MAX;
 
-		#if DEBUG_LEVEL > 10
-			printf("Serial8051Send: Failed to notify Serial Daemon\n");
-		#endif
+		memset(Msgs, 0, sizeof(Msgs));
+		for(i = 0; i < Batch; i++){
+			MsgFlags = Requests[Sent+i].MsgFlags & ~LIBRARY_MSG_FLAGS;
 
-		return NotifyReturn;
+			Iov[i].iov_base = Frames[i];
+			FrameLength = BuildFrame(Requests[Sent+i].TxBuffer, Requests[Sent+i].Length,
+					Requests[Sent+i].MsgID, Requests[Sent+i].SequenceCount, MsgFlags, Frames[i]);
+
+			if(Requests[Sent+i].TtlMs != 0)
+				FrameLength = AppendTxExpiry(Frames[i], FrameLength, TtlExpiresUs(Requests[Sent+i].TtlMs));
+
+			if(Requests[Sent+i].Priority != 0)
+				FrameLength = AppendTxPriority(Frames[i], FrameLength, Requests[Sent+i].Priority);
+
+			Iov[i].iov_len = (size_t)FrameLength;
+			Msgs[i].msg_hdr.msg_iov = &Iov[i];
+			Msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		Accepted = sendmmsg(DaemonSocket, Msgs, (unsigned int)Batch, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+		if(Accepted < 0){
+			if(errno != EAGAIN)
+				CloseDaemonSocket();
+
+			return (Sent > 0) ? Sent : MSG_SEND_FAIL;
+		}
+
+		for(i = 0; i < Accepted; i++)
+			SERIAL_TRACE4(send_enqueue, Requests[Sent+i].MsgID, Requests[Sent+i].SequenceCount,
+					Iov[i].iov_len, 1);
+
+		Sent += Accepted;
+
+		/* The socket is full */
+		if(Accepted < Batch)
+			break;
+	}
 
+	return Sent;
+}
+
+/* Have the Daemon send frames with a MsgID from FirstID to LastID on
+ * our socket, where Serial8051Receive reads them before the shared RX
+ * queue. As with Serial8051Subscribe they no longer go to that queue,
+ * every subscriber gets its own copy, and fragments come as they are.
+ * A socket has one range, calling again replaces it. The subscription
+ * goes with the connection, and frames no one subscribed to stay on
+ * the RX queue for whoever reads it
+
+ * INPUTS:
+ * FirstID, LastID- MsgID range, inclusive
+
+ * RETURNS:
+ * 1 if the request was sent to the Daemon, or a negative int defined
+ * in SeriaLib8051.h
+ */
+int32_t Serial8051SocketSubscribe(uint8_t FirstID, uint8_t LastID ){
 
+	SerialSubscribeMsg Request;
+
+	if(FirstID > LastID)
+		return SUBSCRIBE_BAD_ARGS;
+
+	if(ConnectDaemonSocket() < 0)
+		return SUBSCRIBE_NO_DAEMON;
+
+	memset(&Request, 0, sizeof(Request));
+	Request.Command = SUB_CMD_ADD;
+	Request.FirstID = FirstID;
+	Request.LastID = LastID;
+
+	if(send(DaemonSocket, &Request, sizeof(Request), MSG_DONTWAIT | MSG_NOSIGNAL) != (ssize_t)sizeof(Request)){
+		CloseDaemonSocket();
+		return SUBSCRIBE_SEND_FAIL;
 	}
 
+	SocketSubscribed = TRUE;
+
 	return 1;
+}
 
+/* Stop the frames Serial8051SocketSubscribe asked for, they go back to
+ * the shared RX queue. Ones already on the socket are still read
+
+ * RETURNS:
+ * 1 if the request was sent to the Daemon, or a negative int defined
+ * in SeriaLib8051.h
+ */
+int32_t Serial8051SocketUnsubscribe(void){
+
+	SerialSubscribeMsg Request;
+
+	if(!SocketSubscribed)
+		return 1;
+
+	memset(&Request, 0, sizeof(Request));
+	Request.Command = SUB_CMD_REMOVE;
+
+	if(send(DaemonSocket, &Request, sizeof(Request), MSG_DONTWAIT | MSG_NOSIGNAL) != (ssize_t)sizeof(Request)){
+		CloseDaemonSocket();
+		return SUBSCRIBE_SEND_FAIL;
+	}
+
+	return 1;
+}
+
+/* The Daemon's socket, once Serial8051SocketSubscribe has subscribed
+ * it. It polls readable when Serial8051Receive has a frame from it to
+ * return
+
+ * RETURNS:
+ * The descriptor, -1 if the socket isn't subscribed
+ */
+int32_t Serial8051SocketFd(void){
+
+	return SocketSubscribed ? DaemonSocket : -1;
+}
+
+/* Decode a frame received from the Daemon, into the caller's buffer
+ *
+ *  RETURNS:
+ *  Bytes received, or a negative int defined in SeriaLib8051.h
+*/
+static int32_t
+DecodeReceived(ARM_char_t *ASCII_Buff, ssize_t numRead, uint8_t *RxBuffer, RxMsgInfo *CurrentMsgInfo ){
+
+	int32_t DataIndex;
+
+	DataIndex=ProcessPacket( CurrentMsgInfo, ASCII_Buff );
+
+	/* Don't decode past the end of what we actually received */
+	if ( DataIndex < 0 || numRead < MSG_HEADER_LENGTH ||
+		 DataIndex + ((int32_t)CurrentMsgInfo->MsgLength)*2 > numRead ){
+		errMsg("Serial 8051 Receive: No header present");
+		return SERIAL_RECEIVE_NO_HEADER_FAIL;
+	}
+
+	/* Compressed payloads get decoded in place first, then expanded
+	 * into the caller's buffer */
+	if ( CurrentMsgInfo->MsgFlags & MSG_FLAG_COMPRESSED ){
+		RxMsgView View;
+		int32_t ExpandReturn;
+
+		DecodePacketInPlace( ASCII_Buff, (int32_t)numRead, &View );
+		ExpandReturn = ExpandPayload( &View, RxBuffer, MAX_MSG_SIZE );
+
+		if ( ExpandReturn < 0 )
+			return ExpandReturn;
+
+		*CurrentMsgInfo = View.Info;
+		SERIAL_TRACE3(receive_decode, CurrentMsgInfo->MsgID, CurrentMsgInfo->SeqCount, ExpandReturn);
+		return ExpandReturn;
+	}
+
+	#if DEBUG_LEVEL > 15
+		printf("Serial8051Receive: Cleared the ProcessPacket \n ");
+	#endif
+
+	/* Convert from ASCII encoding back to raw bytes, straight from the
+	 * data portion of the received message into the caller's buffer.
+	 * function requires number of ascii bytes, hence the multiply by 2 */
+
+	#if DEBUG_LEVEL > 15
+		printf("Serial8051Receive: Current Message Length == %u \n ", CurrentMsgInfo->MsgLength);
+	#endif
+
+	ASCIIHexToBytes( &ASCII_Buff[DataIndex], RxBuffer, (CurrentMsgInfo->MsgLength) * 2 );
+
+	#if DEBUG_LEVEL > 15
+		printf("Serial8051Receive: Cleared ASCIIHexToBytes\n ");
+	#endif
+
+	SERIAL_TRACE3(receive_decode, CurrentMsgInfo->MsgID, CurrentMsgInfo->SeqCount, CurrentMsgInfo->MsgLength);
+
+	return CurrentMsgInfo->MsgLength;
+}
+
+/* Take the next frame waiting on the Daemon's socket, if this
+ * connection has subscribed to some
+ *
+ *  INPUTS:
+ *  Return - Set to the bytes received, or a negative int defined in
+ *  	SeriaLib8051.h
+ *
+ *  RETURNS:
+ *  TRUE if a frame was taken, FALSE if nothing is waiting or there's
+ *  no subscribed socket
+*/
+static Boolean
+ReceiveSocketFrame(uint8_t *RxBuffer, RxMsgInfo *CurrentMsgInfo, int32_t *Return ){
+
+	ARM_char_t *Frame;
+	ssize_t numRead;
+
+	if(!SocketSubscribed)
+		return FALSE;
+
+	Frame = (ARM_char_t *) malloc(SERIAL_SOCKET_FRAME_MAX);
+	if(Frame == NULL){
+		*Return = SERIAL_RECEIVE_BUFF_ALLOCATE_FAIL;
+		return TRUE;
+	}
+
+	numRead = recv(DaemonSocket, Frame, SERIAL_SOCKET_FRAME_MAX, MSG_DONTWAIT);
+
+	if(numRead > 0)
+		*Return = DecodeReceived(Frame, numRead, RxBuffer, CurrentMsgInfo);
+	else if(numRead == 0 || errno != EAGAIN)
+		CloseDaemonSocket();	/* 0 is end of file, the Daemon is gone */
+
+	free(Frame);
+
+	return (numRead > 0);
 }
 
 /* Receive message from Serial drivers, from 8051
  * Messages are passed from the serial interface through
  * a Msg Queue, which is created here if it doesn't already
- * exist. Input buffer is also converted from an ASCII to
- * raw bytes
+ * exist, or the Daemon's socket while it's listening. Input
+ * buffer is also converted from an ASCII to raw bytes
 
  * INPUTS:
  * RxBuffer- Raw byte buffer to be received
@@ -288,13 +952,20 @@ int32_t Serial8051Send(uint8_t *TxBuffer, int32_t Length, uint8_t MsgID, uint16_
 int32_t Serial8051Receive(uint8_t * RxBuffer, RxMsgInfo * CurrentMsgInfo ){
 
 	int32_t flags = 0;
-	ARM_char_t DataIndex;
+	int32_t SocketReturn;
 
 	mqd_t mqd;
 	uint32_t prio;
 	struct mq_attr attr;
 	ssize_t numRead;
 
+	/* Frames subscribed to on the socket first, then the ones no one
+	 * subscribed to from the shared RX queue */
+	#ifndef TESTMODE
+	if(ReceiveSocketFrame(RxBuffer, CurrentMsgInfo, &SocketReturn))
+		return SocketReturn;
+	#endif
+
 	flags = O_RDONLY | O_NONBLOCK;
 
 	/* Open the receive side message queue */
@@ -318,6 +989,7 @@ int32_t Serial8051Receive(uint8_t * RxBuffer, RxMsgInfo * CurrentMsgInfo ){
 	/* Get message attributes for allocating size */
 	if(mq_getattr(mqd, &attr) == -1){
 		errMsg("Serial 8051 Receive: Failed to get message attributes");
+		mq_close(mqd);
 		return SERIAL_RECEIVE_MESSAGE_ATTR_FAIL;
 	}
 
@@ -328,6 +1000,7 @@ int32_t Serial8051Receive(uint8_t * RxBuffer, RxMsgInfo * CurrentMsgInfo ){
 	ARM_char_t *ASCII_Buff = (ARM_char_t*) malloc(attr.mq_msgsize);
 	if ( ASCII_Buff == NULL){
 		errMsg("Serial 8051 Receive: Failed to allocate buffer \n ");
+		mq_close(mqd);
 		return SERIAL_RECEIVE_BUFF_ALLOCATE_FAIL;
 	}
 	#if DEBUG_LEVEL > 15
@@ -336,9 +1009,14 @@ int32_t Serial8051Receive(uint8_t * RxBuffer, RxMsgInfo * CurrentMsgInfo ){
 
 	numRead = mq_receive(mqd, ASCII_Buff, attr.mq_msgsize, &prio);
 
+	/* Done with the queue, everything below works on our copy */
+	if(mq_close(mqd) < (int32_t)0){
+			errMsg("Seral8051Receive: Close Failed\n");
+	}
 
 	if(numRead == -1){
 		errMsg("Serial 8051 Receive: Failed to read messages from Rx Queue \n ");
+		free(ASCII_Buff);
 		return SERIAL_RECEIVE_MSG_READ_FAIL;
 	}
 
@@ -346,57 +1024,301 @@ int32_t Serial8051Receive(uint8_t * RxBuffer, RxMsgInfo * CurrentMsgInfo ){
 		printf("Serial8051Receive: Cleared the mqreceive \n ");
 	#endif
 
-	DataIndex=ProcessPacket( CurrentMsgInfo, ASCII_Buff );
+	numRead = DecodeReceived( ASCII_Buff, numRead, RxBuffer, CurrentMsgInfo );
 
-	if ( DataIndex == 0 ){
-		errMsg("Serial 8051 Receive: No header present");
+	free(ASCII_Buff);
+
+	return numRead;
+}
+
+/* Receive message from Serial drivers, decoding it in place in a
+ * buffer supplied by the caller. Nothing is allocated or copied,
+ * the returned view points into MsgBuffer, which makes this the
+ * cheapest way to consume small messages.
+
+ * INPUTS:
+ * MsgBuffer- Buffer the message is received and decoded in, must
+ * 	be at least the RX queue's mq_msgsize
+ * BufferSize - Size of MsgBuffer in bytes
+ * View - Filled in with the header info, and the data pointer and
+ * 	length inside of MsgBuffer. Only valid until MsgBuffer is reused
+
+
+ * RETURNS:
+ * Bytes of data decoded, or Error generated by failed system calls, a negative
+ * int defined in SeriaLib8051.h
+ */
+
+int32_t Serial8051ReceiveView(ARM_char_t *MsgBuffer, int32_t BufferSize, RxMsgView *View ){
+
+	#ifndef TESTMODE
+	return Serial8051ReceiveFrom(SERIAL_RX_QUEUE, MsgBuffer, BufferSize, View);
+	#else
+	return Serial8051ReceiveFrom(SERIAL_TX_QUEUE, MsgBuffer, BufferSize, View);
+	#endif
+}
+
+/* Same as Serial8051ReceiveView, from a queue given to
+ * Serial8051Subscribe rather than the shared RX queue */
+
+int32_t Serial8051ReceiveFrom(const char *QueueName, ARM_char_t *MsgBuffer, int32_t BufferSize, RxMsgView *View ){
+
+	mqd_t mqd;
+	uint32_t prio;
+	struct mq_attr attr;
+	ssize_t numRead;
+	int32_t DecodeReturn;
+
+	mqd = mq_open(QueueName, O_RDONLY | O_NONBLOCK);
+	if(mqd < (mqd_t) 0){
+		errMsg("Serial8051ReceiveFrom: Failed to open receive queue");
+		return SERIAL_RECEIVE_OPEN_FAILURE;
+	}
+
+	if(mq_getattr(mqd, &attr) == -1){
+		errMsg("Serial8051ReceiveFrom: Failed to get message attributes");
+		mq_close(mqd);
+		return SERIAL_RECEIVE_MESSAGE_ATTR_FAIL;
+	}
+
+	/* mq_receive fails outright with a buffer smaller than mq_msgsize */
+	if(BufferSize < attr.mq_msgsize){
+		mq_close(mqd);
+		return SERIAL_RECEIVE_BUFF_TOO_SMALL;
+	}
+
+	numRead = mq_receive(mqd, MsgBuffer, attr.mq_msgsize, &prio);
+
+	if(mq_close(mqd) < (int32_t)0){
+			errMsg("Serial8051ReceiveFrom: Close Failed\n");
+	}
+
+	if(numRead == -1){
+		#if DEBUG_LEVEL > 15
+			errMsg("Serial8051ReceiveFrom: Failed to read messages from Rx Queue");
+		#endif
+		return SERIAL_RECEIVE_MSG_READ_FAIL;
+	}
+
+	DecodeReturn = DecodePacketInPlace(MsgBuffer, (int32_t)numRead, View);
+
+	if(DecodeReturn < 0){
+		#if DEBUG_LEVEL > 10
+			printf("Serial8051ReceiveFrom: Decode fails with error = %i\n", DecodeReturn);
+		#endif
 		return SERIAL_RECEIVE_NO_HEADER_FAIL;
 	}
 
-	#if DEBUG_LEVEL > 15
-		printf("Serial8051Receive: Cleared the ProcessPacket \n ");
-	#endif
+	/* A compressed payload expands into the unused space after it, still
+	 * inside MsgBuffer */
+	if(View->Info.MsgFlags & MSG_FLAG_COMPRESSED){
+		if(BufferSize - DecodeReturn < MAX_MSG_SIZE)
+			return SERIAL_RECEIVE_BUFF_TOO_SMALL;
 
-	/* Set Data Pointer to the the starting address of ASCII_Buff, plus the
-	 * 13 to account for the header, we just want to have ASCII HEX to Bytes
-	 * convert the data portion of the message, not the header */
-	/*DataPointer = &ASCII_Buff[0] + MSG_HEADER_LENGTH; */
+		DecodeReturn = ExpandPayload(View, &View->Data[DecodeReturn], MAX_MSG_SIZE);
+	}
 
+	if(DecodeReturn >= 0)
+		SERIAL_TRACE3(receive_decode, View->Info.MsgID, View->Info.SeqCount, DecodeReturn);
 
-	/* Convert from ASCII encoding back to raw bytes
-	 * function requires number of ascii bytes, hence the multiply by 2 */
+	return DecodeReturn;
+}
 
-	#if DEBUG_LEVEL > 15
-		printf("Serial8051Receive: Current Message Length == %u \n ", CurrentMsgInfo->MsgLength);
+/* Pass a subscription request on to the Daemon */
+static int32_t
+SendSubscribeRequest(uint8_t Command, const char *QueueName, uint8_t FirstID, uint8_t LastID){
+
+	SerialSubscribeMsg Request;
+	mqd_t mqd;
+	int32_t SndMsgRtn;
+
+	memset(&Request, 0, sizeof(Request));
+	Request.Command = Command;
+	Request.FirstID = FirstID;
+	Request.LastID = LastID;
+	strcpy(Request.QueueName, QueueName);
+
+	/* Only the Daemon creates this queue, it not being there means the
+	 * Daemon isn't running */
+	mqd = mq_open(SERIAL_SUB_QUEUE, O_WRONLY | O_NONBLOCK);
+	if(mqd == (mqd_t) -1)
+		return SUBSCRIBE_NO_DAEMON;
+
+	SndMsgRtn = mq_send(mqd, (const char *)&Request, sizeof(Request), 0);
+	mq_close(mqd);
+
+	if(SndMsgRtn < 0){
+		#if DEBUG_LEVEL > 10
+			errMsg("Serial8051Subscribe: Request send failed");
+		#endif
+		return SUBSCRIBE_SEND_FAIL;
+	}
+
+	return 1;
+}
+
+/* Have frames with a MsgID from FirstID to LastID delivered to our own
+ * queue, instead of the shared RX queue. Every queue subscribed to a
+ * MsgID gets its own copy of the frame. Read the queue with
+ * Serial8051ReceiveFrom, its descriptor can also be used with mq_notify
+ * to wake only for these frames. Call again to add more ranges to the
+ * same queue. The Daemon forgets subscriptions when it restarts.
+
+ * INPUTS:
+ * QueueName- Message queue name, "/Name", created if it doesn't exist
+ * FirstID, LastID- MsgID range, inclusive
+
+
+ * RETURNS:
+ * 1 if the request was passed to the Daemon, or a negative int defined
+ * in SeriaLib8051.h
+ */
+
+int32_t Serial8051Subscribe(const char *QueueName, uint8_t FirstID, uint8_t LastID ){
+
+	mqd_t mqd;
+
+	if(FirstID > LastID || QueueName[0] != '/' || strlen(QueueName) >= SUB_QUEUE_NAME_MAX)
+		return SUBSCRIBE_BAD_ARGS;
+
+	/* Create the queue before the Daemon routes to it. If it's already
+	 * there leave it be, the Daemon may have it open for another range */
+	mqd = mq_open(QueueName, O_RDONLY | O_NONBLOCK);
+	if(mqd == (mqd_t) -1)
+		mqd = Serial8051Open(QueueName);
+
+	if(mqd == (mqd_t) -1)
+		return MSG_QUEUE_OPEN_FAIL;
+
+	mq_close(mqd);
+
+	return SendSubscribeRequest(SUB_CMD_ADD, QueueName, FirstID, LastID);
+}
+
+/* Stop routing to QueueName, all of its ranges, and remove the queue.
+ * Frames for those MsgIDs go back to the shared RX queue
+
+ * RETURNS:
+ * 1 if the request was passed to the Daemon, or a negative int defined
+ * in SeriaLib8051.h
+ */
+
+int32_t Serial8051Unsubscribe(const char *QueueName ){
+
+	int32_t Return;
+
+	if(QueueName[0] != '/' || strlen(QueueName) >= SUB_QUEUE_NAME_MAX)
+		return SUBSCRIBE_BAD_ARGS;
+
+	Return = SendSubscribeRequest(SUB_CMD_REMOVE, QueueName, 0, 0);
+
+	mq_unlink(QueueName);
+
+	return Return;
+}
+
+/* Receive a message that may have been fragmented, putting it back
+ * together from as many frames as are waiting. Messages that fit in
+ * one frame come through as they are. Fragments of a message that
+ * isn't complete yet are held on to for the next call.
+
+ * INPUTS:
+ * RxBuffer- Buffer for the complete message, MAX_FRAGMENTED_MSG_SIZE
+ * 	bytes holds anything Serial8051Send will send
+ * BufferSize - Size of RxBuffer in bytes. A reassembled message
+ * 	bigger than this is lost, not kept for a call with a bigger
+ * 	buffer, see MsgsTooLarge in Serial8051FragmentStats
+ * CurrentMsgInfo - Pointer to a struct holding message info, the
+ * 	fragment flags are never set in it
+
+
+ * RETURNS:
+ * Bytes received, or Error generated by failed system calls, a negative
+ * int defined in SeriaLib8051.h. SERIAL_RECEIVE_MSG_READ_FAIL when the
+ * queue ran dry before a complete message came in
+ */
+
+int32_t Serial8051ReceiveLarge(uint8_t *RxBuffer, int32_t BufferSize, RxMsgInfo *CurrentMsgInfo ){
+
+	mqd_t mqd;
+	uint32_t prio;
+	struct mq_attr attr;
+	ssize_t numRead;
+	int32_t DecodeReturn, Return = SERIAL_RECEIVE_MSG_READ_FAIL;
+	ARM_char_t *MsgBuffer;
+	RxMsgView View;
+
+	#ifndef TESTMODE
+	mqd = mq_open(SERIAL_RX_QUEUE, O_RDONLY | O_NONBLOCK);
+	#else
+	mqd = mq_open(SERIAL_TX_QUEUE, O_RDONLY | O_NONBLOCK);
 	#endif
+	if(mqd < (mqd_t) 0){
+		errMsg("Serial8051ReceiveLarge: Failed to open receive queue");
+		return SERIAL_RECEIVE_OPEN_FAILURE;
+	}
+
+	if(mq_getattr(mqd, &attr) == -1){
+		errMsg("Serial8051ReceiveLarge: Failed to get message attributes");
+		mq_close(mqd);
+		return SERIAL_RECEIVE_MESSAGE_ATTR_FAIL;
+	}
 
-	ASCIIHexToBytes( &ASCII_Buff[MSG_HEADER_LENGTH], RxBuffer, (CurrentMsgInfo->MsgLength) * 2 );
+	/* Room for a compressed fragment to expand after the frame */
+	MsgBuffer = (ARM_char_t *) malloc(attr.mq_msgsize + MAX_MSG_SIZE);
+	if(MsgBuffer == NULL){
+		mq_close(mqd);
+		return SERIAL_RECEIVE_BUFF_ALLOCATE_FAIL;
+	}
 
-	/*
-	#if DEBUG_LEVEL > 15
-		for(i=0; i<(120); i++){
-			printf(" %x",RxBuffer[i]);
+	/* One frame at a time until a whole message is in, or we run out */
+	while((numRead = mq_receive(mqd, MsgBuffer, attr.mq_msgsize, &prio)) != -1){
+
+		DecodeReturn = DecodePacketInPlace(MsgBuffer, (int32_t)numRead, &View);
+		if(DecodeReturn < 0){
+			Return = SERIAL_RECEIVE_NO_HEADER_FAIL;
+			break;
 		}
-printf("\n");
-#endif */
 
-	#if DEBUG_LEVEL > 15
-		printf("Serial8051Receive: Cleared ASCIIHexToBytes\n ");
-	#endif
+		DecodeReturn = ExpandPayload(&View, (uint8_t *)&MsgBuffer[attr.mq_msgsize], MAX_MSG_SIZE);
+		if(DecodeReturn < 0){
+			Return = DecodeReturn;
+			break;
+		}
 
+		/* Not a fragment, hand it over as is */
+		if(!(View.Info.MsgFlags & (MSG_FLAG_MORE_FRAGMENTS | MSG_FLAG_FRAGMENT))){
+			if(View.Length > BufferSize){
+				Return = SERIAL_RECEIVE_BUFF_TOO_SMALL;
+				break;
+			}
 
-	free(ASCII_Buff);
+			memcpy(RxBuffer, View.Data, (size_t)View.Length);
+			*CurrentMsgInfo = View.Info;
+			Return = View.Length;
+			break;
+		}
+
+		DecodeReturn = FragmentReassemble(&View, RxBuffer, BufferSize, CurrentMsgInfo);
+
+		if(DecodeReturn > 0){
+			Return = DecodeReturn;
+			break;
+		}
+
+		#if DEBUG_LEVEL > 10
+			if(DecodeReturn < 0)
+				printf("Serial8051ReceiveLarge: Fragment dropped, error = %i\n", DecodeReturn);
+		#endif
+	}
 
-	/* Close message queue before returning */
 	if(mq_close(mqd) < (int32_t)0){
-			errMsg("Seral8051Receive: Close Failed\n");
+			errMsg("Serial8051ReceiveLarge: Close Failed\n");
 	}
 
-	#if DEBUG_LEVEL > 15
-		printf("Serial8051Receive: Cleared the mq_close\n ");
-	#endif
+	free(MsgBuffer);
 
-	return numRead;
+	return Return;
 }
 
 #ifdef TESTMODE
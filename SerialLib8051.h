@@ -7,6 +7,8 @@
 
 #include "typedef.h"
 #include "SerialMsgUtils.h"
+#include "SerialCompress.h"
+#include "SerialFragment.h"
 #include <syslog.h>
 
 
@@ -18,6 +20,7 @@
  * path!!! */
 #define SERIAL_TX_QUEUE "/TxMq"
 #define SERIAL_RX_QUEUE "/RxMqSupervisor"
+#define SERIAL_SUB_QUEUE "/SubMqSupervisor"
 
 
 /* test files */
@@ -31,6 +34,10 @@
 #define MAX_MSG_CNT 		100
 #define MAX_MSG_SIZE		750
 
+/* How long Serial8051Send waits on a full TX queue between fragments
+ * of a large message before giving up */
+#define FRAGMENT_SEND_TIMEOUT_S	5
+
 
 /* codes to keep track of errors */
 
@@ -42,9 +49,75 @@
 #define MAX_READ_BYTES 		255
 #define MAX_RX_BUFF_SIZE 	1020
 
+/* Subscription requests, from Serial8051Subscribe to the Daemon over
+ * SERIAL_SUB_QUEUE. Frames with a MsgID in [FirstID, LastID] are routed
+ * to QueueName instead of SERIAL_RX_QUEUE, which only gets the frames
+ * no one subscribed to */
+#define SUB_QUEUE_NAME_MAX	64
+#define SUB_CMD_ADD			1
+#define SUB_CMD_REMOVE		2
+
+typedef struct SerialSubscribeMsg{
+		uint8_t		Command;
+		uint8_t		FirstID;
+		uint8_t		LastID;
+		char		QueueName[SUB_QUEUE_NAME_MAX];
+	}SerialSubscribeMsg;
+
+/* Unix domain (SOCK_SEQPACKET) socket the Daemon also takes clients
+ * on, see SerialSocket.h. While the Daemon is listening Serial8051Send
+ * uses it instead of the TX queue, and Serial8051Receive reads it for
+ * the MsgIDs given to Serial8051SocketSubscribe. The environment
+ * variable overrides the path to match the Daemon's -u */
+#define SERIAL_SOCKET_PATH		"/tmp/SerialDaemon8051.sock"
+#define SERIAL_SOCKET_ENV		"SERIAL8051_SOCKET"
+
+/* Shared memory table the Daemon keeps the last value of each MsgID
+ * in, see SerialCache.h. The environment variable overrides the name
+ * to match the Daemon's -k */
+#define SERIAL_CACHE_NAME		"/SerialCache8051"
+#define SERIAL_CACHE_ENV		"SERIAL8051_CACHE"
+
+/* Durable TX queue, see SerialJournal.h. A message sent with this bit
+ * in its Priority goes into the journal and is on disk when
+ * Serial8051Send returns. The environment variable overrides the path
+ * to match the Daemon's -j */
+#define SERIAL_TX_DURABLE		0x80000000U
+#define SERIAL_JOURNAL_PATH		"/var/lib/SerialDaemon8051.journal"
+#define SERIAL_JOURNAL_ENV		"SERIAL8051_JOURNAL"
+
+/* Largest frame sent either way on the socket */
+#define SERIAL_SOCKET_FRAME_MAX	PACKET_FRAME_LENGTH(MAX_MSG_SIZE)
+
+/* Messages Serial8051SendBatch hands the kernel in one sendmmsg */
+#define SERIAL_SEND_BATCH_MAX	8
+
+/* One message for Serial8051SendBatch, the arguments of Serial8051Send */
+typedef struct SerialTxRequest{
+		uint8_t		*TxBuffer;
+		int32_t		Length;			/* At most MAX_MSG_SIZE/2, no fragmenting */
+		uint8_t		MsgID;
+		uint16_t	SequenceCount;
+		uint8_t		MsgFlags;
+		uint32_t	Priority;		/* As Serial8051Send's */
+		uint32_t	TtlMs;			/* See Serial8051SendTtl, 0 for none */
+	}SerialTxRequest;
+
 int32_t Serial8051Open(const char *);
 int32_t Serial8051Send(uint8_t *TxBuffer, int32_t Length, uint8_t MsgID, uint16_t SequenceCount, uint8_t MsgFlags, uint32_t Priority);
+int32_t Serial8051SendTtl(uint8_t *TxBuffer, int32_t Length, uint8_t MsgID, uint16_t SequenceCount, uint8_t MsgFlags, uint32_t Priority, uint32_t TtlMs);
 int32_t Serial8051Receive(uint8_t *RxBuffer, RxMsgInfo * CurrentMsgInfo );
+int32_t Serial8051ReceiveView(ARM_char_t *MsgBuffer, int32_t BufferSize, RxMsgView *View );
+int32_t Serial8051ReceiveFrom(const char *QueueName, ARM_char_t *MsgBuffer, int32_t BufferSize, RxMsgView *View );
+int32_t Serial8051Subscribe(const char *QueueName, uint8_t FirstID, uint8_t LastID );
+int32_t Serial8051Unsubscribe(const char *QueueName );
+int32_t Serial8051ReceiveLarge(uint8_t *RxBuffer, int32_t BufferSize, RxMsgInfo *CurrentMsgInfo );
+void Serial8051CompressionStats(SerialCompressStats *Stats);
+void Serial8051FragmentStats(SerialFragmentStats *Stats);
+int32_t Serial8051SendBatch(const SerialTxRequest *Requests, int32_t Count);
+int32_t Serial8051SocketSubscribe(uint8_t FirstID, uint8_t LastID );
+int32_t Serial8051SocketUnsubscribe(void);
+int32_t Serial8051SocketFd(void);
 
 
 /* Error Return Codes */
@@ -54,6 +127,8 @@ int32_t Serial8051Receive(uint8_t *RxBuffer, RxMsgInfo * CurrentMsgInfo );
 #define SERIAL_RECEIVE_BUFF_ALLOCATE_FAIL 	-3
 #define SERIAL_RECEIVE_MSG_READ_FAIL 		-4
 #define SERIAL_RECEIVE_NO_HEADER_FAIL		-5
+#define SERIAL_RECEIVE_BUFF_TOO_SMALL		-6
+#define SERIAL_RECEIVE_DECOMPRESS_FAIL		-7
 #define SEM_OPEN_FAILURE					-1
 #define SEM_GET_VALUE_FAIL					-2
 #define SEM_QUEUE_FAIL						-3
@@ -61,6 +136,9 @@ int32_t Serial8051Receive(uint8_t *RxBuffer, RxMsgInfo * CurrentMsgInfo );
 #define MSG_QUEUE_OPEN_FAIL 				-1
 #define MSG_SEND_FAIL						-2
 #define MSG_CLOSE_FAIL						-3
+#define SUBSCRIBE_BAD_ARGS					-1
+#define SUBSCRIBE_NO_DAEMON					-2
+#define SUBSCRIBE_SEND_FAIL					-3
 
 
 #endif /* SERIALTESTJIG_H_ */
@@ -0,0 +1,727 @@
+/*
+ * SerialLink.c
+ *
+ *  Link speed negotiation with the 8051, see SerialLink.h
+ */
+
+#include <fcntl.h>
+#include <termios.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <linux/serial.h>
+
+#include "tlpi_hdr.h"
+#include "SerialLink.h"
+
+/* Largest control frame payload, the probe */
+#define LINK_PAYLOAD_MAX		LINK_PROBE_BYTES
+
+/* No reply before the deadline */
+#define LINK_NO_REPLY			0
+
+static const struct { speed_t Code; int32_t Bps; } Rates[LINK_RATE_COUNT] = {
+	{ B9600, 9600 }, { B19200, 19200 }, { B38400, 38400 }, { B57600, 57600 },
+	{ B115200, 115200 }, { B230400, 230400 }, { B460800, 460800 }, { B921600, 921600 } };
+
+typedef struct{
+	uint32_t Negotiations;
+	uint32_t Upgrades;
+	uint32_t ProbeFailures;
+	uint32_t Fallbacks;
+	uint32_t NoReply;		/* Negotiations the MCU didn't answer */
+	uint32_t StrayFrames;	/* Control frames nobody was waiting for */
+	uint32_t BadFrames;		/* Seen while negotiating */
+}LinkCounters;
+
+/* The last probe that passed or failed */
+typedef struct{
+	int32_t Bps;
+	int32_t Echoes;
+	int32_t Errors;
+	int32_t PayloadBytesPerSec;
+	int32_t RoundTripUs;
+}LinkProbeResult;
+
+static int32_t MaxIndex = -1;		/* -1 with negotiation off */
+static int32_t CurrentIndex = LINK_RATE_9600;
+static uint32_t PeerMask = 0;
+static uint32_t BadMask = 0;
+
+static LinkCounters Counters;
+static LinkProbeResult LastProbe;
+
+/* Error counts at the last watchdog period */
+static Boolean Baseline = FALSE;
+static uint32_t LastBadFrames = 0;
+static uint32_t LastLineErrors = 0;
+static int32_t ErrorPeriods = 0;
+
+/* Bytes read while negotiating, frames for clients go on to Deliver */
+static ARM_char_t RxData[2*PACKET_FRAME_LENGTH(MAX_MSG_SIZE)];
+static int32_t RxLength = 0;
+static LinkFrameFn Deliver = NULL;
+static uint16_t SeqCount = 0;
+
+
+static int64_t
+LinkNowUs(void){
+
+	struct timespec Now;
+
+	clock_gettime(CLOCK_MONOTONIC, &Now);
+
+	return (int64_t)Now.tv_sec*1000000 + Now.tv_nsec/1000;
+}
+
+static void
+LinkSleepMs(int32_t Ms ){
+
+	struct timespec Pause;
+
+	Pause.tv_sec = Ms/1000;
+	Pause.tv_nsec = (long)(Ms%1000)*1000*1000;
+
+	while(nanosleep(&Pause, &Pause) == -1 && errno == EINTR)
+		;
+}
+
+/* Line time of Bytes at the rate Index, with a margin for the MCU to
+ * answer, in ms */
+static int32_t
+ReplyWaitMs(int32_t Index, int32_t Bytes ){
+
+	return LINK_REPLY_MS + (int32_t)(((int64_t)Bytes*10*1000)/Rates[Index].Bps);
+}
+
+static void
+RxDrop(int32_t Bytes ){
+
+	memmove(RxData, &RxData[Bytes], (size_t)(RxLength - Bytes));
+	RxLength -= Bytes;
+}
+
+/* Write a whole control frame, the fd is non blocking here
+ *
+ *  RETURNS:
+ *  1 if sucessful, LINK_TTY_FAIL if failure
+*/
+static int32_t
+LinkSend(int ttyFd, const uint8_t *Payload, int32_t Length ){
+
+	ARM_char_t Frame[PACKET_FRAME_LENGTH(LINK_PAYLOAD_MAX)];
+	PacketHdr Hdr;
+	struct pollfd Pfd;
+	int64_t DeadlineUs;
+	int32_t FrameLength, Sent = 0;
+	ssize_t Written;
+
+	BuildPacketHdr(Length, LINK_MSGID, 0, SeqCount++, &Hdr);
+	memcpy(Frame, &Hdr, MSG_HEADER_LENGTH);
+	BytesToASCIIHex((uint8_t *)Payload, (uint8_t *)&Frame[MSG_HEADER_LENGTH], Length);
+
+	FrameLength = PACKET_FRAME_LENGTH(Length);
+	Frame[FrameLength - 1] = '\n';
+
+	/* Room in the output buffer could be held off by flow control */
+	DeadlineUs = LinkNowUs() + (int64_t)LINK_REPLY_MS*1000;
+
+	while(Sent < FrameLength)
+	{
+		Written = write(ttyFd, &Frame[Sent], (size_t)(FrameLength - Sent));
+
+		if(Written > 0)
+		{
+			Sent += (int32_t)Written;
+			continue;
+		}
+
+		if(Written < 0 && errno != EAGAIN && errno != EINTR)
+			return LINK_TTY_FAIL;
+
+		if(LinkNowUs() >= DeadlineUs)
+			return LINK_TTY_FAIL;
+
+		Pfd.fd = ttyFd;
+		Pfd.events = POLLOUT;
+		poll(&Pfd, 1, 10);
+	}
+
+	return 1;
+}
+
+/* Read until a control frame with command Cmd comes in, or DeadlineUs
+ * (CLOCK_MONOTONIC) passes. Other frames go to Deliver, other control
+ * frames are stray
+ *
+ *  RETURNS:
+ *  Payload bytes, LINK_NO_REPLY at the deadline, LINK_TTY_FAIL if the
+ *  tty failed
+*/
+static int32_t
+LinkWaitFor(int ttyFd, uint8_t Cmd, uint8_t *Payload, int64_t DeadlineUs ){
+
+	struct pollfd Pfd;
+	RxMsgInfo Info;
+	int32_t Skip, FrameLength, Length, Waited;
+	int64_t NowUs;
+	ssize_t Read;
+
+	for( ;; )
+	{
+		Skip = FindPacketHeader(RxData, RxLength);
+		if(Skip > 0)
+		{
+			RxDrop(Skip);
+			continue;
+		}
+
+		if(RxLength >= MSG_HEADER_LENGTH)
+		{
+			if(ProcessPacket(&Info, RxData) < 0)
+				FrameLength = -1;
+			else
+				FrameLength = PACKET_FRAME_LENGTH(Info.MsgLength);
+
+			if(FrameLength < 0 || (FrameLength <= RxLength && RxData[FrameLength - 1] != '\n'))
+			{
+				Counters.BadFrames++;
+				RxDrop(1);
+				continue;
+			}
+
+			if(FrameLength <= RxLength)
+			{
+				if(Info.MsgID != LINK_MSGID)
+				{
+					if(Deliver != NULL)
+						Deliver(RxData, FrameLength);
+
+					RxDrop(FrameLength);
+					continue;
+				}
+
+				if(Info.MsgLength < 1 || Info.MsgLength > LINK_PAYLOAD_MAX)
+				{
+					Counters.StrayFrames++;
+					RxDrop(FrameLength);
+					continue;
+				}
+
+				Length = ASCIIHexToBytes(&RxData[MSG_HEADER_LENGTH], Payload, Info.MsgLength*2);
+				RxDrop(FrameLength);
+
+				if(Payload[0] == Cmd)
+					return Length;
+
+				Counters.StrayFrames++;
+				continue;
+			}
+		}
+
+		NowUs = LinkNowUs();
+		if(NowUs >= DeadlineUs)
+			return LINK_NO_REPLY;
+
+		Pfd.fd = ttyFd;
+		Pfd.events = POLLIN;
+		Waited = poll(&Pfd, 1, (int)((DeadlineUs - NowUs + 999)/1000));
+
+		if(Waited == -1 && errno != EINTR)
+			return LINK_TTY_FAIL;
+
+		if(Waited <= 0)
+			continue;
+
+		if((Pfd.revents & (POLLERR | POLLNVAL)) || ((Pfd.revents & POLLHUP) && !(Pfd.revents & POLLIN)))
+			return LINK_TTY_FAIL;
+
+		/* A frame can't be that long, what's there is junk */
+		if(RxLength == (int32_t)sizeof(RxData))
+			RxLength = 0;
+
+		Read = read(ttyFd, &RxData[RxLength], sizeof(RxData) - (size_t)RxLength);
+
+		if(Read > 0)
+			RxLength += (int32_t)Read;
+		else if(Read == 0 || (errno != EAGAIN && errno != EINTR))
+			return LINK_TTY_FAIL;
+	}
+}
+
+/* Send Payload and wait for the reply Cmd, LINK_RETRIES times
+ *
+ *  RETURNS:
+ *  Reply payload bytes, LINK_NO_REPLY or LINK_TTY_FAIL
+*/
+static int32_t
+LinkRequest(int ttyFd, const uint8_t *Payload, int32_t Length, uint8_t Cmd, uint8_t *Reply ){
+
+	int32_t Tries, Return;
+
+	for(Tries = 0; Tries < LINK_RETRIES; Tries++)
+	{
+		if(LinkSend(ttyFd, Payload, Length) < 0)
+			return LINK_TTY_FAIL;
+
+		Return = LinkWaitFor(ttyFd, Cmd, Reply,
+				LinkNowUs() + (int64_t)ReplyWaitMs(CurrentIndex, 2*PACKET_FRAME_LENGTH(Length))*1000);
+
+		if(Return != LINK_NO_REPLY)
+			return Return;
+	}
+
+	return LINK_NO_REPLY;
+}
+
+/* Change our end of the link to the rate Index, whatever was read at
+ * the old rate is dropped */
+static int32_t
+LinkSetSpeed(int ttyFd, int32_t Index ){
+
+	struct termios Termios;
+
+	if(tcgetattr(ttyFd, &Termios) == -1)
+		return LINK_TTY_FAIL;
+
+	cfsetospeed(&Termios, Rates[Index].Code);
+	cfsetispeed(&Termios, Rates[Index].Code);
+
+	if(tcsetattr(ttyFd, TCSANOW, &Termios) == -1)
+		return LINK_TTY_FAIL;
+
+	tcflush(ttyFd, TCIFLUSH);
+	RxLength = 0;
+	CurrentIndex = Index;
+
+	return 1;
+}
+
+/* Let the last bytes at the old rate out before changing it */
+static void
+LinkDrain(int ttyFd ){
+
+	int64_t DeadlineUs = LinkNowUs() + (int64_t)LINK_REPLY_MS*1000;
+	int Unsent = 0;
+
+	while(ioctl(ttyFd, TIOCOUTQ, &Unsent) == 0 && Unsent > 0 && LinkNowUs() < DeadlineUs)
+		LinkSleepMs(1);
+
+	tcdrain(ttyFd);
+}
+
+/* Look for the MCU at the safe rate, for up to WaitMs. Long enough
+ * and it has had time to give up on a rate change and come back
+ *
+ *  RETURNS:
+ *  The MCU's CAPS mask, 0 if it never answered, LINK_TTY_FAIL
+*/
+static int32_t
+LinkFindPeer(int ttyFd, int32_t WaitMs ){
+
+	uint8_t Caps[6], Reply[LINK_PAYLOAD_MAX];
+	uint32_t OwnMask;
+	int64_t DeadlineUs;
+	int32_t Return;
+
+	if(CurrentIndex != LINK_RATE_9600 && LinkSetSpeed(ttyFd, LINK_RATE_9600) < 0)
+		return LINK_TTY_FAIL;
+
+	OwnMask = (2u << MaxIndex) - 1;
+
+	Caps[0] = LINK_CMD_CAPS;
+	Caps[1] = LINK_VERSION;
+	Caps[2] = (uint8_t)OwnMask;
+	Caps[3] = (uint8_t)(OwnMask >> 8);
+	Caps[4] = (uint8_t)(OwnMask >> 16);
+	Caps[5] = (uint8_t)(OwnMask >> 24);
+
+	DeadlineUs = LinkNowUs() + (int64_t)WaitMs*1000;
+
+	do{
+		Return = LinkRequest(ttyFd, Caps, sizeof(Caps), LINK_CMD_CAPS, Reply);
+
+		if(Return < 0)
+			return LINK_TTY_FAIL;
+
+		/* The safe rate is always there, so never 0 */
+		if(Return >= 6)
+			return (int32_t)((((uint32_t)Reply[2] | (uint32_t)Reply[3] << 8 |
+					(uint32_t)Reply[4] << 16 | (uint32_t)Reply[5] << 24) & 0x7FFFFFFF) | 1u);
+
+	}while(LinkNowUs() < DeadlineUs);
+
+	return 0;
+}
+
+/* Echo LINK_PROBE_FRAMES test patterns at the current rate, one at a
+ * time. Fills in LastProbe
+ *
+ *  RETURNS:
+ *  Echoes lost or corrupted, LINK_TTY_FAIL
+*/
+static int32_t
+LinkProbe(int ttyFd ){
+
+	uint8_t Probe[LINK_PROBE_BYTES], Reply[LINK_PAYLOAD_MAX];
+	int64_t StartUs, ElapsedUs, DeadlineUs;
+	int32_t Frame, i, Return, Errors = 0, Echoes = 0, WaitMs;
+
+	WaitMs = ReplyWaitMs(CurrentIndex, 2*PACKET_FRAME_LENGTH(LINK_PROBE_BYTES));
+	StartUs = LinkNowUs();
+
+	for(Frame = 0; Frame < LINK_PROBE_FRAMES; Frame++)
+	{
+		/* Every bit pattern a bad clock tends to get wrong, runs of
+		 * ones and zeros and alternating bits */
+		Probe[0] = LINK_CMD_PROBE;
+		Probe[1] = (uint8_t)Frame;
+		for(i = 2; i < LINK_PROBE_BYTES; i++)
+			Probe[i] = (uint8_t)((Frame*LINK_PROBE_BYTES + i)*37) ^ ((i & 1) ? 0x55 : 0xAA);
+
+		if(LinkSend(ttyFd, Probe, LINK_PROBE_BYTES) < 0)
+			return LINK_TTY_FAIL;
+
+		/* A late echo of an earlier probe doesn't count for this one */
+		DeadlineUs = LinkNowUs() + (int64_t)WaitMs*1000;
+		do{
+			Return = LinkWaitFor(ttyFd, LINK_CMD_PROBE_REPLY, Reply, DeadlineUs);
+		}while(Return > 1 && Reply[1] != (uint8_t)Frame);
+
+		if(Return < 0)
+			return LINK_TTY_FAIL;
+
+		if(Return == LINK_PROBE_BYTES && memcmp(&Reply[1], &Probe[1], LINK_PROBE_BYTES - 1) == 0)
+			Echoes++;
+		else
+			Errors++;
+
+		/* Past saving, don't spend the rest of the probe on it */
+		if(Errors > LINK_PROBE_MAX_ERRORS)
+			break;
+	}
+
+	ElapsedUs = LinkNowUs() - StartUs;
+	if(ElapsedUs <= 0)
+		ElapsedUs = 1;
+
+	LastProbe.Bps = Rates[CurrentIndex].Bps;
+	LastProbe.Echoes = Echoes;
+	LastProbe.Errors = Errors;
+	/* Payload both ways, what a client gets out of the line */
+	LastProbe.PayloadBytesPerSec = (int32_t)(((int64_t)Echoes*2*LINK_PROBE_BYTES*1000000)/ElapsedUs);
+	LastProbe.RoundTripUs = (int32_t)(ElapsedUs/(Echoes + Errors));
+
+	return Errors;
+}
+
+/* Move the link to the rate Index and probe it. Left at the safe rate
+ * when it fails
+ *
+ *  RETURNS:
+ *  1 if the link is at the rate, 0 if it didn't take, LINK_TTY_FAIL
+*/
+static int32_t
+LinkTrySwitch(int ttyFd, int32_t Index ){
+
+	uint8_t Request[2], Reply[LINK_PAYLOAD_MAX];
+	int32_t Return, Errors;
+
+	Request[0] = LINK_CMD_SWITCH;
+	Request[1] = (uint8_t)Index;
+
+	Return = LinkRequest(ttyFd, Request, sizeof(Request), LINK_CMD_SWITCH_ACK, Reply);
+	if(Return < 0)
+		return LINK_TTY_FAIL;
+
+	if(Return < 2 || Reply[1] != (uint8_t)Index)
+	{
+		syslog(LOG_INFO, "Link: MCU didn't take %i bps", Rates[Index].Bps);
+		return 0;
+	}
+
+	LinkDrain(ttyFd);
+
+	if(LinkSetSpeed(ttyFd, Index) < 0)
+		return LINK_TTY_FAIL;
+
+	LinkSleepMs(LINK_SETTLE_MS);
+
+	Errors = LinkProbe(ttyFd);
+	if(Errors < 0)
+		return LINK_TTY_FAIL;
+
+	if(Errors > LINK_PROBE_MAX_ERRORS)
+	{
+		Counters.ProbeFailures++;
+		syslog(LOG_INFO, "Link: %i bps failed its probe, %i of %i echoes", Rates[Index].Bps,
+				LastProbe.Echoes, LastProbe.Echoes + LastProbe.Errors);
+		return (LinkSetSpeed(ttyFd, LINK_RATE_9600) < 0) ? LINK_TTY_FAIL : 0;
+	}
+
+	/* Echoed, so both ends know the rate is kept */
+	Request[0] = LINK_CMD_CONFIRM;
+
+	Return = LinkRequest(ttyFd, Request, sizeof(Request), LINK_CMD_CONFIRM, Reply);
+	if(Return < 0)
+		return LINK_TTY_FAIL;
+
+	if(Return == LINK_NO_REPLY)
+	{
+		syslog(LOG_INFO, "Link: %i bps not confirmed by the MCU", Rates[Index].Bps);
+		return (LinkSetSpeed(ttyFd, LINK_RATE_9600) < 0) ? LINK_TTY_FAIL : 0;
+	}
+
+	return 1;
+}
+
+/* Ask the MCU back to the safe rate and go there, while the fd is
+ * non blocking */
+static int32_t
+LinkStepDown(int ttyFd ){
+
+	uint8_t Request[2], Reply[LINK_PAYLOAD_MAX];
+
+	if(CurrentIndex == LINK_RATE_9600)
+		return 1;
+
+	Request[0] = LINK_CMD_SWITCH;
+	Request[1] = LINK_RATE_9600;
+
+	/* The link is likely bad, one try. If the MCU doesn't hear it the
+	 * framing errors at the safe rate bring it back */
+	if(LinkSend(ttyFd, Request, sizeof(Request)) < 0)
+		return LINK_TTY_FAIL;
+
+	LinkWaitFor(ttyFd, LINK_CMD_SWITCH_ACK, Reply,
+			LinkNowUs() + (int64_t)ReplyWaitMs(CurrentIndex, 2*PACKET_FRAME_LENGTH(sizeof(Request)))*1000);
+	LinkDrain(ttyFd);
+
+	return LinkSetSpeed(ttyFd, LINK_RATE_9600);
+}
+
+int32_t
+LinkRateIndex(int32_t Bps ){
+
+	int32_t i;
+
+	for(i = 0; i < LINK_RATE_COUNT; i++)
+	{
+		if(Rates[i].Bps == Bps)
+			return i;
+	}
+
+	return LINK_BAD_RATE;
+}
+
+int32_t
+LinkSpeedBps(speed_t Speed ){
+
+	int32_t i;
+
+	for(i = 0; i < LINK_RATE_COUNT; i++)
+	{
+		if(Rates[i].Code == Speed)
+			return Rates[i].Bps;
+	}
+
+	return LINK_BAD_RATE;
+}
+
+void
+LinkEnable(int32_t MaxBps ){
+
+	MaxIndex = (MaxBps > 0) ? LinkRateIndex(MaxBps) : -1;
+}
+
+Boolean
+LinkEnabled(void){
+
+	return (MaxIndex >= 0) ? TRUE : FALSE;
+}
+
+int32_t
+LinkNegotiate(int ttyFd, LinkFrameFn FrameFn ){
+
+	int32_t Index, Found, Return = 1, Flags;
+	int64_t StartUs;
+
+	if(MaxIndex < 0)
+		return Rates[CurrentIndex].Bps;
+
+	Flags = fcntl(ttyFd, F_GETFL);
+	if(Flags == -1 || fcntl(ttyFd, F_SETFL, Flags | O_NONBLOCK) == -1)
+		return LINK_TTY_FAIL;
+
+	Deliver = FrameFn;
+	RxLength = 0;
+	Counters.Negotiations++;
+	StartUs = LinkNowUs();
+
+	/* A tty just opened is at the safe rate, a fall back isn't yet */
+	Return = LinkStepDown(ttyFd);
+
+	if(Return > 0)
+	{
+		Found = LinkFindPeer(ttyFd, LINK_REVERT_MS + LINK_RETRIES*LINK_REPLY_MS);
+		Return = Found;
+
+		if(Found == 0)
+		{
+			Counters.NoReply++;
+			syslog(LOG_INFO, "Link: no reply from the MCU, staying at %i bps", Rates[LINK_RATE_9600].Bps);
+		}
+	}
+
+	if(Return > 0)
+		PeerMask = (uint32_t)Return;
+
+	/* Highest first, a failed rate is given up on and the MCU found
+	 * again at the safe rate */
+	for(Index = MaxIndex; Return > 0 && Index > LINK_RATE_9600; Index--)
+	{
+		if(!(PeerMask & (1u << Index)) || (BadMask & (1u << Index)))
+			continue;
+
+		Return = LinkTrySwitch(ttyFd, Index);
+
+		if(Return > 0)
+		{
+			Counters.Upgrades++;
+			break;
+		}
+
+		if(Return < 0)
+			break;
+
+		BadMask |= 1u << Index;
+
+		Return = LinkFindPeer(ttyFd, LINK_REVERT_MS + LINK_RETRIES*LINK_REPLY_MS);
+		if(Return > 0)
+			PeerMask = (uint32_t)Return;
+		else if(Return == 0)
+			syslog(LOG_INFO, "Link: MCU lost after %i bps failed, staying at %i bps", Rates[Index].Bps,
+					Rates[LINK_RATE_9600].Bps);
+	}
+
+	fcntl(ttyFd, F_SETFL, Flags);
+	Deliver = NULL;
+
+	/* Errors at the old rate aren't held against the new one */
+	Baseline = FALSE;
+	ErrorPeriods = 0;
+
+	if(Return < 0)
+	{
+		syslog(LOG_INFO, "Link: negotiation failed, error %s", strerror(errno));
+		return LINK_TTY_FAIL;
+	}
+
+	syslog(LOG_INFO, "Link: %i bps, MCU rates 0x%02x, in %lld ms", Rates[CurrentIndex].Bps, PeerMask,
+			(long long)((LinkNowUs() - StartUs)/1000));
+
+	if(CurrentIndex != LINK_RATE_9600)
+		syslog(LOG_INFO, "Link: probe %i of %i echoes, %i payload bytes/s of %i bytes/s line, round trip %i us",
+				LastProbe.Echoes, LastProbe.Echoes + LastProbe.Errors, LastProbe.PayloadBytesPerSec,
+				Rates[CurrentIndex].Bps/10, LastProbe.RoundTripUs);
+
+	return Rates[CurrentIndex].Bps;
+}
+
+void
+LinkRelease(int ttyFd ){
+
+	int32_t Flags;
+
+	if(CurrentIndex == LINK_RATE_9600)
+		return;
+
+	Flags = fcntl(ttyFd, F_GETFL);
+	if(Flags == -1 || fcntl(ttyFd, F_SETFL, Flags | O_NONBLOCK) == -1)
+		return;
+
+	Deliver = NULL;
+	RxLength = 0;
+
+	if(LinkStepDown(ttyFd) < 0)
+		syslog(LOG_INFO, "Link: release failed, error %s", strerror(errno));
+
+	fcntl(ttyFd, F_SETFL, Flags);
+
+	/* Whatever happened, the next tty opened is at the safe rate */
+	CurrentIndex = LINK_RATE_9600;
+}
+
+Boolean
+LinkCheckErrors(int ttyFd, uint32_t BadFrames ){
+
+	struct serial_icounter_struct Count;
+	uint32_t Errors = 0, LineErrors;
+	Boolean HaveCounts;
+
+	/* Framing, parity and overruns from the driver where it counts
+	 * them, the bad frames catch the rest */
+	HaveCounts = ioctl(ttyFd, TIOCGICOUNT, &Count) == 0;
+	LineErrors = HaveCounts ? (uint32_t)(Count.frame + Count.parity + Count.overrun + Count.buf_overrun) : 0;
+
+	if(Baseline)
+		Errors = (BadFrames - LastBadFrames) + (LineErrors - LastLineErrors);
+
+	Baseline = TRUE;
+	LastBadFrames = BadFrames;
+	LastLineErrors = LineErrors;
+
+	if(MaxIndex < 0 || CurrentIndex == LINK_RATE_9600)
+		return FALSE;
+
+	if(Errors < LINK_ERROR_THRESHOLD)
+	{
+		ErrorPeriods = 0;
+		return FALSE;
+	}
+
+	if(++ErrorPeriods < LINK_ERROR_PERIODS)
+		return FALSE;
+
+	BadMask |= 1u << CurrentIndex;
+	Counters.Fallbacks++;
+	syslog(LOG_INFO, "Link: %u errors in the last period at %i bps, falling back", Errors,
+			Rates[CurrentIndex].Bps);
+
+	return TRUE;
+}
+
+void
+LinkStrayFrame(void){
+
+	Counters.StrayFrames++;
+}
+
+int32_t
+LinkCurrentBps(void){
+
+	return Rates[CurrentIndex].Bps;
+}
+
+void
+LinkLogStats(void){
+
+	if(MaxIndex < 0)
+		return;
+
+	syslog(LOG_INFO, "Link: %i bps, up to %i, MCU rates 0x%02x, given up on 0x%02x", Rates[CurrentIndex].Bps,
+			Rates[MaxIndex].Bps, PeerMask, BadMask);
+
+	syslog(LOG_INFO, "Link: Negotiations %u, Upgrades %u, ProbeFailures %u, Fallbacks %u, NoReply %u, "
+			"StrayFrames %u, BadFrames %u", Counters.Negotiations, Counters.Upgrades, Counters.ProbeFailures,
+			Counters.Fallbacks, Counters.NoReply, Counters.StrayFrames, Counters.BadFrames);
+
+	if(LastProbe.Bps > 0)
+		syslog(LOG_INFO, "Link: last probe at %i bps, %i of %i echoes, %i payload bytes/s, round trip %i us",
+				LastProbe.Bps, LastProbe.Echoes, LastProbe.Echoes + LastProbe.Errors,
+				LastProbe.PayloadBytesPerSec, LastProbe.RoundTripUs);
+}
@@ -0,0 +1,175 @@
+/*
+ * SerialLink.h
+ *
+ *  Link speed negotiation with the 8051 (-n). The link comes up at the
+ *  safe rate, TTYBAUDRATE, which every variant runs at. The Daemon asks
+ *  the MCU which rates it supports, steps up to the highest one both
+ *  ends have that passes an echo probe, and steps back down when the
+ *  line shows persistent framing errors.
+ *
+ *  Control frames are ordinary frames with MsgID LINK_MSGID. While
+ *  negotiation is on that MsgID is the Daemon's, such frames are never
+ *  delivered to clients. The first payload byte is the command:
+ *
+ *   LINK_CMD_CAPS     Daemon -> MCU, MCU -> Daemon
+ *                     Version, then the rates the sender supports, a
+ *                     LINK_RATE_* bit mask (uint32_t little endian)
+ *   LINK_CMD_SWITCH   Daemon -> MCU, the LINK_RATE_* index to move to
+ *   LINK_CMD_SWITCH_ACK
+ *                     MCU -> Daemon, the same index, sent at the old
+ *                     rate. The MCU then changes rate
+ *   LINK_CMD_PROBE    Daemon -> MCU at the new rate, a test pattern
+ *   LINK_CMD_PROBE_REPLY
+ *                     MCU -> Daemon, the probe's payload echoed back
+ *   LINK_CMD_CONFIRM  Daemon -> MCU, the new rate is kept. The MCU
+ *                     echoes it
+ *
+ *  Two rules on the MCU side make sure the ends can't stay apart: when
+ *  LINK_REVERT_MS pass after a SWITCH_ACK with neither a PROBE nor a
+ *  CONFIRM, and whenever it sees persistent framing errors, the MCU
+ *  goes back to the safe rate. The Daemon then finds it there with a CAPS exchange, retried
+ *  for as long as the MCU may take to get there. An MCU that never
+ *  answers CAPS doesn't negotiate, the link stays at the safe rate.
+ *
+ *  A rate that failed its probe, or that the link fell back from, isn't
+ *  tried again until the Daemon restarts.
+ *
+ *  The Daemon negotiates in line: on start, when it reopens the tty and
+ *  when it falls back. Nothing else is serviced meanwhile, TX waits on
+ *  its queue and RX in the driver, apart from frames that come in with
+ *  the replies. Each rate tried can take up to LINK_RETRIES replies and
+ *  the probe, about two seconds when the MCU stops answering. Falling
+ *  back is checked from the health check, with the watchdog off (-w 0)
+ *  the Daemon never falls back by itself: the MCU's revert still takes
+ *  the MCU to the safe rate, and the link is lost until the tty is
+ *  reopened.
+ */
+
+#ifndef SERIALLINK_H_
+#define SERIALLINK_H_
+
+#include <termios.h>
+
+#include "tlpi_hdr.h"
+#include "typedef.h"
+#include "SerialMsgUtils.h"
+
+#define LINK_MSGID				0xFF
+#define LINK_VERSION			1
+
+#define LINK_CMD_CAPS			0x01
+#define LINK_CMD_SWITCH			0x02
+#define LINK_CMD_SWITCH_ACK		0x03
+#define LINK_CMD_PROBE			0x04
+#define LINK_CMD_PROBE_REPLY	0x05
+#define LINK_CMD_CONFIRM		0x06
+
+/* Rates, bit n of a CAPS mask is index n. Index 0 is the safe rate */
+#define LINK_RATE_9600			0
+#define LINK_RATE_19200			1
+#define LINK_RATE_38400			2
+#define LINK_RATE_57600			3
+#define LINK_RATE_115200		4
+#define LINK_RATE_230400		5
+#define LINK_RATE_460800		6
+#define LINK_RATE_921600		7
+#define LINK_RATE_COUNT			8
+
+/* Wait for each reply, and the tries at each step */
+#define LINK_REPLY_MS			250
+#define LINK_RETRIES			3
+
+/* MCU side, see above. The Daemon waits this long before it looks for
+ * the MCU at the safe rate */
+#define LINK_REVERT_MS			1000
+
+/* Let the UARTs settle after a rate change */
+#define LINK_SETTLE_MS			20
+
+/* The probe, LINK_PROBE_FRAMES echoes of LINK_PROBE_BYTES, passes with
+ * at most LINK_PROBE_MAX_ERRORS lost or corrupted */
+#define LINK_PROBE_FRAMES		16
+#define LINK_PROBE_BYTES		64
+#define LINK_PROBE_MAX_ERRORS	1
+
+/* Falling back: LINK_ERROR_PERIODS watchdog periods in a row, each with
+ * at least LINK_ERROR_THRESHOLD framing, parity or overrun errors, or
+ * bad frames */
+#define LINK_ERROR_THRESHOLD	4
+#define LINK_ERROR_PERIODS		3
+
+/* Error Return Codes */
+#define LINK_BAD_RATE			-1		/* Not one of the LINK_RATE_* rates */
+#define LINK_TTY_FAIL			-2
+
+/* Called with each frame other than a control frame that comes in
+ * while the link is being negotiated */
+typedef void (*LinkFrameFn)(const ARM_char_t *Frame, int32_t Length);
+
+
+/* LINK_RATE_* index of a rate in bits per second
+ *
+ *  RETURNS:
+ *  The index, LINK_BAD_RATE if it isn't one
+*/
+int32_t
+LinkRateIndex(int32_t Bps );
+
+/* Bits per second of a tty speed (cfgetospeed) that is one of the
+ * LINK_RATE_* rates
+ *
+ *  RETURNS:
+ *  The rate, LINK_BAD_RATE if it isn't one
+*/
+int32_t
+LinkSpeedBps(speed_t Speed );
+
+/* Set the highest rate to negotiate up to, 0 turns negotiation off.
+ * The tty speed itself only changes in LinkNegotiate */
+void
+LinkEnable(int32_t MaxBps );
+
+/* TRUE while negotiation is on */
+Boolean
+LinkEnabled(void);
+
+/* Bring the link up to the best rate both ends can hold. A tty just
+ * opened is at the safe rate. Blocks for up to a few seconds, frames
+ * that aren't control frames go to Deliver
+ *
+ *  RETURNS:
+ *  The rate in bits per second, LINK_TTY_FAIL if the tty failed
+*/
+int32_t
+LinkNegotiate(int ttyFd, LinkFrameFn Deliver );
+
+/* Take the link back to the safe rate before the tty is closed, so
+ * the next open finds the MCU there */
+void
+LinkRelease(int ttyFd );
+
+/* Once a watchdog period, with the Daemon's bad frame count. Only run
+ * while the watchdog is on
+ *
+ *  RETURNS:
+ *  TRUE when the current rate has had persistent errors, it is then
+ *  marked bad and LinkNegotiate should be run to fall back
+*/
+Boolean
+LinkCheckErrors(int ttyFd, uint32_t BadFrames );
+
+/* A control frame that came in outside LinkNegotiate, a late reply.
+ * Counted and dropped */
+void
+LinkStrayFrame(void);
+
+/* The rate now in use, in bits per second */
+int32_t
+LinkCurrentBps(void);
+
+/* Write the negotiated rate, the last probe and the counters to the
+ * system log */
+void
+LinkLogStats(void);
+
+#endif /* SERIALLINK_H_ */
@@ -0,0 +1,830 @@
+/*
+ * SerialLoad.c
+ *
+ *  Load generator for the client library, to find where a Daemon
+ *  saturates. N producer processes call Serial8051Send and M consumers
+ *  call Serial8051Receive against a running Daemon, for a set time.
+ *
+ *  The link is looped back: whatever the Daemon writes to the tty is
+ *  written straight back to it, so each message goes producer, TX
+ *  queue, Daemon, tty, Daemon, RX queue, consumer. Without a tty a pty
+ *  is opened, start the Daemon on the slave end it names (-d). A tty
+ *  given on the command line is echoed the same way, the far end of a
+ *  null modem cable say.
+ *
+ *  Each payload starts with the time it was due to be sent, so the
+ *  consumers measure the whole trip. Paced producers (-r) stamp the
+ *  time on their schedule rather than when the send went, a producer
+ *  held up by a full queue then shows as latency instead of hiding it.
+ *
+ *   -p producers   -c consumers
+ *   -s sizes       Payload bytes, a list of sizes and ranges picked
+ *                  from at random, 16,64,100-375 say
+ *   -q priorities  The same for the TX queue priority
+ *   -r rate        Messages a second from each producer, 0 flat out
+ *   -t seconds     How long the producers run
+ *   -w ms          How long to wait after for the last messages
+ *   -i msgid       MsgID of the load, anything else received is counted
+ *                  as foreign
+ *   -P us          Consumer sleep when the RX queue is empty
+ *   -T ms          TTL of each message, see Serial8051SendTtl. Those
+ *                  the Daemon drops as too late count as lost, and are
+ *                  in its TxExpired
+ *   -H ms          Hang up the pty halfway through the run and loop back
+ *                  a new one this long after, at the same path. The
+ *                  Daemon (-d on that path, -w to reopen it) fails the
+ *                  tty with messages held and queued, and requeues them
+ *   -S             Consumers subscribe the Daemon's socket to the load's
+ *                  MsgID (Serial8051SocketSubscribe) rather than share
+ *                  the RX queue
+ *   -C             Report as one comma separated line, for sweeps
+ *   -v             Keep the library's debug and error output, which
+ *                  goes to /dev/null otherwise
+ *
+ *  Reports throughput, TX queue full and other send failures, messages
+ *  lost between the queues and percentiles of the latency. A message
+ *  of the load whose stamp doesn't match its header (another
+ *  producer's index, another count) is counted as corrupt. While the
+ *  Daemon listens on its socket the producers send on that instead.
+ *  With -S each consumer is sent every message rather than a share of
+ *  them, losses are counted against that. At the end
+ *  the Daemon is sent SIGUSR2, so its own counters (RxQueueDrops,
+ *  TxWriteStalls) for the run are in its log. Run it against a Daemon
+ *  nothing else is using, the consumers take everything off the RX
+ *  queue.
+ *
+ *  A program of its own, built with SERIAL_LOAD_MAIN defined:
+ *   gcc -DSERIAL_LOAD_MAIN SerialLoad.c SerialLib8051.c SerialMsgUtils.c
+ *       SerialCompress.c SerialFragment.c SerialJournal.c error_functions.c
+ *       get_num.c alt_functions.c -lrt -pthread
+ */
+
+/* posix_openpt and friends */
+#define _GNU_SOURCE
+
+/* Build the load generator */
+/* #define SERIAL_LOAD_MAIN */
+
+#ifdef SERIAL_LOAD_MAIN
+
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <mqueue.h>
+#include <signal.h>
+#include <semaphore.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "tlpi_hdr.h"
+#include "SerialLib8051.h"
+#include "SerialDaemon.h"
+
+#define LOAD_MAX_PROCS			64
+#define LOAD_MAX_RANGES			16
+
+/* Send time (CLOCK_MONOTONIC ns), producer and its count */
+#define LOAD_STAMP_BYTES		16
+#define LOAD_MAX_PAYLOAD		(MAX_MSG_SIZE/2)
+
+/* Latency histogram, 16 buckets to each power of two, within 1/16 */
+#define LOAD_SUB_BITS			4
+#define LOAD_SUB_BUCKETS		(1 << LOAD_SUB_BITS)
+#define LOAD_LATENCY_BUCKETS	(40 * LOAD_SUB_BUCKETS)
+
+#define LOAD_ECHO_BYTES			65536
+
+/* Where the pty is looped back with -H, so the Daemon finds the new
+ * one when it reopens the tty */
+#define LOAD_PTY_LINK			"/tmp/SerialLoad8051.pty"
+
+#define LOAD_USAGE	"%s [-p producers] [-c consumers] [-s sizes] [-q priorities] [-r rate] " \
+					"[-t seconds] [-w ms] [-i msgid] [-P us] [-T ms] [-H ms] [-S] [-C] [-v] [tty]\n"
+
+/* A list like 16,64,100-375 */
+typedef struct LoadRanges{
+		int32_t		Count;
+		int32_t		Low[LOAD_MAX_RANGES];
+		int32_t		High[LOAD_MAX_RANGES];
+	}LoadRanges;
+
+/* One process's counters, producers use the first four */
+typedef struct LoadCounters{
+		uint64_t	Sent;
+		uint64_t	QueueFull;
+		uint64_t	SendErrors;
+		uint64_t	NotifyFails;		/* Queued, but the Daemon wasn't signalled */
+		uint64_t	Received;
+		uint64_t	Foreign;
+		uint64_t	Corrupt;		/* The load's MsgID, but not a payload sent */
+		uint64_t	ReceiveErrors;
+		uint64_t	EmptyPolls;
+		uint64_t	PayloadBytes;
+		uint64_t	LatencySumUs;
+		uint64_t	LatencyMaxUs;
+		uint64_t	LastRxNs;
+		uint32_t	Latency[LOAD_LATENCY_BUCKETS];
+	}LoadCounters;
+
+/* Shared by all the processes of a run */
+typedef struct LoadShared{
+		volatile int32_t	Go;
+		volatile int32_t	Stop;
+		int32_t		ProducersDone;
+		int32_t		SocketConsumers;	/* Each gets every message */
+		int32_t		QueueConsumers;		/* Share one copy */
+		uint64_t	StartNs;
+		uint64_t	EndNs;			/* Producers stop */
+		LoadCounters	Procs[LOAD_MAX_PROCS];
+	}LoadShared;
+
+typedef struct LoadConfig{
+		int32_t		Producers;
+		int32_t		Consumers;
+		LoadRanges	Sizes;
+		LoadRanges	Priorities;
+		double		Rate;
+		int32_t		Seconds;
+		int32_t		DrainMs;
+		uint8_t		MsgID;
+		int32_t		PollUs;
+		uint32_t	TtlMs;
+		int32_t		HangupMs;
+		Boolean		Socket;
+		Boolean		Csv;
+		Boolean		Verbose;
+		const char	*SizeSpec;
+		const char	*PrioritySpec;
+	}LoadConfig;
+
+static LoadShared *Shared;
+
+
+static uint64_t
+NowNs(void){
+
+	struct timespec Now;
+
+	clock_gettime(CLOCK_MONOTONIC, &Now);
+	return (uint64_t)Now.tv_sec * 1000000000ULL + (uint64_t)Now.tv_nsec;
+}
+
+static void
+SleepUntilNs(uint64_t DueNs ){
+
+	struct timespec Due;
+
+	Due.tv_sec = (time_t)(DueNs / 1000000000ULL);
+	Due.tv_nsec = (long)(DueNs % 1000000000ULL);
+
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &Due, NULL) == EINTR)
+		;
+}
+
+/* Parse a list of values and ranges, each within Min and Max
+ *
+ *  RETURNS:
+ *  1 if sucessful, -1 if the list is bad
+*/
+static int32_t
+ParseRanges(const char *Spec, int32_t Min, int32_t Max, LoadRanges *Ranges ){
+
+	const char *Next = Spec;
+	char *End;
+	long Low, High;
+
+	Ranges->Count = 0;
+
+	while(*Next != '\0')
+	{
+		if(Ranges->Count == LOAD_MAX_RANGES)
+			return -1;
+
+		Low = strtol(Next, &End, 10);
+		if(End == Next)
+			return -1;
+
+		High = Low;
+		if(*End == '-')
+		{
+			Next = End + 1;
+			High = strtol(Next, &End, 10);
+			if(End == Next)
+				return -1;
+		}
+
+		if(Low < Min || High > Max || Low > High)
+			return -1;
+
+		Ranges->Low[Ranges->Count] = (int32_t)Low;
+		Ranges->High[Ranges->Count] = (int32_t)High;
+		Ranges->Count++;
+
+		if(*End == ',')
+			End++;
+		else if(*End != '\0')
+			return -1;
+
+		Next = End;
+	}
+
+	return (Ranges->Count > 0) ? 1 : -1;
+}
+
+/* A value from one of the ranges, each range as likely as the next */
+static int32_t
+PickFromRanges(const LoadRanges *Ranges, unsigned int *Seed ){
+
+	int32_t Which = rand_r(Seed) % Ranges->Count;
+
+	return Ranges->Low[Which] + rand_r(Seed) % (Ranges->High[Which] - Ranges->Low[Which] + 1);
+}
+
+static int32_t
+LatencyBucket(uint64_t Us ){
+
+	int32_t Exp, Bucket;
+
+	if(Us < LOAD_SUB_BUCKETS)
+		return (int32_t)Us;
+
+	Exp = 63 - __builtin_clzll(Us);
+	Bucket = (Exp - LOAD_SUB_BITS + 1) * LOAD_SUB_BUCKETS +
+			(int32_t)((Us >> (Exp - LOAD_SUB_BITS)) & (LOAD_SUB_BUCKETS - 1));
+
+	return (Bucket < LOAD_LATENCY_BUCKETS) ? Bucket : LOAD_LATENCY_BUCKETS - 1;
+}
+
+/* The top of a bucket, percentiles err on the high side */
+static uint64_t
+BucketTopUs(int32_t Bucket ){
+
+	int32_t Exp, Sub;
+
+	if(Bucket < LOAD_SUB_BUCKETS)
+		return (uint64_t)Bucket;
+
+	Exp = Bucket / LOAD_SUB_BUCKETS + LOAD_SUB_BITS - 1;
+	Sub = Bucket % LOAD_SUB_BUCKETS;
+
+	return ((uint64_t)(LOAD_SUB_BUCKETS + Sub + 1) << (Exp - LOAD_SUB_BITS)) - 1;
+}
+
+static uint64_t
+Percentile(const uint32_t *Histogram, uint64_t Total, double Fraction ){
+
+	uint64_t Want, Seen = 0;
+	int32_t Bucket;
+
+	if(Total == 0)
+		return 0;
+
+	Want = (uint64_t)((double)Total * Fraction);
+	if(Want == 0)
+		Want = 1;
+
+	for(Bucket = 0; Bucket < LOAD_LATENCY_BUCKETS; Bucket++)
+	{
+		Seen += Histogram[Bucket];
+		if(Seen >= Want)
+			return BucketTopUs(Bucket);
+	}
+
+	return BucketTopUs(LOAD_LATENCY_BUCKETS - 1);
+}
+
+/* The library prints at its DEBUG_LEVEL, and Serial8051Receive logs
+ * every empty poll, only the report is wanted */
+static void
+QuietChild(void){
+
+	int NullFd;
+
+	NullFd = open("/dev/null", O_WRONLY);
+	if(NullFd == -1)
+		return;
+
+	dup2(NullFd, STDOUT_FILENO);
+	dup2(NullFd, STDERR_FILENO);
+	close(NullFd);
+}
+
+/* Messages the consumers should get between them for each one sent */
+static uint64_t
+CopiesPerMessage(void){
+
+	return (uint64_t)Shared->SocketConsumers + (Shared->QueueConsumers > 0 ? 1 : 0);
+}
+
+static void
+WaitForGo(void){
+
+	while(!Shared->Go)
+		usleep(1000);
+}
+
+static void
+RunProducer(const LoadConfig *Config, int32_t Index ){
+
+	LoadCounters *Counters = &Shared->Procs[Index];
+	uint8_t Payload[LOAD_MAX_PAYLOAD];
+	unsigned int Seed = (unsigned int)getpid() ^ (unsigned int)NowNs();
+	uint64_t IntervalNs = 0, DueNs, StampNs;
+	uint32_t Count = 0, Producer = (uint32_t)Index;
+	int32_t Length, Return, i;
+
+	for(i = LOAD_STAMP_BYTES; i < LOAD_MAX_PAYLOAD; i++)
+		Payload[i] = (uint8_t)rand_r(&Seed);
+
+	if(Config->Rate > 0)
+		IntervalNs = (uint64_t)(1e9 / Config->Rate);
+
+	WaitForGo();
+	DueNs = Shared->StartNs;
+
+	while(NowNs() < Shared->EndNs)
+	{
+		if(IntervalNs > 0)
+		{
+			SleepUntilNs(DueNs);
+			StampNs = DueNs;
+			DueNs += IntervalNs;
+		}
+		else
+			StampNs = NowNs();
+
+		Length = PickFromRanges(&Config->Sizes, &Seed);
+		memcpy(&Payload[0], &StampNs, sizeof(StampNs));
+		memcpy(&Payload[8], &Producer, sizeof(Producer));
+		memcpy(&Payload[12], &Count, sizeof(Count));
+
+		Return = Serial8051SendTtl(Payload, Length, Config->MsgID, (uint16_t)Count, 0,
+				(uint32_t)PickFromRanges(&Config->Priorities, &Seed), Config->TtlMs);
+
+		/* A failed notify still queued the message */
+		if(Return >= 0 || Return == SEM_QUEUE_FAIL)
+		{
+			Counters->Sent++;
+			if(Return == SEM_QUEUE_FAIL)
+				Counters->NotifyFails++;
+		}
+		else if(Return == MSG_SEND_FAIL && errno == EAGAIN)
+			Counters->QueueFull++;
+		else
+			Counters->SendErrors++;
+
+		Count++;
+	}
+
+	__atomic_add_fetch(&Shared->ProducersDone, 1, __ATOMIC_RELEASE);
+}
+
+static void
+RunConsumer(const LoadConfig *Config, int32_t Index ){
+
+	LoadCounters *Counters = &Shared->Procs[Index];
+	uint8_t Payload[MAX_MSG_SIZE];
+	RxMsgInfo Info;
+	uint64_t StampNs, NowStamp, Us;
+	uint32_t Producer, Count;
+	int32_t Return;
+
+	/* Subscribed to the socket before the first message is sent */
+	if(Config->Socket && Serial8051SocketSubscribe(Config->MsgID, Config->MsgID) > 0)
+		__atomic_add_fetch(&Shared->SocketConsumers, 1, __ATOMIC_RELEASE);
+	else
+		__atomic_add_fetch(&Shared->QueueConsumers, 1, __ATOMIC_RELEASE);
+
+	WaitForGo();
+
+	while(!Shared->Stop)
+	{
+		Return = Serial8051Receive(Payload, &Info);
+
+		if(Return < 0)
+		{
+			if(Return == SERIAL_RECEIVE_MSG_READ_FAIL && errno == EAGAIN)
+				Counters->EmptyPolls++;
+			else
+				Counters->ReceiveErrors++;
+
+			usleep((useconds_t)Config->PollUs);
+			continue;
+		}
+
+		NowStamp = NowNs();
+
+		if(Info.MsgID != Config->MsgID || Return < LOAD_STAMP_BYTES)
+		{
+			Counters->Foreign++;
+			continue;
+		}
+
+		memcpy(&StampNs, Payload, sizeof(StampNs));
+		memcpy(&Producer, &Payload[8], sizeof(Producer));
+		memcpy(&Count, &Payload[12], sizeof(Count));
+
+		if(Producer >= (uint32_t)Config->Producers || (uint16_t)Count != Info.SeqCount)
+		{
+			Counters->Corrupt++;
+			continue;
+		}
+
+		Us = (NowStamp > StampNs) ? (NowStamp - StampNs) / 1000 : 0;
+
+		Counters->Received++;
+		Counters->PayloadBytes += (uint64_t)Return;
+		Counters->LatencySumUs += Us;
+		if(Us > Counters->LatencyMaxUs)
+			Counters->LatencyMaxUs = Us;
+		Counters->Latency[LatencyBucket(Us)]++;
+		Counters->LastRxNs = NowStamp;
+	}
+}
+
+/* Open a pty, its slave end at LOAD_PTY_LINK too when Linked */
+static int
+OpenPtyMaster(Boolean Linked ){
+
+	int MasterFd;
+
+	MasterFd = posix_openpt(O_RDWR | O_NOCTTY);
+	if(MasterFd == -1 || grantpt(MasterFd) == -1 || unlockpt(MasterFd) == -1)
+		errExit("posix_openpt");
+
+	if(Linked)
+	{
+		unlink(LOAD_PTY_LINK);
+		if(symlink(ptsname(MasterFd), LOAD_PTY_LINK) == -1)
+			errExit("symlink %s", LOAD_PTY_LINK);
+	}
+
+	return MasterFd;
+}
+
+/* Open a pty and wait for the Daemon to be started on its slave end */
+static int
+OpenLoadPty(Boolean Linked ){
+
+	int MasterFd;
+
+	MasterFd = OpenPtyMaster(Linked);
+
+	printf("Looping back %s, start the Daemon on it and press Enter\n",
+			Linked ? LOAD_PTY_LINK : ptsname(MasterFd));
+	fflush(stdout);
+	getchar();
+
+	return MasterFd;
+}
+
+/* Write back what the Daemon sent until DeadlineNs, or until every
+ * message sent has been received once the producers are done. Writes
+ * don't block, a Daemon busy writing isn't reading either. With
+ * HangupMs the pty is closed at HangupNs, whatever it held is lost,
+ * and a new one looped back HangupMs later. Returns the tty in use */
+static int
+EchoLink(int TtyFd, uint64_t DeadlineNs, int32_t Producers, int32_t Consumers,
+		uint64_t HangupNs, int32_t HangupMs ){
+
+	static char Echo[LOAD_ECHO_BYTES];
+	struct pollfd Pfd;
+	size_t Pending = 0;
+	ssize_t Count;
+	uint64_t Sent, Received;
+	int32_t i;
+
+	Pfd.fd = TtyFd;
+
+	while(NowNs() < DeadlineNs)
+	{
+		if(HangupMs > 0 && NowNs() >= HangupNs)
+		{
+			close(TtyFd);
+			Pending = 0;
+			SleepUntilNs(NowNs() + (uint64_t)HangupMs * 1000000ULL);
+
+			TtyFd = OpenPtyMaster(TRUE);
+			if(fcntl(TtyFd, F_SETFL, fcntl(TtyFd, F_GETFL) | O_NONBLOCK) == -1)
+				errExit("fcntl");
+			Pfd.fd = TtyFd;
+			HangupMs = 0;
+		}
+
+		Pfd.events = 0;
+		if(Pending < sizeof(Echo))
+			Pfd.events |= POLLIN;
+		if(Pending > 0)
+			Pfd.events |= POLLOUT;
+
+		if(poll(&Pfd, 1, 10) > 0)
+		{
+			/* Nobody on the slave end yet, the Daemon is still to reopen it */
+			if(Pfd.revents == POLLHUP)
+				usleep(1000);
+
+			if(Pfd.revents & POLLIN)
+			{
+				Count = read(TtyFd, &Echo[Pending], sizeof(Echo) - Pending);
+				if(Count > 0)
+					Pending += (size_t)Count;
+			}
+
+			if(Pending > 0 && (Pfd.revents & POLLOUT))
+			{
+				Count = write(TtyFd, Echo, Pending);
+				if(Count > 0)
+				{
+					memmove(Echo, &Echo[Count], Pending - (size_t)Count);
+					Pending -= (size_t)Count;
+				}
+			}
+		}
+
+		if(Pending > 0 || __atomic_load_n(&Shared->ProducersDone, __ATOMIC_ACQUIRE) < Producers)
+			continue;
+
+		for(i = 0, Sent = 0; i < Producers; i++)
+			Sent += Shared->Procs[i].Sent;
+		for(Received = 0; i < Producers + Consumers; i++)
+			Received += Shared->Procs[i].Received;
+
+		if(Received >= Sent * CopiesPerMessage())
+			return TtyFd;
+	}
+
+	return TtyFd;
+}
+
+/* The Daemon logs its counters on SIGUSR2, its pid is the value of
+ * the semaphore it creates */
+static void
+SignalDaemonStats(void){
+
+	sem_t *Sem;
+	int DaemonPid = 0;
+
+	Sem = sem_open(SERIAL_DAEMON_SEM, 0);
+	if(Sem == SEM_FAILED)
+		return;
+
+	if(sem_getvalue(Sem, &DaemonPid) == 0 && DaemonPid > 0)
+		kill(DaemonPid, SIGUSR2);
+
+	sem_close(Sem);
+}
+
+static void
+Report(const LoadConfig *Config ){
+
+	static uint32_t Histogram[LOAD_LATENCY_BUCKETS];
+	LoadCounters Total;
+	const LoadCounters *Proc;
+	uint64_t LastRxNs = 0, Expected, Lost;
+	double SendSecs, RxSecs, Mean = 0;
+	int32_t i, Bucket;
+
+	memset(&Total, 0, sizeof(Total));
+
+	for(i = 0; i < Config->Producers + Config->Consumers; i++)
+	{
+		Proc = &Shared->Procs[i];
+
+		Total.Sent += Proc->Sent;
+		Total.QueueFull += Proc->QueueFull;
+		Total.SendErrors += Proc->SendErrors;
+		Total.NotifyFails += Proc->NotifyFails;
+		Total.Received += Proc->Received;
+		Total.Foreign += Proc->Foreign;
+		Total.Corrupt += Proc->Corrupt;
+		Total.ReceiveErrors += Proc->ReceiveErrors;
+		Total.EmptyPolls += Proc->EmptyPolls;
+		Total.PayloadBytes += Proc->PayloadBytes;
+		Total.LatencySumUs += Proc->LatencySumUs;
+		if(Proc->LatencyMaxUs > Total.LatencyMaxUs)
+			Total.LatencyMaxUs = Proc->LatencyMaxUs;
+		if(Proc->LastRxNs > LastRxNs)
+			LastRxNs = Proc->LastRxNs;
+
+		for(Bucket = 0; Bucket < LOAD_LATENCY_BUCKETS; Bucket++)
+			Histogram[Bucket] += Proc->Latency[Bucket];
+	}
+
+	SendSecs = (double)(Shared->EndNs - Shared->StartNs) / 1e9;
+	RxSecs = (LastRxNs > Shared->StartNs) ? (double)(LastRxNs - Shared->StartNs) / 1e9 : 0;
+	Expected = Total.Sent * CopiesPerMessage();
+	Lost = (Expected > Total.Received) ? Expected - Total.Received : 0;
+	if(Total.Received > 0)
+		Mean = (double)Total.LatencySumUs / (double)Total.Received;
+
+	if(Config->Csv)
+	{
+		printf("# producers,consumers,socket_consumers,sizes,priorities,rate,seconds,sent,sent_per_s,queue_full,"
+				"send_errors,notify_fails,received,received_per_s,payload_bytes_per_s,lost,foreign,"
+				"corrupt,latency_mean_us,p50_us,p90_us,p99_us,p999_us,max_us\n");
+		printf("%d,%d,%d,%s,%s,%.0f,%d,%llu,%.0f,%llu,%llu,%llu,%llu,%.0f,%.0f,%llu,%llu,%llu,%.0f,%llu,%llu,%llu,%llu,%llu\n",
+				Config->Producers, Config->Consumers, Shared->SocketConsumers, Config->SizeSpec,
+				Config->PrioritySpec, Config->Rate, Config->Seconds,
+				(unsigned long long)Total.Sent, Total.Sent / SendSecs,
+				(unsigned long long)Total.QueueFull, (unsigned long long)Total.SendErrors,
+				(unsigned long long)Total.NotifyFails, (unsigned long long)Total.Received,
+				(RxSecs > 0) ? Total.Received / RxSecs : 0,
+				(RxSecs > 0) ? Total.PayloadBytes / RxSecs : 0,
+				(unsigned long long)Lost, (unsigned long long)Total.Foreign,
+				(unsigned long long)Total.Corrupt, Mean,
+				(unsigned long long)Percentile(Histogram, Total.Received, 0.50),
+				(unsigned long long)Percentile(Histogram, Total.Received, 0.90),
+				(unsigned long long)Percentile(Histogram, Total.Received, 0.99),
+				(unsigned long long)Percentile(Histogram, Total.Received, 0.999),
+				(unsigned long long)Total.LatencyMaxUs);
+		return;
+	}
+
+	printf("Producers %d, Consumers %d (%d on the socket), Sizes %s, Priorities %s, Rate %.0f/s each, %d s\n",
+			Config->Producers, Config->Consumers, Shared->SocketConsumers, Config->SizeSpec,
+			Config->PrioritySpec, Config->Rate, Config->Seconds);
+	printf("Sent %llu, %.0f/s, QueueFull %llu, SendErrors %llu, NotifyFails %llu\n",
+			(unsigned long long)Total.Sent, Total.Sent / SendSecs, (unsigned long long)Total.QueueFull,
+			(unsigned long long)Total.SendErrors, (unsigned long long)Total.NotifyFails);
+	printf("Received %llu, %.0f/s, %.2f MB/s of payload, Lost %llu (%.2f%%), Foreign %llu, "
+			"Corrupt %llu, ReceiveErrors %llu, EmptyPolls %llu\n",
+			(unsigned long long)Total.Received, (RxSecs > 0) ? Total.Received / RxSecs : 0,
+			(RxSecs > 0) ? Total.PayloadBytes / RxSecs / 1e6 : 0, (unsigned long long)Lost,
+			(Expected > 0) ? 100.0 * (double)Lost / (double)Expected : 0,
+			(unsigned long long)Total.Foreign, (unsigned long long)Total.Corrupt,
+			(unsigned long long)Total.ReceiveErrors,
+			(unsigned long long)Total.EmptyPolls);
+	printf("Latency us: mean %.0f, p50 %llu, p90 %llu, p99 %llu, p99.9 %llu, max %llu\n", Mean,
+			(unsigned long long)Percentile(Histogram, Total.Received, 0.50),
+			(unsigned long long)Percentile(Histogram, Total.Received, 0.90),
+			(unsigned long long)Percentile(Histogram, Total.Received, 0.99),
+			(unsigned long long)Percentile(Histogram, Total.Received, 0.999),
+			(unsigned long long)Total.LatencyMaxUs);
+}
+
+int
+main(int argc, char *argv[])
+{
+	LoadConfig Config;
+	pid_t Pid;
+	int opt, TtyFd;
+	int32_t i;
+	Boolean OwnPty = FALSE;
+
+	memset(&Config, 0, sizeof(Config));
+	Config.Producers = 4;
+	Config.Consumers = 2;
+	Config.SizeSpec = "16-64";
+	Config.PrioritySpec = "0";
+	Config.Seconds = 10;
+	Config.DrainMs = 2000;
+	Config.MsgID = 200;
+	Config.PollUs = 200;
+
+	while((opt = getopt(argc, argv, "p:c:s:q:r:t:w:i:P:T:H:SCv")) != -1)
+	{
+		switch(opt)
+		{
+		case 'p':
+			Config.Producers = getInt(optarg, GN_GT_0, "producers");
+			break;
+
+		case 'c':
+			Config.Consumers = getInt(optarg, GN_GT_0, "consumers");
+			break;
+
+		case 's':
+			Config.SizeSpec = optarg;
+			break;
+
+		case 'q':
+			Config.PrioritySpec = optarg;
+			break;
+
+		case 'r':
+			Config.Rate = strtod(optarg, NULL);
+			break;
+
+		case 't':
+			Config.Seconds = getInt(optarg, GN_GT_0, "seconds");
+			break;
+
+		case 'w':
+			Config.DrainMs = getInt(optarg, GN_NONNEG, "drain ms");
+			break;
+
+		case 'i':
+			Config.MsgID = (uint8_t)getInt(optarg, GN_NONNEG, "msgid");
+			break;
+
+		case 'P':
+			Config.PollUs = getInt(optarg, GN_NONNEG, "poll us");
+			break;
+
+		case 'T':
+			Config.TtlMs = (uint32_t)getInt(optarg, GN_NONNEG, "ttl ms");
+			break;
+
+		case 'H':
+			Config.HangupMs = getInt(optarg, GN_GT_0, "hangup ms");
+			break;
+
+		case 'S':
+			Config.Socket = TRUE;
+			break;
+
+		case 'C':
+			Config.Csv = TRUE;
+			break;
+
+		case 'v':
+			Config.Verbose = TRUE;
+			break;
+
+		default:
+			usageErr(LOAD_USAGE, argv[0]);
+		}
+	}
+
+	if(Config.Producers + Config.Consumers > LOAD_MAX_PROCS)
+		fatal("At most %d producers and consumers together", LOAD_MAX_PROCS);
+
+	if(ParseRanges(Config.SizeSpec, LOAD_STAMP_BYTES, LOAD_MAX_PAYLOAD, &Config.Sizes) < 0)
+		fatal("Sizes must be between %d and %d bytes, like 16,64,100-375", LOAD_STAMP_BYTES, LOAD_MAX_PAYLOAD);
+
+	if(ParseRanges(Config.PrioritySpec, 0, MQ_PRIO_MAX - 1, &Config.Priorities) < 0)
+		fatal("Priorities must be between 0 and %d, like 0-3", MQ_PRIO_MAX - 1);
+
+	if(optind < argc && Config.HangupMs > 0)
+		fatal("-H hangs up the pty it opens, not a tty given");
+
+	if(optind < argc)
+	{
+		TtyFd = open(argv[optind], O_RDWR | O_NOCTTY);
+		if(TtyFd == -1)
+			errExit("open %s", argv[optind]);
+	}
+	else
+	{
+		TtyFd = OpenLoadPty(Config.HangupMs > 0);
+		OwnPty = TRUE;
+	}
+
+	if(fcntl(TtyFd, F_SETFL, fcntl(TtyFd, F_GETFL) | O_NONBLOCK) == -1)
+		errExit("fcntl");
+
+	Shared = mmap(NULL, sizeof(LoadShared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if(Shared == MAP_FAILED)
+		errExit("mmap");
+
+	/* Consumers first, so the first messages have someone waiting */
+	for(i = Config.Producers + Config.Consumers - 1; i >= 0; i--)
+	{
+		Pid = fork();
+		if(Pid == -1)
+			errExit("fork");
+
+		if(Pid == 0)
+		{
+			close(TtyFd);
+			if(!Config.Verbose)
+				QuietChild();
+
+			if(i < Config.Producers)
+				RunProducer(&Config, i);
+			else
+				RunConsumer(&Config, i);
+			_exit(EXIT_SUCCESS);
+		}
+	}
+
+	Shared->StartNs = NowNs() + 10000000ULL;
+	Shared->EndNs = Shared->StartNs + (uint64_t)Config.Seconds * 1000000000ULL;
+	__atomic_store_n(&Shared->Go, 1, __ATOMIC_RELEASE);
+
+	TtyFd = EchoLink(TtyFd, Shared->EndNs + (uint64_t)Config.DrainMs * 1000000ULL,
+			Config.Producers, Config.Consumers,
+			Shared->StartNs + (Shared->EndNs - Shared->StartNs) / 2, Config.HangupMs);
+
+	__atomic_store_n(&Shared->Stop, 1, __ATOMIC_RELEASE);
+	while(wait(NULL) > 0 || errno == EINTR)
+		;
+
+	Report(&Config);
+	SignalDaemonStats();
+
+	/* Hanging up the pty would hang up the Daemon too */
+	if(OwnPty)
+	{
+		printf("Done, press Enter to close the pty\n");
+		fflush(stdout);
+		getchar();
+	}
+
+	exit(EXIT_SUCCESS);
+}
+
+#endif /* SERIAL_LOAD_MAIN */
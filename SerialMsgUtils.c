@@ -2,6 +2,7 @@
 #include "SerialMsgUtils.h"
 #include <stdio.h>
 #include <stddef.h>
+#include <string.h>
 
 
 #ifdef LINUX
@@ -36,28 +37,19 @@
 int32_t
 BuildPacketHdr(int32_t Length, uint8_t MsgID, uint8_t MsgFlags, uint16_t SequenceCount, PacketHdr *ReturnPacketHdr ){
 
-	/* Declare the packet header initial bytes */
-	ReturnPacketHdr-> HeaderByte1 = HEADERBYTE1;
-	ReturnPacketHdr-> HeaderByte2 = HEADERBYTE2;
-	ReturnPacketHdr-> HeaderByte3 = HEADERBYTE3;
-	ReturnPacketHdr-> HeaderByte4 = HEADERBYTE4;
-	ReturnPacketHdr-> HeaderByte5 = HEADERBYTE5;
-	ReturnPacketHdr-> HeaderByte6 = HEADERBYTE6;
-	ReturnPacketHdr-> HeaderByte7 = HEADERBYTE7;
-
-	/* UINT8_ENCODE adds 48 to message ID to prevent Message ID in range of ASCII charcters like New Line,
-	 * which could confuse the serial Hardware */
-	ReturnPacketHdr->MsgID=MsgID + UINT8_ENCODE;
-	/* Length is in bytes (after raw bytes get converted to ASCII (
-	 * HEADER_ENCODE==12288, ensures that upper and lower bytes are not
-	 * any reserved bytes like New Line, +1 is for a new line byte */
-	ReturnPacketHdr->MsgLength=(Length*2) + MSG_HEADER_LENGTH + 1 + UINT16_ENCODE;
-	/* Add 48 to Message Flags to prevent MessageFlags in range of ASCII charcters like New Line,
-	 * which could confuse the serial Hardware */
-	ReturnPacketHdr->MsgFlags=MsgFlags + UINT8_ENCODE;
-	/* Add 48 to Sequence Count to prevent data in range of ASCII charcters like New Line,
-	 * which could confuse the serial Hardware */
-	ReturnPacketHdr->SeqCount=SequenceCount + UINT8_ENCODE;
+	PacketHdrFields Fields;
+
+	/* Encode offsets (UINT8_ENCODE / UINT16_ENCODE) keep the header bytes out of the range of
+	 * ASCII charcters like New Line, which could confuse the serial Hardware, the schema
+	 * applies them */
+	Fields.MsgID = MsgID;
+	/* Length on the wire is the complete frame, after the raw bytes get converted to ASCII,
+	 * including the header and a new line byte */
+	Fields.FrameLength = PACKET_FRAME_LENGTH(Length);
+	Fields.MsgFlags = MsgFlags;
+	Fields.SeqCount = SequenceCount;
+
+	EncodePacketHdrFields((uint8_t *)ReturnPacketHdr, &Fields);
 
 	return (sizeof(PacketHdr));
 }
@@ -71,30 +63,53 @@ BuildPacketHdr(int32_t Length, uint8_t MsgID, uint8_t MsgFlags, uint16_t Sequenc
  *
  *
  *  RETURNS:
- *  Memory address of the Actual Data Bytes if sucessful,
- *  negative error code if failure
+ *  Index in RxMessage where the data bytes start if sucessful,
+ *  negative error code (PARSE_PKT_*) if failure
 */
 
-ARM_char_t
+int32_t
 ProcessPacket(RxMsgInfo *MessageInfo, ARM_char_t* RxMessage ){
 
+	PacketHdrFields Fields;
+
 #if DEBUG_LEVEL > 15
 	int i=0;
 #endif
 
 	/* Check for our initial header bytes */
-	if(RxMessage[0] == HEADERBYTE1 &&
-	   RxMessage[1] == HEADERBYTE2 &&
-	   RxMessage[2] == HEADERBYTE3 &&
-	   RxMessage[3] == HEADERBYTE4 &&
-	   RxMessage[4] == HEADERBYTE5 &&
-	   RxMessage[5] == HEADERBYTE6 &&
-	   RxMessage[6] == HEADERBYTE7 ){
+	if( !PacketHdrMagicMatch((uint8_t *)RxMessage) ){
+	#if DEBUG_LEVEL > 15
+	#ifdef LINUX
+		printf("ProcessPacketHdr: No header present\n");
+	#endif //LINUX
+	#endif //DEBUG_LEVEL . 15
+
+		return PARSE_PKT_NO_HEADER_PRESENT;
+	}
 
 	/* Remove encoding artifacts from the Build packet header step */
-	MessageInfo->MsgID=RxMessage[7]- UINT8_ENCODE;;
-	/* Combine two bytes into unsigned 16 bit integer, -1 accounts for new line character */
-	MessageInfo->MsgLength=(( ( ( ( (uint16_t )RxMessage[9] ) << 8 )| (uint16_t )RxMessage[8] )) - MSG_HEADER_LENGTH - UINT16_ENCODE)/2;
+	DecodePacketHdrFields((uint8_t *)RxMessage, &Fields);
+
+	#if DEBUG_LEVEL > 15
+		printf("\n Header: ");
+					for(i=0; i<( MSG_HEADER_LENGTH ); i++){
+								printf(" %x",RxMessage[i]);
+						}
+					printf("\n");
+	#endif //DEBUG_LEVEL
+
+	/* Prevent buffer overflows that could result from a corrupt FrameLength */
+	if( Fields.FrameLength < PACKET_FRAME_LENGTH(0) ||
+		Fields.FrameLength > PACKET_FRAME_LENGTH(MAX_MSG_SIZE) )
+	{
+		return PARSE_PKT_BAD_LENGTH;
+	}
+
+	MessageInfo->MsgID = Fields.MsgID;
+	/* Back out the header and new line, two ASCII characters per data byte */
+	MessageInfo->MsgLength = (Fields.FrameLength - PACKET_FRAME_LENGTH(0))/2;
+	MessageInfo->MsgFlags = Fields.MsgFlags;
+	MessageInfo->SeqCount = Fields.SeqCount;
 
 #if DISPLAY_MSG_LENGTH == 1
 	char UsrMsg[75];
@@ -104,42 +119,110 @@ ProcessPacket(RxMsgInfo *MessageInfo, ARM_char_t* RxMessage ){
 	closelog();
 #endif
 
-	/* Prevent buffer overflows that could result from the MsgLength being wrong (due to Endian stuff)  */
-	if( MessageInfo->MsgLength > MAX_MSG_SIZE )
-	{
-		MessageInfo->MsgLength=(( ( ( ( (uint16_t )RxMessage[8] ) << 8 )| (uint16_t )RxMessage[9] )) - MSG_HEADER_LENGTH - UINT16_ENCODE)/2;
-	}
+	/* Index in Buffer where the data bytes start */
+	return ( MSG_HEADER_LENGTH );
+}
 
-	#if DEBUG_LEVEL > 15
-		printf("\n Header: ");
-					for(i=0; i<( MSG_HEADER_LENGTH ); i++){
-								printf(" %x",RxMessage[i]);
-						}
-					printf("\n");
-	#endif //DEBUG_LEVEL
 
-	MessageInfo->MsgFlags=RxMessage[10]- UINT8_ENCODE;;
-	/* Make sure you are using the right Endian!!!!! Otherwise you might get a too large or too
-	 * small number here */
-	MessageInfo->SeqCount=  ( ( ( (uint16_t )RxMessage[13] ) << 8 ) | (uint16_t )RxMessage[11] ) -UINT16_ENCODE;
 
-	/* Address in Buffer where the data bytes start */
-	ARM_char_t DataIndex = 13;
+/* Parse the header and decode the ASCII hex data of a packet in place.
+ * The decoded bytes are written over the start of Buffer, which is safe
+ * since the raw bytes take half the room of their ASCII encoding.
+ *
+ *  INPUTS:
+ *  Buffer - Received packet, header first. Overwritten by the decode
+ *  BufferLength - Number of valid bytes in Buffer
+ *  View - Filled in with the header info, and a pointer/length
+ *  	of the decoded data inside Buffer
+ *
+ *  RETURNS:
+ *  Number of decoded data bytes if sucessful,
+ *  negative error code (PARSE_PKT_*) if failure
+*/
+int32_t
+DecodePacketInPlace(ARM_char_t *Buffer, int32_t BufferLength, RxMsgView *View ){
 
-	return ( DataIndex );
-	}
-	else{
-	#if DEBUG_LEVEL > 15
-	#ifdef LINUX
-		printf("ProcessPacketHdr: No header present\n");
-	#endif //LINUX
-	#endif //DEBUG_LEVEL . 15
+	int32_t DataIndex;
 
-		return PARSE_PKT_NO_HEADER_PRESENT;
-	}
+	if( BufferLength < MSG_HEADER_LENGTH )
+		return PARSE_PKT_TRUNCATED;
+
+	DataIndex = ProcessPacket( &View->Info, Buffer );
+
+	if( DataIndex < 0 )
+		return DataIndex;
+
+	if( View->Info.MsgLength > MAX_MSG_SIZE )
+		return PARSE_PKT_BAD_LENGTH;
+
+	/* Make sure the ASCII data the header claims is actually in the buffer,
+	 * otherwise we would decode whatever follows the message */
+	if( DataIndex + ((int32_t)View->Info.MsgLength)*2 > BufferLength )
+		return PARSE_PKT_TRUNCATED;
+
+	/* The header has been copied into View->Info, so the decoded bytes can go
+	 * right over it. Output index never passes the input index, so
+	 * ASCIIHexToBytes never overwrites characters it still has to read */
+	ASCIIHexToBytes( &Buffer[DataIndex], (uint8_t *)Buffer, ((int32_t)View->Info.MsgLength)*2 );
+
+	View->Data = (uint8_t *)Buffer;
+	View->Length = View->Info.MsgLength;
+
+	return View->Length;
 }
 
 
+/* Find the first packet header in a buffer of received bytes, so a
+ * receiver that starts mid packet, or sees line noise, can throw away
+ * the junk in front of the next header instead of the whole buffer.
+ *
+ *  INPUTS:
+ *  Buffer - Received bytes
+ *  Length - Number of bytes in Buffer
+ *
+ *  RETURNS:
+ *  Offset of the first header, or of a partial header at the very end
+ *  of Buffer that may complete with more bytes. Length if there is no
+ *  header at all. Everything before the returned offset is junk.
+*/
+int32_t
+FindPacketHeader(const ARM_char_t *Buffer, int32_t Length ){
+
+	static const ARM_char_t Magic[PACKET_HDR_MAGIC_LENGTH] = { HEADERBYTE1, HEADERBYTE2, HEADERBYTE3,
+			HEADERBYTE4, HEADERBYTE5, HEADERBYTE6, HEADERBYTE7 };
+	const ARM_char_t *Candidate;
+	int32_t Offset = 0, Remaining;
+
+	while( Offset < Length ){
+
+		/* memchr skips through junk a word at a time, only stop
+		 * where the first magic byte shows up */
+		Candidate = memchr(&Buffer[Offset], HEADERBYTE1, (size_t)(Length - Offset));
+
+		if( Candidate == NULL )
+			return Length;
+
+		Offset = (int32_t)(Candidate - Buffer);
+		Remaining = Length - Offset;
+
+		/* Enough bytes for the 64 bit compare of the whole magic */
+		if( Remaining >= (int32_t)sizeof(uint64_t) ){
+			if( PacketHdrMagicMatch((const uint8_t *)Candidate) )
+				return Offset;
+		}
+		/* Too close to the end to tell, keep it if what is there matches
+		 * the start of the magic, the rest may arrive with the next read */
+		else if( memcmp(Candidate, Magic,
+				(size_t)(Remaining < PACKET_HDR_MAGIC_LENGTH ? Remaining : PACKET_HDR_MAGIC_LENGTH)) == 0 ){
+			return Offset;
+		}
+
+		Offset++;
+	}
+
+	return Length;
+}
+
 
 /* Convert Raw Byte data to array of ASCII characters, representing
  * the HEX values of the raw bytes
@@ -187,7 +270,7 @@ BytesToASCIIHex(uint8_t *RawByteIn, uint8_t *ASCIIHexOut, int32_t Length ){
 
 		/* Repeat Upper nibble ASCII conversion for the lower
 		 * nibble */
-		LowerNibble = RawByteIn[i] & 0x00FF;
+		LowerNibble = RawByteIn[i] & 0x0F;
 
 		if(LowerNibble >= 0x0A)
 			LowerNibble+=55;
@@ -213,7 +296,8 @@ BytesToASCIIHex(uint8_t *RawByteIn, uint8_t *ASCIIHexOut, int32_t Length ){
  *
  * INPUTS:
  * ASCIIHexIn - Pointer to Input Array of ASCII
- * ASCIIHexOut- Pointer to Output array of Bytes
+ * ASCIIHexOut- Pointer to Output array of Bytes, may point at
+ * 	(or before) ASCIIHexIn to decode in place
  * Length- Bytes in input array
  * DataPointer - Pointer to the start of the data in the received hex byte buffer
  *
@@ -275,3 +359,118 @@ ASCIIHexToBytes( ARM_char_t *ASCIIHexIn, uint8_t *RawByteOut, int32_t Length ){
 	return RawByteCnt;
 
 }
+
+
+/* Size of the trailer with Marker, 0 for one that isn't known */
+static int32_t
+TxTrailerSize(uint16_t Marker ){
+
+	switch(Marker){
+	case TX_EXPIRY_MARKER:
+		return (int32_t)sizeof(TxExpiryTrailer);
+	case TX_PRIORITY_MARKER:
+		return (int32_t)sizeof(TxPriorityTrailer);
+	case TX_BUILT_MARKER:
+		return (int32_t)sizeof(TxBuiltTrailer);
+	default:
+		return 0;
+	}
+}
+
+/* Find the trailer with Marker among those after a frame
+ *
+ *  RETURNS:
+ *  Its offset in Frame, -1 if the frame doesn't have one
+*/
+static int32_t
+FindTxTrailer(const ARM_char_t *Frame, int32_t FrameLength, int32_t QueuedLength, uint16_t Marker ){
+
+	int32_t Offset = FrameLength, Size;
+	uint16_t Found;
+
+	while(Offset + (int32_t)sizeof(Found) <= QueuedLength){
+		memcpy(&Found, &Frame[Offset], sizeof(Found));
+
+		Size = TxTrailerSize(Found);
+		if(Size == 0 || Offset + Size > QueuedLength)
+			return -1;
+
+		if(Found == Marker)
+			return Offset;
+
+		Offset += Size;
+	}
+
+	return -1;
+}
+
+int32_t
+AppendTxExpiry(ARM_char_t *Frame, int32_t FrameLength, int64_t ExpiresUs ){
+
+	TxExpiryTrailer Trailer;
+
+	Trailer.Marker = TX_EXPIRY_MARKER;
+	Trailer.ExpiresUs = ExpiresUs;
+	memcpy(&Frame[FrameLength], &Trailer, sizeof(Trailer));
+
+	return FrameLength + (int32_t)sizeof(Trailer);
+}
+
+int64_t
+TxExpiry(const ARM_char_t *Frame, int32_t FrameLength, int32_t QueuedLength ){
+
+	TxExpiryTrailer Trailer;
+	int32_t Offset;
+
+	Offset = FindTxTrailer(Frame, FrameLength, QueuedLength, TX_EXPIRY_MARKER);
+	if(Offset < 0)
+		return 0;
+
+	memcpy(&Trailer, &Frame[Offset], sizeof(Trailer));
+
+	return Trailer.ExpiresUs;
+}
+
+int32_t
+AppendTxPriority(ARM_char_t *Frame, int32_t Length, uint32_t Priority ){
+
+	TxPriorityTrailer Trailer;
+
+	Trailer.Marker = TX_PRIORITY_MARKER;
+	Trailer.Priority = Priority;
+	memcpy(&Frame[Length], &Trailer, sizeof(Trailer));
+
+	return Length + (int32_t)sizeof(Trailer);
+}
+
+uint32_t
+TxPriority(const ARM_char_t *Frame, int32_t FrameLength, int32_t QueuedLength ){
+
+	TxPriorityTrailer Trailer;
+	int32_t Offset;
+
+	Offset = FindTxTrailer(Frame, FrameLength, QueuedLength, TX_PRIORITY_MARKER);
+	if(Offset < 0)
+		return 0;
+
+	memcpy(&Trailer, &Frame[Offset], sizeof(Trailer));
+
+	return Trailer.Priority;
+}
+
+int32_t
+AppendTxBuilt(ARM_char_t *Frame, int32_t Length ){
+
+	TxBuiltTrailer Trailer;
+
+	Trailer.Marker = TX_BUILT_MARKER;
+	memcpy(&Frame[Length], &Trailer, sizeof(Trailer));
+
+	return Length + (int32_t)sizeof(Trailer);
+}
+
+int32_t
+TxBuilt(const ARM_char_t *Frame, int32_t FrameLength, int32_t QueuedLength ){
+
+	return (FindTxTrailer(Frame, FrameLength, QueuedLength, TX_BUILT_MARKER) >= 0) ? 1 : 0;
+}
@@ -47,6 +47,15 @@ typedef struct RxMsgInfo{
 		uint16_t	SeqCount;
 	}RxMsgInfo;
 
+/* View of a packet that was decoded in place, Data points back
+ * into the buffer the packet was received in, so no second buffer
+ * is needed to get at the payload */
+typedef struct RxMsgView{
+		RxMsgInfo	Info;
+		uint8_t		*Data;
+		int32_t		Length;
+	}RxMsgView;
+
 
 #define HEADERBYTE1 'B'
 #define HEADERBYTE2 'A'
@@ -56,8 +65,64 @@ typedef struct RxMsgInfo{
 #define	HEADERBYTE6 'F'
 #define	HEADERBYTE7 'E'
 
+/* Header encoder / decoder, generated from the header schema */
+#include "PacketHdrSchema.h"
+
+/* Wire length of a frame carrying Length raw bytes: the header, the
+ * ASCII encoded data and the trailing new line */
+#define PACKET_FRAME_LENGTH(Length)	(MSG_HEADER_LENGTH + 2*(Length) + 1)
+
+/* PacketHdr has to stay byte for byte the wire header described by the schema */
+typedef char PacketHdrSizeCheck[(sizeof(PacketHdr) == MSG_HEADER_LENGTH) ? 1 : -1];
+
+/* MsgFlags bits the library itself uses, applications should keep
+ * their own flags inside MSG_FLAGS_USER_MASK. MSG_FLAG_AGGREGATE and
+ * MSG_FLAG_DELTA are the application's too, unless the Daemon runs
+ * with -g / -x: it then takes the bit over for the link, and clears it
+ * from the frames clients send */
+#define MSG_FLAG_COMPRESSED			0x80	/* Payload is SerialCompress coded */
+#define MSG_FLAG_MORE_FRAGMENTS		0x40	/* Another fragment of this message follows */
+#define MSG_FLAG_FRAGMENT			0x20	/* Continues the message started at an earlier SeqCount */
+#define MSG_FLAG_AGGREGATE			0x10	/* With -g, several messages, see SerialAggregate.h */
+#define MSG_FLAG_DELTA				0x08	/* With -x, changed bytes, see SerialDelta.h */
+#define MSG_FLAGS_USER_MASK			0x1F
+
+/* A frame on the TX queue or the Daemon's socket may be followed, after
+ * its new line, by this trailer: the CLOCK_MONOTONIC time past which
+ * the Daemon drops the frame instead of writing it. Only the frame goes
+ * on the line, so a Daemon that doesn't look for it sends it as ever */
+#define TX_EXPIRY_MARKER			0x5845		/* "EX" */
+
+typedef struct __attribute__((__packed__))TxExpiryTrailer{
+		uint16_t	Marker;
+		int64_t		ExpiresUs;
+	}TxExpiryTrailer;
+
+/* A frame on the Daemon's socket, which has no priorities of its own,
+ * may carry its Priority in this trailer */
+#define TX_PRIORITY_MARKER			0x5250		/* "PR" */
+
+typedef struct __attribute__((__packed__))TxPriorityTrailer{
+		uint16_t	Marker;
+		uint32_t	Priority;
+	}TxPriorityTrailer;
+
+/* Marks a frame the Daemon built for the line itself, an aggregated
+ * one, and put back on the TX queue when the port failed. It goes out
+ * as it is, the flags it carries are the link's */
+#define TX_BUILT_MARKER				0x4C42		/* "BL" */
+
+typedef struct __attribute__((__packed__))TxBuiltTrailer{
+		uint16_t	Marker;
+	}TxBuiltTrailer;
+
+/* Room for every trailer a frame may have, they can come in any order */
+#define TX_TRAILERS_MAX				(sizeof(TxExpiryTrailer) + sizeof(TxPriorityTrailer) + sizeof(TxBuiltTrailer))
+
 	/* Error Codes */
-#define PARSE_PKT_NO_HEADER_PRESENT 		0
+#define PARSE_PKT_NO_HEADER_PRESENT 		-1
+#define PARSE_PKT_TRUNCATED					-2
+#define PARSE_PKT_BAD_LENGTH				-3
 
 
 
@@ -105,17 +170,110 @@ BytesToASCIIHex(uint8_t *RawByteIn, uint8_t *ASCIIHexOut, int32_t Length );
  *
  *
  *  RETURNS:
- *  Memory address of the Actual Data Bytes if sucessful,
- *  negative error code if failure
+ *  Index in RxMessage where the data bytes start if sucessful,
+ *  negative error code (PARSE_PKT_*) if failure
 */
 
-ARM_char_t
+int32_t
 ProcessPacket(RxMsgInfo *MessageInfo, ARM_char_t* RxMessage );
 
+/* Parse the header and decode the ASCII hex data of a packet in place.
+ * The decoded bytes are written over the start of Buffer, which is safe
+ * since the raw bytes take half the room of their ASCII encoding.
+ *
+ *  INPUTS:
+ *  Buffer - Received packet, header first. Overwritten by the decode
+ *  BufferLength - Number of valid bytes in Buffer
+ *  View - Filled in with the header info, and a pointer/length
+ *  	of the decoded data inside Buffer
+ *
+ *  RETURNS:
+ *  Number of decoded data bytes if sucessful,
+ *  negative error code (PARSE_PKT_*) if failure
+*/
+int32_t
+DecodePacketInPlace(ARM_char_t *Buffer, int32_t BufferLength, RxMsgView *View );
+
+/* Find the first packet header in a buffer of received bytes, so a
+ * receiver that starts mid packet, or sees line noise, can throw away
+ * the junk in front of the next header instead of the whole buffer.
+ *
+ *  INPUTS:
+ *  Buffer - Received bytes
+ *  Length - Number of bytes in Buffer
+ *
+ *  RETURNS:
+ *  Offset of the first header, or of a partial header at the very end
+ *  of Buffer that may complete with more bytes. Length if there is no
+ *  header at all. Everything before the returned offset is junk.
+*/
+int32_t
+FindPacketHeader(const ARM_char_t *Buffer, int32_t Length );
+
 /* Convert ASCII hex Representation of bytes to regular bytes (reverse
- * operations of BytesToASCIIHex */
+ * operations of BytesToASCIIHex. RawByteOut may point at (or before)
+ * ASCIIHexIn in the same buffer, to decode in place */
 
 int32_t
 ASCIIHexToBytes( ARM_char_t *ASCIIHexIn, uint8_t *RawByteOut, int32_t Length );
 
+/* Put an expiry trailer after a frame, Frame has room for
+ * sizeof(TxExpiryTrailer) more bytes
+ *
+ *  RETURNS:
+ *  Length of the frame and the trailer
+*/
+int32_t
+AppendTxExpiry(ARM_char_t *Frame, int32_t FrameLength, int64_t ExpiresUs );
+
+/* Expiry of a frame taken off the TX queue or the socket
+ *
+ *  INPUTS:
+ *  Frame - The frame, FrameLength bytes by its header
+ *  QueuedLength - Bytes that were queued, the trailer is after the frame
+ *
+ *  RETURNS:
+ *  ExpiresUs (CLOCK_MONOTONIC), 0 for a frame without one
+*/
+int64_t
+TxExpiry(const ARM_char_t *Frame, int32_t FrameLength, int32_t QueuedLength );
+
+/* Put a priority trailer after a frame and the trailers it has.
+ * Frame has room for sizeof(TxPriorityTrailer) more bytes
+ *
+ *  INPUTS:
+ *  Length - Bytes of the frame and its trailers
+ *
+ *  RETURNS:
+ *  Length with the trailer
+*/
+int32_t
+AppendTxPriority(ARM_char_t *Frame, int32_t Length, uint32_t Priority );
+
+/* Priority of a frame taken off the Daemon's socket, arguments as
+ * TxExpiry
+ *
+ *  RETURNS:
+ *  The Priority, 0 for a frame without one
+*/
+uint32_t
+TxPriority(const ARM_char_t *Frame, int32_t FrameLength, int32_t QueuedLength );
+
+/* Mark a frame as the Daemon's own, as AppendTxPriority
+ *
+ *  RETURNS:
+ *  Length with the trailer
+*/
+int32_t
+AppendTxBuilt(ARM_char_t *Frame, int32_t Length );
+
+/* Whether a frame taken off the TX queue has a TxBuiltTrailer,
+ * arguments as TxExpiry
+ *
+ *  RETURNS:
+ *  1 if it has, 0 if not
+*/
+int32_t
+TxBuilt(const ARM_char_t *Frame, int32_t FrameLength, int32_t QueuedLength );
+
 #endif /* SERIALMSGUTILS_H_ */
@@ -0,0 +1,89 @@
+/*
+ * SerialPool.c
+ *
+ *  Fixed size block pool, see SerialPool.h
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "SerialPool.h"
+
+/* Every block has to be able to hold the free list link, and keep
+ * the next block aligned for whatever is put in it */
+#define POOL_ALIGN		8
+
+
+int32_t
+PoolInit(SerialPool *Pool, const char *Name, int32_t BlockSize, int32_t BlockCount ){
+
+	int32_t i;
+
+	memset(Pool, 0, sizeof(SerialPool));
+
+	if(BlockSize <= 0 || BlockCount <= 0)
+		return POOL_ALLOCATE_FAIL;
+
+	BlockSize = (BlockSize + POOL_ALIGN - 1) & ~(POOL_ALIGN - 1);
+
+	Pool->Blocks = (uint8_t *)malloc((size_t)BlockSize * (size_t)BlockCount);
+	if(Pool->Blocks == NULL)
+		return POOL_ALLOCATE_FAIL;
+
+	Pool->Name = Name;
+	Pool->BlockSize = BlockSize;
+	Pool->BlockCount = BlockCount;
+
+	/* Thread the free list through the blocks, first block first */
+	for(i = BlockCount - 1; i >= 0; i--){
+		*(void **)&Pool->Blocks[(size_t)i*(size_t)BlockSize] = Pool->FreeList;
+		Pool->FreeList = &Pool->Blocks[(size_t)i*(size_t)BlockSize];
+	}
+
+	return BlockCount;
+}
+
+void
+PoolRelease(SerialPool *Pool ){
+
+	free(Pool->Blocks);
+	memset(Pool, 0, sizeof(SerialPool));
+}
+
+void *
+PoolAlloc(SerialPool *Pool ){
+
+	void *Block = Pool->FreeList;
+
+	if(Block == NULL){
+		Pool->Exhausted++;
+		return NULL;
+	}
+
+	Pool->FreeList = *(void **)Block;
+
+	Pool->InUse++;
+	if(Pool->InUse > Pool->HighWater)
+		Pool->HighWater = Pool->InUse;
+
+	return Block;
+}
+
+void
+PoolFree(SerialPool *Pool, void *Block ){
+
+	if(Block == NULL)
+		return;
+
+	*(void **)Block = Pool->FreeList;
+	Pool->FreeList = Block;
+	Pool->InUse--;
+}
+
+void
+PoolLogStats(const SerialPool *Pool ){
+
+	syslog(LOG_INFO, "Pool %s: %i of %i blocks (%i bytes) in use, HighWater %i, Exhausted %u",
+			Pool->Name, Pool->InUse, Pool->BlockCount, Pool->BlockSize, Pool->HighWater, Pool->Exhausted);
+}
@@ -0,0 +1,60 @@
+/*
+ * SerialPool.h
+ *
+ *  Fixed size block pool. All the blocks are allocated in one piece
+ *  when the pool is set up, allocating and freeing after that just
+ *  moves a block on or off the free list, so a long running Daemon
+ *  does no heap allocation per message and can't fragment the heap.
+ *  An empty pool fails the allocation rather than fall back on malloc.
+ */
+
+#ifndef SERIALPOOL_H_
+#define SERIALPOOL_H_
+
+#include "typedef.h"
+
+/* Error Return Codes */
+#define POOL_ALLOCATE_FAIL		-1
+
+typedef struct SerialPool{
+		const char	*Name;			/* For the stats */
+		uint8_t		*Blocks;
+		int32_t		BlockSize;
+		int32_t		BlockCount;
+		void		*FreeList;		/* Each free block holds the next one's address */
+		int32_t		InUse;
+		int32_t		HighWater;		/* Most blocks ever in use at once */
+		uint32_t	Exhausted;		/* Allocations failed for want of a block */
+	}SerialPool;
+
+
+/* Allocate every block of the pool up front
+ *
+ *  INPUTS:
+ *  Pool - Pool to initialize
+ *  Name - Shown in the stats, not copied
+ *  BlockSize - Bytes each allocation gets
+ *  BlockCount - Blocks in the pool
+ *
+ *  RETURNS:
+ *  BlockCount if sucessful, POOL_ALLOCATE_FAIL if failure
+*/
+int32_t
+PoolInit(SerialPool *Pool, const char *Name, int32_t BlockSize, int32_t BlockCount );
+
+void
+PoolRelease(SerialPool *Pool );
+
+/* A block of Pool->BlockSize bytes, NULL if every block is in use */
+void *
+PoolAlloc(SerialPool *Pool );
+
+/* Give a block back to the pool it came from, NULL is ignored */
+void
+PoolFree(SerialPool *Pool, void *Block );
+
+/* Write the pool's usage to the system log */
+void
+PoolLogStats(const SerialPool *Pool );
+
+#endif /* SERIALPOOL_H_ */
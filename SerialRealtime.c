@@ -0,0 +1,211 @@
+/*
+ * SerialRealtime.c
+ *
+ *  Real time scheduling, CPU pinning and memory locking for the
+ *  Daemon, see SerialRealtime.h
+ */
+
+/* CPU_SET and sched_setaffinity */
+#define _GNU_SOURCE
+
+#include <sched.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+
+#include "tlpi_hdr.h"
+#include "SerialRealtime.h"
+
+
+static const char *
+PolicyName(int32_t Policy ){
+
+	switch(Policy)
+	{
+	case SCHED_FIFO:
+		return "fifo";
+	case SCHED_RR:
+		return "rr";
+	default:
+		return "other";
+	}
+}
+
+/* Fault in the stack pages the Daemon will use, so locking memory
+ * covers them and a deep call never takes a fault later */
+static void
+PrefaultStack(void){
+
+	volatile uint8_t Stack[PREFAULT_STACK_BYTES];
+	long PageSize = sysconf(_SC_PAGESIZE);
+	size_t i;
+
+	if(PageSize <= 0)
+		PageSize = 4096;
+
+	for(i = 0; i < sizeof(Stack); i += (size_t)PageSize)
+		Stack[i] = 0;
+}
+
+int32_t
+RealtimeApply(const DaemonConfig *Config ){
+
+	struct sched_param Param;
+	cpu_set_t CpuSet;
+	int32_t Cpu, Return = 1;
+
+	if(Config->CpuMask != 0)
+	{
+		CPU_ZERO(&CpuSet);
+		for(Cpu = 0; Cpu < 32; Cpu++)
+		{
+			if(Config->CpuMask & (1U << Cpu))
+				CPU_SET(Cpu, &CpuSet);
+		}
+
+		if(sched_setaffinity(0, sizeof(CpuSet), &CpuSet) == -1)
+		{
+			syslog(LOG_INFO, "Realtime: CPU mask 0x%x not applied, error %s", Config->CpuMask, strerror(errno));
+			Return = REALTIME_AFFINITY_FAIL;
+		}
+		else
+			syslog(LOG_INFO, "Realtime: pinned to CPU mask 0x%x", Config->CpuMask);
+	}
+
+	/* Lock before raising the priority, faulting everything in is the
+	 * slow part and shouldn't hold the CPU away from anyone */
+	if(Config->LockMemory)
+	{
+		PrefaultStack();
+
+		/* MCL_CURRENT faults in and locks what's mapped now, the pools
+		 * and the RX buffer included. MCL_FUTURE covers the RX buffer
+		 * growing, and the capture file as it's extended */
+		if(mlockall(MCL_CURRENT | MCL_FUTURE) == -1)
+		{
+			syslog(LOG_INFO, "Realtime: mlockall failed, error %s", strerror(errno));
+			Return = REALTIME_LOCK_FAIL;
+		}
+		else
+			syslog(LOG_INFO, "Realtime: memory locked");
+	}
+	else
+		munlockall();
+
+	memset(&Param, 0, sizeof(Param));
+	if(Config->SchedPolicy != SCHED_OTHER)
+		Param.sched_priority = Config->SchedPriority;
+
+	if(sched_setscheduler(0, Config->SchedPolicy, &Param) == -1)
+	{
+		syslog(LOG_INFO, "Realtime: scheduling %s priority %i not applied, error %s",
+				PolicyName(Config->SchedPolicy), Param.sched_priority, strerror(errno));
+		Return = REALTIME_SCHED_FAIL;
+	}
+	else if(Config->SchedPolicy != SCHED_OTHER)
+		syslog(LOG_INFO, "Realtime: scheduling %s priority %i", PolicyName(Config->SchedPolicy), Param.sched_priority);
+
+	return Return;
+}
+
+static int64_t
+TimespecNs(const struct timespec *Time ){
+
+	return (int64_t)Time->tv_sec*1000000000LL + Time->tv_nsec;
+}
+
+void
+JitterMeasure(int32_t Seconds, JitterStats *Stats ){
+
+	struct timespec Due, Now;
+	int64_t LateNs, EndNs;
+	int32_t Bucket;
+
+	memset(Stats, 0, sizeof(JitterStats));
+	Stats->MinNs = INT64_MAX;
+
+	clock_gettime(CLOCK_MONOTONIC, &Due);
+	EndNs = TimespecNs(&Due) + (int64_t)Seconds*1000000000LL;
+
+	for( ;; )
+	{
+		/* Absolute due times, so the time spent here doesn't drift the
+		 * period and only the wakeup latency is measured */
+		Due.tv_nsec += JITTER_PERIOD_US*1000;
+		if(Due.tv_nsec >= 1000000000)
+		{
+			Due.tv_sec++;
+			Due.tv_nsec -= 1000000000;
+		}
+
+		if(TimespecNs(&Due) > EndNs)
+			break;
+
+		while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &Due, NULL) == EINTR)
+			;
+
+		clock_gettime(CLOCK_MONOTONIC, &Now);
+		LateNs = TimespecNs(&Now) - TimespecNs(&Due);
+
+		Stats->Samples++;
+		Stats->SumNs += LateNs;
+
+		if(LateNs < Stats->MinNs)
+			Stats->MinNs = LateNs;
+		if(LateNs > Stats->MaxNs)
+			Stats->MaxNs = LateNs;
+
+		Bucket = (int32_t)(LateNs / (JITTER_BUCKET_US*1000));
+		if(Bucket >= JITTER_BUCKETS)
+			Bucket = JITTER_BUCKETS - 1;
+
+		Stats->Histogram[Bucket]++;
+	}
+}
+
+/* Latency (us, bucket resolution) Fraction of the wakeups came within */
+static int32_t
+JitterPercentileUs(const JitterStats *Stats, double Fraction ){
+
+	uint64_t Wanted, Seen = 0;
+	int32_t Bucket;
+
+	Wanted = (uint64_t)(Fraction * Stats->Samples);
+	if(Wanted == 0)
+		Wanted = 1;
+
+	for(Bucket = 0; Bucket < JITTER_BUCKETS; Bucket++)
+	{
+		Seen += Stats->Histogram[Bucket];
+		if(Seen >= Wanted)
+			break;
+	}
+
+	return (Bucket + 1)*JITTER_BUCKET_US;
+}
+
+void
+JitterReport(const JitterStats *Stats, const DaemonConfig *Config ){
+
+	if(Stats->Samples == 0)
+	{
+		syslog(LOG_INFO, "Jitter: no samples");
+		return;
+	}
+
+	syslog(LOG_INFO, "Jitter: %s priority %i, CPU mask 0x%x, memory %s, %u wakeups every %i us",
+			PolicyName(Config->SchedPolicy), (Config->SchedPolicy != SCHED_OTHER) ? Config->SchedPriority : 0,
+			Config->CpuMask, Config->LockMemory ? "locked" : "not locked", Stats->Samples, JITTER_PERIOD_US);
+
+	syslog(LOG_INFO, "Jitter: late by min %lli us, avg %lli us, max %lli us, 99%% within %i us, 99.9%% within %i us",
+			(long long)(Stats->MinNs / 1000), (long long)(Stats->SumNs / Stats->Samples / 1000),
+			(long long)(Stats->MaxNs / 1000), JitterPercentileUs(Stats, 0.99), JitterPercentileUs(Stats, 0.999));
+
+	if(Stats->Histogram[JITTER_BUCKETS - 1] > 0)
+		syslog(LOG_INFO, "Jitter: %u wakeups %i us or more late",
+				Stats->Histogram[JITTER_BUCKETS - 1], (JITTER_BUCKETS - 1)*JITTER_BUCKET_US);
+}
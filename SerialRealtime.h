@@ -0,0 +1,75 @@
+/*
+ * SerialRealtime.h
+ *
+ *  Settings for deterministic RX servicing, applied by the Daemon at
+ *  startup. Under load from other processes an ordinary SCHED_OTHER
+ *  Daemon can be kept off the CPU for tens of milliseconds, long
+ *  enough for the UART FIFO to overrun. Each setting is optional:
+ *   -s / -R   SCHED_FIFO or SCHED_RR at a real time priority
+ *   -a        pin the Daemon to a set of CPUs
+ *   -L        mlockall, with the stack pre-faulted, so servicing RX
+ *             never waits on a page fault
+ *
+ *  The jitter mode (-J seconds) runs a periodic timer under the same
+ *  settings instead of the Daemon, and reports how late each wakeup
+ *  was. Run it with and without the settings, under the usual load,
+ *  to see what they buy.
+ */
+
+#ifndef SERIALREALTIME_H_
+#define SERIALREALTIME_H_
+
+#include "typedef.h"
+#include "SerialConfig.h"
+
+/* Touched before locking memory, deeper than the Daemon's stack gets */
+#define PREFAULT_STACK_BYTES	(64*1024)
+
+/* Jitter mode timer period */
+#define JITTER_PERIOD_US		1000
+
+/* Wakeup latency histogram, the last bucket holds everything later */
+#define JITTER_BUCKET_US		10
+#define JITTER_BUCKETS			1000
+
+/* Error Return Codes */
+#define REALTIME_SCHED_FAIL		-1
+#define REALTIME_AFFINITY_FAIL	-2
+#define REALTIME_LOCK_FAIL		-3
+
+typedef struct JitterStats{
+		uint32_t	Samples;
+		int64_t		MinNs;			/* Wakeup latency, past the due time */
+		int64_t		MaxNs;
+		int64_t		SumNs;
+		uint32_t	Histogram[JITTER_BUCKETS];
+	}JitterStats;
+
+
+/* Apply the scheduling policy, CPU affinity and memory locking from
+ * Config, each one that is asked for. A setting that fails (no
+ * CAP_SYS_NICE, a CPU that isn't there) is logged and the rest are
+ * still applied, the Daemon runs on without it
+ *
+ *  RETURNS:
+ *  1 if sucessful, the error code of the last setting that failed
+*/
+int32_t
+RealtimeApply(const DaemonConfig *Config );
+
+/* Wake every JITTER_PERIOD_US for Seconds and record how late each
+ * wakeup was
+ *
+ *  INPUTS:
+ *  Seconds - How long to measure
+ *  Stats - Filled in
+*/
+void
+JitterMeasure(int32_t Seconds, JitterStats *Stats );
+
+/* Write the measurement to the system log, which jitter mode opens
+ * with LOG_PERROR so it shows on the terminal too */
+void
+JitterReport(const JitterStats *Stats, const DaemonConfig *Config );
+
+#endif /* SERIALREALTIME_H_ */
@@ -0,0 +1,366 @@
+/*
+ * SerialReplay.c
+ *
+ *  Plays a capture (see SerialCapture.h) back, to reproduce a load
+ *  pattern from the field offline.
+ *
+ *   decode - Feeds the records through the same framing and decoding
+ *            the Daemon and the library do (FindPacketHeader,
+ *            ProcessPacket, DecodePacketInPlace, DecompressPayload)
+ *            and reports the rates, for profiling those without a link
+ *   write  - Writes the records to a tty. Without one a pty is opened,
+ *            start the Daemon on the slave end it names (-d)
+ *
+ *  Records are replayed at their original spacing divided by the speed
+ *  factor (-x), a speed of 0 plays them back to back. Only RX records
+ *  are replayed unless -D says otherwise.
+ *
+ *  A program of its own, built with SERIAL_REPLAY_MAIN defined:
+ *   gcc -DSERIAL_REPLAY_MAIN SerialReplay.c SerialCapture.c SerialMsgUtils.c
+ *       SerialRxBuffer.c SerialCompress.c error_functions.c get_num.c -lrt
+ */
+
+/* posix_openpt and friends */
+#define _GNU_SOURCE
+
+/* Build the replay tool */
+/* #define SERIAL_REPLAY_MAIN */
+
+#ifdef SERIAL_REPLAY_MAIN
+
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "tlpi_hdr.h"
+#include "SerialCapture.h"
+#include "SerialMsgUtils.h"
+#include "SerialCompress.h"
+#include "SerialFragment.h"
+#include "SerialRxBuffer.h"
+#include "SerialConfig.h"
+
+/* -D all */
+#define REPLAY_DIR_ALL		2
+
+#define REPLAY_USAGE	"%s [-x speed] [-D rx|tx|all] decode capture-file\n" \
+						"%s [-x speed] [-D rx|tx|all] write capture-file [tty]\n"
+
+typedef struct ReplayStats{
+		uint32_t	Records;
+		uint64_t	Bytes;
+		uint32_t	Frames;
+		uint32_t	BadFrames;
+		uint32_t	SkippedBytes;
+		uint32_t	DecodeErrors;
+		uint64_t	PayloadBytes;	/* Decoded, and decompressed */
+	}ReplayStats;
+
+static ReplayStats Stats;
+
+/* Decode mode stands in for the Daemon's RX buffer */
+static SerialRxBuffer ReplayAccum;
+
+
+static int32_t
+DirectionFromName(const char *Name ){
+
+	if(strcmp(Name, "rx") == 0)
+		return CAPTURE_DIR_RX;
+	if(strcmp(Name, "tx") == 0)
+		return CAPTURE_DIR_TX;
+	if(strcmp(Name, "all") == 0)
+		return REPLAY_DIR_ALL;
+
+	return -1;
+}
+
+/* Sleep until the record is due, Start is when the first record went */
+static void
+PaceRecord(const SerialCaptureRec *Rec, uint64_t FirstNs, const struct timespec *Start, double Speed ){
+
+	struct timespec Due;
+	uint64_t OffsetNs;
+
+	if(Speed <= 0)
+		return;
+
+	OffsetNs = (uint64_t)((double)(Rec->TimestampNs - FirstNs) / Speed);
+
+	Due.tv_sec = Start->tv_sec + (time_t)(OffsetNs / 1000000000ULL);
+	Due.tv_nsec = Start->tv_nsec + (long)(OffsetNs % 1000000000ULL);
+	if(Due.tv_nsec >= 1000000000){
+		Due.tv_sec++;
+		Due.tv_nsec -= 1000000000;
+	}
+
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &Due, NULL) == EINTR)
+		;
+}
+
+/* Frame and decode everything complete in the buffer, the way
+ * ExtractRxFrames in the Daemon and then a receiver would */
+static void
+DecodeFrames(void){
+
+	static uint8_t Expanded[MAX_FRAGMENTED_MSG_SIZE];
+	ARM_char_t *Data;
+	int32_t Length, SkipBytes, FrameLength, Decoded;
+	RxMsgInfo Info;
+	RxMsgView View;
+
+	for( ;; ){
+		Data = RxBufferData(&ReplayAccum);
+		Length = RxBufferLength(&ReplayAccum);
+
+		SkipBytes = FindPacketHeader(Data, Length);
+		if(SkipBytes > 0){
+			Stats.SkippedBytes += SkipBytes;
+			RxBufferConsume(&ReplayAccum, SkipBytes);
+			continue;
+		}
+
+		if(Length < MSG_HEADER_LENGTH)
+			return;
+
+		if(ProcessPacket(&Info, Data) < 0)
+			FrameLength = -1;
+		else
+			FrameLength = PACKET_FRAME_LENGTH(Info.MsgLength);
+
+		if(FrameLength > Length)
+			return;
+
+		if(FrameLength < 0 || Data[FrameLength - 1] != '\n'){
+			Stats.BadFrames++;
+			Stats.SkippedBytes++;
+			RxBufferConsume(&ReplayAccum, 1);
+			continue;
+		}
+
+		Decoded = DecodePacketInPlace(Data, FrameLength, &View);
+
+		if(Decoded >= 0 && (View.Info.MsgFlags & MSG_FLAG_COMPRESSED))
+			Decoded = DecompressPayload(View.Data, View.Length, Expanded, sizeof(Expanded));
+
+		if(Decoded < 0)
+			Stats.DecodeErrors++;
+		else
+			Stats.PayloadBytes += (uint64_t)Decoded;
+
+		Stats.Frames++;
+		RxBufferConsume(&ReplayAccum, FrameLength);
+	}
+}
+
+static void
+DecodeRecord(const ARM_char_t *Data, int32_t Length ){
+
+	int32_t FreeBytes, Chunk;
+
+	while(Length > 0){
+		FreeBytes = RxBufferReserve(&ReplayAccum);
+
+		/* Full of bytes that will never frame, the Daemon starts over too */
+		if(FreeBytes == 0){
+			Stats.SkippedBytes += RxBufferLength(&ReplayAccum);
+			RxBufferConsume(&ReplayAccum, RxBufferLength(&ReplayAccum));
+			continue;
+		}
+
+		Chunk = (Length < FreeBytes) ? Length : FreeBytes;
+
+		memcpy(RxBufferWritePtr(&ReplayAccum), Data, (size_t)Chunk);
+		RxBufferCommit(&ReplayAccum, Chunk);
+		DecodeFrames();
+
+		Data += Chunk;
+		Length -= Chunk;
+	}
+}
+
+/* Throw away what the other end sent us, a pty nobody reads would
+ * otherwise fill and stall the Daemon's writes */
+static void
+DrainInput(int TtyFd ){
+
+	struct pollfd Pfd;
+	char Discard[256];
+
+	Pfd.fd = TtyFd;
+	Pfd.events = POLLIN;
+
+	while(poll(&Pfd, 1, 0) > 0 && (Pfd.revents & POLLIN)){
+		if(read(TtyFd, Discard, sizeof(Discard)) <= 0)
+			return;
+	}
+}
+
+static int32_t
+WriteRecord(int TtyFd, const ARM_char_t *Data, int32_t Length ){
+
+	ssize_t Written;
+
+	while(Length > 0){
+		Written = write(TtyFd, Data, (size_t)Length);
+
+		if(Written < 0){
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		Data += Written;
+		Length -= (int32_t)Written;
+	}
+
+	return 1;
+}
+
+/* Open a pty and wait for the Daemon to be started on its slave end */
+static int
+OpenReplayPty(void){
+
+	int MasterFd;
+
+	MasterFd = posix_openpt(O_RDWR | O_NOCTTY);
+	if(MasterFd == -1 || grantpt(MasterFd) == -1 || unlockpt(MasterFd) == -1)
+		errExit("posix_openpt");
+
+	printf("Replaying to %s, start the Daemon on it and press Enter\n", ptsname(MasterFd));
+	fflush(stdout);
+	getchar();
+
+	return MasterFd;
+}
+
+int
+main(int argc, char *argv[])
+{
+	SerialCaptureReader Reader;
+	const SerialCaptureRec *Rec;
+	const ARM_char_t *Data;
+	struct timespec Start, End;
+	uint64_t FirstNs = 0, SpanNs = 0;
+	double Speed = -1, Elapsed;
+	int32_t Direction = CAPTURE_DIR_RX, Return;
+	int opt, TtyFd = -1;
+	Boolean Decode, OwnPty = FALSE;
+
+	while((opt = getopt(argc, argv, "x:D:")) != -1)
+	{
+		switch(opt)
+		{
+		case 'x':
+			Speed = strtod(optarg, NULL);
+			break;
+
+		case 'D':
+			Direction = DirectionFromName(optarg);
+			if(Direction < 0)
+				usageErr(REPLAY_USAGE, argv[0], argv[0]);
+			break;
+
+		default:
+			usageErr(REPLAY_USAGE, argv[0], argv[0]);
+		}
+	}
+
+	if(optind + 2 > argc)
+		usageErr(REPLAY_USAGE, argv[0], argv[0]);
+
+	Decode = (strcmp(argv[optind], "decode") == 0);
+	if(!Decode && strcmp(argv[optind], "write") != 0)
+		usageErr(REPLAY_USAGE, argv[0], argv[0]);
+
+	/* Profiling wants the decode flat out, a link wants field timing */
+	if(Speed < 0)
+		Speed = Decode ? 0 : 1;
+
+	if(CaptureReaderOpen(argv[optind + 1], &Reader) < 0)
+		fatal("%s is not a capture file", argv[optind + 1]);
+
+	if(Decode)
+	{
+		if(RxBufferInit(&ReplayAccum, RX_BUFF_DEFAULT_SIZE, RX_BUFF_DEFAULT_MAX) < 0)
+			fatal("RX buffer allocation failed");
+	}
+	else if(optind + 2 < argc)
+	{
+		TtyFd = open(argv[optind + 2], O_RDWR | O_NOCTTY);
+		if(TtyFd == -1)
+			errExit("open %s", argv[optind + 2]);
+	}
+	else
+	{
+		TtyFd = OpenReplayPty();
+		OwnPty = TRUE;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &Start);
+
+	while((Return = CaptureReaderNext(&Reader, &Rec, &Data)) > 0)
+	{
+		if(Direction != REPLAY_DIR_ALL && Rec->Direction != Direction)
+			continue;
+
+		if(Stats.Records == 0)
+			FirstNs = Rec->TimestampNs;
+
+		PaceRecord(Rec, FirstNs, &Start, Speed);
+
+		Stats.Records++;
+		Stats.Bytes += Rec->Length;
+		SpanNs = Rec->TimestampNs - FirstNs;
+
+		if(Decode)
+		{
+			DecodeRecord(Data, (int32_t)Rec->Length);
+		}
+		else
+		{
+			DrainInput(TtyFd);
+			if(WriteRecord(TtyFd, Data, (int32_t)Rec->Length) < 0)
+				errExit("write");
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &End);
+
+	if(Return < 0)
+		printf("Capture is corrupt after record %u, stopped there\n", Stats.Records);
+
+	Elapsed = (double)(End.tv_sec - Start.tv_sec) + (double)(End.tv_nsec - Start.tv_nsec) / 1e9;
+
+	printf("Records %u, Bytes %llu, Captured over %.3f s, Replayed in %.3f s\n",
+			Stats.Records, (unsigned long long)Stats.Bytes, (double)SpanNs / 1e9, Elapsed);
+
+	if(Decode)
+	{
+		printf("Frames %u, BadFrames %u, SkippedBytes %u, DecodeErrors %u, PayloadBytes %llu\n",
+				Stats.Frames, Stats.BadFrames, Stats.SkippedBytes, Stats.DecodeErrors,
+				(unsigned long long)Stats.PayloadBytes);
+
+		if(Elapsed > 0)
+			printf("%.0f frames/s, %.2f MB/s in\n", Stats.Frames / Elapsed, Stats.Bytes / Elapsed / 1e6);
+	}
+
+	if(Reader.Hdr->RecordsDropped > 0)
+		printf("The capture dropped %u records at its size limit\n", Reader.Hdr->RecordsDropped);
+
+	/* Hanging up the pty would hang up the Daemon too */
+	if(OwnPty)
+	{
+		printf("Done, press Enter to close the pty\n");
+		fflush(stdout);
+		getchar();
+	}
+
+	CaptureReaderClose(&Reader);
+
+	exit(EXIT_SUCCESS);
+}
+
+#endif /* SERIAL_REPLAY_MAIN */
@@ -0,0 +1,212 @@
+/*
+ * SerialRoute.c
+ *
+ *  RX subscription routing for the Daemon, see SerialRoute.h
+ */
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "tlpi_hdr.h"
+#include "SerialRoute.h"
+
+typedef struct SerialRoute{
+		Boolean		InUse;
+		uint8_t		FirstID;
+		uint8_t		LastID;
+		char		QueueName[SUB_QUEUE_NAME_MAX];
+		mqd_t		mqd;		/* Shared by every route to the same queue */
+	}SerialRoute;
+
+static SerialRoute Routes[ROUTE_MAX];
+
+/* Bit n set when Routes[n] covers the MsgID, so routing a frame is a
+ * single lookup. Rebuilt whenever a route changes */
+static uint32_t RouteMask[256];
+
+static mqd_t RequestMqd = (mqd_t) -1;
+
+
+static void
+RebuildRouteMask(void){
+
+	int32_t i, MsgID;
+
+	memset(RouteMask, 0, sizeof(RouteMask));
+
+	for(i = 0; i < ROUTE_MAX; i++){
+		if(!Routes[i].InUse)
+			continue;
+
+		for(MsgID = Routes[i].FirstID; MsgID <= Routes[i].LastID; MsgID++)
+			RouteMask[MsgID] |= (uint32_t)1 << i;
+	}
+}
+
+/* Already open descriptor for QueueName, -1 if no route uses it yet */
+static mqd_t
+FindRouteQueue(const char *QueueName ){
+
+	int32_t i;
+
+	for(i = 0; i < ROUTE_MAX; i++){
+		if(Routes[i].InUse && strcmp(Routes[i].QueueName, QueueName) == 0)
+			return Routes[i].mqd;
+	}
+
+	return (mqd_t) -1;
+}
+
+static int32_t
+RouteAdd(const SerialSubscribeMsg *Request ){
+
+	int32_t i, Free = -1;
+	mqd_t mqd;
+
+	for(i = 0; i < ROUTE_MAX; i++){
+		if(!Routes[i].InUse){
+			if(Free < 0)
+				Free = i;
+			continue;
+		}
+
+		/* Asked for twice, nothing to do */
+		if(Routes[i].FirstID == Request->FirstID && Routes[i].LastID == Request->LastID &&
+				strcmp(Routes[i].QueueName, Request->QueueName) == 0)
+			return i;
+	}
+
+	if(Free < 0)
+		return ROUTE_TABLE_FULL;
+
+	/* The subscriber created the queue, read / write so a full queue can
+	 * drop its oldest message like SERIAL_RX_QUEUE does */
+	mqd = FindRouteQueue(Request->QueueName);
+	if(mqd == (mqd_t) -1)
+		mqd = mq_open(Request->QueueName, O_RDWR | O_NONBLOCK);
+
+	if(mqd == (mqd_t) -1)
+		return ROUTE_OPEN_FAIL;
+
+	Routes[Free].InUse = TRUE;
+	Routes[Free].FirstID = Request->FirstID;
+	Routes[Free].LastID = Request->LastID;
+	strcpy(Routes[Free].QueueName, Request->QueueName);
+	Routes[Free].mqd = mqd;
+
+	RebuildRouteMask();
+
+	return Free;
+}
+
+/* Drop every route to QueueName, returns how many there were */
+static int32_t
+RouteRemove(const char *QueueName ){
+
+	int32_t i, Removed = 0;
+	mqd_t mqd = FindRouteQueue(QueueName);
+
+	for(i = 0; i < ROUTE_MAX; i++){
+		if(Routes[i].InUse && strcmp(Routes[i].QueueName, QueueName) == 0){
+			Routes[i].InUse = FALSE;
+			Removed++;
+		}
+	}
+
+	if(mqd != (mqd_t) -1)
+		mq_close(mqd);
+
+	RebuildRouteMask();
+
+	return Removed;
+}
+
+int32_t
+RouteTableOpen(void){
+
+	struct mq_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.mq_maxmsg = ROUTE_REQUEST_MAX_CNT;
+	attr.mq_msgsize = sizeof(SerialSubscribeMsg);
+
+	mq_unlink(SERIAL_SUB_QUEUE);
+
+	RequestMqd = mq_open(SERIAL_SUB_QUEUE, O_RDONLY | O_CREAT | O_NONBLOCK,
+			S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, &attr);
+
+	if(RequestMqd == (mqd_t) -1)
+		return ROUTE_OPEN_FAIL;
+
+	return 1;
+}
+
+void
+RouteTableClose(void){
+
+	int32_t i;
+
+	for(i = 0; i < ROUTE_MAX; i++){
+		if(Routes[i].InUse)
+			RouteRemove(Routes[i].QueueName);
+	}
+
+	if(RequestMqd != (mqd_t) -1){
+		mq_close(RequestMqd);
+		mq_unlink(SERIAL_SUB_QUEUE);
+		RequestMqd = (mqd_t) -1;
+	}
+}
+
+void
+RouteApplyRequests(void){
+
+	SerialSubscribeMsg Request;
+	int32_t Return;
+
+	if(RequestMqd == (mqd_t) -1)
+		return;
+
+	while(mq_receive(RequestMqd, (char *)&Request, sizeof(Request), NULL) == (ssize_t)sizeof(Request)){
+
+		Request.QueueName[SUB_QUEUE_NAME_MAX - 1] = '\0';
+
+		if(Request.Command == SUB_CMD_ADD && Request.FirstID <= Request.LastID)
+			Return = RouteAdd(&Request);
+		else if(Request.Command == SUB_CMD_REMOVE)
+			Return = RouteRemove(Request.QueueName);
+		else
+			Return = ROUTE_BAD_REQUEST;
+
+		if(Return < 0)
+			syslog(LOG_INFO, "Subscription request for %s failed with error %i", Request.QueueName, Return);
+		else if(Request.Command == SUB_CMD_ADD)
+			syslog(LOG_INFO, "Subscription added: MsgID %u-%u to %s", Request.FirstID, Request.LastID, Request.QueueName);
+		else
+			syslog(LOG_INFO, "Subscription removed: %s", Request.QueueName);
+	}
+}
+
+int32_t
+RouteLookup(uint8_t MsgID, mqd_t *Subscribers, int32_t MaxSubscribers ){
+
+	uint32_t Mask = RouteMask[MsgID];
+	int32_t i, j, Count = 0;
+
+	for(i = 0; Mask != 0 && Count < MaxSubscribers; i++, Mask >>= 1){
+		if(!(Mask & 1))
+			continue;
+
+		for(j = 0; j < Count; j++){
+			if(Subscribers[j] == Routes[i].mqd)
+				break;
+		}
+
+		if(j == Count)
+			Subscribers[Count++] = Routes[i].mqd;
+	}
+
+	return Count;
+}
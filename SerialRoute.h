@@ -0,0 +1,64 @@
+/*
+ * SerialRoute.h
+ *
+ *  Daemon side of RX subscriptions. Subscribers register a MsgID range
+ *  and a queue (Serial8051Subscribe), the Daemon picks the requests up
+ *  from SERIAL_SUB_QUEUE and, once a frame's header is parsed, copies
+ *  the frame to every queue whose range holds its MsgID. Routes live
+ *  only as long as the Daemon, subscribers have to register again
+ *  after a restart.
+ */
+
+#ifndef SERIALROUTE_H_
+#define SERIALROUTE_H_
+
+#include <mqueue.h>
+
+#include "typedef.h"
+#include "SerialLib8051.h"
+
+/* Routes (MsgID range to queue) held at once */
+#define ROUTE_MAX				32
+
+/* Subscription requests waiting for the Daemon */
+#define ROUTE_REQUEST_MAX_CNT	10
+
+/* Error Return Codes */
+#define ROUTE_TABLE_FULL		-1
+#define ROUTE_OPEN_FAIL			-2
+#define ROUTE_BAD_REQUEST		-3
+
+
+/* Create SERIAL_SUB_QUEUE, throwing away requests left from an earlier
+ * run of the Daemon
+ *
+ *  RETURNS:
+ *  1 if sucessful, ROUTE_OPEN_FAIL if failure
+*/
+int32_t
+RouteTableOpen(void);
+
+/* Drop every route and remove SERIAL_SUB_QUEUE */
+void
+RouteTableClose(void);
+
+/* Apply the subscription requests waiting in SERIAL_SUB_QUEUE, call
+ * before routing a batch of frames. Never blocks */
+void
+RouteApplyRequests(void);
+
+/* Queues subscribed to MsgID, each listed once however many of its
+ * ranges hold MsgID
+ *
+ *  INPUTS:
+ *  MsgID - From the frame's header
+ *  Subscribers - Filled in with the queues
+ *  MaxSubscribers - Size of Subscribers
+ *
+ *  RETURNS:
+ *  Number of queues, 0 if the frame should go to SERIAL_RX_QUEUE
+*/
+int32_t
+RouteLookup(uint8_t MsgID, mqd_t *Subscribers, int32_t MaxSubscribers );
+
+#endif /* SERIALROUTE_H_ */
@@ -0,0 +1,110 @@
+/*
+ * SerialRxBuffer.c
+ *
+ *  Linear accumulation buffer for bytes read from the serial port,
+ *  see SerialRxBuffer.h
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "SerialRxBuffer.h"
+
+
+int32_t
+RxBufferInit(SerialRxBuffer *Buffer, int32_t Capacity, int32_t MaxCapacity ){
+
+	if(MaxCapacity < Capacity)
+		MaxCapacity = Capacity;
+
+	Buffer->Data = (ARM_char_t *)malloc((size_t)Capacity);
+	if(Buffer->Data == NULL)
+		return RX_BUFF_ALLOCATE_FAIL;
+
+	Buffer->Capacity = Capacity;
+	Buffer->MaxCapacity = MaxCapacity;
+	Buffer->Start = 0;
+	Buffer->End = 0;
+
+	return Capacity;
+}
+
+void
+RxBufferRelease(SerialRxBuffer *Buffer ){
+
+	free(Buffer->Data);
+	Buffer->Data = NULL;
+	Buffer->Capacity = 0;
+	Buffer->Start = 0;
+	Buffer->End = 0;
+}
+
+int32_t
+RxBufferReserve(SerialRxBuffer *Buffer ){
+
+	int32_t NewCapacity;
+	ARM_char_t *NewData;
+
+	if(Buffer->End < Buffer->Capacity)
+		return Buffer->Capacity - Buffer->End;
+
+	/* Tail is full, move the unconsumed bytes back to the front. Only
+	 * happens once per buffer worth of data, and usually moves no more
+	 * than a partial frame */
+	if(Buffer->Start > 0){
+		memmove(Buffer->Data, &Buffer->Data[Buffer->Start], (size_t)(Buffer->End - Buffer->Start));
+		Buffer->End -= Buffer->Start;
+		Buffer->Start = 0;
+
+		return Buffer->Capacity - Buffer->End;
+	}
+
+	/* Every byte is unconsumed, grow if we are allowed to */
+	if(Buffer->Capacity >= Buffer->MaxCapacity)
+		return 0;
+
+	NewCapacity = Buffer->Capacity*2;
+	if(NewCapacity > Buffer->MaxCapacity)
+		NewCapacity = Buffer->MaxCapacity;
+
+	NewData = (ARM_char_t *)realloc(Buffer->Data, (size_t)NewCapacity);
+	if(NewData == NULL)
+		return 0;
+
+	Buffer->Data = NewData;
+	Buffer->Capacity = NewCapacity;
+
+	return Buffer->Capacity - Buffer->End;
+}
+
+ARM_char_t *
+RxBufferWritePtr(SerialRxBuffer *Buffer ){
+	return &Buffer->Data[Buffer->End];
+}
+
+void
+RxBufferCommit(SerialRxBuffer *Buffer, int32_t Count ){
+	Buffer->End += Count;
+}
+
+ARM_char_t *
+RxBufferData(SerialRxBuffer *Buffer ){
+	return &Buffer->Data[Buffer->Start];
+}
+
+int32_t
+RxBufferLength(SerialRxBuffer *Buffer ){
+	return Buffer->End - Buffer->Start;
+}
+
+void
+RxBufferConsume(SerialRxBuffer *Buffer, int32_t Count ){
+
+	Buffer->Start += Count;
+
+	/* Empty, start over at the front so no compaction is needed */
+	if(Buffer->Start >= Buffer->End){
+		Buffer->Start = 0;
+		Buffer->End = 0;
+	}
+}
@@ -0,0 +1,73 @@
+/*
+ * SerialRxBuffer.h
+ *
+ *  Linear accumulation buffer for bytes read from the serial port.
+ *  Reads go straight into the free space at the end, frames are
+ *  consumed from the front. When the free space at the end runs out
+ *  the unconsumed bytes are moved back to the start (compaction), and
+ *  if that is not enough the buffer grows, up to a configured maximum.
+ */
+
+#ifndef SERIALRXBUFFER_H_
+#define SERIALRXBUFFER_H_
+
+#include "typedef.h"
+
+typedef struct SerialRxBuffer{
+		ARM_char_t	*Data;
+		int32_t		Capacity;
+		int32_t		MaxCapacity;
+		int32_t		Start;		/* First unconsumed byte */
+		int32_t		End;		/* One past the last valid byte */
+	}SerialRxBuffer;
+
+/* Error Return Codes */
+#define RX_BUFF_ALLOCATE_FAIL	-1
+
+
+/* Allocate the buffer
+ *
+ *  INPUTS:
+ *  Buffer - Buffer to initialize
+ *  Capacity - Bytes to allocate up front
+ *  MaxCapacity - Largest size the buffer may grow to
+ *
+ *  RETURNS:
+ *  Capacity if sucessful, RX_BUFF_ALLOCATE_FAIL if failure
+*/
+int32_t
+RxBufferInit(SerialRxBuffer *Buffer, int32_t Capacity, int32_t MaxCapacity );
+
+void
+RxBufferRelease(SerialRxBuffer *Buffer );
+
+/* Make room at the end of the buffer, compacting first and growing
+ * only when compacting doesn't free anything.
+ *
+ *  RETURNS:
+ *  Free bytes at RxBufferWritePtr, 0 if the buffer is full and
+ *  already at MaxCapacity
+*/
+int32_t
+RxBufferReserve(SerialRxBuffer *Buffer );
+
+/* Where the next read should land, RxBufferReserve bytes are free there */
+ARM_char_t *
+RxBufferWritePtr(SerialRxBuffer *Buffer );
+
+/* Mark Count bytes at RxBufferWritePtr as filled */
+void
+RxBufferCommit(SerialRxBuffer *Buffer, int32_t Count );
+
+/* Unconsumed bytes, and how many of them there are */
+ARM_char_t *
+RxBufferData(SerialRxBuffer *Buffer );
+
+int32_t
+RxBufferLength(SerialRxBuffer *Buffer );
+
+/* Drop Count bytes from the front */
+void
+RxBufferConsume(SerialRxBuffer *Buffer, int32_t Count );
+
+#endif /* SERIALRXBUFFER_H_ */
@@ -0,0 +1,454 @@
+/*
+ * SerialSocket.c
+ *
+ *  Unix domain socket transport for the Daemon, see SerialSocket.h
+ */
+
+/* F_SETSIG, SO_PEERCRED, accept4 and recvmmsg */
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+
+#include "SerialSocket.h"
+
+typedef struct SocketClient{
+		int			fd;				/* -1 when the slot is free */
+		pid_t		Pid;			/* Peer credentials, from when it connected */
+		uid_t		Uid;
+		Boolean		Subscribed;
+		uint8_t		FirstID;
+		uint8_t		LastID;
+		uint32_t	FramesIn;		/* TX frames it sent */
+		uint32_t	FramesOut;		/* RX frames sent to it */
+		uint32_t	Drops;			/* RX frames lost to a full socket */
+	}SocketClient;
+
+typedef struct SocketStats{
+		uint32_t	Accepted;
+		uint32_t	Rejected;		/* Turned away, SOCKET_CLIENT_MAX connected */
+		uint32_t	FramesIn;
+		uint32_t	FramesOut;
+		uint32_t	Drops;
+		uint32_t	BadMessages;	/* Truncated, or a frame TxFrame refused */
+		uint32_t	TxKept;			/* Read, the tty failed, given to KeepFrame */
+		uint32_t	TxLost;			/* Read, but the tty wouldn't take them */
+		uint32_t	Batches;		/* recvmmsg calls that returned frames */
+	}SocketStats;
+
+static SocketClient Clients[SOCKET_CLIENT_MAX];
+static SocketStats Stats;
+
+static int ListenFd = -1;
+static int SocketSignal;
+static struct sockaddr_un ListenAddr;
+
+/* ReadClient, TxFrame failed to write */
+#define SOCKET_TX_STALLED	-2
+
+/* recvmmsg lands here, one client's batch at a time */
+static ARM_char_t RecvFrames[SOCKET_RECV_BATCH][SERIAL_SOCKET_FRAME_MAX];
+
+
+/* Non-blocking, and raise SocketSignal at us on input or a hang up */
+static int32_t
+SetSocketAsync(int fd ){
+
+	int flags;
+
+	if(fcntl(fd, F_SETOWN, getpid()) == -1 || fcntl(fd, F_SETSIG, SocketSignal) == -1)
+		return SOCKET_OPEN_FAIL;
+
+	flags = fcntl(fd, F_GETFL);
+	if(flags == -1 || fcntl(fd, F_SETFL, flags | O_ASYNC | O_NONBLOCK) == -1)
+		return SOCKET_OPEN_FAIL;
+
+	return 1;
+}
+
+static void
+DropClient(SocketClient *Client, const char *Reason ){
+
+	syslog(LOG_INFO, "Socket: client pid %i %s, sent %u frames, received %u, dropped %u",
+			(int)Client->Pid, Reason, Client->FramesIn, Client->FramesOut, Client->Drops);
+
+	close(Client->fd);
+	memset(Client, 0, sizeof(SocketClient));
+	Client->fd = -1;
+}
+
+static void
+AcceptClients(void){
+
+	struct ucred Cred;
+	socklen_t CredLength;
+	int fd, i;
+
+	while((fd = accept4(ListenFd, NULL, NULL, SOCK_CLOEXEC)) >= 0){
+
+		for(i = 0; i < SOCKET_CLIENT_MAX; i++){
+			if(Clients[i].fd < 0)
+				break;
+		}
+
+		if(i == SOCKET_CLIENT_MAX || SetSocketAsync(fd) < 0){
+			Stats.Rejected++;
+			syslog(LOG_INFO, "Socket: client turned away, %s", (i == SOCKET_CLIENT_MAX) ? "too many connected" : strerror(errno));
+			close(fd);
+			continue;
+		}
+
+		memset(&Clients[i], 0, sizeof(SocketClient));
+		Clients[i].fd = fd;
+
+		CredLength = sizeof(Cred);
+		if(getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &Cred, &CredLength) == 0){
+			Clients[i].Pid = Cred.pid;
+			Clients[i].Uid = Cred.uid;
+		}
+
+		Stats.Accepted++;
+		syslog(LOG_INFO, "Socket: client pid %i uid %i connected", (int)Clients[i].Pid, (int)Clients[i].Uid);
+	}
+}
+
+/* A SerialSubscribeMsg rather than a frame. Frames start with the
+ * header's sync bytes, never a SUB_CMD_* */
+static Boolean
+IsSubscribeMsg(const ARM_char_t *Message, int32_t Length ){
+
+	return (Length == (int32_t)sizeof(SerialSubscribeMsg) &&
+			(Message[0] == SUB_CMD_ADD || Message[0] == SUB_CMD_REMOVE));
+}
+
+/* Priority a client sent a frame at, see TxPriorityTrailer */
+static uint32_t
+FramePriority(ARM_char_t *Frame, int32_t Length ){
+
+	RxMsgInfo Info;
+
+	if(ProcessPacket(&Info, Frame) < 0)
+		return 0;
+
+	return TxPriority(Frame, PACKET_FRAME_LENGTH((int32_t)Info.MsgLength), Length);
+}
+
+static void
+ApplySubscribeMsg(SocketClient *Client, const SerialSubscribeMsg *Request ){
+
+	if(Request->Command == SUB_CMD_ADD && Request->FirstID <= Request->LastID){
+		Client->Subscribed = TRUE;
+		Client->FirstID = Request->FirstID;
+		Client->LastID = Request->LastID;
+		syslog(LOG_INFO, "Socket: client pid %i subscribed to MsgID %u-%u",
+				(int)Client->Pid, Request->FirstID, Request->LastID);
+	}
+	else if(Request->Command == SUB_CMD_REMOVE){
+		Client->Subscribed = FALSE;
+		syslog(LOG_INFO, "Socket: client pid %i unsubscribed", (int)Client->Pid);
+	}
+	else
+		Stats.BadMessages++;
+}
+
+/* One recvmmsg worth of messages from Client. If TxFrame fails on
+ * one, it and those after it in the batch go to KeepFrame, except one
+ * the tty stalled on, that is dropped as SerialTx drops it
+ *
+ *  RETURNS:
+ *  Messages read, 0 if none were waiting, -1 once the client is gone,
+ *  SOCKET_TX_STALLED if TxFrame couldn't write one
+*/
+static int32_t
+ReadClient(SocketClient *Client, int ttyFd, SocketFrameFn TxFrame, SocketKeepFn KeepFrame, int32_t *Frames ){
+
+	struct mmsghdr Msgs[SOCKET_RECV_BATCH];
+	struct iovec Iov[SOCKET_RECV_BATCH];
+	SerialSubscribeMsg Request;
+	int32_t Order[SOCKET_RECV_BATCH];
+	uint32_t Prios[SOCKET_RECV_BATCH], Prio;
+	int32_t Count, Length, TxReturn, Pending = 0, i, j;
+	Boolean Closed = FALSE;
+
+	memset(Msgs, 0, sizeof(Msgs));
+	for(i = 0; i < SOCKET_RECV_BATCH; i++){
+		Iov[i].iov_base = RecvFrames[i];
+		Iov[i].iov_len = SERIAL_SOCKET_FRAME_MAX;
+		Msgs[i].msg_hdr.msg_iov = &Iov[i];
+		Msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	Count = recvmmsg(Client->fd, Msgs, SOCKET_RECV_BATCH, MSG_DONTWAIT, NULL);
+
+	if(Count < 0){
+		if(errno == EAGAIN || errno == EINTR)
+			return 0;
+
+		DropClient(Client, strerror(errno));
+		return -1;
+	}
+
+	if(Count == 0){
+		DropClient(Client, "disconnected");
+		return -1;
+	}
+
+	Stats.Batches++;
+
+	/* Put the frames in Priority order, as the TX queue would. Equal
+	 * ones, a fragmented message's included, keep the order they were
+	 * sent in */
+	for(i = 0; i < Count; i++){
+		Length = (int32_t)Msgs[i].msg_len;
+
+		/* End of file, the client closed its end after what's above */
+		if(Length == 0){
+			Closed = TRUE;
+			break;
+		}
+
+		if(Msgs[i].msg_hdr.msg_flags & MSG_TRUNC){
+			Stats.BadMessages++;
+			continue;
+		}
+
+		if(IsSubscribeMsg(RecvFrames[i], Length)){
+			memcpy(&Request, RecvFrames[i], sizeof(Request));
+			ApplySubscribeMsg(Client, &Request);
+			continue;
+		}
+
+		if(Length < MSG_HEADER_LENGTH){
+			Stats.BadMessages++;
+			continue;
+		}
+
+		Prio = FramePriority(RecvFrames[i], Length);
+
+		for(j = Pending; j > 0 && Prios[j-1] < Prio; j--){
+			Order[j] = Order[j-1];
+			Prios[j] = Prios[j-1];
+		}
+
+		Order[j] = i;
+		Prios[j] = Prio;
+		Pending++;
+	}
+
+	for(j = 0; j < Pending; j++){
+		i = Order[j];
+
+		TxReturn = TxFrame(ttyFd, RecvFrames[i], (int32_t)Msgs[i].msg_len, Prios[j]);
+
+		if(TxReturn == SOCKET_FRAME_REFUSED){
+			Stats.BadMessages++;
+			continue;
+		}
+
+		/* Don't stall on the tty again for each frame left in the batch */
+		if(TxReturn < 0){
+			if(TxReturn != SOCKET_FRAME_FAILED){
+				Stats.TxLost++;
+				j++;
+			}
+
+			for(; j < Pending; j++){
+				i = Order[j];
+
+				if(KeepFrame != NULL && KeepFrame(RecvFrames[i], (int32_t)Msgs[i].msg_len, Prios[j]) >= 0)
+					Stats.TxKept++;
+				else
+					Stats.TxLost++;
+			}
+
+			return SOCKET_TX_STALLED;
+		}
+
+		/* Input read while writing went to SocketDeliver, which drops
+		 * a client it finds gone, this one included */
+		if(Client->fd < 0)
+			return -1;
+
+		Client->FramesIn++;
+		Stats.FramesIn++;
+		(*Frames)++;
+	}
+
+	if(Closed){
+		DropClient(Client, "disconnected");
+		return -1;
+	}
+
+	return Count;
+}
+
+int32_t
+SocketOpen(const char *Path, int Signal ){
+
+	struct stat Status;
+	int Probe, i;
+
+	for(i = 0; i < SOCKET_CLIENT_MAX; i++)
+		Clients[i].fd = -1;
+
+	if(strlen(Path) >= sizeof(ListenAddr.sun_path))
+		return SOCKET_OPEN_FAIL;
+
+	memset(&ListenAddr, 0, sizeof(ListenAddr));
+	ListenAddr.sun_family = AF_UNIX;
+	strcpy(ListenAddr.sun_path, Path);
+	SocketSignal = Signal;
+
+	/* Only ever remove a socket, and only one no one answers on */
+	if(lstat(Path, &Status) == 0){
+		if(!S_ISSOCK(Status.st_mode))
+			return SOCKET_OPEN_FAIL;
+
+		Probe = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+		if(Probe >= 0 && connect(Probe, (struct sockaddr *)&ListenAddr, sizeof(ListenAddr)) == 0){
+			close(Probe);
+			return SOCKET_IN_USE;
+		}
+
+		if(Probe >= 0)
+			close(Probe);
+
+		unlink(Path);
+	}
+
+	ListenFd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if(ListenFd < 0)
+		return SOCKET_OPEN_FAIL;
+
+	/* Set file permissions everyone can read and write, like the queues */
+	if(bind(ListenFd, (struct sockaddr *)&ListenAddr, sizeof(ListenAddr)) == -1 ||
+			chmod(Path, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH) == -1 ||
+			listen(ListenFd, SOCKET_BACKLOG) == -1 ||
+			SetSocketAsync(ListenFd) < 0){
+
+		close(ListenFd);
+		ListenFd = -1;
+		unlink(Path);
+		return SOCKET_OPEN_FAIL;
+	}
+
+	return 1;
+}
+
+void
+SocketClose(void){
+
+	int32_t i;
+
+	if(ListenFd < 0)
+		return;
+
+	for(i = 0; i < SOCKET_CLIENT_MAX; i++){
+		if(Clients[i].fd >= 0)
+			DropClient(&Clients[i], "disconnected, Daemon exiting");
+	}
+
+	close(ListenFd);
+	ListenFd = -1;
+	unlink(ListenAddr.sun_path);
+}
+
+int32_t
+SocketService(int ttyFd, SocketFrameFn TxFrame, SocketKeepFn KeepFrame, Boolean *More ){
+
+	int32_t i, Return, Frames = 0;
+
+	*More = FALSE;
+
+	if(ListenFd < 0)
+		return 0;
+
+	AcceptClients();
+
+	if(TxFrame == NULL)
+		return 0;
+
+	/* A batch from each client in turn, so one busy client can't hold
+	 * the others off. Whoever filled a batch gets another pass */
+	for(i = 0; i < SOCKET_CLIENT_MAX; i++){
+		if(Clients[i].fd < 0)
+			continue;
+
+		Return = ReadClient(&Clients[i], ttyFd, TxFrame, KeepFrame, &Frames);
+
+		if(Return == SOCKET_TX_STALLED){
+			*More = TRUE;
+			break;
+		}
+
+		if(Return == SOCKET_RECV_BATCH)
+			*More = TRUE;
+	}
+
+	return Frames;
+}
+
+int32_t
+SocketDeliver(uint8_t MsgID, const ARM_char_t *Frame, int32_t Length ){
+
+	int32_t i, Subscribers = 0;
+
+	if(ListenFd < 0 || Length > SERIAL_SOCKET_FRAME_MAX)
+		return 0;
+
+	for(i = 0; i < SOCKET_CLIENT_MAX; i++){
+		if(Clients[i].fd < 0 || !Clients[i].Subscribed ||
+				MsgID < Clients[i].FirstID || MsgID > Clients[i].LastID)
+			continue;
+
+		if(send(Clients[i].fd, Frame, (size_t)Length, MSG_DONTWAIT | MSG_NOSIGNAL) == Length){
+			Clients[i].FramesOut++;
+			Stats.FramesOut++;
+		}
+		else if(errno == EAGAIN){
+			Clients[i].Drops++;
+			Stats.Drops++;
+		}
+		else{
+			/* Gone before we saw it disconnect, it doesn't count */
+			DropClient(&Clients[i], strerror(errno));
+			continue;
+		}
+
+		Subscribers++;
+	}
+
+	return Subscribers;
+}
+
+Boolean
+SocketListening(void){
+
+	return (ListenFd >= 0);
+}
+
+void
+SocketLogStats(void){
+
+	int32_t i, Connected = 0;
+
+	if(ListenFd < 0)
+		return;
+
+	for(i = 0; i < SOCKET_CLIENT_MAX; i++){
+		if(Clients[i].fd >= 0)
+			Connected++;
+	}
+
+	syslog(LOG_INFO, "Socket: %i clients, Accepted %u, Rejected %u, FramesIn %u in %u batches, "
+			"FramesOut %u, Drops %u, BadMessages %u, TxKept %u, TxLost %u",
+			Connected, Stats.Accepted, Stats.Rejected, Stats.FramesIn, Stats.Batches,
+			Stats.FramesOut, Stats.Drops, Stats.BadMessages, Stats.TxKept, Stats.TxLost);
+}
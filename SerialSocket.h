@@ -0,0 +1,103 @@
+/*
+ * SerialSocket.h
+ *
+ *  Daemon side of the Unix domain socket transport. Alongside the
+ *  message queues the Daemon listens on a SOCK_SEQPACKET socket
+ *  (SERIAL_SOCKET_PATH, or -u). A client connects once and sends each
+ *  TX frame as one message, frame boundaries are kept by the socket
+ *  and a full socket buffer holds the client back rather than failing.
+ *  No semaphore or signal is needed to wake the Daemon.
+ *
+ *  State lives with the connection: the peer's pid / uid, counters,
+ *  and an RX MsgID range set with a SerialSubscribeMsg (QueueName
+ *  unused) sent on the socket. RX frames in a client's range are sent
+ *  to it as one message each, and it all goes when the client
+ *  disconnects, nothing is left behind by a client that dies.
+ */
+
+#ifndef SERIALSOCKET_H_
+#define SERIALSOCKET_H_
+
+#include "tlpi_hdr.h"
+#include "typedef.h"
+#include "SerialLib8051.h"
+
+/* Clients connected at once */
+#define SOCKET_CLIENT_MAX		16
+
+/* Frames taken from one client with a single recvmmsg */
+#define SOCKET_RECV_BATCH		8
+
+#define SOCKET_BACKLOG			8
+
+/* Error Return Codes */
+#define SOCKET_OPEN_FAIL		-1
+#define SOCKET_IN_USE			-2		/* Another Daemon is listening on the path */
+#define SOCKET_FRAME_REFUSED	-3		/* From TxFrame, a bad frame */
+#define SOCKET_FRAME_FAILED		-4		/* From TxFrame, the port failed, keep the frame */
+
+/* Called with each TX frame a client sends and the Priority it was
+ * sent at, see TxPriorityTrailer. Returns SOCKET_FRAME_REFUSED for a
+ * frame it won't write, SOCKET_FRAME_FAILED when the port failed and
+ * the frame is to be kept, < 0 otherwise when the tty stalled on it
+ * and it is dropped. Either ends the pass, the frames read with it but
+ * not yet written go to a SocketKeepFn, the rest wait in the clients'
+ * sockets */
+typedef int32_t (*SocketFrameFn)(int ttyFd, ARM_char_t *Frame, int32_t Length, uint32_t Priority);
+
+/* Keeps a frame a SocketFrameFn couldn't write, at its Priority, for
+ * when the tty is back. Returns < 0 if the frame is lost */
+typedef int32_t (*SocketKeepFn)(ARM_char_t *Frame, int32_t Length, uint32_t Priority);
+
+
+/* Listen on Path. The listening socket and every client raise Signal
+ * (F_SETSIG) when there is something to do. A stale socket file from
+ * an earlier run is replaced
+ *
+ *  RETURNS:
+ *  1 if sucessful, SOCKET_IN_USE or SOCKET_OPEN_FAIL if failure
+*/
+int32_t
+SocketOpen(const char *Path, int Signal );
+
+/* Disconnect every client, stop listening and remove the socket file */
+void
+SocketClose(void);
+
+/* Accept waiting clients, then take up to SOCKET_RECV_BATCH frames
+ * from each one and hand them to TxFrame, highest Priority first.
+ * Never blocks
+ *
+ *  INPUTS:
+ *  ttyFd - Passed on to TxFrame
+ *  TxFrame - Writes a frame out, NULL to only accept clients (the
+ *  	tty is down, frames stay in the clients' sockets until it's back)
+ *  KeepFrame - Takes the frames of a batch TxFrame failed on, NULL
+ *  	and they are lost
+ *  More - Set when a client had more than one batch waiting
+ *
+ *  RETURNS:
+ *  Frames handed to TxFrame
+*/
+int32_t
+SocketService(int ttyFd, SocketFrameFn TxFrame, SocketKeepFn KeepFrame, Boolean *More );
+
+/* Send an RX frame to every client whose range holds MsgID. A client
+ * whose socket is full loses the frame, the Daemon never waits
+ *
+ *  RETURNS:
+ *  Number of clients subscribed to MsgID, 0 if the frame should go to
+ *  SERIAL_RX_QUEUE
+*/
+int32_t
+SocketDeliver(uint8_t MsgID, const ARM_char_t *Frame, int32_t Length );
+
+/* TRUE while the Daemon is listening */
+Boolean
+SocketListening(void);
+
+/* Write the socket counters to the system log */
+void
+SocketLogStats(void);
+
+#endif /* SERIALSOCKET_H_ */
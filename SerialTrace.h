@@ -0,0 +1,68 @@
+/*
+ * SerialTrace.h
+ *
+ *  Static tracepoints (USDT) on the data path, provider serial8051.
+ *  Built with SERIAL_USDT defined they go in with <sys/sdt.h> from
+ *  systemtap, each one a single nop plus an ELF note until a tracer
+ *  attaches, so a shipping build can keep them. Without it they
+ *  compile to nothing.
+ *
+ *  Client library (SerialLib8051.c):
+ *   send_entry      MsgID, SeqCount, Length      Serial8051Send called
+ *   send_enqueue    MsgID, SeqCount, FrameBytes, Socket
+ *                                                A frame queued, or sent
+ *                                                on the Daemon's socket
+ *   notify          DaemonPid                    SIGUSR1 queued to the
+ *                                                Daemon, the frames this
+ *                                                thread just queued
+ *   receive_decode  MsgID, SeqCount, Length      A message decoded by
+ *                                                Serial8051Receive(View)
+ *
+ *  Daemon (SerialDaemon.c):
+ *   tx_dequeue      MsgID, SeqCount, FrameBytes  A frame off the TX queue
+ *                                                or a client's socket
+ *   tx_write        MsgID, SeqCount, BytesWritten
+ *                                                Written to the tty
+ *   tx_expire       MsgID, SeqCount, LateUs      Dropped instead of
+ *                                                written, past its TTL
+ *   rx_read         Bytes, BufferedBytes         A read off the tty
+ *   rx_frame        MsgID, SeqCount, FrameBytes  A whole frame found
+ *   rx_publish      MsgID, SeqCount, FrameBytes, Return
+ *                                                The mq_send of it, to
+ *                                                the RX queue or a
+ *                                                subscriber's
+ *
+ *  Length is payload bytes, FrameBytes the ASCII frame. With MsgID and
+ *  SeqCount the stages of one message match up, the time from a frame
+ *  coming in to it being on the RX queue say:
+ *   bpftrace -e 'usdt:./SerialDaemon8051:serial8051:rx_frame
+ *                    { @t[arg0, arg1] = nsecs; }
+ *                usdt:./SerialDaemon8051:serial8051:rx_publish /@t[arg0, arg1]/
+ *                    { @us = hist((nsecs - @t[arg0, arg1]) / 1000); delete(@t[arg0, arg1]); }'
+ */
+
+#ifndef SERIALTRACE_H_
+#define SERIALTRACE_H_
+
+/* Build the tracepoints in, needs <sys/sdt.h> (systemtap-sdt-dev) */
+/* #define SERIAL_USDT */
+
+#ifdef SERIAL_USDT
+
+#include <sys/sdt.h>
+
+#define SERIAL_TRACE1(Name, A)				DTRACE_PROBE1(serial8051, Name, A)
+#define SERIAL_TRACE2(Name, A, B)			DTRACE_PROBE2(serial8051, Name, A, B)
+#define SERIAL_TRACE3(Name, A, B, C)		DTRACE_PROBE3(serial8051, Name, A, B, C)
+#define SERIAL_TRACE4(Name, A, B, C, D)		DTRACE_PROBE4(serial8051, Name, A, B, C, D)
+
+#else
+
+#define SERIAL_TRACE1(Name, A)				do { } while(0)
+#define SERIAL_TRACE2(Name, A, B)			do { } while(0)
+#define SERIAL_TRACE3(Name, A, B, C)		do { } while(0)
+#define SERIAL_TRACE4(Name, A, B, C, D)		do { } while(0)
+
+#endif /* SERIAL_USDT */
+
+#endif /* SERIALTRACE_H_ */
@@ -0,0 +1,262 @@
+/*
+ * SerialTransact.c
+ *
+ *  Command / response exchanges with the 8051, see SerialTransact.h
+ */
+
+#include <fcntl.h>
+#include <mqueue.h>
+#include <time.h>
+#include <string.h>
+
+#include "SerialTransact.h"
+#include "SerialCompress.h"
+
+/* Transactions waiting on a reply, oldest first */
+static SerialTransaction *Outstanding = NULL;
+
+/* Our reply queue, and the ReplyIDs already subscribed to it */
+static char ReplyQueue[SUB_QUEUE_NAME_MAX];
+static mqd_t ReplyMqd = (mqd_t) -1;
+static uint8_t ReplyIDsSubscribed[256/8];
+
+
+/* Put a frame that answers none of our transactions back where it
+ * would have gone without our subscription */
+static void
+RepostFrame(const ARM_char_t *Frame, ssize_t Length ){
+
+	mqd_t mqd = mq_open(SERIAL_RX_QUEUE, O_WRONLY | O_NONBLOCK);
+
+	if(mqd == (mqd_t) -1)
+		return;
+
+	mq_send(mqd, Frame, (size_t)Length, 0);
+	mq_close(mqd);
+}
+
+/* Outstanding transaction a reply belongs to, NULL if none */
+static SerialTransaction *
+MatchReply(const RxMsgInfo *Info ){
+
+	SerialTransaction *Txn;
+
+	for(Txn = Outstanding; Txn != NULL; Txn = Txn->Next){
+		if(!Txn->Done && Txn->ReplyID == Info->MsgID &&
+				(!Txn->MatchSeq || Txn->SeqCount == Info->SeqCount))
+			return Txn;
+	}
+
+	return NULL;
+}
+
+/* Fill in the transaction a received frame answers, or repost it */
+static void
+DeliverReply(ARM_char_t *Frame, ssize_t Length ){
+
+	SerialTransaction *Txn;
+	RxMsgInfo Info;
+	RxMsgView View;
+
+	/* Only the header, the frame is untouched in case it goes back */
+	if(Length < MSG_HEADER_LENGTH || ProcessPacket(&Info, Frame) < 0)
+		return;
+
+	Txn = MatchReply(&Info);
+	if(Txn == NULL){
+		RepostFrame(Frame, Length);
+		return;
+	}
+
+	Txn->Done = TRUE;
+
+	if(DecodePacketInPlace(Frame, (int32_t)Length, &View) < 0){
+		Txn->ReplyLength = SERIAL_RECEIVE_NO_HEADER_FAIL;
+		return;
+	}
+
+	if(View.Info.MsgFlags & MSG_FLAG_COMPRESSED){
+		Txn->ReplyLength = DecompressPayload(View.Data, View.Length, Txn->ReplyBuffer, Txn->ReplyBufferSize);
+
+		if(Txn->ReplyLength < 0){
+			Txn->ReplyLength = SERIAL_RECEIVE_DECOMPRESS_FAIL;
+			return;
+		}
+
+		View.Info.MsgFlags &= ~MSG_FLAG_COMPRESSED;
+		View.Info.MsgLength = (uint16_t)Txn->ReplyLength;
+	}
+	else if(View.Length > Txn->ReplyBufferSize){
+		Txn->ReplyLength = TRANSACT_REPLY_TOO_BIG;
+		return;
+	}
+	else{
+		memcpy(Txn->ReplyBuffer, View.Data, (size_t)View.Length);
+		Txn->ReplyLength = View.Length;
+	}
+
+	Txn->ReplyInfo = View.Info;
+}
+
+/* Take Txn off the outstanding list. With nothing left outstanding the
+ * subscription is dropped, anything still in our queue is reposted */
+static void
+FinishTransaction(SerialTransaction *Txn ){
+
+	SerialTransaction **Link;
+	ARM_char_t *Frame;
+	struct mq_attr attr;
+	ssize_t numRead;
+
+	for(Link = &Outstanding; *Link != NULL; Link = &(*Link)->Next){
+		if(*Link == Txn){
+			*Link = Txn->Next;
+			break;
+		}
+	}
+
+	if(Outstanding != NULL || ReplyMqd == (mqd_t) -1)
+		return;
+
+	Serial8051Unsubscribe(ReplyQueue);
+
+	attr.mq_flags = O_NONBLOCK;
+	mq_setattr(ReplyMqd, &attr, NULL);
+
+	if(mq_getattr(ReplyMqd, &attr) == 0 && (Frame = (ARM_char_t *)malloc(attr.mq_msgsize)) != NULL){
+		while((numRead = mq_receive(ReplyMqd, Frame, attr.mq_msgsize, NULL)) > 0)
+			RepostFrame(Frame, numRead);
+
+		free(Frame);
+	}
+
+	mq_close(ReplyMqd);
+	ReplyMqd = (mqd_t) -1;
+	memset(ReplyIDsSubscribed, 0, sizeof(ReplyIDsSubscribed));
+}
+
+int32_t
+Serial8051TransactBegin(SerialTransaction *Txn, uint8_t *TxBuffer, int32_t Length, uint8_t MsgID,
+		uint16_t SeqCount, uint8_t MsgFlags, uint32_t Priority, uint8_t ReplyID, Boolean MatchSeq,
+		uint8_t *ReplyBuffer, int32_t ReplyBufferSize ){
+
+	SerialTransaction **Link;
+	int32_t Return;
+
+	if(ReplyQueue[0] == '\0')
+		snprintf(ReplyQueue, sizeof(ReplyQueue), "/SerialTxn.%ld", (long)getpid());
+
+	/* The subscription has to reach the Daemon before the command goes
+	 * out, so the reply can't beat it */
+	if(!(ReplyIDsSubscribed[ReplyID/8] & (1 << (ReplyID%8)))){
+		Return = Serial8051Subscribe(ReplyQueue, ReplyID, ReplyID);
+		if(Return < 0)
+			return Return;
+
+		ReplyIDsSubscribed[ReplyID/8] |= (uint8_t)(1 << (ReplyID%8));
+	}
+
+	/* Blocking, Serial8051TransactWait sleeps in mq_timedreceive */
+	if(ReplyMqd == (mqd_t) -1){
+		ReplyMqd = mq_open(ReplyQueue, O_RDONLY);
+		if(ReplyMqd == (mqd_t) -1)
+			return TRANSACT_QUEUE_FAIL;
+	}
+
+	memset(Txn, 0, sizeof(SerialTransaction));
+	Txn->ReplyID = ReplyID;
+	Txn->SeqCount = SeqCount;
+	Txn->MatchSeq = MatchSeq;
+	Txn->ReplyBuffer = ReplyBuffer;
+	Txn->ReplyBufferSize = ReplyBufferSize;
+
+	/* Oldest first, for replies that don't carry the SeqCount */
+	for(Link = &Outstanding; *Link != NULL; Link = &(*Link)->Next)
+		;
+	*Link = Txn;
+
+	Return = Serial8051Send(TxBuffer, Length, MsgID, SeqCount, MsgFlags, Priority);
+	if(Return < 0){
+		FinishTransaction(Txn);
+		return Return;
+	}
+
+	return 1;
+}
+
+int32_t
+Serial8051TransactWait(SerialTransaction *Txn, int32_t TimeoutMs ){
+
+	struct timespec Deadline;
+	struct mq_attr attr;
+	ARM_char_t *Frame;
+	ssize_t numRead;
+	int32_t Return;
+
+	if(ReplyMqd == (mqd_t) -1)
+		return TRANSACT_NOT_STARTED;
+
+	/* mq_timedreceive takes an absolute CLOCK_REALTIME deadline */
+	clock_gettime(CLOCK_REALTIME, &Deadline);
+	Deadline.tv_sec += TimeoutMs/1000;
+	Deadline.tv_nsec += (long)(TimeoutMs%1000)*1000000;
+	if(Deadline.tv_nsec >= 1000000000){
+		Deadline.tv_sec++;
+		Deadline.tv_nsec -= 1000000000;
+	}
+
+	if(mq_getattr(ReplyMqd, &attr) == -1)
+		return SERIAL_RECEIVE_MESSAGE_ATTR_FAIL;
+
+	Frame = (ARM_char_t *)malloc(attr.mq_msgsize);
+	if(Frame == NULL)
+		return SERIAL_RECEIVE_BUFF_ALLOCATE_FAIL;
+
+	Return = TRANSACT_TIMEOUT;
+
+	while(!Txn->Done){
+		numRead = mq_timedreceive(ReplyMqd, Frame, attr.mq_msgsize, NULL, &Deadline);
+
+		if(numRead == -1){
+			if(errno == EINTR)
+				continue;
+
+			if(errno != ETIMEDOUT)
+				Return = SERIAL_RECEIVE_MSG_READ_FAIL;
+			break;
+		}
+
+		DeliverReply(Frame, numRead);
+	}
+
+	free(Frame);
+
+	if(Txn->Done){
+		Return = Txn->ReplyLength;
+	}
+
+	FinishTransaction(Txn);
+
+	return Return;
+}
+
+int32_t
+Serial8051Transact(uint8_t *TxBuffer, int32_t Length, uint8_t MsgID, uint16_t SeqCount, uint8_t MsgFlags,
+		uint8_t ReplyID, Boolean MatchSeq, uint8_t *ReplyBuffer, int32_t ReplyBufferSize,
+		RxMsgInfo *ReplyInfo, int32_t TimeoutMs ){
+
+	SerialTransaction Txn;
+	int32_t Return;
+
+	Return = Serial8051TransactBegin(&Txn, TxBuffer, Length, MsgID, SeqCount, MsgFlags, 0,
+			ReplyID, MatchSeq, ReplyBuffer, ReplyBufferSize);
+	if(Return < 0)
+		return Return;
+
+	Return = Serial8051TransactWait(&Txn, TimeoutMs);
+
+	if(Return >= 0 && ReplyInfo != NULL)
+		*ReplyInfo = Txn.ReplyInfo;
+
+	return Return;
+}
@@ -0,0 +1,89 @@
+/*
+ * SerialTransact.h
+ *
+ *  Command / response exchanges with the 8051. A transaction sends a
+ *  command and waits for the reply carrying ReplyID, and (optionally)
+ *  the command's SeqCount echoed back. Any number of transactions can
+ *  be in flight, begin them all and then wait on each one.
+ *
+ *  While transactions are outstanding the process subscribes its own
+ *  reply queue ("/SerialTxn.<pid>") to their ReplyIDs, so waiting is a
+ *  blocking mq_timedreceive rather than polling. Frames with those
+ *  MsgIDs that don't answer a transaction are put back on the shared
+ *  RX queue for other readers. The subscription is dropped when the
+ *  last transaction completes.
+ *
+ *  Like the rest of the library, not safe to use from several threads
+ *  of one process at once. Replies have to fit in a single frame.
+ */
+
+#ifndef SERIALTRANSACT_H_
+#define SERIALTRANSACT_H_
+
+#include "typedef.h"
+#include "tlpi_hdr.h"
+#include "SerialLib8051.h"
+
+/* Error Return Codes, along with those of Serial8051Send and
+ * Serial8051Subscribe */
+#define TRANSACT_TIMEOUT			-20
+#define TRANSACT_REPLY_TOO_BIG		-21
+#define TRANSACT_QUEUE_FAIL			-22
+#define TRANSACT_NOT_STARTED		-23
+
+typedef struct SerialTransaction{
+		/* Set by Serial8051TransactBegin */
+		uint8_t		ReplyID;
+		uint16_t	SeqCount;		/* Of the command */
+		Boolean		MatchSeq;		/* Reply must echo SeqCount, otherwise the
+									 * oldest transaction waiting on ReplyID wins */
+		uint8_t		*ReplyBuffer;
+		int32_t		ReplyBufferSize;
+
+		/* Set once the reply is in */
+		Boolean		Done;
+		int32_t		ReplyLength;	/* Or a negative error code */
+		RxMsgInfo	ReplyInfo;
+
+		struct SerialTransaction *Next;
+	}SerialTransaction;
+
+
+/* Send a command and register for its reply, returns without waiting
+ *
+ *  INPUTS:
+ *  Txn - Transaction state, must stay valid until Serial8051TransactWait
+ *  	returns for it
+ *  TxBuffer, Length, MsgID, SeqCount, MsgFlags, Priority - The command,
+ *  	as for Serial8051Send
+ *  ReplyID - MsgID of the reply
+ *  MatchSeq - TRUE if the reply echoes the command's SeqCount
+ *  ReplyBuffer, ReplyBufferSize - Where the reply payload goes
+ *
+ *  RETURNS:
+ *  1 if the command was sent, or a negative error code
+*/
+int32_t
+Serial8051TransactBegin(SerialTransaction *Txn, uint8_t *TxBuffer, int32_t Length, uint8_t MsgID,
+		uint16_t SeqCount, uint8_t MsgFlags, uint32_t Priority, uint8_t ReplyID, Boolean MatchSeq,
+		uint8_t *ReplyBuffer, int32_t ReplyBufferSize );
+
+/* Block until Txn's reply is in, or TimeoutMs has passed. Replies to
+ * other outstanding transactions that turn up meanwhile are filled in
+ * on those. Txn is finished with either way, a reply arriving after a
+ * timeout goes to the shared RX queue
+ *
+ *  RETURNS:
+ *  Bytes of reply payload in Txn->ReplyBuffer, TRANSACT_TIMEOUT or
+ *  another negative error code
+*/
+int32_t
+Serial8051TransactWait(SerialTransaction *Txn, int32_t TimeoutMs );
+
+/* Begin and wait on a single transaction */
+int32_t
+Serial8051Transact(uint8_t *TxBuffer, int32_t Length, uint8_t MsgID, uint16_t SeqCount, uint8_t MsgFlags,
+		uint8_t ReplyID, Boolean MatchSeq, uint8_t *ReplyBuffer, int32_t ReplyBufferSize,
+		RxMsgInfo *ReplyInfo, int32_t TimeoutMs );
+
+#endif /* SERIALTRANSACT_H_ */
@@ -0,0 +1,688 @@
+/*
+ * SerialUring.c
+ *
+ *  io_uring I/O engine for the Daemon's tty, see SerialUring.h
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "tlpi_hdr.h"
+#include "SerialUring.h"
+
+#ifdef SERIAL_IO_URING
+
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/* Multishot read, Linux 6.7. Older headers don't name it */
+#ifndef IORING_OP_READ_MULTISHOT
+#define URING_OP_READ_MULTISHOT		49
+#else
+#define URING_OP_READ_MULTISHOT		IORING_OP_READ_MULTISHOT
+#endif
+
+#define URING_BUFFER_GROUP		0
+
+/* Completions the ring holds. Each RX one takes a buffer until it's
+ * copied out, so with room for every buffer, a last completion and a
+ * TX batch the ring never overflows, an overflow would end the read */
+#define URING_CQ_ENTRIES		(2*URING_RX_BUFFERS)
+
+/* user_data of each request */
+#define URING_TAG_RX			0x100
+#define URING_TAG_CANCEL		0x200
+#define URING_TAG_TX			0x300
+#define URING_TAG_MASK			0xF00
+
+/* Enters waited through for the cancelled read, or the TX write, to complete */
+#define URING_WAITS			4
+
+/* A completed read, copied out by UringRead. Res < 0 is a tty error,
+ * 0 end of file, otherwise Res bytes in buffer Bid */
+typedef struct{
+	int32_t Res;
+	uint16_t Bid;
+	int32_t Offset;
+}UringRxEntry;
+
+#define URING_RX_FIFO			(URING_RX_BUFFERS + 2)
+
+typedef struct{
+	uint32_t Enters;
+	uint32_t RxCompletions;
+	uint32_t RxBytes;
+	uint32_t RxRearms;
+	uint32_t RxNoBuffers;
+	uint32_t TxBatches;
+	uint32_t TxFrames;
+	uint32_t TxShort;
+}UringCounters;
+
+static int RingFd = -1;
+static struct io_uring_params Params;
+
+static void *SqRing = NULL;
+static size_t SqRingSize;
+static void *CqRing = NULL;
+static size_t CqRingSize;
+static struct io_uring_sqe *Sqes = NULL;
+static size_t SqesSize;
+
+static uint32_t *SqTail, *SqMask, *SqArray, *SqFlags;
+static uint32_t *CqHead, *CqTail, *CqMask;
+static struct io_uring_cqe *Cqes;
+
+/* Provided buffer ring and the buffers it hands out */
+static struct io_uring_buf_ring *BufRing = NULL;
+static size_t BufRingSize;
+static char *RxBuffers = NULL;
+static uint16_t BufTail;
+
+static UringRxEntry RxFifo[URING_RX_FIFO];
+static int32_t RxHead, RxCount;
+
+static int AttachedFd = -1;
+static Boolean RxArmed = FALSE;
+static Boolean RxStopped = FALSE;		/* Read ended with an error or end of file */
+
+static char *TxBuffers = NULL;
+static int32_t TxSize;
+static struct iovec TxIov[URING_TX_BATCH];
+static Boolean TxPending;
+static int32_t TxResult;
+
+static UringCounters Counters;
+
+
+static int
+RingEnter(uint32_t ToSubmit, uint32_t MinComplete, uint32_t Flags ){
+
+	Counters.Enters++;
+	return (int)syscall(__NR_io_uring_enter, RingFd, ToSubmit, MinComplete, Flags, NULL, 0);
+}
+
+/* Next free submission, zeroed. The ring is only ever a few entries
+ * full, every submission is entered straight away */
+static struct io_uring_sqe *
+GetSqe(void){
+
+	uint32_t Tail = *SqTail;
+	struct io_uring_sqe *Sqe = &Sqes[Tail & *SqMask];
+
+	memset(Sqe, 0, sizeof(struct io_uring_sqe));
+	SqArray[Tail & *SqMask] = Tail & *SqMask;
+	return Sqe;
+}
+
+static void
+PublishSqes(uint32_t Count ){
+
+	__atomic_store_n(SqTail, *SqTail + Count, __ATOMIC_RELEASE);
+}
+
+/* Give buffer Bid back to the kernel */
+static void
+RecycleBuffer(uint16_t Bid ){
+
+	struct io_uring_buf *Buf = &BufRing->bufs[BufTail & (URING_RX_BUFFERS - 1)];
+
+	Buf->addr = (uint64_t)(uintptr_t)(RxBuffers + (size_t)Bid*URING_RX_BUFFER_SIZE);
+	Buf->len = URING_RX_BUFFER_SIZE;
+	Buf->bid = Bid;
+	BufTail++;
+	__atomic_store_n(&BufRing->tail, BufTail, __ATOMIC_RELEASE);
+}
+
+static void
+PushRx(int32_t Res, uint16_t Bid ){
+
+	UringRxEntry *Entry;
+
+	if(RxCount == URING_RX_FIFO)
+		return;		/* Can't happen, there is a buffer per entry and two spare */
+
+	Entry = &RxFifo[(RxHead + RxCount) % URING_RX_FIFO];
+	Entry->Res = Res;
+	Entry->Bid = Bid;
+	Entry->Offset = 0;
+	RxCount++;
+}
+
+static void
+PopRx(void){
+
+	if(RxFifo[RxHead].Res > 0)
+		RecycleBuffer(RxFifo[RxHead].Bid);
+
+	RxHead = (RxHead + 1) % URING_RX_FIFO;
+	RxCount--;
+}
+
+/* Take every posted completion off the ring. Reads go on the RX FIFO,
+ * the TX write's result is recorded for UringWriteBatch */
+static void
+ReapCompletions(void){
+
+	uint32_t Head, Tail;
+	struct io_uring_cqe *Cqe;
+
+	/* Completions the kernel is holding back come in on an enter */
+	if(__atomic_load_n(SqFlags, __ATOMIC_ACQUIRE) & IORING_SQ_CQ_OVERFLOW)
+		RingEnter(0, 0, IORING_ENTER_GETEVENTS);
+
+	Head = *CqHead;
+	Tail = __atomic_load_n(CqTail, __ATOMIC_ACQUIRE);
+
+	while(Head != Tail)
+	{
+		Cqe = &Cqes[Head & *CqMask];
+
+		switch(Cqe->user_data & URING_TAG_MASK)
+		{
+		case URING_TAG_RX:
+			Counters.RxCompletions++;
+
+			if(Cqe->res > 0 && (Cqe->flags & IORING_CQE_F_BUFFER))
+			{
+				Counters.RxBytes += Cqe->res;
+				PushRx(Cqe->res, (uint16_t)(Cqe->flags >> IORING_CQE_BUFFER_SHIFT));
+			}
+			else if(Cqe->res == -ENOBUFS)
+				Counters.RxNoBuffers++;		/* Re-armed once UringRead frees some */
+			else if(Cqe->res != -ECANCELED && AttachedFd >= 0)
+			{
+				PushRx(Cqe->res, 0);
+				RxStopped = TRUE;
+			}
+
+			if(!(Cqe->flags & IORING_CQE_F_MORE))
+				RxArmed = FALSE;
+			break;
+
+		case URING_TAG_TX:
+			TxResult = Cqe->res;
+			TxPending = FALSE;
+			break;
+
+		default:
+			break;
+		}
+
+		Head++;
+	}
+
+	__atomic_store_n(CqHead, Head, __ATOMIC_RELEASE);
+}
+
+static int32_t
+ArmRx(void){
+
+	struct io_uring_sqe *Sqe = GetSqe();
+
+	Sqe->opcode = URING_OP_READ_MULTISHOT;
+	Sqe->fd = AttachedFd;
+	Sqe->flags = IOSQE_BUFFER_SELECT;
+	Sqe->buf_group = URING_BUFFER_GROUP;
+	Sqe->user_data = URING_TAG_RX;
+	PublishSqes(1);
+
+	if(RingEnter(1, 0, 0) != 1)
+	{
+		syslog(LOG_INFO, "io_uring: arming the tty read failed, error %s", strerror(errno));
+		return URING_SUBMIT_FAIL;
+	}
+
+	RxArmed = TRUE;
+	return 1;
+}
+
+/* Ask the kernel whether it has the multishot read */
+static Boolean
+ProbeMultishot(void){
+
+	struct io_uring_probe *Probe;
+	size_t Size = sizeof(struct io_uring_probe) + 256*sizeof(struct io_uring_probe_op);
+	Boolean Supported = FALSE;
+
+	Probe = calloc(1, Size);
+	if(Probe == NULL)
+		return FALSE;
+
+	if(syscall(__NR_io_uring_register, RingFd, IORING_REGISTER_PROBE, Probe, 256) == 0
+			&& Probe->last_op >= URING_OP_READ_MULTISHOT)
+		Supported = (Probe->ops[URING_OP_READ_MULTISHOT].flags & IO_URING_OP_SUPPORTED) ? TRUE : FALSE;
+
+	free(Probe);
+	return Supported;
+}
+
+static void
+UnmapRing(void){
+
+	if(Sqes != NULL)
+		munmap(Sqes, SqesSize);
+	if(CqRing != NULL && CqRing != SqRing)
+		munmap(CqRing, CqRingSize);
+	if(SqRing != NULL)
+		munmap(SqRing, SqRingSize);
+	if(BufRing != NULL)
+		munmap(BufRing, BufRingSize);
+
+	Sqes = NULL;
+	SqRing = CqRing = NULL;
+	BufRing = NULL;
+
+	free(RxBuffers);
+	free(TxBuffers);
+	RxBuffers = TxBuffers = NULL;
+
+	if(RingFd >= 0)
+		close(RingFd);
+	RingFd = -1;
+}
+
+int32_t
+UringOpen(int32_t TxBufferSize ){
+
+	struct io_uring_buf_reg Reg;
+	uint16_t Bid;
+
+	memset(&Params, 0, sizeof(Params));
+	memset(&Counters, 0, sizeof(Counters));
+
+	Params.flags = IORING_SETUP_CQSIZE;
+	Params.cq_entries = URING_CQ_ENTRIES;
+
+	RingFd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &Params);
+	if(RingFd < 0)
+	{
+		syslog(LOG_INFO, "io_uring: not available, error %s", strerror(errno));
+		return URING_UNAVAILABLE;
+	}
+
+	if(!(Params.features & IORING_FEAT_NODROP) || !ProbeMultishot())
+	{
+		syslog(LOG_INFO, "io_uring: kernel has no multishot read");
+		UnmapRing();
+		return URING_UNAVAILABLE;
+	}
+
+	SqRingSize = Params.sq_off.array + Params.sq_entries*sizeof(uint32_t);
+	CqRingSize = Params.cq_off.cqes + Params.cq_entries*sizeof(struct io_uring_cqe);
+	if(Params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if(CqRingSize > SqRingSize)
+			SqRingSize = CqRingSize;
+		CqRingSize = SqRingSize;
+	}
+
+	SqRing = mmap(NULL, SqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, RingFd, IORING_OFF_SQ_RING);
+	if(SqRing == MAP_FAILED)
+	{
+		SqRing = NULL;
+		goto Fail;
+	}
+
+	if(Params.features & IORING_FEAT_SINGLE_MMAP)
+		CqRing = SqRing;
+	else
+	{
+		CqRing = mmap(NULL, CqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, RingFd, IORING_OFF_CQ_RING);
+		if(CqRing == MAP_FAILED)
+		{
+			CqRing = NULL;
+			goto Fail;
+		}
+	}
+
+	SqesSize = Params.sq_entries*sizeof(struct io_uring_sqe);
+	Sqes = mmap(NULL, SqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, RingFd, IORING_OFF_SQES);
+	if(Sqes == MAP_FAILED)
+	{
+		Sqes = NULL;
+		goto Fail;
+	}
+
+	SqTail = (uint32_t *)((char *)SqRing + Params.sq_off.tail);
+	SqMask = (uint32_t *)((char *)SqRing + Params.sq_off.ring_mask);
+	SqArray = (uint32_t *)((char *)SqRing + Params.sq_off.array);
+	SqFlags = (uint32_t *)((char *)SqRing + Params.sq_off.flags);
+	CqHead = (uint32_t *)((char *)CqRing + Params.cq_off.head);
+	CqTail = (uint32_t *)((char *)CqRing + Params.cq_off.tail);
+	CqMask = (uint32_t *)((char *)CqRing + Params.cq_off.ring_mask);
+	Cqes = (struct io_uring_cqe *)((char *)CqRing + Params.cq_off.cqes);
+
+	/* The buffer ring has to be page aligned, an anonymous mapping is */
+	BufRingSize = URING_RX_BUFFERS*sizeof(struct io_uring_buf);
+	BufRing = mmap(NULL, BufRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	RxBuffers = malloc((size_t)URING_RX_BUFFERS*URING_RX_BUFFER_SIZE);
+	TxBuffers = malloc((size_t)URING_TX_BATCH*TxBufferSize);
+	if(BufRing == MAP_FAILED || RxBuffers == NULL || TxBuffers == NULL)
+	{
+		if(BufRing == MAP_FAILED)
+			BufRing = NULL;
+		goto Fail;
+	}
+
+	memset(&Reg, 0, sizeof(Reg));
+	Reg.ring_addr = (uint64_t)(uintptr_t)BufRing;
+	Reg.ring_entries = URING_RX_BUFFERS;
+	Reg.bgid = URING_BUFFER_GROUP;
+	if(syscall(__NR_io_uring_register, RingFd, IORING_REGISTER_PBUF_RING, &Reg, 1) != 0)
+	{
+		syslog(LOG_INFO, "io_uring: kernel has no provided buffer rings");
+		UnmapRing();
+		return URING_UNAVAILABLE;
+	}
+
+	BufTail = 0;
+	for(Bid = 0; Bid < URING_RX_BUFFERS; Bid++)
+		RecycleBuffer(Bid);
+
+	TxSize = TxBufferSize;
+	RxHead = RxCount = 0;
+	AttachedFd = -1;
+	RxArmed = RxStopped = FALSE;
+	TxPending = FALSE;
+
+	syslog(LOG_INFO, "io_uring: %u entries, %i RX buffers of %i bytes, TX batches of %i",
+			Params.sq_entries, URING_RX_BUFFERS, URING_RX_BUFFER_SIZE, URING_TX_BATCH);
+	return 1;
+
+Fail:
+	syslog(LOG_INFO, "io_uring: setup failed, error %s", strerror(errno));
+	UnmapRing();
+	return URING_SETUP_FAIL;
+}
+
+void
+UringClose(void){
+
+	if(RingFd < 0)
+		return;
+
+	UringDetachTty();
+	UnmapRing();
+}
+
+Boolean
+UringActive(void){
+
+	return (RingFd >= 0) ? TRUE : FALSE;
+}
+
+int32_t
+UringAttachTty(int ttyFd ){
+
+	if(RingFd < 0)
+		return URING_UNAVAILABLE;
+
+	UringDetachTty();
+
+	AttachedFd = ttyFd;
+	RxStopped = FALSE;
+	return ArmRx();
+}
+
+void
+UringDetachTty(void){
+
+	struct io_uring_sqe *Sqe;
+	int32_t Waits;
+
+	if(RingFd < 0 || AttachedFd < 0)
+		return;
+
+	ReapCompletions();
+
+	if(RxArmed)
+	{
+		Sqe = GetSqe();
+		Sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		Sqe->addr = URING_TAG_RX;
+		Sqe->user_data = URING_TAG_CANCEL;
+		PublishSqes(1);
+		RingEnter(1, 0, 0);
+
+		/* The read's last completion comes once it's cancelled, the fd
+		 * mustn't be closed under it before then */
+		for(Waits = 0; RxArmed && Waits < URING_WAITS; Waits++)
+		{
+			RingEnter(0, 1, IORING_ENTER_GETEVENTS);
+			ReapCompletions();
+		}
+	}
+
+	AttachedFd = -1;
+	RxArmed = FALSE;
+
+	while(RxCount > 0)
+		PopRx();
+}
+
+int32_t
+UringRead(char *Buffer, int32_t Size ){
+
+	UringRxEntry *Entry;
+	int32_t Length;
+
+	ReapCompletions();
+
+	if(RxCount == 0)
+	{
+		/* Out of buffers, or the kernel ended the read, now there's room */
+		if(!RxArmed && !RxStopped && AttachedFd >= 0)
+		{
+			Counters.RxRearms++;
+			ArmRx();
+		}
+
+		errno = EAGAIN;
+		return -1;
+	}
+
+	Entry = &RxFifo[RxHead];
+
+	if(Entry->Res < 0)
+	{
+		errno = -Entry->Res;
+		PopRx();
+		return -1;
+	}
+
+	if(Entry->Res == 0)
+	{
+		PopRx();
+		return 0;
+	}
+
+	Length = Entry->Res - Entry->Offset;
+	if(Length > Size)
+		Length = Size;
+
+	memcpy(Buffer, RxBuffers + (size_t)Entry->Bid*URING_RX_BUFFER_SIZE + Entry->Offset, Length);
+	Entry->Offset += Length;
+
+	if(Entry->Offset == Entry->Res)
+		PopRx();
+
+	return Length;
+}
+
+Boolean
+UringRxPending(void){
+
+	if(RingFd < 0)
+		return FALSE;
+
+	ReapCompletions();
+	return (RxCount > 0) ? TRUE : FALSE;
+}
+
+char *
+UringTxBuffer(int32_t Index ){
+
+	return TxBuffers + (size_t)Index*TxSize;
+}
+
+int32_t
+UringTxBufferSize(void){
+
+	return TxSize;
+}
+
+int32_t
+UringWriteBatch(int ttyFd, int32_t Count, const int32_t *Lengths, int32_t *Written ){
+
+	struct io_uring_sqe *Sqe;
+	int32_t i, Left, Whole = 0;
+	int32_t Waits;
+
+	if(RingFd < 0 || Count <= 0)
+		return URING_SUBMIT_FAIL;
+
+	if(Count > URING_TX_BATCH)
+		Count = URING_TX_BATCH;
+
+	for(i = 0; i < Count; i++)
+	{
+		TxIov[i].iov_base = UringTxBuffer(i);
+		TxIov[i].iov_len = (size_t)Lengths[i];
+		Written[i] = 0;
+	}
+
+	/* One vectored write rather than a linked write per frame: n_tty
+	 * gives up with EINTR on a write that finds task work pending, which
+	 * the previous link in a chain always leaves */
+	Sqe = GetSqe();
+	Sqe->opcode = IORING_OP_WRITEV;
+	Sqe->fd = ttyFd;
+	Sqe->addr = (uint64_t)(uintptr_t)TxIov;
+	Sqe->len = (uint32_t)Count;
+	Sqe->off = (uint64_t)-1;		/* Current position, a tty has none */
+	Sqe->user_data = URING_TAG_TX;
+	PublishSqes(1);
+
+	TxPending = TRUE;
+	TxResult = 0;
+
+	if(RingEnter(1, 1, IORING_ENTER_GETEVENTS) != 1)
+	{
+		__atomic_store_n(SqTail, *SqTail - 1, __ATOMIC_RELEASE);
+		TxPending = FALSE;
+		syslog(LOG_INFO, "io_uring: TX submit failed, error %s", strerror(errno));
+		return URING_SUBMIT_FAIL;
+	}
+
+	/* A write to the non blocking tty completes straight away, an RX
+	 * completion posted first satisfies the wait too */
+	for(Waits = 0; TxPending && Waits < URING_WAITS; Waits++)
+	{
+		ReapCompletions();
+		if(TxPending)
+			RingEnter(0, 1, IORING_ENTER_GETEVENTS);
+	}
+	ReapCompletions();
+	TxPending = FALSE;
+
+	/* Split what the tty took over the frames, in order */
+	Left = (TxResult > 0) ? TxResult : 0;
+	for(i = 0; i < Count; i++)
+	{
+		Written[i] = (Left < Lengths[i]) ? Left : Lengths[i];
+		Left -= Written[i];
+
+		if(Written[i] == Lengths[i])
+			Whole++;
+	}
+
+	Counters.TxBatches++;
+	Counters.TxFrames += Whole;
+	if(Whole < Count)
+		Counters.TxShort++;
+
+	return Whole;
+}
+
+void
+UringLogStats(void){
+
+	if(RingFd < 0)
+		return;
+
+	syslog(LOG_INFO, "io_uring: Enters %u, RxCompletions %u, RxBytes %u, RxRearms %u, RxNoBuffers %u, TxBatches %u, TxFrames %u, TxShort %u",
+			Counters.Enters, Counters.RxCompletions, Counters.RxBytes, Counters.RxRearms, Counters.RxNoBuffers,
+			Counters.TxBatches, Counters.TxFrames, Counters.TxShort);
+}
+
+#else /* SERIAL_IO_URING */
+
+int32_t
+UringOpen(int32_t TxBufferSize ){
+
+	syslog(LOG_INFO, "io_uring: not built in (SERIAL_IO_URING)");
+	return URING_UNAVAILABLE;
+}
+
+void
+UringClose(void){
+}
+
+Boolean
+UringActive(void){
+
+	return FALSE;
+}
+
+int32_t
+UringAttachTty(int ttyFd ){
+
+	return URING_UNAVAILABLE;
+}
+
+void
+UringDetachTty(void){
+}
+
+int32_t
+UringRead(char *Buffer, int32_t Size ){
+
+	errno = ENOSYS;
+	return -1;
+}
+
+Boolean
+UringRxPending(void){
+
+	return FALSE;
+}
+
+char *
+UringTxBuffer(int32_t Index ){
+
+	return NULL;
+}
+
+int32_t
+UringTxBufferSize(void){
+
+	return 0;
+}
+
+int32_t
+UringWriteBatch(int ttyFd, int32_t Count, const int32_t *Lengths, int32_t *Written ){
+
+	return URING_SUBMIT_FAIL;
+}
+
+void
+UringLogStats(void){
+}
+
+#endif /* SERIAL_IO_URING */
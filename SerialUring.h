@@ -0,0 +1,113 @@
+/*
+ * SerialUring.h
+ *
+ *  io_uring I/O engine for the Daemon's tty (-e uring). Built only
+ *  with SERIAL_IO_URING defined, it talks to the kernel directly so
+ *  there is no liburing to cross compile. Without it, or on a kernel
+ *  without what it needs (multishot read and provided buffer rings,
+ *  Linux 6.7), UringOpen fails and the Daemon stays on the signal
+ *  driven read / write path.
+ *
+ *  RX: one multishot read stays armed on the tty, filling buffers from
+ *  a ring the kernel picks from. Completions are posted on the way
+ *  back to user space, before the RX signal is handled, so SerialRx
+ *  copies them out with no read calls at all.
+ *  TX: SerialTxBatch takes up to URING_TX_BATCH frames off the TX
+ *  queue and writes them with one vectored write, a single
+ *  io_uring_enter. What a short write leaves goes out through
+ *  SerialWriteFrame as before.
+ *
+ *  Wakeups still come from the tty's RT signal, the loop is signal
+ *  driven. The ring's completions are checked on each one.
+ */
+
+#ifndef SERIALURING_H_
+#define SERIALURING_H_
+
+#include "tlpi_hdr.h"
+#include "typedef.h"
+
+#define URING_ENTRIES			32
+
+/* Provided RX buffers, a power of two */
+#define URING_RX_BUFFERS		64
+#define URING_RX_BUFFER_SIZE	1024
+
+/* TX frames written with one submission */
+#define URING_TX_BATCH			8
+
+/* Error Return Codes */
+#define URING_UNAVAILABLE		-1		/* Not built in, or the kernel can't */
+#define URING_SETUP_FAIL		-2
+#define URING_SUBMIT_FAIL		-3
+
+
+/* Set up the ring, the RX buffers, and TX buffers of TxBufferSize bytes
+ * (the TX queue's mq_msgsize)
+ *
+ *  RETURNS:
+ *  1 if sucessful, URING_UNAVAILABLE or URING_SETUP_FAIL if failure
+*/
+int32_t
+UringOpen(int32_t TxBufferSize );
+
+/* Cancel what's in flight and free the ring */
+void
+UringClose(void);
+
+/* TRUE once UringOpen has suceeded */
+Boolean
+UringActive(void);
+
+/* Arm the multishot read on a newly opened tty
+ *
+ *  RETURNS:
+ *  1 if sucessful, URING_SUBMIT_FAIL if failure
+*/
+int32_t
+UringAttachTty(int ttyFd );
+
+/* Cancel the read before the tty is closed, input it took and no one
+ * collected is thrown away. Does nothing if no tty is attached */
+void
+UringDetachTty(void);
+
+/* Copy out input the read has completed, in place of read()
+ *
+ *  RETURNS:
+ *  Bytes copied, 0 at end of file, -1 with errno set, EAGAIN when
+ *  there is nothing yet
+*/
+int32_t
+UringRead(char *Buffer, int32_t Size );
+
+/* TRUE when input is waiting for UringRead */
+Boolean
+UringRxPending(void);
+
+/* TX buffer Index (0 to URING_TX_BATCH - 1), for SerialTxBatch to
+ * receive a frame into */
+char *
+UringTxBuffer(int32_t Index );
+
+int32_t
+UringTxBufferSize(void);
+
+/* Write TX buffers 0 to Count - 1 with one vectored write, in order
+ *
+ *  INPUTS:
+ *  Lengths - Bytes to write from each
+ *  Written - Filled in with the bytes the tty took from each, a short
+ *  	write leaves the frames after it at 0
+ *
+ *  RETURNS:
+ *  Frames written whole, URING_SUBMIT_FAIL if nothing was submitted
+*/
+int32_t
+UringWriteBatch(int ttyFd, int32_t Count, const int32_t *Lengths, int32_t *Written );
+
+/* Write the engine counters to the system log */
+void
+UringLogStats(void);
+
+#endif /* SERIALURING_H_ */
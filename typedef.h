@@ -19,7 +19,7 @@ typedef unsigned short 	uint16_t;
 typedef int 			int32_t;
 typedef unsigned int 	uint32_t;
 
-typedef unsigned long 	uint64_t;
+typedef unsigned long long	uint64_t;
 typedef long long 		int64_t;
 typedef float     		float32_t;
 typedef double	  		float64_t;